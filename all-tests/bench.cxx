@@ -0,0 +1,544 @@
+// bench.cxx
+// Benchmark of the winbgim library, made from the drawing of the programs
+// in all-tests: the bgidemo demos, the rotating cube, the fractal, the
+// putpixel test and the flood test.  Each workload draws a fixed number of
+// frames with a fixed random seed, without waiting for the user, and the
+// program reports the operations and pixels per second and the percentiles
+// of the frame times, as a table and (with --json) as a JSON file.
+//
+// By default the frames are drawn on page 1 while page 0 is shown, so the
+// window is never repainted and only the drawing itself is timed.  With
+// --visible the window is double buffered and each frame is shown with
+// swapbuffers, which adds the repainting to the frame times.
+//
+// Usage: bench [--frames n] [--size n] [--seed n] [--only name] [--json file]
+//              [--visible]
+
+#include <algorithm>  // Provides sort
+#include <vector>     // Provides the vector class
+#include <chrono>     // Provides steady_clock
+#include <complex>    // Provides the complex type
+#include <stdio.h>    // Provides printf and fprintf
+#include <stdlib.h>   // Provides atoi and strtoul
+#include <string.h>   // Provides strcmp
+#include <math.h>     // Provides sin, cos and fabs
+#include <graphics.h> // Provides the winbgim library
+using namespace std;
+
+// Constant declarations
+const double PI = 3.141592653589;
+const int DEFAULT_FRAMES = 50;  // Frames timed in each workload
+const int DEFAULT_SIZE = 600;   // Width and height of the window in pixels
+const int WARMUP_FRAMES = 2;    // Frames drawn before the timing starts
+
+// The work done by one frame
+struct work
+{
+    double ops;     // Drawing calls made
+    double pixels;  // Pixels those calls drew (approximately, for outlines)
+};
+
+// A workload: a name and the function that draws frame number frame
+struct workload
+{
+    const char* name;
+    work (*draw)(int frame);
+};
+
+// The results of one workload
+struct result
+{
+    const char* name;
+    int frames;
+    double seconds;
+    double ops;
+    double pixels;
+    double mean_ms, p50_ms, p90_ms, p99_ms, max_ms;
+    bgistatstype stats;
+};
+
+int window_size = DEFAULT_SIZE;  // Width and height of the window
+unsigned long seed_state = 1;   // State of the random numbers
+
+
+// Random numbers from 0 to n-1, the same on every system for a given seed
+// (xorshift32).
+int next_random(int n)
+{
+    seed_state ^= (seed_state << 13) & 0xFFFFFFFFUL;
+    seed_state ^= seed_state >> 17;
+    seed_state ^= (seed_state << 5) & 0xFFFFFFFFUL;
+    return (int)(seed_state % (unsigned long)n);
+}
+
+// Pixels on a line from (x1,y1) to (x2,y2).
+double line_pixels(int x1, int y1, int x2, int y2)
+{
+    int dx = abs(x2 - x1), dy = abs(y2 - y1);
+    return (dx > dy ? dx : dy) + 1;
+}
+
+
+// ---------------------------------------------------------------------------
+//                          The workloads
+// ---------------------------------------------------------------------------
+
+// The demos of test-bgidemo0: random bars, circles, arcs, polygons, lines,
+// pixels and text on a cleared page.
+work bgidemo(int frame)
+{
+    work w = { 0, 0 };
+    int maxx = getmaxx(), maxy = getmaxy();
+    int i, j;
+
+    cleardevice();
+    w.ops++;
+    w.pixels += (double)window_size * window_size;
+
+    // RandomBars
+    for (i = 0; i < 20; ++i)
+    {
+        int x1 = next_random(maxx), y1 = next_random(maxy);
+        int x2 = next_random(maxx), y2 = next_random(maxy);
+        setfillstyle(next_random(11) + 1, next_random(15) + 1);
+        bar3d(x1, y1, x2, y2, 0, 0);
+        w.ops += 2;
+        w.pixels += (double)(abs(x2 - x1) + 1) * (abs(y2 - y1) + 1);
+    }
+
+    // CircleDemo
+    for (i = 0; i < 20; ++i)
+    {
+        int radius = next_random(maxy / 4) + 1;
+        setcolor(next_random(15) + 1);
+        circle(next_random(maxx), next_random(maxy), radius);
+        w.ops += 2;
+        w.pixels += 2 * PI * radius;
+    }
+
+    // ArcDemo: an arc and the lines from its center to its ends
+    for (i = 0; i < 20; ++i)
+    {
+        arccoordstype ai;
+        int start = next_random(360), end = start + next_random(360) + 1;
+        int radius = next_random(maxy / 4) + 1;
+        setcolor(next_random(15) + 1);
+        arc(maxx / 2, maxy / 2, start, end, radius);
+        getarccoords(&ai);
+        line(ai.x, ai.y, ai.xstart, ai.ystart);
+        line(ai.x, ai.y, ai.xend, ai.yend);
+        w.ops += 4;
+        w.pixels += radius * (end - start) * PI / 180 + 2 * radius;
+    }
+
+    // PolyDemo: filled polygons of 6 random points
+    for (i = 0; i < 10; ++i)
+    {
+        int poly[12];
+        double area = 0;
+        for (j = 0; j < 6; ++j)
+        {
+            poly[2*j] = next_random(maxx);
+            poly[2*j+1] = next_random(maxy);
+        }
+        for (j = 0; j < 6; ++j)
+        {
+            int k = (j + 1) % 6;
+            area += (double)poly[2*j] * poly[2*k+1] - (double)poly[2*k] * poly[2*j+1];
+        }
+        setcolor(next_random(15) + 1);
+        setfillstyle(next_random(10) + 1, next_random(15) + 1);
+        fillpoly(6, poly);
+        w.ops += 3;
+        w.pixels += fabs(area) / 2;
+    }
+
+    // LineToDemo: the cords between points on a circle
+    {
+        const int MAXPTS = 15;
+        int px[MAXPTS], py[MAXPTS];
+        int radius = maxy / 2 - 15;
+        double turn = frame * PI / 180;
+        for (i = 0; i < MAXPTS; ++i)
+        {
+            double rads = turn + 2 * PI * i / MAXPTS;
+            px[i] = maxx / 2 + (int)(cos(rads) * radius);
+            py[i] = maxy / 2 - (int)(sin(rads) * radius);
+        }
+        setcolor(next_random(15) + 1);
+        for (i = 0; i < MAXPTS; ++i)
+            for (j = i; j < MAXPTS; ++j)
+            {
+                moveto(px[i], py[i]);
+                lineto(px[j], py[j]);
+                w.ops += 2;
+                w.pixels += line_pixels(px[i], py[i], px[j], py[j]);
+            }
+    }
+
+    // PutPixelDemo
+    for (i = 0; i < 2000; ++i)
+    {
+        putpixel(next_random(maxx), next_random(maxy), next_random(15) + 1);
+        w.ops++;
+        w.pixels++;
+    }
+
+    // TextDemo
+    for (i = 0; i < 5; ++i)
+    {
+        const char* text = "Windows BGI";
+        settextstyle(next_random(5), HORIZ_DIR, next_random(4) + 1);
+        setcolor(next_random(15) + 1);
+        outtextxy(next_random(maxx / 2), next_random(maxy), (char*)text);
+        w.ops += 3;
+        w.pixels += (double)textwidth((char*)text) * textheight((char*)text);
+    }
+    settextstyle(DEFAULT_FONT, HORIZ_DIR, 1);
+    return w;
+}
+
+
+// test-cube: the wireframe cube in perspective, turned a little more each
+// frame.  The cube and the projection are those of the test, scaled from
+// its 400 pixel window to this one.
+work cube(int frame)
+{
+    static double c[8][3];
+    double scale = window_size / 400.0;
+    double pro[3] = { 0, 0, -50 * scale };      // The projection point
+    double plane_z = 120 * scale;               // The projection plane
+    double side = 20 * scale / 2.0;
+    double point[8][2];
+    const int edges[12][2] = {
+        {6, 4}, {6, 7}, {6, 2}, {0, 2}, {0, 4}, {0, 1},
+        {3, 2}, {3, 1}, {3, 7}, {5, 4}, {5, 1}, {5, 7}
+    };
+    double xa = 3 * PI / 180, ya = 5 * PI / 180, za = 7 * PI / 180;
+    work w = { 0, 0 };
+    int i;
+
+    if (frame == 0)
+        for (i = 0; i < 8; ++i)
+        {
+            c[i][0] = (i & 2) ? side : -side;
+            c[i][1] = (i & 1) ? side : -side;
+            c[i][2] = (i & 4) ? -side : side;
+        }
+
+    // Rotate along the Z, Y and X axes, as rotate_cube does.
+    for (i = 0; i < 8; ++i)
+    {
+        double tx, ty, tz;
+        tx = c[i][0] * cos(za) - c[i][1] * sin(za);
+        ty = c[i][0] * sin(za) + c[i][1] * cos(za);
+        c[i][0] = tx; c[i][1] = ty;
+        tx = c[i][0] * cos(ya) + c[i][2] * sin(ya);
+        tz = -c[i][0] * sin(ya) + c[i][2] * cos(ya);
+        c[i][0] = tx; c[i][2] = tz;
+        ty = c[i][1] * cos(xa) - c[i][2] * sin(xa);
+        tz = c[i][1] * sin(xa) + c[i][2] * cos(xa);
+        c[i][1] = ty; c[i][2] = tz;
+    }
+
+    // Project the points, as draw_cube does, into the center of the window.
+    for (i = 0; i < 8; ++i)
+        for (int j = 0; j < 2; ++j)
+            point[i][j] = (plane_z - c[i][2]) / (c[i][2] - pro[2]) * (c[i][j] - pro[j])
+                        + c[i][j] + window_size / 2;
+
+    cleardevice();
+    w.ops++;
+    w.pixels += (double)window_size * window_size;
+    setcolor(WHITE);
+    for (i = 0; i < 12; ++i)
+    {
+        int x1 = (int)point[edges[i][0]][0], y1 = (int)point[edges[i][0]][1];
+        int x2 = (int)point[edges[i][1]][0], y2 = (int)point[edges[i][1]][1];
+        line(x1, y1, x2, y2);
+        w.ops++;
+        w.pixels += line_pixels(x1, y1, x2, y2);
+    }
+    return w;
+}
+
+
+// fractal: the Mandelbrot set, drawn with shadepixels as the fractal
+// program draws it, zooming in a little each frame.
+const int MANY_COLORS = 8;
+const int TABLE[MANY_COLORS][3] = {
+    {   0,   0,   0},  // Black
+    {  20,  20, 200},  // Blue
+    { 130, 130, 235},  // Light Blue
+    { 252, 252,  84},  // Yellow
+    { 255,   0,   0},  // Red
+    { 255,  60,   0},  // Orange
+    { 230, 230, 255},  // Light Blue
+    {   0,   0,   0}   // Black
+};
+
+int fractal_shader(int col, int row, void* data)
+{
+    double* view = (double*) data;   // cx, cy and half_side
+    const int LIMIT = (MANY_COLORS-1) * 10 - 1;
+    complex<double> p((2.0*view[2]/window_size)*col + (view[0]-view[2]),
+                      -(2.0*view[2]/window_size)*row + (view[1]+view[2]));
+    complex<double> start = p;
+    int count = 0;
+    int lower, upper, tenths;
+
+    while (count < LIMIT && abs(p) < 2.0)
+    {
+        p = p*p + start;
+        count++;
+    }
+    lower = count / 10;
+    upper = lower + 1;
+    tenths = count % 10;
+    return COLOR(
+        TABLE[lower][0] + tenths * (TABLE[upper][0] - TABLE[lower][0]) / 10,
+        TABLE[lower][1] + tenths * (TABLE[upper][1] - TABLE[lower][1]) / 10,
+        TABLE[lower][2] + tenths * (TABLE[upper][2] - TABLE[lower][2]) / 10
+        );
+}
+
+work fractal(int frame)
+{
+    double view[3] = { -0.75, 0.1, 2 * pow(0.97, frame) };
+    work w = { 1, (double)window_size * window_size };
+
+    shadepixels(0, 0, window_size-1, window_size-1, fractal_shader, view, 16);
+    return w;
+}
+
+
+// test-putpixel: every pixel of the window, one putpixel at a time, in the
+// colors of the test (moved along by one each frame).
+work putpixels(int frame)
+{
+    work w = { (double)window_size * window_size, (double)window_size * window_size };
+
+    for (int i = 0; i < window_size; ++i)
+        for (int j = 0; j < window_size; ++j)
+            putpixel(i, j, (i + j + frame) % 16);
+    return w;
+}
+
+
+// test-flood: every pixel set to the color of the frame, row by row, and
+// then a circle that is filled with floodfill (in place of the recursive
+// flood of the test, which runs out of stack on a large window).
+work flood(int frame)
+{
+    work w = { 0, 0 };
+    int radius = window_size / 3;
+
+    for (int i = 0; i < window_size; ++i)
+        for (int j = 0; j < window_size; ++j)
+            putpixel(j, i, frame % 16);
+    w.ops += (double)window_size * window_size;
+    w.pixels += (double)window_size * window_size;
+
+    setcolor(WHITE);
+    circle(window_size / 2, window_size / 2, radius);
+    setfillstyle(SOLID_FILL, (frame + 1) % 15 + 1);
+    floodfill(window_size / 2, window_size / 2, WHITE);
+    w.ops += 4;
+    w.pixels += 2 * PI * radius + PI * radius * radius;
+    return w;
+}
+
+
+const workload WORKLOADS[] = {
+    { "bgidemo", bgidemo },
+    { "cube", cube },
+    { "fractal", fractal },
+    { "putpixel", putpixels },
+    { "flood", flood }
+};
+const int MANY_WORKLOADS = sizeof(WORKLOADS) / sizeof(WORKLOADS[0]);
+
+
+// ---------------------------------------------------------------------------
+//                          Timing and reporting
+// ---------------------------------------------------------------------------
+
+// The p percentile (nearest rank) of the sorted times.
+double percentile(const vector<double>& sorted, double p)
+{
+    int rank = (int)ceil(p / 100 * sorted.size());
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+// Draws the frames of one workload and times them.  A frame ends when the
+// library has finished its drawing (getpixel waits for GDI) and, with
+// visible set, when it has been shown.
+result run(const workload& load, int frames, unsigned long seed, bool visible)
+{
+    result r;
+    vector<double> times;
+    int frame;
+
+    seed_state = seed ? seed : 1;
+    for (frame = 0; frame < WARMUP_FRAMES; ++frame)
+    {
+        load.draw(frame);
+        getpixel(0, 0);
+    }
+    seed_state = seed ? seed : 1;
+    resetbgistats();
+
+    r.name = load.name;
+    r.frames = frames;
+    r.ops = r.pixels = 0;
+    for (frame = 0; frame < frames; ++frame)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        work w = load.draw(frame);
+        getpixel(0, 0);
+        if (visible)
+            swapbuffers();
+        chrono::duration<double, milli> ms = chrono::steady_clock::now() - start;
+        times.push_back(ms.count());
+        r.ops += w.ops;
+        r.pixels += w.pixels;
+    }
+    getbgistats(&r.stats);
+
+    r.seconds = 0;
+    for (size_t i = 0; i < times.size(); ++i)
+        r.seconds += times[i] / 1000;
+    sort(times.begin(), times.end());
+    r.mean_ms = r.seconds * 1000 / frames;
+    r.p50_ms = percentile(times, 50);
+    r.p90_ms = percentile(times, 90);
+    r.p99_ms = percentile(times, 99);
+    r.max_ms = times.back();
+    return r;
+}
+
+// Writes the results to a JSON file.  It returns false if the file cannot
+// be made.
+bool write_json(const char* filename, const vector<result>& results,
+                int frames, unsigned long seed, bool visible)
+{
+    FILE* f = fopen(filename, "w");
+
+    if (f == NULL)
+        return false;
+    fprintf(f, "{\n  \"size\": %d,\n  \"frames\": %d,\n  \"seed\": %lu,\n  \"mode\": \"%s\",\n",
+            window_size, frames, seed, visible ? "visible" : "offscreen");
+    fprintf(f, "  \"workloads\": [");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const result& r = results[i];
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"frames\": %d, \"seconds\": %.6f,"
+                " \"ops\": %.0f, \"pixels\": %.0f, \"ops_per_sec\": %.1f, \"pixels_per_sec\": %.1f,\n",
+                i ? "," : "", r.name, r.frames, r.seconds, r.ops, r.pixels,
+                r.ops / r.seconds, r.pixels / r.seconds);
+        fprintf(f, "     \"frame_ms\": {\"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f,"
+                " \"p99\": %.4f, \"max\": %.4f}",
+                r.mean_ms, r.p50_ms, r.p90_ms, r.p99_ms, r.max_ms);
+        if (r.stats.enabled)
+        {
+            // The counters of a library built with BGI_STATS
+            fprintf(f, ",\n     \"calls\": [");
+            for (int j = 0, n = 0; j < r.stats.count; ++j)
+            {
+                const callstatstype& c = r.stats.call[j];
+                if (c.calls == 0)
+                    continue;
+                fprintf(f, "%s\n       {\"name\": \"%s\", \"calls\": %lu, \"total_ms\": %.4f,"
+                        " \"max_ms\": %.4f, \"wait_ms\": %.4f, \"pixels\": %.0f, \"refreshed\": %.0f}",
+                        n++ ? "," : "", c.name, c.calls, c.total_ms, c.max_ms, c.wait_ms,
+                        c.pixels, c.refreshed);
+            }
+            fprintf(f, "\n     ]");
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+    return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+    int frames = DEFAULT_FRAMES;
+    unsigned long seed = 1;
+    const char* only = NULL;
+    const char* json = NULL;
+    bool visible = false;
+    vector<result> results;
+    int i;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--visible") == 0)
+            visible = true;
+        else if (i + 1 < argc && strcmp(argv[i], "--frames") == 0)
+            frames = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--size") == 0)
+            window_size = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--seed") == 0)
+            seed = strtoul(argv[++i], NULL, 10);
+        else if (i + 1 < argc && strcmp(argv[i], "--only") == 0)
+            only = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--json") == 0)
+            json = argv[++i];
+        else
+        {
+            fprintf(stderr, "Usage: %s [--frames n] [--size n] [--seed n] [--only name]"
+                    " [--json file] [--visible]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (frames < 1 || window_size < 16)
+    {
+        fprintf(stderr, "%s: --frames must be at least 1 and --size at least 16\n", argv[0]);
+        return 2;
+    }
+    if (only != NULL)
+    {
+        for (i = 0; i < MANY_WORKLOADS && strcmp(only, WORKLOADS[i].name) != 0; ++i)
+            ;
+        if (i == MANY_WORKLOADS)
+        {
+            fprintf(stderr, "%s: no workload named %s\n", argv[0], only);
+            return 2;
+        }
+    }
+
+    initwindow(window_size, window_size, "winbgim benchmark", 0, 0, visible);
+    if (!visible)
+    {
+        // Draw on a page that is never shown.
+        setvisualpage(0);
+        setactivepage(1);
+    }
+
+    printf("%-10s %7s %12s %14s %9s %9s %9s %9s\n",
+           "workload", "frames", "ops/sec", "pixels/sec", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (i = 0; i < MANY_WORKLOADS; ++i)
+    {
+        if (only != NULL && strcmp(only, WORKLOADS[i].name) != 0)
+            continue;
+        result r = run(WORKLOADS[i], frames, seed, visible);
+        printf("%-10s %7d %12.0f %14.0f %9.3f %9.3f %9.3f %9.3f\n",
+               r.name, r.frames, r.ops / r.seconds, r.pixels / r.seconds,
+               r.p50_ms, r.p90_ms, r.p99_ms, r.max_ms);
+        fflush(stdout);
+        results.push_back(r);
+    }
+    closegraph();
+
+    if (json != NULL && !write_json(json, results, frames, seed, visible))
+    {
+        fprintf(stderr, "%s: cannot write %s\n", argv[0], json);
+        return 1;
+    }
+    return 0;
+}
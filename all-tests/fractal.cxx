@@ -72,6 +72,10 @@ void draw_fractal(double cx, double cy, double half_side);
 // (cx, cy) and half_side is the length of half the side
 // of the square that is drawn.
     
+int fractal_shader(int col, int row, void* data);
+// Shader for shadepixels: calculates the color of the pixel at the
+// specified col and row.  The data is the center and half_side.
+
 int pixel_color(complex<double> p);
 // Calculates the color to put at the specified col and row.
 
@@ -132,37 +136,27 @@ void change_controls
 
 void draw_fractal(double cx, double cy, double half_side)
 {
-    int row, col; // The pixel numbers of the row and column
+    double view[3] = { cx, cy, half_side }; // Passed along to the shader
+
+    // Shade the window on all processors, showing 16x16 blocks first and
+    // then refining them down to single pixels.
+    shadepixels(0, 0, WINDOW_SIZE-1, WINDOW_SIZE-1, fractal_shader, view, 16);
+}
+
+int fractal_shader(int col, int row, void* data)
+{
+    double* view = (double*) data;   // cx, cy and half_side
     double realx, realy; // The coordinates in the complex plane
-    complex<double> p;    // The point as a complex number
 
-    setrefreshingbgi(false);
-    row = 0;
-    while (row < WINDOW_SIZE)
-    {
-	// Color all the pixels in this row...
-        col = 0;
-	while (col < WINDOW_SIZE)
-	{
-	    // Color the pixel at location (col, row)
-            realx =
-		(2.0*half_side/WINDOW_SIZE)*col
-		+
-		(cx-half_side);
-            realy =
-		-(2.0*half_side/WINDOW_SIZE)*row
-		+
-		(cy+half_side);
-            p = complex<double>(realx, realy);
-
-	    putpixel(col, row, pixel_color(p));
-	    col++;
-	}
-	//refresh(0, row, WINDOW_SIZE-1, row);
-	row++;
-    }
-    refreshallbgi( );
-    setrefreshingbgi(true);
+    realx =
+	(2.0*view[2]/WINDOW_SIZE)*col
+	+
+	(view[0]-view[2]);
+    realy =
+	-(2.0*view[2]/WINDOW_SIZE)*row
+	+
+	(view[1]+view[2]);
+    return pixel_color(complex<double>(realx, realy));
 }
 
 int pixel_color(complex<double> p)
@@ -0,0 +1,526 @@
+// golden.cxx
+// Golden image tests of the winbgim library.  Each case is a fixed sequence
+// of drawing calls on page 1 of the window while page 0 is shown, so nothing
+// waits for the user and the window is never repainted.  The pixels of the
+// page are read back with getpixel and compared with the golden image of the
+// case, a binary PPM file named after it.  A case passes if no more than
+// --max-bad pixels differ from the golden image by more than --tolerance in
+// any of red, green or blue (both are 0 by default, which asks for the same
+// image bit for bit).  When a case fails, the image it drew and an image of
+// the differences (the wrong pixels in red over a dim copy of the golden
+// image) are written to the --diffs directory.
+//
+// Every case is drawn on each of the page formats, in a window of its own.
+// The golden image of a case on 32-bit pages is named after the case, and
+// on the other formats the name of the format is added (lines-rgb565.ppm).
+// --only lines runs a case on every format, and --only lines-rgb565 on one.
+//
+// The golden images are made by running the tests with --update on a build
+// whose drawing is known to be right, and checked in with the tests.
+//
+// Usage: golden [--update] [--only name] [--golden dir] [--diffs dir]
+//               [--tolerance n] [--max-bad n]
+// The exit status is 0 if all of the cases pass, and 1 if any fail.
+
+#include <vector>     // Provides the vector class
+#include <string>     // Provides the string class
+#include <stdio.h>    // Provides fopen, fread and fwrite
+#include <stdlib.h>   // Provides atoi and abs
+#include <string.h>   // Provides strcmp
+#include <graphics.h> // Provides the winbgim library
+using namespace std;
+
+#ifndef GOLDEN_DIR
+#define GOLDEN_DIR "golden"     // Where the golden images are kept
+#endif
+
+// Constant declarations
+const int WIDTH = 256;          // Width of the page drawn by each case
+const int HEIGHT = 192;         // Height of the page drawn by each case
+
+// An image in 8 bit red, green and blue, row by row
+struct image
+{
+    int width, height;
+    vector<unsigned char> rgb;
+};
+
+// A test case: a name and the function that draws it
+struct testcase
+{
+    const char* name;
+    void (*draw)();
+};
+
+// A page format that the cases are drawn on, and what is added to the names
+// of its golden images
+struct pageformat
+{
+    int format;
+    const char* suffix;
+};
+
+
+// ---------------------------------------------------------------------------
+//                          The cases
+// ---------------------------------------------------------------------------
+
+// Lines of every slope, in each of the line styles, thin and thick.
+void draw_lines()
+{
+    int style, i;
+
+    for (style = SOLID_LINE; style <= USERBIT_LINE; ++style)
+    {
+        setlinestyle(style, 0xF0C3, NORM_WIDTH);
+        setcolor(style + 9);
+        for (i = 0; i < 16; ++i)
+            line(20 + 48*style, 20, 20 + 48*style + (i % 4) * 10 - 15, 20 + (i / 4) * 20 - 15 + i);
+    }
+    for (style = SOLID_LINE; style <= USERBIT_LINE; ++style)
+    {
+        setlinestyle(style, 0xF0C3, THICK_WIDTH);
+        setcolor(style + 1);
+        line(10, 100 + 18*style, 245, 90 + 22*style);
+        line(30 + 50*style, 100, 10 + 50*style, 185);
+    }
+    setlinestyle(SOLID_LINE, 0, NORM_WIDTH);
+    setcolor(WHITE);
+    moveto(128, 96);
+    lineto(255, 0);
+    linerel(-300, 300);
+}
+
+// Outlined and filled rectangles in each of the fill patterns.
+void draw_bars()
+{
+    char pattern[8] = { (char)0x81, 0x42, 0x24, 0x18, 0x18, 0x24, 0x42, (char)0x81 };
+    int style;
+
+    for (style = EMPTY_FILL; style < USER_FILL; ++style)
+    {
+        int left = 4 + (style % 6) * 42, top = 4 + (style / 6) * 60;
+        setfillstyle(style, style + 1);
+        bar(left, top, left + 36, top + 50);
+        setcolor(WHITE);
+        rectangle(left, top, left + 36, top + 50);
+    }
+    setfillpattern(pattern, LIGHTGREEN);
+    bar3d(140, 130, 220, 180, 10, 1);
+    setfillstyle(SOLID_FILL, RED);
+    bar(250, 186, 240, 176);            // Corners given in the other order
+}
+
+// Circles, arcs, ellipses, pie slices and sectors, including some that
+// leave the page.
+void draw_curves()
+{
+    for (int r = 2; r < 90; r += 7)
+    {
+        setcolor(r % 15 + 1);
+        circle(64, 64, r);
+    }
+    setcolor(YELLOW);
+    arc(190, 50, 30, 300, 40);
+    ellipse(190, 140, 0, 360, 60, 25);
+    setcolor(WHITE);
+    setfillstyle(HATCH_FILL, CYAN);
+    pieslice(60, 150, 45, 270, 35);
+    setfillstyle(SOLID_FILL, MAGENTA);
+    sector(150, 150, 200, 20, 40, 20);
+    setfillstyle(INTERLEAVE_FILL, GREEN);
+    fillellipse(240, 180, 30, 20);
+}
+
+// Polygons: outlines, filled polygons (one that crosses itself) and the
+// fast outline.
+void draw_polygons()
+{
+    int star[] = { 60, 10, 80, 90, 10, 40, 110, 40, 40, 90, 60, 10 };
+    int box[] = { 140, 10, 240, 30, 220, 90, 130, 70, 140, 10 };
+    int wave[2 * 64];
+
+    setcolor(WHITE);
+    setfillstyle(SOLID_FILL, BLUE);
+    fillpoly(5, star);
+    setfillstyle(WIDE_DOT_FILL, LIGHTRED);
+    fillpoly(4, box);
+    setcolor(LIGHTCYAN);
+    drawpoly(5, box);
+    for (int i = 0; i < 64; ++i)
+    {
+        wave[2*i] = 4 * i;
+        wave[2*i+1] = 140 + ((i * 37) % 41) - 20;
+    }
+    setcolor(YELLOW);
+    drawpolyfast(64, wave);
+}
+
+// Pixels in RGB and palette colors, and XOR drawing that undoes itself.
+void draw_pixels()
+{
+    int x, y;
+
+    for (y = 0; y < HEIGHT; y += 2)
+        for (x = 0; x < WIDTH; x += 3)
+            putpixel(x, y, (x < WIDTH / 2) ? (x + y) % 16 : COLOR(x, y, (x * y) % 256));
+    setwritemode(XOR_PUT);
+    setcolor(WHITE);
+    line(0, 0, WIDTH - 1, HEIGHT - 1);
+    line(0, HEIGHT - 1, WIDTH - 1, 0);
+    line(0, HEIGHT - 1, WIDTH - 1, 0);  // Takes the second line away again
+    rectangle(20, 20, 100, 60);
+    setwritemode(COPY_PUT);
+}
+
+// Flood fills of closed shapes, from inside and from the background.
+void draw_flood()
+{
+    setcolor(WHITE);
+    circle(60, 60, 40);
+    rectangle(120, 20, 230, 100);
+    line(120, 20, 230, 100);
+    setfillstyle(SOLID_FILL, GREEN);
+    floodfill(60, 60, WHITE);
+    setfillstyle(SLASH_FILL, RED);
+    floodfill(200, 40, WHITE);
+    setfillstyle(SOLID_FILL, DARKGRAY);
+    floodfill(5, 180, WHITE);
+}
+
+// Drawing in a clipping viewport, and clearing it.
+void draw_viewport()
+{
+    setfillstyle(SOLID_FILL, BLUE);
+    bar(0, 0, WIDTH - 1, HEIGHT - 1);
+    setviewport(40, 30, 200, 150, 1);
+    setbkcolor(LIGHTGRAY);
+    clearviewport();
+    setcolor(RED);
+    circle(80, 60, 100);
+    line(-50, -50, 300, 200);
+    setfillstyle(SOLID_FILL, YELLOW);
+    bar(140, 100, 400, 300);
+    putpixel(-1, -1, WHITE);            // Outside the viewport
+    setviewport(0, 0, WIDTH, HEIGHT, 0);
+    setbkcolor(BLACK);
+}
+
+// The batched calls, which must draw what the calls one at a time draw.
+void draw_batches()
+{
+    int rects[4 * 6], colors[6], segs[4 * 8], centers[2 * 5], radii[5];
+    int i;
+
+    for (i = 0; i < 6; ++i)
+    {
+        rects[4*i] = 10 + 30*i;
+        rects[4*i+1] = 10 + 5*i;
+        rects[4*i+2] = 50 + 30*i;
+        rects[4*i+3] = 60 + 5*i;
+        colors[i] = i + 1;
+    }
+    bars(6, rects, colors);
+    for (i = 0; i < 8; ++i)
+    {
+        segs[4*i] = 10;
+        segs[4*i+1] = 90 + 10*i;
+        segs[4*i+2] = 250;
+        segs[4*i+3] = 180 - 10*i;
+    }
+    setcolor(LIGHTGREEN);
+    setlinestyle(DASHED_LINE, 0, NORM_WIDTH);
+    lines(8, segs);
+    setlinestyle(SOLID_LINE, 0, NORM_WIDTH);
+    for (i = 0; i < 5; ++i)
+    {
+        centers[2*i] = 40 + 45*i;
+        centers[2*i+1] = 140;
+        radii[i] = 5 + 6*i;
+    }
+    setcolor(WHITE);
+    circles(5, centers, radii);
+}
+
+// Images copied with each of the putimage operations.
+void draw_images()
+{
+    vector<char> bitmap(imagesize(0, 0, 63, 47));
+    int op;
+
+    setfillstyle(CLOSE_DOT_FILL, LIGHTMAGENTA);
+    bar(0, 0, 63, 47);
+    setcolor(YELLOW);
+    circle(32, 24, 20);
+    getimage(0, 0, 63, 47, &bitmap[0]);
+    setfillstyle(SOLID_FILL, CYAN);
+    bar(0, 100, WIDTH - 1, HEIGHT - 1);
+    for (op = COPY_PUT; op <= NOT_PUT; ++op)
+    {
+        putimage(70 + 36*op, 20 + 20*op, &bitmap[0], op);
+        putimage(10 + 48*op, 120, &bitmap[0], op);
+    }
+}
+
+// A pixel shader, drawn in 8x8 blocks first and then refined.
+int shader(int x, int y, void* data)
+{
+    return COLOR(x, y, (x ^ y) & 255);
+}
+
+void draw_shader()
+{
+    shadepixels(0, 0, WIDTH - 1, HEIGHT - 1, shader, NULL, 8);
+}
+
+// A display list, replayed at two places.
+void draw_replay()
+{
+    int list;
+
+    beginrecord();
+    setcolor(LIGHTRED);
+    rectangle(0, 0, 60, 40);
+    setfillstyle(SOLID_FILL, BROWN);
+    fillellipse(30, 20, 20, 12);
+    line(0, 40, 60, 0);
+    list = endrecord();
+    replay(list, 100, 50);
+    replay(list, 180, 130);
+    deletelist(list);
+}
+
+const testcase CASES[] = {
+    { "lines", draw_lines },
+    { "bars", draw_bars },
+    { "curves", draw_curves },
+    { "polygons", draw_polygons },
+    { "pixels", draw_pixels },
+    { "flood", draw_flood },
+    { "viewport", draw_viewport },
+    { "batches", draw_batches },
+    { "images", draw_images },
+    { "shader", draw_shader },
+    { "replay", draw_replay }
+};
+const int MANY_CASES = sizeof(CASES) / sizeof(CASES[0]);
+
+const pageformat FORMATS[] = {
+    { XRGB8888_PAGES, "" },
+    { RGB565_PAGES, "-rgb565" },
+    { GRAY8_PAGES, "-gray8" },
+    { INDEXED8_PAGES, "-indexed8" }
+};
+const int MANY_FORMATS = sizeof(FORMATS) / sizeof(FORMATS[0]);
+
+
+// ---------------------------------------------------------------------------
+//                          Images
+// ---------------------------------------------------------------------------
+
+// Draws one case on a cleared page, with the default settings, and reads
+// back the pixels of the page.
+image draw_case(const testcase& t)
+{
+    image answer;
+
+    graphdefaults();
+    setwritemode(COPY_PUT);
+    setbkcolor(BLACK);
+    cleardevice();
+    t.draw();
+
+    // The whole page, as graphdefaults sets it (a viewport leaves out its
+    // right and bottom edges, which getpixel would then not read).
+    setviewport(0, 0, WIDTH, HEIGHT, 0);
+    answer.width = WIDTH;
+    answer.height = HEIGHT;
+    answer.rgb.resize(3 * WIDTH * HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y)
+        for (int x = 0; x < WIDTH; ++x)
+        {
+            int color = getpixel(x, y);
+            unsigned char* p = &answer.rgb[3 * (y * WIDTH + x)];
+            p[0] = RED_VALUE(color);
+            p[1] = GREEN_VALUE(color);
+            p[2] = BLUE_VALUE(color);
+        }
+    return answer;
+}
+
+// FNV-1a hash of the pixels of an image, which the report shows so that
+// images can be told apart without looking at them.
+unsigned long long hash_image(const image& img)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < img.rgb.size(); ++i)
+    {
+        hash ^= img.rgb[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Writes an image to a binary PPM file.  It returns false if it cannot.
+bool write_ppm(const string& filename, const image& img)
+{
+    FILE* f = fopen(filename.c_str(), "wb");
+    bool ok;
+
+    if (f == NULL)
+        return false;
+    fprintf(f, "P6\n%d %d\n255\n", img.width, img.height);
+    ok = fwrite(&img.rgb[0], 1, img.rgb.size(), f) == img.rgb.size();
+    return (fclose(f) == 0) && ok;
+}
+
+// Reads an image from a binary PPM file (as write_ppm writes them).  It
+// returns false if there is no such file or it is not a PPM file.
+bool read_ppm(const string& filename, image& img)
+{
+    FILE* f = fopen(filename.c_str(), "rb");
+    int maxval;
+    bool ok;
+
+    if (f == NULL)
+        return false;
+    ok = fscanf(f, "P6 %d %d %d", &img.width, &img.height, &maxval) == 3
+        && maxval == 255 && img.width > 0 && img.height > 0 && fgetc(f) != EOF;
+    if (ok)
+    {
+        img.rgb.resize(3 * img.width * img.height);
+        ok = fread(&img.rgb[0], 1, img.rgb.size(), f) == img.rgb.size();
+    }
+    fclose(f);
+    return ok;
+}
+
+// Counts the pixels of actual that differ from expected by more than
+// tolerance, and makes an image of them: the wrong pixels are red, and the
+// others a dim gray copy of expected.
+int compare(const image& expected, const image& actual, int tolerance, image& diff)
+{
+    int bad = 0;
+
+    diff.width = actual.width;
+    diff.height = actual.height;
+    diff.rgb.resize(actual.rgb.size());
+    for (size_t i = 0; i < actual.rgb.size(); i += 3)
+    {
+        const unsigned char* e = &expected.rgb[i];
+        const unsigned char* a = &actual.rgb[i];
+        if (abs(e[0] - a[0]) > tolerance || abs(e[1] - a[1]) > tolerance || abs(e[2] - a[2]) > tolerance)
+        {
+            diff.rgb[i] = 255;
+            diff.rgb[i+1] = diff.rgb[i+2] = 0;
+            bad++;
+        }
+        else
+            diff.rgb[i] = diff.rgb[i+1] = diff.rgb[i+2] = (e[0] + e[1] + e[2]) / 12;
+    }
+    return bad;
+}
+
+
+int main(int argc, char* argv[])
+{
+    string golden = GOLDEN_DIR;
+    string diffs = ".";
+    const char* only = NULL;
+    bool update = false;
+    int tolerance = 0;
+    int max_bad = 0;
+    int ran = 0, failed = 0;
+    int i;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--update") == 0)
+            update = true;
+        else if (i + 1 < argc && strcmp(argv[i], "--only") == 0)
+            only = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--golden") == 0)
+            golden = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--diffs") == 0)
+            diffs = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--tolerance") == 0)
+            tolerance = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--max-bad") == 0)
+            max_bad = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Usage: %s [--update] [--only name] [--golden dir] [--diffs dir]"
+                    " [--tolerance n] [--max-bad n]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    for (int f = 0; f < MANY_FORMATS; ++f)
+    {
+        initwindow(WIDTH, HEIGHT, "winbgim golden images", 0, 0, false, true, FORMATS[f].format);
+        setvisualpage(0);
+        setactivepage(1);
+
+        for (i = 0; i < MANY_CASES; ++i)
+        {
+            const testcase& t = CASES[i];
+            string name = string(t.name) + FORMATS[f].suffix;
+            string path = golden + "/" + name + ".ppm";
+            image actual, expected, diff;
+
+            if (only != NULL && strcmp(only, t.name) != 0 && name != only)
+                continue;
+            ran++;
+            actual = draw_case(t);
+
+            if (update)
+            {
+                if (!write_ppm(path, actual))
+                {
+                    printf("FAIL %-18s cannot write %s\n", name.c_str(), path.c_str());
+                    failed++;
+                }
+                else
+                    printf("made %-18s %016llx\n", name.c_str(), hash_image(actual));
+                continue;
+            }
+            if (!read_ppm(path, expected))
+            {
+                printf("FAIL %-18s no golden image %s (make it with --update)\n", name.c_str(), path.c_str());
+                failed++;
+                continue;
+            }
+            if (expected.width != actual.width || expected.height != actual.height)
+            {
+                printf("FAIL %-18s golden image is %dx%d, not %dx%d\n", name.c_str(),
+                       expected.width, expected.height, actual.width, actual.height);
+                failed++;
+                continue;
+            }
+
+            int bad = compare(expected, actual, tolerance, diff);
+            if (bad > max_bad)
+            {
+                string actual_path = diffs + "/" + name + ".actual.ppm";
+                string diff_path = diffs + "/" + name + ".diff.ppm";
+                printf("FAIL %-18s %016llx != %016llx, %d pixels differ (see %s)\n", name.c_str(),
+                       hash_image(actual), hash_image(expected), bad, diff_path.c_str());
+                if (!write_ppm(actual_path, actual) || !write_ppm(diff_path, diff))
+                    printf("     %-18s cannot write the images to %s\n", "", diffs.c_str());
+                failed++;
+            }
+            else
+                printf("ok   %-18s %016llx\n", name.c_str(), hash_image(actual));
+        }
+        closegraph(CURRENT_WINDOW);
+    }
+
+    if (ran == 0)
+    {
+        fprintf(stderr, "%s: no case named %s\n", argv[0], only);
+        return 2;
+    }
+    printf("%d of %d cases passed\n", ran - failed, ran);
+    return failed ? 1 : 0;
+}
@@ -16,6 +16,6 @@ int main(int argc, char* argv[])
 #ifdef WINDOWS
     command += " -mwindows";
 #endif
-    command += " -lbgi -lgdi32 -lcomdlg32 -luuid -loleaut32 -lole32";
+    command += " -lbgi -lgdi32 -lcomdlg32 -luuid -loleaut32 -lole32 -lws2_32";
     return system(command.c_str( ));
 }
@@ -0,0 +1,1288 @@
+// File: decode.cxx
+//
+// This file contains the image file readers used by readimagefile.  BMP
+// (every bit depth, uncompressed or with bit fields), PNG (every color type
+// and bit depth, interlaced or not) and uncompressed TGA files are decoded
+// here, straight into the pixel layout of the pages, and then scaled into
+// the target rectangle of the active page.  Other formats (GIF, JPEG, icons
+// and metafiles) are still loaded through OLE by readimagefile.
+//
+
+#include <windows.h>        // Provides the Win32 API
+#include <limits.h>         // Provides INT_MAX
+#include <stdlib.h>         // Provides abs
+#include <string.h>         // Provides memcpy and memcmp
+#include <list>             // Provides STL list class
+#include <string>           // Provides STL string class
+#include <vector>           // Provides STL vector class
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+#include "dibapi.h"         // MapDIB and BlitDIBRow from file.cpp
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Structures and constants
+*
+*****************************************************************************/
+#define MAX_IMAGE_SIDE  32768   // Larger images are refused as damaged
+#define CACHE_BUDGET    ( 64 * 1024 * 1024 )    // Default image cache size
+
+// A decoded image.  Each pixel is 0xAARRGGBB and the rows are top-down.
+struct DecodedImage
+{
+    int width, height;
+    bool alpha;                 // True if any pixel is not fully opaque
+    std::vector<DWORD> pixels;
+};
+
+// The rows of an image that is being drawn.  They come either from a decoded
+// image or straight from a BMP file mapped by MapDIB (file.cpp).  Rows of a
+// mapped file are converted as they are needed, into buffer[y % 2], so that
+// the two rows used by bilinear scaling are both at hand.
+struct ImageRows
+{
+    int width, height;
+    bool alpha;                 // True if any pixel is not fully opaque
+    const DecodedImage* image;  // Decoded image, or NULL
+    LPSTR dib;                  // Mapped BMP file, or NULL
+    std::vector<DWORD> buffer[2];
+    int buffered[2];            // Row in each buffer (-1 if none)
+};
+
+// One channel of the pixels of a 16 or 32-bit BMP: the bits of its mask
+// (moved down to bit 0), where they start and how many there are.  A mask
+// of 0 makes a channel that is always 255.
+struct BitField
+{
+    DWORD mask;
+    int shift, bits;
+};
+
+// An image in the cache of readimagefile, already scaled to the size at
+// which it was drawn.  The key is the file (name, time of the last write
+// and size) and the requested size (0 for the image's own width or height).
+struct CacheEntry
+{
+    std::string filename;
+    __int64 write_time, file_size;
+    int key_width, key_height, scaling;
+    DecodedImage image;
+};
+
+// Reads bits from a deflate stream, least significant bit first.
+struct Inflater
+{
+    const BYTE* in;
+    size_t size, pos;
+    DWORD bits;                 // Bits read from in but not used yet
+    int count;                  // Number of them
+    BYTE* out;
+    size_t out_size, out_pos;
+    bool error;
+};
+
+// A canonical Huffman code: the number of codes of each length and the
+// symbols in code order.
+struct Huffman
+{
+    short count[16];
+    short symbol[288];
+};
+
+
+/*****************************************************************************
+*
+*   Global Variables
+*
+*****************************************************************************/
+static int image_scaling = NEAREST_SCALING;     // Set by setimagescaling
+static std::list<CacheEntry> image_cache;      // Most recently used first
+static imagecachetype cache_info = { 0, 0, 0, 0, CACHE_BUDGET };
+
+
+/*****************************************************************************
+*
+*   Inflate (RFC 1950 and 1951)
+*
+*****************************************************************************/
+
+// This function returns the next n bits of the stream.
+//
+static int GetBits( Inflater* s, int n )
+{
+    DWORD value;
+
+    while ( s->count < n )
+    {
+        if ( s->pos == s->size )
+        {
+            s->error = true;
+            return 0;
+        }
+        s->bits |= (DWORD)s->in[s->pos++] << s->count;
+        s->count += 8;
+    }
+    value = s->bits & ( ( 1U << n ) - 1 );
+    s->bits >>= n;
+    s->count -= n;
+    return (int)value;
+}
+
+
+// This function builds a Huffman code from the code length of each symbol.
+// It returns false if the lengths do not describe a usable code.
+//
+static bool BuildHuffman( Huffman* h, const BYTE* lengths, int n )
+{
+    short offsets[16];
+    int left = 1, len, sym;
+
+    memset( h->count, 0, sizeof( h->count ) );
+    for ( sym = 0; sym < n; sym++ )
+        h->count[lengths[sym]]++;
+    if ( h->count[0] == n )
+        return true;            // No codes at all; any use of it is an error
+    for ( len = 1; len < 16; len++ )
+    {
+        left = ( left << 1 ) - h->count[len];
+        if ( left < 0 )
+            return false;       // Too many codes of this length
+    }
+    offsets[1] = 0;
+    for ( len = 1; len < 15; len++ )
+        offsets[len + 1] = offsets[len] + h->count[len];
+    for ( sym = 0; sym < n; sym++ )
+        if ( lengths[sym] != 0 )
+            h->symbol[offsets[lengths[sym]]++] = sym;
+    return true;
+}
+
+
+// This function decodes one symbol.
+//
+static int DecodeSymbol( Inflater* s, const Huffman* h )
+{
+    int code = 0, first = 0, index = 0, count;
+
+    for ( int len = 1; len < 16; len++ )
+    {
+        code |= GetBits( s, 1 );
+        count = h->count[len];
+        if ( code - count < first )
+            return h->symbol[index + ( code - first )];
+        index += count;
+        first = ( first + count ) << 1;
+        code <<= 1;
+    }
+    s->error = true;
+    return -1;
+}
+
+
+// This function decodes the symbols of one compressed block.
+//
+static void InflateCodes( Inflater* s, const Huffman* lencode, const Huffman* distcode )
+{
+    static const short length_base[29] =
+        { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+          67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const short length_extra[29] =
+        { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const short distance_base[30] =
+        { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+          1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const short distance_extra[30] =
+        { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+          11, 11, 12, 12, 13, 13 };
+    int sym, length;
+    size_t distance;
+
+    while ( !s->error )
+    {
+        sym = DecodeSymbol( s, lencode );
+        if ( sym < 0 || sym == 256 )
+            return;
+        if ( sym < 256 )
+        {
+            if ( s->out_pos == s->out_size )
+            {
+                s->error = true;
+                return;
+            }
+            s->out[s->out_pos++] = (BYTE)sym;
+            continue;
+        }
+
+        sym -= 257;
+        if ( sym >= 29 )
+        {
+            s->error = true;
+            return;
+        }
+        length = length_base[sym] + GetBits( s, length_extra[sym] );
+        sym = DecodeSymbol( s, distcode );
+        if ( sym < 0 || sym >= 30 )
+        {
+            s->error = true;
+            return;
+        }
+        distance = distance_base[sym] + GetBits( s, distance_extra[sym] );
+        if ( s->error || distance > s->out_pos || length > (int)( s->out_size - s->out_pos ) )
+        {
+            s->error = true;
+            return;
+        }
+        // The copy may overlap itself, so it is done a byte at a time.
+        BYTE* dst = s->out + s->out_pos;
+        const BYTE* src = dst - distance;
+        for ( int i = 0; i < length; i++ )
+            dst[i] = src[i];
+        s->out_pos += length;
+    }
+}
+
+
+// This function decodes a block that uses the fixed Huffman codes.
+//
+static void InflateFixed( Inflater* s )
+{
+    static Huffman lencode, distcode;
+    static bool ready = false;
+    BYTE lengths[288];
+    int i;
+
+    if ( !ready )
+    {
+        for ( i = 0; i < 144; i++ ) lengths[i] = 8;
+        for ( ; i < 256; i++ ) lengths[i] = 9;
+        for ( ; i < 280; i++ ) lengths[i] = 7;
+        for ( ; i < 288; i++ ) lengths[i] = 8;
+        BuildHuffman( &lencode, lengths, 288 );
+        for ( i = 0; i < 30; i++ ) lengths[i] = 5;
+        BuildHuffman( &distcode, lengths, 30 );
+        ready = true;
+    }
+    InflateCodes( s, &lencode, &distcode );
+}
+
+
+// This function decodes a block whose Huffman codes are in the block.
+//
+static void InflateDynamic( Inflater* s )
+{
+    static const BYTE order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    BYTE lengths[320];
+    Huffman lencode, distcode;
+    int nlen, ndist, ncode, index, sym, len, repeat;
+
+    nlen = GetBits( s, 5 ) + 257;
+    ndist = GetBits( s, 5 ) + 1;
+    ncode = GetBits( s, 4 ) + 4;
+    if ( s->error || nlen > 286 || ndist > 30 )
+    {
+        s->error = true;
+        return;
+    }
+
+    memset( lengths, 0, sizeof( lengths ) );
+    for ( index = 0; index < ncode; index++ )
+        lengths[order[index]] = GetBits( s, 3 );
+    if ( !BuildHuffman( &lencode, lengths, 19 ) )
+    {
+        s->error = true;
+        return;
+    }
+
+    for ( index = 0; index < nlen + ndist && !s->error; )
+    {
+        sym = DecodeSymbol( s, &lencode );
+        if ( sym < 0 )
+            return;
+        if ( sym < 16 )
+        {
+            lengths[index++] = sym;
+            continue;
+        }
+        len = 0;
+        if ( sym == 16 )
+        {
+            if ( index == 0 )
+            {
+                s->error = true;
+                return;
+            }
+            len = lengths[index - 1];
+            repeat = 3 + GetBits( s, 2 );
+        }
+        else if ( sym == 17 )
+            repeat = 3 + GetBits( s, 3 );
+        else
+            repeat = 11 + GetBits( s, 7 );
+        if ( index + repeat > nlen + ndist )
+        {
+            s->error = true;
+            return;
+        }
+        while ( repeat-- > 0 )
+            lengths[index++] = len;
+    }
+
+    if ( s->error || lengths[256] == 0
+         || !BuildHuffman( &lencode, lengths, nlen )
+         || !BuildHuffman( &distcode, lengths + nlen, ndist ) )
+    {
+        s->error = true;
+        return;
+    }
+    InflateCodes( s, &lencode, &distcode );
+}
+
+
+// This function decompresses a zlib stream into exactly out_size bytes.  It
+// returns false if the stream is damaged or does not hold that many bytes.
+//
+static bool Inflate( const BYTE* in, size_t size, BYTE* out, size_t out_size )
+{
+    Inflater s;
+    int last, type, len;
+
+    if ( size < 2 || ( in[0] & 0x0F ) != 8 || ( in[0] * 256 + in[1] ) % 31 != 0 || ( in[1] & 0x20 ) )
+        return false;           // Not deflate, bad check, or a preset dictionary
+
+    s.in = in;
+    s.size = size;
+    s.pos = 2;
+    s.bits = 0;
+    s.count = 0;
+    s.out = out;
+    s.out_size = out_size;
+    s.out_pos = 0;
+    s.error = false;
+
+    do
+    {
+        last = GetBits( &s, 1 );
+        type = GetBits( &s, 2 );
+        if ( type == 0 )
+        {
+            // Stored block: skip to a byte boundary, then copy LEN bytes.
+            s.bits = 0;
+            s.count = 0;
+            if ( s.pos + 4 > s.size )
+                return false;
+            len = s.in[s.pos] | ( s.in[s.pos + 1] << 8 );
+            if ( ( len ^ 0xFFFF ) != ( s.in[s.pos + 2] | ( s.in[s.pos + 3] << 8 ) ) )
+                return false;
+            s.pos += 4;
+            if ( s.pos + len > s.size || len > (int)( s.out_size - s.out_pos ) )
+                return false;
+            memcpy( s.out + s.out_pos, s.in + s.pos, len );
+            s.pos += len;
+            s.out_pos += len;
+        }
+        else if ( type == 1 )
+            InflateFixed( &s );
+        else if ( type == 2 )
+            InflateDynamic( &s );
+        else
+            return false;
+    } while ( !last && !s.error );
+
+    return !s.error && s.out_pos == s.out_size;
+}
+
+
+/*****************************************************************************
+*
+*   Decoders
+*
+*****************************************************************************/
+
+// These functions read little- and big-endian numbers.
+//
+static DWORD LE16( const BYTE* p ) { return p[0] | ( p[1] << 8 ); }
+static DWORD LE32( const BYTE* p ) { return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (DWORD)p[3] << 24 ); }
+static DWORD BE32( const BYTE* p ) { return ( (DWORD)p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3]; }
+
+
+// This function sets the size of an image, refusing sizes that cannot be
+// real.
+//
+static bool SetSize( DecodedImage* image, int width, int height )
+{
+    if ( width <= 0 || height <= 0 || width > MAX_IMAGE_SIDE || height > MAX_IMAGE_SIDE )
+        return false;
+    image->width = width;
+    image->height = height;
+    image->alpha = false;
+    image->pixels.resize( (size_t)width * height );
+    return true;
+}
+
+
+// This function works out the bit field of a BMP mask, once per image.  It
+// returns false if the bits of the mask are not all next to each other.
+//
+static bool MakeBitField( DWORD mask, BitField* field )
+{
+    field->shift = field->bits = 0;
+    field->mask = 0;
+    if ( mask == 0 )
+        return true;
+    while ( ( mask & 1 ) == 0 )
+    {
+        mask >>= 1;
+        field->shift++;
+    }
+    while ( field->bits < 32 && ( mask & ( 1U << field->bits ) ) )
+        field->bits++;
+    field->mask = mask;
+    return field->bits == 32 || mask == ( 1U << field->bits ) - 1;
+}
+
+
+// This function scales the masked part of a value to 0..255.
+//
+static inline DWORD MaskedChannel( DWORD value, const BitField* field )
+{
+    if ( field->bits == 0 )
+        return 255;
+    value = ( value >> field->shift ) & field->mask;
+    return ( field->bits >= 8 ) ? value >> ( field->bits - 8 ) : value * 255 / field->mask;
+}
+
+
+// This function decodes a BMP file with 1, 4, 8, 16, 24 or 32 bits per
+// pixel, uncompressed or with bit fields.  Run-length compressed files are
+// left to OLE.
+//
+static bool DecodeBMP( const BYTE* file, size_t size, DecodedImage* image )
+{
+    const BYTE* info = file + 14;
+    DWORD header, offset, compression, colors, masks[3], entry;
+    DWORD palette[256];
+    BitField fields[3];
+    int width, height, bpp, stride, x, y, i;
+    bool topdown;
+
+    if ( size < 14 + 12 || file[0] != 'B' || file[1] != 'M' )
+        return false;
+    offset = LE32( file + 10 );
+    header = LE32( info );
+    if ( header < 12 || 14 + header > size )
+        return false;
+
+    if ( header == 12 )
+    {
+        // OS/2 BITMAPCOREHEADER
+        width = LE16( info + 4 );
+        height = (short)LE16( info + 6 );
+        bpp = LE16( info + 10 );
+        compression = BI_RGB;
+        colors = 0;
+        entry = 3;
+    }
+    else
+    {
+        if ( header < 40 )
+            return false;
+        width = (int)LE32( info + 4 );
+        height = (int)LE32( info + 8 );
+        bpp = LE16( info + 14 );
+        compression = LE32( info + 16 );
+        colors = LE32( info + 32 );
+        entry = 4;
+    }
+    topdown = ( height < 0 );
+    height = topdown ? -height : height;
+    if ( compression != BI_RGB && compression != BI_BITFIELDS )
+        return false;
+    if ( bpp != 1 && bpp != 4 && bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32 )
+        return false;
+    if ( !SetSize( image, width, height ) )
+        return false;
+
+    // The palette follows the header (and the masks, for BI_BITFIELDS with
+    // a 40-byte header).
+    if ( bpp <= 8 )
+    {
+        const BYTE* p = info + header;
+        if ( colors == 0 || colors > ( 1U << bpp ) )
+            colors = 1 << bpp;
+        if ( p + colors * entry > file + size )
+            return false;
+        memset( palette, 0, sizeof( palette ) );
+        for ( i = 0; i < (int)colors; i++, p += entry )
+            palette[i] = 0xFF000000 | ( p[2] << 16 ) | ( p[1] << 8 ) | p[0];
+    }
+    if ( bpp == 16 )
+    {
+        masks[0] = 0x7C00; masks[1] = 0x03E0; masks[2] = 0x001F;
+    }
+    else
+    {
+        masks[0] = 0xFF0000; masks[1] = 0x00FF00; masks[2] = 0x0000FF;
+    }
+    if ( compression == BI_BITFIELDS )
+    {
+        if ( ( bpp != 16 && bpp != 32 ) || 14 + max( header, 52 ) > size )
+            return false;
+        for ( i = 0; i < 3; i++ )
+            masks[i] = LE32( info + 40 + 4 * i );
+    }
+    for ( i = 0; i < 3; i++ )
+        if ( !MakeBitField( masks[i], &fields[i] ) )
+            return false;
+
+    stride = ( ( width * bpp + 31 ) / 32 ) * 4;
+    if ( offset > size || (size_t)stride * height > size - offset )
+        return false;
+
+    for ( y = 0; y < height; y++ )
+    {
+        const BYTE* row = file + offset + (size_t)stride * ( topdown ? y : height - 1 - y );
+        DWORD* dst = &image->pixels[(size_t)y * width];
+        for ( x = 0; x < width; x++ )
+        {
+            DWORD v;
+            switch ( bpp )
+            {
+            case 1:  dst[x] = palette[( row[x >> 3] >> ( 7 - ( x & 7 ) ) ) & 1]; break;
+            case 4:  dst[x] = palette[( row[x >> 1] >> ( ( x & 1 ) ? 0 : 4 ) ) & 15]; break;
+            case 8:  dst[x] = palette[row[x]]; break;
+            case 24: dst[x] = 0xFF000000 | ( row[3 * x + 2] << 16 ) | ( row[3 * x + 1] << 8 ) | row[3 * x]; break;
+            case 16:
+            case 32:
+                v = ( bpp == 16 ) ? LE16( row + 2 * x ) : LE32( row + 4 * x );
+                dst[x] = 0xFF000000 | ( MaskedChannel( v, &fields[0] ) << 16 )
+                       | ( MaskedChannel( v, &fields[1] ) << 8 ) | MaskedChannel( v, &fields[2] );
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+
+// This function returns sample number index of a PNG row with the given
+// bit depth, scaled to 0..255 (16-bit samples keep their high byte).
+//
+static int Sample( const BYTE* row, int index, int depth )
+{
+    switch ( depth )
+    {
+    case 1:  return ( ( row[index >> 3] >> ( 7 - ( index & 7 ) ) ) & 1 ) * 255;
+    case 2:  return ( ( row[index >> 2] >> ( 6 - 2 * ( index & 3 ) ) ) & 3 ) * 85;
+    case 4:  return ( ( row[index >> 1] >> ( ( index & 1 ) ? 0 : 4 ) ) & 15 ) * 17;
+    case 8:  return row[index];
+    default: return row[2 * index];
+    }
+}
+
+
+// This function returns sample number index of a PNG row without scaling,
+// as needed to compare against a tRNS color.
+//
+static int RawSample( const BYTE* row, int index, int depth )
+{
+    switch ( depth )
+    {
+    case 1:  return ( row[index >> 3] >> ( 7 - ( index & 7 ) ) ) & 1;
+    case 2:  return ( row[index >> 2] >> ( 6 - 2 * ( index & 3 ) ) ) & 3;
+    case 4:  return ( row[index >> 1] >> ( ( index & 1 ) ? 0 : 4 ) ) & 15;
+    case 8:  return row[index];
+    default: return ( row[2 * index] << 8 ) | row[2 * index + 1];
+    }
+}
+
+
+// This function undoes the PNG filter of one row in place.  prev is the
+// previous row after unfiltering (all zero for the first row of a pass).
+//
+static bool Unfilter( int filter, BYTE* row, const BYTE* prev, int bytes, int bpp )
+{
+    int i, a, b, c, p, pa, pb, pc;
+
+    switch ( filter )
+    {
+    case 0:
+        break;
+    case 1:
+        for ( i = bpp; i < bytes; i++ )
+            row[i] += row[i - bpp];
+        break;
+    case 2:
+        for ( i = 0; i < bytes; i++ )
+            row[i] += prev[i];
+        break;
+    case 3:
+        for ( i = 0; i < bytes; i++ )
+            row[i] += ( ( ( i >= bpp ) ? row[i - bpp] : 0 ) + prev[i] ) >> 1;
+        break;
+    case 4:
+        for ( i = 0; i < bytes; i++ )
+        {
+            a = ( i >= bpp ) ? row[i - bpp] : 0;
+            b = prev[i];
+            c = ( i >= bpp ) ? prev[i - bpp] : 0;
+            p = a + b - c;
+            pa = abs( p - a );
+            pb = abs( p - b );
+            pc = abs( p - c );
+            row[i] += ( pa <= pb && pa <= pc ) ? a : ( pb <= pc ) ? b : c;
+        }
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+
+// This function decodes a PNG file.
+//
+static bool DecodePNG( const BYTE* file, size_t size, DecodedImage* image )
+{
+    static const BYTE signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    // Adam7 passes: first column, first row, column step, row step
+    static const int adam7[7][4] = { { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+                                     { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 } };
+    static const int channels_of[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    std::vector<BYTE> idat, data;
+    DWORD palette[256];
+    int trns[3] = { -1, -1, -1 };   // Transparent gray or RGB sample values
+    int width = 0, height = 0, depth = 0, type = -1, interlace = 0;
+    int channels, bits, bpp, passes, pass, x, y, i;
+    size_t pos = 8, total;
+    bool ok;
+
+    if ( size < 8 || memcmp( file, signature, 8 ) != 0 )
+        return false;
+    for ( i = 0; i < 256; i++ )
+        palette[i] = 0xFF000000;
+
+    while ( pos + 12 <= size )
+    {
+        DWORD length = BE32( file + pos );
+        const BYTE* type_name = file + pos + 4;
+        const BYTE* body = file + pos + 8;
+        if ( length > size - pos - 12 )
+            return false;
+        if ( memcmp( type_name, "IHDR", 4 ) == 0 && length >= 13 )
+        {
+            width = (int)BE32( body );
+            height = (int)BE32( body + 4 );
+            depth = body[8];
+            type = body[9];
+            interlace = body[12];
+        }
+        else if ( memcmp( type_name, "PLTE", 4 ) == 0 )
+        {
+            for ( i = 0; i < (int)length / 3 && i < 256; i++ )
+                palette[i] = 0xFF000000 | ( body[3 * i] << 16 ) | ( body[3 * i + 1] << 8 ) | body[3 * i + 2];
+        }
+        else if ( memcmp( type_name, "tRNS", 4 ) == 0 )
+        {
+            if ( type == 3 )
+                for ( i = 0; i < (int)length && i < 256; i++ )
+                    palette[i] = ( palette[i] & 0x00FFFFFF ) | ( (DWORD)body[i] << 24 );
+            else if ( type == 0 && length >= 2 )
+                trns[0] = ( body[0] << 8 ) | body[1];
+            else if ( type == 2 && length >= 6 )
+                for ( i = 0; i < 3; i++ )
+                    trns[i] = ( body[2 * i] << 8 ) | body[2 * i + 1];
+        }
+        else if ( memcmp( type_name, "IDAT", 4 ) == 0 )
+            idat.insert( idat.end( ), body, body + length );
+        else if ( memcmp( type_name, "IEND", 4 ) == 0 )
+            break;
+        pos += 12 + length;
+    }
+
+    if ( type < 0 || type > 6 || channels_of[type] == 0 || interlace > 1 )
+        return false;
+    channels = channels_of[type];
+    if ( depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16 )
+        return false;
+    if ( ( type == 3 && depth == 16 ) || ( type != 0 && type != 3 && depth < 8 ) )
+        return false;
+    if ( !SetSize( image, width, height ) )
+        return false;
+
+    bits = channels * depth;
+    bpp = max( 1, bits / 8 );
+    passes = interlace ? 7 : 1;
+
+    // Work out the size of the filtered data, then inflate it all at once.
+    for ( total = 0, pass = 0; pass < passes; pass++ )
+    {
+        int pw = interlace ? ( width - adam7[pass][0] + adam7[pass][2] - 1 ) / adam7[pass][2] : width;
+        int ph = interlace ? ( height - adam7[pass][1] + adam7[pass][3] - 1 ) / adam7[pass][3] : height;
+        if ( pw > 0 && ph > 0 )
+            total += (size_t)ph * ( 1 + ( (size_t)pw * bits + 7 ) / 8 );
+    }
+    data.resize( total );
+    if ( idat.empty( ) || !Inflate( &idat[0], idat.size( ), &data[0], total ) )
+        return false;
+
+    ok = true;
+    BYTE* p = &data[0];
+    std::vector<BYTE> zero( ( (size_t)width * bits + 7 ) / 8 + 1, 0 );
+    for ( pass = 0; pass < passes && ok; pass++ )
+    {
+        int x0 = interlace ? adam7[pass][0] : 0, y0 = interlace ? adam7[pass][1] : 0;
+        int dx = interlace ? adam7[pass][2] : 1, dy = interlace ? adam7[pass][3] : 1;
+        int pw = ( width - x0 + dx - 1 ) / dx;
+        int ph = ( height - y0 + dy - 1 ) / dy;
+        int bytes = (int)( ( (size_t)pw * bits + 7 ) / 8 );
+        const BYTE* prev = &zero[0];
+
+        if ( pw <= 0 || ph <= 0 )
+            continue;
+        for ( y = 0; y < ph && ok; y++ )
+        {
+            BYTE* row = p + 1;
+            ok = Unfilter( p[0], row, prev, bytes, bpp );
+            DWORD* dst = &image->pixels[(size_t)( y0 + y * dy ) * width];
+            for ( x = 0; x < pw; x++ )
+            {
+                int r, g, b, a = 255, n = x * channels;
+                switch ( type )
+                {
+                case 0:     // Gray
+                    r = g = b = Sample( row, n, depth );
+                    if ( RawSample( row, n, depth ) == trns[0] )
+                        a = 0;
+                    break;
+                case 2:     // RGB
+                    r = Sample( row, n, depth );
+                    g = Sample( row, n + 1, depth );
+                    b = Sample( row, n + 2, depth );
+                    if ( RawSample( row, n, depth ) == trns[0] && RawSample( row, n + 1, depth ) == trns[1]
+                         && RawSample( row, n + 2, depth ) == trns[2] )
+                        a = 0;
+                    break;
+                case 3:     // Palette
+                    {
+                        DWORD c = palette[RawSample( row, n, depth )];
+                        r = ( c >> 16 ) & 0xFF;
+                        g = ( c >> 8 ) & 0xFF;
+                        b = c & 0xFF;
+                        a = c >> 24;
+                    }
+                    break;
+                case 4:     // Gray and alpha
+                    r = g = b = Sample( row, n, depth );
+                    a = Sample( row, n + 1, depth );
+                    break;
+                default:    // RGB and alpha
+                    r = Sample( row, n, depth );
+                    g = Sample( row, n + 1, depth );
+                    b = Sample( row, n + 2, depth );
+                    a = Sample( row, n + 3, depth );
+                    break;
+                }
+                if ( a != 255 )
+                    image->alpha = true;
+                dst[x0 + x * dx] = ( (DWORD)a << 24 ) | ( r << 16 ) | ( g << 8 ) | b;
+            }
+            prev = row;
+            p += 1 + bytes;
+        }
+    }
+    return ok;
+}
+
+
+// This function decodes an uncompressed TGA file: color-mapped (type 1),
+// true-color (type 2, 15 to 32 bits) or gray (type 3).  The alpha channel is
+// used only if the header says the image has one.
+//
+static bool DecodeTGA( const BYTE* file, size_t size, DecodedImage* image )
+{
+    DWORD palette[256];
+    int type, cmap_first, cmap_length, cmap_bits, width, height, depth, descriptor;
+    int bytes, x, y, i;
+    bool has_alpha, topdown, rightleft;
+    const BYTE* p;
+
+    if ( size < 18 )
+        return false;
+    type = file[2];
+    cmap_first = LE16( file + 3 );
+    cmap_length = LE16( file + 5 );
+    cmap_bits = file[7];
+    width = LE16( file + 12 );
+    height = LE16( file + 14 );
+    depth = file[16];
+    descriptor = file[17];
+    has_alpha = ( descriptor & 0x0F ) != 0;
+    rightleft = ( descriptor & 0x10 ) != 0;
+    topdown = ( descriptor & 0x20 ) != 0;
+
+    if ( type != 1 && type != 2 && type != 3 )
+        return false;
+    if ( type == 1 && ( depth != 8 || file[1] != 1 ) )
+        return false;
+    if ( type == 2 && depth != 15 && depth != 16 && depth != 24 && depth != 32 )
+        return false;
+    if ( type == 3 && depth != 8 )
+        return false;
+    if ( !SetSize( image, width, height ) )
+        return false;
+
+    // Read the color map (which may be present even when it is not used).
+    p = file + 18 + file[0];
+    if ( file[1] == 1 )
+    {
+        int entry = ( cmap_bits + 7 ) / 8;
+        if ( entry < 2 || entry > 4 || p + cmap_length * entry > file + size )
+            return false;
+        for ( i = 0; i < 256; i++ )
+            palette[i] = 0xFF000000;
+        for ( i = 0; i < cmap_length; i++, p += entry )
+        {
+            int index = cmap_first + i;
+            DWORD c;
+            if ( entry == 2 )
+            {
+                DWORD v = LE16( p );
+                c = 0xFF000000 | ( ( ( v >> 10 ) & 31 ) * 255 / 31 << 16 )
+                  | ( ( ( v >> 5 ) & 31 ) * 255 / 31 << 8 ) | ( v & 31 ) * 255 / 31;
+            }
+            else
+                c = ( ( entry == 4 && has_alpha ) ? ( (DWORD)p[3] << 24 ) : 0xFF000000 )
+                  | ( p[2] << 16 ) | ( p[1] << 8 ) | p[0];
+            if ( index < 256 )
+                palette[index] = c;
+        }
+    }
+
+    bytes = ( depth + 7 ) / 8;
+    if ( p > file + size || (size_t)width * height * bytes > (size_t)( file + size - p ) )
+        return false;
+
+    for ( y = 0; y < height; y++ )
+    {
+        DWORD* dst = &image->pixels[(size_t)( topdown ? y : height - 1 - y ) * width];
+        for ( x = 0; x < width; x++, p += bytes )
+        {
+            DWORD c;
+            switch ( bytes )
+            {
+            case 1:
+                c = ( type == 1 ) ? palette[p[0]] : 0xFF000000 | ( p[0] * 0x010101 );
+                break;
+            case 2:
+                {
+                    DWORD v = LE16( p );
+                    c = ( ( depth == 16 && has_alpha && !( v & 0x8000 ) ) ? 0 : 0xFF000000 )
+                      | ( ( ( v >> 10 ) & 31 ) * 255 / 31 << 16 )
+                      | ( ( ( v >> 5 ) & 31 ) * 255 / 31 << 8 ) | ( v & 31 ) * 255 / 31;
+                }
+                break;
+            case 3:
+                c = 0xFF000000 | ( p[2] << 16 ) | ( p[1] << 8 ) | p[0];
+                break;
+            default:
+                c = ( has_alpha ? ( (DWORD)p[3] << 24 ) : 0xFF000000 ) | ( p[2] << 16 ) | ( p[1] << 8 ) | p[0];
+                break;
+            }
+            if ( ( c >> 24 ) != 255 )
+                image->alpha = true;
+            dst[rightleft ? width - 1 - x : x] = c;
+        }
+    }
+    return true;
+}
+
+
+/*****************************************************************************
+*
+*   Drawing a decoded image
+*
+*****************************************************************************/
+
+// This function blends a pixel of the image over a pixel of the page.
+//
+static DWORD Blend( DWORD src, DWORD dst )
+{
+    DWORD a = src >> 24;
+
+    if ( a == 255 )
+        return src & 0x00FFFFFF;
+    if ( a == 0 )
+        return dst;
+    DWORD rb = ( ( src & 0xFF00FF ) * a + ( dst & 0xFF00FF ) * ( 255 - a ) + 0x800080 ) >> 8;
+    DWORD g = ( ( src & 0x00FF00 ) * a + ( dst & 0x00FF00 ) * ( 255 - a ) + 0x008000 ) >> 8;
+    return ( rb & 0xFF00FF ) | ( g & 0x00FF00 );
+}
+
+
+// This function mixes two pixels (all four channels); f is the weight of b,
+// from 0 to 256.
+//
+static DWORD Mix( DWORD a, DWORD b, DWORD f )
+{
+    DWORD rb = ( ( a & 0x00FF00FF ) * ( 256 - f ) + ( b & 0x00FF00FF ) * f ) >> 8;
+    DWORD ag = ( ( ( a >> 8 ) & 0x00FF00FF ) * ( 256 - f ) + ( ( b >> 8 ) & 0x00FF00FF ) * f ) >> 8;
+    return ( rb & 0x00FF00FF ) | ( ( ag & 0x00FF00FF ) << 8 );
+}
+
+
+// This function returns row y of an image.
+//
+static const DWORD* GetRow( ImageRows* rows, int y )
+{
+    if ( rows->image != NULL )
+        return &rows->image->pixels[(size_t)y * rows->width];
+    if ( rows->buffered[y % 2] != y )
+    {
+        BlitDIBRow( rows->dib, y, 0, rows->width, &rows->buffer[y % 2][0] );
+        rows->buffered[y % 2] = y;
+    }
+    return &rows->buffer[y % 2][0];
+}
+
+
+// This function scales an image to width by height pixels, placed with its
+// upper left corner at (x,y) of a page (or of any other block of 32-bit
+// pixels), and stores the part that is inside clip.  For nearest scaling,
+// a pixel takes the image pixel its center falls in; for bilinear scaling,
+// the four nearest image pixels are mixed.  If blend is true, pixels that
+// are not opaque are blended over what is already there; otherwise they are
+// stored with their alpha.
+//
+static void Resample( ImageRows* image, int x, int y, int width, int height, const RECT* clip,
+                      BYTE* pBits, int pitch, bool blend )
+{
+    std::vector<int> sx;                // Source column (16.16) of each column
+    int i, j;
+
+    if ( width == image->width && height == image->height && !image->alpha )
+    {
+        // At its own size, an opaque image is just copied.
+        for ( j = clip->top; j < clip->bottom; j++ )
+        {
+            DWORD* dst = (DWORD*)( pBits + j * pitch ) + clip->left;
+            if ( image->dib != NULL )
+                BlitDIBRow( image->dib, j - y, clip->left - x, clip->right - clip->left, dst );
+            else
+                memcpy( dst, GetRow( image, j - y ) + ( clip->left - x ), 4 * ( clip->right - clip->left ) );
+        }
+        return;
+    }
+
+    sx.resize( clip->right - clip->left );
+    for ( i = clip->left; i < clip->right; i++ )
+    {
+        __int64 n = i - x;
+        if ( image_scaling == BILINEAR_SCALING )
+            sx[i - clip->left] = (int)max( 0, min( ( ( 2 * n + 1 ) * image->width * 32768 ) / width - 32768,
+                                                   (__int64)( image->width - 1 ) << 16 ) );
+        else
+            sx[i - clip->left] = (int)( ( ( 2 * n + 1 ) * image->width / ( 2 * width ) ) << 16 );
+    }
+
+    for ( j = clip->top; j < clip->bottom; j++ )
+    {
+        __int64 n = j - y;
+        DWORD* dst = (DWORD*)( pBits + j * pitch );
+        int sy, fy;
+        if ( image_scaling == BILINEAR_SCALING )
+        {
+            sy = (int)max( 0, min( ( ( 2 * n + 1 ) * image->height * 32768 ) / height - 32768,
+                                   (__int64)( image->height - 1 ) << 16 ) );
+            fy = ( sy >> 8 ) & 0xFF;
+        }
+        else
+        {
+            sy = (int)( ( ( 2 * n + 1 ) * image->height / ( 2 * height ) ) << 16 );
+            fy = 0;
+        }
+        const DWORD* row0 = GetRow( image, sy >> 16 );
+        const DWORD* row1 = ( fy != 0 ) ? GetRow( image, ( sy >> 16 ) + 1 ) : row0;
+
+        for ( i = clip->left; i < clip->right; i++ )
+        {
+            int s = sx[i - clip->left];
+            int col = s >> 16, fx = ( s >> 8 ) & 0xFF;
+            DWORD c;
+            if ( fx == 0 && fy == 0 )
+                c = row0[col];
+            else
+            {
+                int col1 = ( fx != 0 ) ? col + 1 : col;
+                c = Mix( Mix( row0[col], row0[col1], fx ), Mix( row1[col], row1[col1], fx ), fy );
+            }
+            if ( !image->alpha )
+                dst[i] = c & 0x00FFFFFF;
+            else
+                dst[i] = blend ? Blend( c, dst[i] ) : c;
+        }
+    }
+}
+
+
+// This function draws an image into the rectangle from (left,top) to
+// (right,bottom) of the active page, in viewport coordinates with both
+// corners included.  The result is clipped like any other drawing.
+//
+static void DrawImage( ImageRows* image, int left, int top, int right, int bottom )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    viewporttype* vp = &pWndData->viewportInfo;
+    RECT target, clip;
+
+    target.left = min( left, right ) + vp->left;
+    target.top = min( top, bottom ) + vp->top;
+    target.right = target.left + abs( right - left ) + 1;
+    target.bottom = target.top + abs( bottom - top ) + 1;
+
+    clip.left = max( target.left, 0 );
+    clip.top = max( target.top, 0 );
+    clip.right = min( target.right, pWndData->width );
+    clip.bottom = min( target.bottom, pWndData->height );
+    if ( vp->clip != 0 )
+    {
+        clip.left = max( clip.left, vp->left );
+        clip.top = max( clip.top, vp->top );
+        clip.right = min( clip.right, vp->right );
+        clip.bottom = min( clip.bottom, vp->bottom );
+    }
+    if ( clip.left >= clip.right || clip.top >= clip.bottom )
+        return;
+
+    BGI__GetWinbgiDC( );
+    GdiFlush( );
+    if ( pWndData->page_format == XRGB8888_PAGES )
+        Resample( image, target.left, target.top, target.right - target.left, target.bottom - target.top,
+                  &clip, pWndData->pBits[pWndData->ActivePage], pWndData->pitch, true );
+    else
+    {
+        // Other pages are converted to 32-bit pixels and back around it.
+        int width = clip.right - clip.left, height = clip.bottom - clip.top;
+        std::vector<DWORD> pixels( width * height );
+        RECT local = { 0, 0, width, height };
+        BGI__ReadPixels( pWndData, pWndData->ActivePage, &clip, (BYTE*)&pixels[0], 4 * width );
+        Resample( image, target.left - clip.left, target.top - clip.top, target.right - target.left,
+                  target.bottom - target.top, &local, (BYTE*)&pixels[0], 4 * width, true );
+        BGI__WritePixels( pWndData, pWndData->ActivePage, &clip, (const BYTE*)&pixels[0], 4 * width );
+    }
+    BGI__COUNT_PIXELS( pWndData, (double)( clip.right - clip.left ) * ( clip.bottom - clip.top ) );
+    BGI__ReleaseWinbgiDC( );
+
+    // The update rectangle is in logical coordinates.
+    OffsetRect( &clip, -vp->left, -vp->top );
+    RefreshWindow( &clip );
+}
+
+
+// This function drops the least recently used images from the cache until
+// it fits in its budget.
+//
+static void TrimCache( )
+{
+    while ( cache_info.bytes > cache_info.budget )
+    {
+        cache_info.bytes -= 4 * (unsigned int)image_cache.back( ).image.pixels.size( );
+        cache_info.entries--;
+        image_cache.pop_back( );
+    }
+}
+
+
+// This function reads a whole file into memory.  It returns NULL if the
+// file cannot be read.  The caller deletes the memory.
+//
+static BYTE* ReadWholeFile( const char* filename, size_t* size )
+{
+    HANDLE hFile;
+    DWORD length, read;
+    BYTE* data;
+
+    hFile = CreateFile( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if ( hFile == INVALID_HANDLE_VALUE )
+        return NULL;
+    length = GetFileSize( hFile, NULL );
+    data = ( length == INVALID_FILE_SIZE || length == 0 ) ? NULL : new BYTE[length];
+    if ( data != NULL && ( !ReadFile( hFile, data, length, &read, NULL ) || read != length ) )
+    {
+        delete [] data;
+        data = NULL;
+    }
+    CloseHandle( hFile );
+    *size = length;
+    return data;
+}
+
+
+// This function decodes an image file with one of the native decoders and
+// draws it (see DrawImage).  If right or bottom is INT_MAX, the image keeps
+// its own width or height.  Images that fit in the cache are kept there, as
+// scaled, so drawing the same file at the same size again is a single copy.
+// It returns false if the file is not in a format handled here (or is
+// damaged), so that readimagefile can try OLE instead.
+// (used by readimagefile in drawing.cpp)
+//
+bool BGI__ReadImageFile( const char* filename, int left, int top, int right, int bottom )
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    std::list<CacheEntry>::iterator entry;
+    DecodedImage image;
+    ImageRows rows;
+    __int64 write_time = 0, file_size = 0;
+    int key_width, key_height, width, height;
+    size_t size, length = strlen( filename );
+    BYTE* file;
+    bool ok, cache;
+
+    key_width = ( right == INT_MAX ) ? 0 : abs( right - left ) + 1;
+    key_height = ( bottom == INT_MAX ) ? 0 : abs( bottom - top ) + 1;
+    cache = ( cache_info.budget > 0 && GetFileAttributesEx( filename, GetFileExInfoStandard, &attributes ) );
+    if ( cache )
+    {
+        write_time = ( (__int64)attributes.ftLastWriteTime.dwHighDateTime << 32 )
+                   | attributes.ftLastWriteTime.dwLowDateTime;
+        file_size = ( (__int64)attributes.nFileSizeHigh << 32 ) | attributes.nFileSizeLow;
+        for ( entry = image_cache.begin( ); entry != image_cache.end( ); ++entry )
+        {
+            if ( entry->write_time == write_time && entry->file_size == file_size
+                 && entry->key_width == key_width && entry->key_height == key_height
+                 && entry->scaling == image_scaling && lstrcmpi( entry->filename.c_str( ), filename ) == 0 )
+                break;
+        }
+        if ( entry != image_cache.end( ) )
+        {
+            cache_info.hits++;
+            image_cache.splice( image_cache.begin( ), image_cache, entry );
+            rows.width = entry->image.width;
+            rows.height = entry->image.height;
+            rows.alpha = entry->image.alpha;
+            rows.image = &entry->image;
+            rows.dib = NULL;
+            if ( right == INT_MAX )
+                right = left + rows.width - 1;
+            if ( bottom == INT_MAX )
+                bottom = top + rows.height - 1;
+            DrawImage( &rows, left, top, right, bottom );
+            return true;
+        }
+        cache_info.misses++;
+    }
+
+    // Plain 8, 24 and 32-bit BMP files are drawn from a mapping of the file,
+    // so that even very large ones are never copied into memory.
+    rows.dib = MapDIB( filename );
+    if ( rows.dib != NULL )
+    {
+        LPBITMAPINFOHEADER lpbi = (LPBITMAPINFOHEADER)( rows.dib + sizeof( BITMAPFILEHEADER ) );
+        rows.width = lpbi->biWidth;
+        rows.height = abs( lpbi->biHeight );
+        rows.alpha = false;
+        rows.image = NULL;
+        rows.buffer[0].resize( rows.width );
+        rows.buffer[1].resize( rows.width );
+        rows.buffered[0] = rows.buffered[1] = -1;
+        ok = true;
+    }
+    else
+    {
+        file = ReadWholeFile( filename, &size );
+        if ( file == NULL )
+            return false;
+        ok = DecodeBMP( file, size, &image ) || DecodePNG( file, size, &image )
+          || ( length >= 4 && lstrcmpi( filename + length - 4, ".tga" ) == 0 && DecodeTGA( file, size, &image ) );
+        delete [] file;
+        if ( !ok )
+            return false;
+        rows.width = image.width;
+        rows.height = image.height;
+        rows.alpha = image.alpha;
+        rows.image = &image;
+    }
+
+    if ( right == INT_MAX )
+        right = left + rows.width - 1;
+    if ( bottom == INT_MAX )
+        bottom = top + rows.height - 1;
+    width = abs( right - left ) + 1;
+    height = abs( bottom - top ) + 1;
+
+    if ( cache && (__int64)4 * width * height <= cache_info.budget )
+    {
+        // Scale the image once into a new cache entry, then draw that.
+        RECT all = { 0, 0, width, height };
+        image_cache.push_front( CacheEntry( ) );
+        entry = image_cache.begin( );
+        entry->filename = filename;
+        entry->write_time = write_time;
+        entry->file_size = file_size;
+        entry->key_width = key_width;
+        entry->key_height = key_height;
+        entry->scaling = image_scaling;
+        entry->image.width = width;
+        entry->image.height = height;
+        entry->image.alpha = rows.alpha;
+        entry->image.pixels.resize( (size_t)width * height );
+        Resample( &rows, 0, 0, width, height, &all, (BYTE*)&entry->image.pixels[0], 4 * width, false );
+        cache_info.entries++;
+        cache_info.bytes += 4 * width * height;
+        TrimCache( );
+
+        UnmapDIB( rows.dib );
+        rows.width = width;
+        rows.height = height;
+        rows.image = &entry->image;
+        rows.dib = NULL;
+    }
+    DrawImage( &rows, left, top, right, bottom );
+    UnmapDIB( rows.dib );
+    return true;
+}
+
+
+/*****************************************************************************
+*
+*   The actual API calls are implemented below
+*
+*****************************************************************************/
+
+// This function chooses how readimagefile scales images that are drawn at a
+// size other than their own: NEAREST_SCALING (each pixel takes the nearest
+// image pixel) or BILINEAR_SCALING (the four nearest image pixels are mixed).
+//
+__declspec(dllexport) void setimagescaling( int mode )
+{
+    if ( mode == NEAREST_SCALING || mode == BILINEAR_SCALING )
+        image_scaling = mode;
+}
+
+
+// This function sets the most memory (in bytes) that readimagefile may use
+// to keep images it has drawn, so that drawing them again at the same size
+// does not read the file.  A budget of 0 turns the cache off and empties it.
+//
+__declspec(dllexport) void setimagecache( unsigned int budget )
+{
+    cache_info.budget = budget;
+    TrimCache( );
+}
+
+
+// This function gets the state of the image cache, including the number of
+// readimagefile calls that did and did not find their image in it.
+//
+__declspec(dllexport) void getimagecache( imagecachetype *cacheinfo )
+{
+    *cacheinfo = cache_info;
+}
@@ -11,6 +11,7 @@
  *  function prototypes and constants for the following functions:
  *
  *  BitmapToDIB()        - Creates a DIB from a bitmap
+ *  BlitDIBRow()         - Converts pixels of a mapped DIB to 32-bit pixels
  *  ChangeBitmapFormat() - Changes a bitmap to a specified DIB format
  *  ChangeDIBFormat()    - Changes a DIB's BPP and/or compression format
  *  CopyScreenToBitmap() - Copies entire screen to a standard Bitmap
@@ -28,6 +29,7 @@
  *  FindDIBBits()        - Sets pointer to the DIB bits
  *  GetSystemPalette()   - Gets the current palette
  *  LoadDIB()            - Loads a DIB from a file
+ *  MapDIB()             - Maps a DIB file into memory without reading it
  *  PaintBitmap()        - Displays standard bitmap in the specified DC
  *  PaintDIB()           - Displays DIB in the specified DC
  *  PalEntriesOnDevice() - Gets the number of palette entries
@@ -36,6 +38,7 @@
  *  PrintScreen()        - Prints the entire screen
  *  PrintWindow()        - Prints all or part of a window
  *  SaveDIB()            - Saves the specified dib in a file
+ *  UnmapDIB()           - Unmaps a DIB file mapped by MapDIB
  *
  * See the file DIBAPI.TXT for more information about these functions.
  *
@@ -99,6 +102,7 @@ enum {
 /* Function prototypes */
 
 HDIB BitmapToDIB (HBITMAP hBitmap, HPALETTE hPal);
+void BlitDIBRow (LPSTR lpFile, int nRow, int nFirst, int nCount, LPDWORD lpDest);
 HDIB ChangeBitmapFormat (HBITMAP	hBitmap,
                                    WORD     wBitCount,
                                    DWORD    dwCompression,
@@ -120,6 +124,7 @@ DWORD DIBWidth (LPSTR lpDIB);
 LPSTR FindDIBBits (LPSTR lpDIB);
 HPALETTE GetSystemPalette (void);
 HDIB LoadDIB (const LPSTR);
+LPSTR MapDIB (const char*);
 BOOL PaintBitmap (HDC, LPRECT, HBITMAP, LPRECT, HPALETTE);
 BOOL PaintDIB (HDC, LPRECT, HDIB, LPRECT, HPALETTE);
 int PalEntriesOnDevice (HDC hDC);
@@ -129,3 +134,4 @@ WORD PrintScreen (LPRECT, WORD, WORD, WORD, LPSTR);
 // This doesn't work for some reason -self comment
 // WORD PrintWindow (HWND, WORD, WORD, WORD, WORD, LPSTR);
 WORD SaveDIB (HDIB, const char*);
+void UnmapDIB (LPSTR);
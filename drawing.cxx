@@ -26,6 +26,7 @@
 #include "winbgitypes.h"    // Internal structure data
 #include "dibapi.h"         // DIB functions from Microsoft
 #include <iostream>
+#include <vector>           // Provides STL vector class
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -82,8 +83,14 @@ HDC BGI__GetWinbgiDC( HWND hWnd )
     // MGM: Added mutex to prevent conflict with OnPaint thread.
     // Anyone who calls BGI_GetWinbgiDC must later call
     // BGI_ReleaseWinbgiDC.
+#ifdef BGI__COUNTING
+    BGI__WaitForDC( pWndData );
+#else
     WaitForSingleObject(pWndData->hDCMutex, 5000);
-    // This is the device context we want to draw to
+#endif
+    // This is the device context we want to draw to, once it has the
+    // viewport that was last set
+    BGI__SyncViewport( pWndData, pWndData->ActivePage );
     return pWndData->hDC[pWndData->ActivePage];
 }
 
@@ -140,6 +147,120 @@ void ArcEndPoints( int x, int y, int xradius, int yradius, int stangle,
     *yend    = -*yend + y;
 }
 
+// This function copies the polyline through the n points (x,y pairs) in
+// points to out, leaving out points that do not change the pixels of a thin
+// solid line that leaves out its last point.  Each run of points that share
+// a column (axis 0) or a row (axis 1) covers that column or row from its
+// lowest to its highest point, whatever the order of the points, so it is
+// replaced by its first point, its two extremes and its last point.
+// Repeated points are dropped as well.  out may be points.  The number of
+// points left is returned.
+//
+static int CollapseRuns( int n, const int* points, int axis, int* out )
+{
+    int count = 0;
+    int i = 0, j, k, kept, low, high, last, a, b;
+    bool drawn;
+    int keep[4];
+
+    while ( i < n )
+    {
+        // Find the run from i to j-1, and the first of its extremes
+        low = high = i;
+        for ( j = i + 1; j < n && points[2*j+axis] == points[2*i+axis]; j++ )
+        {
+            if ( points[2*j+1-axis] < points[2*low+1-axis] ) low = j;
+            if ( points[2*j+1-axis] > points[2*high+1-axis] ) high = j;
+        }
+
+        if ( j - i <= 4 )
+        {
+            for ( kept = 0; kept < j - i; kept++ )
+                keep[kept] = i + kept;
+        }
+        else
+        {
+            // A line does not draw its last point, so the pixel of the last
+            // point of the run may or may not have been drawn by the rest
+            // of the run.  If that pixel is an extreme, the extremes are
+            // visited in the order that does the same.
+            last = points[2*(j-1)+1-axis];
+            drawn = false;
+            for ( k = i; k + 1 < j && !drawn; k++ )
+            {
+                a = points[2*k+1-axis];
+                b = points[2*k+3-axis];
+                drawn = ( a <= last && last < b ) || ( b < last && last <= a );
+            }
+            keep[0] = i;
+            if ( ( last == points[2*high+1-axis] && drawn )
+                 || ( last == points[2*low+1-axis] && !drawn ) )
+            {
+                keep[1] = high;
+                keep[2] = low;
+            }
+            else
+            {
+                keep[1] = low;
+                keep[2] = high;
+            }
+            keep[3] = j - 1;
+            kept = 4;
+        }
+
+        // The kept points are all read before any is overwritten, and a run
+        // never grows, so out may be points.
+        int x[4], y[4];
+        for ( k = 0; k < kept; k++ )
+        {
+            x[k] = points[2*keep[k]];
+            y[k] = points[2*keep[k]+1];
+        }
+        for ( k = 0; k < kept; k++ )
+        {
+            if ( count > 0 && out[2*count-2] == x[k] && out[2*count-1] == y[k] )
+                continue;
+            out[2*count] = x[k];
+            out[2*count+1] = y[k];
+            count++;
+        }
+        i = j;
+    }
+    return count;
+}
+
+// This function grows rect (right and bottom edges excluded) to hold the
+// box from (left,top) to (right,bottom).  An empty rect holds nothing yet.
+//
+static void AddToRect( RECT* rect, int left, int top, int right, int bottom )
+{
+    if ( rect->left >= rect->right || rect->top >= rect->bottom )
+    {
+        SetRect( rect, left, top, right, bottom );
+        return;
+    }
+    rect->left = min( rect->left, left );
+    rect->top = min( rect->top, top );
+    rect->right = max( rect->right, right );
+    rect->bottom = max( rect->bottom, bottom );
+}
+
+
+// This function adds a change of the fill color to the display list being
+// recorded, for the batch calls that change the color without setfillstyle.
+//
+static void RecordFillColor( WindowData* pWndData, int color )
+{
+    if ( pWndData->fillInfo.pattern == USER_FILL )
+    {
+        BGI__Recorder record( BGI__OP_SETFILLPATTERN, color, 0, pWndData->uPattern, 8 );
+    }
+    else
+    {
+        BGI__Recorder record( BGI__OP_SETFILLSTYLE, pWndData->fillInfo.pattern, color );
+    }
+}
+
 // This function will refresh the area of the window specified by rect.  If
 // want to update the entire screen, pass in NULL for rect.
 // POSTCONDITION: The parameter rect has been updated to now refer to
@@ -176,7 +297,12 @@ void RefreshWindow( RECT* rect )
 	// Only invalidate the window if we are viewing what we are drawing.
 	// The call to InvalidateRect can fail, but I don't know what to do if it does.
 	if ( pWndData->VisualPage == pWndData->ActivePage )
+	{
 	    InvalidateRect( pWndData->hWnd, rect, FALSE );
+	    BGI__COUNT_REFRESH( pWndData, rect );
+	    BGI__TRACE_INSTANT( "refresh", rect ? ( rect->right - rect->left ) * ( rect->bottom - rect->top )
+	                                        : pWndData->width * pWndData->height );
+	}
     }
 }
 
@@ -186,6 +312,16 @@ __declspec(dllexport) bool getrefreshingbgi( )
 }
 
 
+// This function returns how many drawing calls on the current window have
+// drawn nothing because all of their shape was outside the viewport (or the
+// window).  Such calls return before any lock is taken.
+//
+__declspec(dllexport) unsigned long getculledcount( )
+{
+    return BGI__GetWindowDataPtr( )->culled;
+}
+
+
 __declspec(dllexport) void setrefreshingbgi(bool value)
 {
     BGI__GetWindowDataPtr( )->refreshing = value;
@@ -198,6 +334,7 @@ __declspec(dllexport) void refreshallbgi( )
 
 __declspec(dllexport) void refreshbgi(int left, int top, int right, int bottom)
 {
+    BGI__Counter counter( BGI__CALL_REFRESHBGI );
     // The update rectangle does not contain the right or bottom edge.  Thus
     // add 1 so the entire region is included.
     RECT rect;
@@ -242,6 +379,7 @@ __declspec(dllexport) void refreshbgi(int left, int top, int right, int bottom)
 //
 __declspec(dllexport) void arc( int x, int y, int stangle, int endangle, int radius )
 {
+    BGI__Recorder record( BGI__OP_ARC, x, y, stangle, endangle, radius );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     // Convert coordinates to those expected by GDI Arc
@@ -253,6 +391,17 @@ __declspec(dllexport) void arc( int x, int y, int stangle, int endangle, int rad
     // Convert given arc specifications to pixel start and end points.
     ArcEndPoints( x, y, radius, radius, stangle, endangle, &xstart, &ystart, &xend, &yend );
 
+    // Set the arccoords structure to relevant data.  This is done even if
+    // the arc cannot be seen.
+    pWndData->arcInfo.x = x;
+    pWndData->arcInfo.y = y;
+    pWndData->arcInfo.xstart = xstart;
+    pWndData->arcInfo.ystart = ystart;
+    pWndData->arcInfo.xend = xend;
+    pWndData->arcInfo.yend = yend;
+    if ( !BGI__ShapeVisible( pWndData, left, top, right, bottom ) )
+        return;
+
     // Draw to the current active page
     hDC = BGI__GetWinbgiDC( );
     Arc( hDC, left, top, right, bottom, xstart, ystart, xend, yend );
@@ -262,37 +411,36 @@ __declspec(dllexport) void arc( int x, int y, int stangle, int endangle, int rad
     // add 1 so the entire region is included.
     RECT rect = { left, top, right+1, bottom+1 };
     RefreshWindow( &rect );
-
-    // Set the arccoords structure to relevant data.
-    pWndData->arcInfo.x = x;
-    pWndData->arcInfo.y = y;
-    pWndData->arcInfo.xstart = xstart;
-    pWndData->arcInfo.ystart = ystart;
-    pWndData->arcInfo.xend = xend;
-    pWndData->arcInfo.yend = yend;
 }
 
 // This function draws a 2D bar.
 //
 __declspec(dllexport) void bar( int left, int top, int right, int bottom )
 {
+    BGI__Recorder record( BGI__OP_BAR, left, top, right, bottom );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     HBRUSH hBrush;
     int color;
 
+    if ( !BGI__RectVisible( pWndData, left, top, right, bottom ) )
+        return;
     hDC = BGI__GetWinbgiDC( );
-    // Is it okay to use the currently selected brush to paint with?
-    hBrush = (HBRUSH)GetCurrentObject( hDC, OBJ_BRUSH );
-    // Set the text color for the fill pattern
-    // Convert from BGI color to RGB color
-    color = converttorgb( pWndData->fillInfo.color );
-    SetTextColor( hDC, color );
-    RECT r = {left, top, right, bottom};
-    FillRect( hDC, &r, hBrush );
-    // Reset the text color to the drawing color
-    color = converttorgb( pWndData->drawColor );
-    SetTextColor( hDC, color );
+    // Solid and bitmap fills are drawn without GDI.
+    if ( !BGI__FillBar( pWndData, left, top, right, bottom ) )
+    {
+        // Is it okay to use the currently selected brush to paint with?
+        hBrush = (HBRUSH)GetCurrentObject( hDC, OBJ_BRUSH );
+        // Set the text color for the fill pattern
+        // Convert from BGI color to RGB color
+        color = converttorgb( pWndData->fillInfo.color );
+        SetTextColor( hDC, color );
+        RECT r = {left, top, right, bottom};
+        FillRect( hDC, &r, hBrush );
+        // Reset the text color to the drawing color
+        color = converttorgb( pWndData->drawColor );
+        SetTextColor( hDC, color );
+    }
     BGI__ReleaseWinbgiDC( );
     
     // The update rectangle does not contain the right or bottom edge.  Thus
@@ -306,12 +454,20 @@ __declspec(dllexport) void bar( int left, int top, int right, int bottom )
 // 30 degrees.
 __declspec(dllexport) void bar3d( int left, int top, int right, int bottom, int depth, int topflag )
 {
+    BGI__Recorder record( BGI__OP_BAR3D, left, top, right, bottom, depth, topflag );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     int color;
     int dy;     // Distance to draw 3D bar up to
     POINT p[4]; // An array to hold vertices for the outline
 
+    // The depth is specified to be the x-distance from the front line to the
+    // back line, not the actual diagonal line length
+    dy = (int)(depth * tan( 30.0 * M_PI / 180.0 ));
+    if ( !BGI__ShapeVisible( pWndData, min( left, left+depth ), min( top, top-dy ),
+                             max( right, right+depth ), max( bottom, bottom-dy ) ) )
+        return;
+
     hDC = BGI__GetWinbgiDC( );
     // Set the text color for the fill pattern
     // Convert from BGI color to RGB color
@@ -323,10 +479,6 @@ __declspec(dllexport) void bar3d( int left, int top, int right, int bottom, int
     SetTextColor( hDC, color );
 
     // Draw the surrounding part.
-    // The depth is specified to be the x-distance from the front line to the
-    // back line, not the actual diagonal line length
-    dy = (int)(depth * tan( 30.0 * M_PI / 180.0 ));
-    
     p[0].x = right;
     p[0].y = bottom;            // Bottom right of box
     p[1].x = right + depth;
@@ -365,12 +517,15 @@ __declspec(dllexport) void bar3d( int left, int top, int right, int bottom, int
 //
 __declspec(dllexport) void circle( int x, int y, int radius )
 {
+    BGI__Recorder record( BGI__OP_CIRCLE, x, y, radius );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     int left, top, right, bottom;
 
     // Convert center coordinates to box coordinates
     CenterToBox( x, y, radius, radius, &left, &top, &right, &bottom );
+    if ( !BGI__ShapeVisible( pWndData, left, top, right, bottom ) )
+        return;
 
     // When the start and end points are the same, Arc draws a complete ellipse
     hDC = BGI__GetWinbgiDC( );
@@ -389,53 +544,18 @@ __declspec(dllexport) void circle( int x, int y, int radius )
 //
 __declspec(dllexport) void cleardevice( )
 {
+    BGI__Recorder record( BGI__OP_CLEARDEVICE );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
-    int color;          // Background color to fill with
-    RECT rect;          // The rectangle to fill
-    HRGN hRGN;          // The clipping region (if any)
-    int is_rgn;         // Whether or not a clipping region is present
-    POINT p;            // Upper left point of window (convert from device to logical points)
-    HBRUSH hBrush;      // Brush in the background color
-
-    // Convert from BGI color to RGB color
-    color = converttorgb( pWndData->bgColor );
+    RECT rect = { 0, 0, pWndData->width, pWndData->height };
 
+    // Even though a viewport may be set, this function clears the entire
+    // screen, so the page is filled directly rather than through the
+    // clipping region.
     hDC = BGI__GetWinbgiDC( );
-    // Even though a viewport may be set, this function clears the entire screen.
-    // Compute the origin in logical coordinates.
-    p.x = 0;
-    p.y = 0;
-    DPtoLP( hDC, &p, 1 );
-    rect.left = p.x;
-    rect.top = p.y;
-    rect.right = pWndData->width;
-    rect.bottom = pWndData->height;
-
-    // Get the current clipping region, if any.  The region object must first
-    // be created with some valid region.  If the GetClipRgn function
-    // succeeds, the region info will be updated to reflect the new region.
-    // However, this does not create a new region object.  That is, this
-    // simply overwrites the memory of the old region object and we don't have
-    // to worry about deleting the old region.
-    hRGN = CreateRectRgn( 0, 0, 5, 5 );
-    is_rgn = GetClipRgn( hDC, hRGN );
-    // If there is a clipping region, select none
-    if ( is_rgn != 0 )
-        SelectClipRgn( hDC, NULL );
-    
-    // Fill hDC with background color
-    hBrush = CreateSolidBrush( color );
-    FillRect( hDC, &rect, hBrush );
-    DeleteObject( hBrush );
+    BGI__ClearRect( pWndData, rect, pWndData->bgColor );
     // Move the CP back to (0,0) (NOT viewport relative)
-    moveto( p.x, p.y );
-
-    // Select the old clipping region back into the device context
-    if ( is_rgn != 0 )
-        SelectClipRgn( hDC, hRGN );
-    // Delete the region
-    DeleteRgn( hRGN );
+    MoveToEx( hDC, -pWndData->viewportInfo.left, -pWndData->viewportInfo.top, NULL );
     BGI__ReleaseWinbgiDC( );
     
     RefreshWindow( NULL );
@@ -447,25 +567,14 @@ __declspec(dllexport) void cleardevice( )
 //
 __declspec(dllexport) void clearviewport( )
 {
-    HDC hDC;
+    BGI__Recorder record( BGI__OP_CLEARVIEWPORT );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
-    int color;
-    RECT rect;
-    HBRUSH hBrush;
-    
-    // Convert from BGI color to RGB color
-    color = converttorgb( pWndData->bgColor );
+    RECT rect = { pWndData->viewportInfo.left, pWndData->viewportInfo.top,
+                  pWndData->viewportInfo.right, pWndData->viewportInfo.bottom };
 
-    rect.left = 0;
-    rect.top = 0;
-    rect.right = pWndData->viewportInfo.right - pWndData->viewportInfo.left;
-    rect.bottom = pWndData->viewportInfo.bottom - pWndData->viewportInfo.top;
-
-    // Fill hDC with background color
-    hDC = BGI__GetWinbgiDC( );
-    hBrush = CreateSolidBrush( color );
-    FillRect( hDC, &rect, hBrush );
-    DeleteObject( hBrush );
+    // Fill the viewport (in device coordinates) with background color
+    BGI__GetWinbgiDC( );
+    BGI__ClearRect( pWndData, rect, pWndData->bgColor );
     BGI__ReleaseWinbgiDC( );
     moveto( 0, 0 );
 
@@ -475,16 +584,50 @@ __declspec(dllexport) void clearviewport( )
 
 __declspec(dllexport) void drawpoly(int n_points, int* points)
 { 
+    BGI__Recorder record( BGI__OP_DRAWPOLY, n_points, 0, points, 2 * n_points * sizeof( int ) );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
+    RECT rect;
+
+    // Only the box around the points, grown by the pen, is updated.
+    if ( !BGI__PolyBounds( pWndData, n_points, points, &rect )
+         || !BGI__RectVisible( pWndData, rect.left, rect.top, rect.right, rect.bottom ) )
+        return;
     
     hDC = BGI__GetWinbgiDC();
-    Polyline(hDC, (POINT*)points, n_points);
+    if ( !BGI__StrokePolyline( pWndData, (POINT*)points, n_points ) )
+        Polyline(hDC, (POINT*)points, n_points);
     BGI__ReleaseWinbgiDC( );
     
-    // One could compute the convex hull of these points and create the
-    // associated region to update...
-    RefreshWindow( NULL );
+    RefreshWindow( &rect );
+}
+
+
+// This function draws the same polyline as drawpoly, but first leaves out
+// points that cannot change what is drawn.  With a thin solid pen that
+// leaves out the last point of each line, in COPY_PUT mode, a dense data
+// series with many points in each pixel column (or row) is drawn from at
+// most four points per column, and the pixels are exactly those that
+// drawpoly would draw.  Otherwise (for instance with the square-capped pen
+// that setcolor and setlinestyle make, which draws the end points) all of
+// the points are drawn.
+//
+__declspec(dllexport) void drawpolyfast(int n_points, int* points)
+{
+    BGI__Counter counter( BGI__CALL_DRAWPOLYFAST );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    std::vector<int> kept;
+
+    if ( n_points < 4 || !pWndData->pipeline.lines || pWndData->pipeline.last_point
+         || pWndData->writemode != COPY_PUT )
+    {
+        drawpoly( n_points, points );
+        return;
+    }
+    kept.resize( 2 * n_points );
+    n_points = CollapseRuns( n_points, points, 0, &kept[0] );
+    n_points = CollapseRuns( n_points, &kept[0], 1, &kept[0] );
+    drawpoly( n_points, &kept[0] );
 }
 
 
@@ -496,6 +639,7 @@ __declspec(dllexport) void drawpoly(int n_points, int* points)
 // 
 __declspec(dllexport) void ellipse( int x, int y, int stangle, int endangle, int xradius, int yradius )
 {
+    BGI__Recorder record( BGI__OP_ELLIPSE, x, y, stangle, endangle, xradius, yradius );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     // Convert coordinates to those expected by GDI Arc
@@ -507,6 +651,8 @@ __declspec(dllexport) void ellipse( int x, int y, int stangle, int endangle, int
     CenterToBox( x, y, xradius, yradius, &left, &top, &right, &bottom );
     // Convert given arc specifications to pixel start and end points.
     ArcEndPoints( x, y, xradius, yradius, stangle, endangle, &xstart, &ystart, &xend, &yend );
+    if ( !BGI__ShapeVisible( pWndData, left, top, right, bottom ) )
+        return;
 
     // Draw to the current active page
     hDC = BGI__GetWinbgiDC( );
@@ -526,6 +672,7 @@ __declspec(dllexport) void ellipse( int x, int y, int stangle, int endangle, int
 //
 __declspec(dllexport) void fillellipse( int x, int y, int xradius, int yradius )
 {
+    BGI__Recorder record( BGI__OP_FILLELLIPSE, x, y, xradius, yradius );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     // Convert coordinates to those expected by GDI Ellipse
@@ -534,6 +681,8 @@ __declspec(dllexport) void fillellipse( int x, int y, int xradius, int yradius )
 
     // Convert center coordinates to box coordinates
     CenterToBox( x, y, xradius, yradius, &left, &top, &right, &bottom );
+    if ( !BGI__ShapeVisible( pWndData, left, top, right, bottom ) )
+        return;
 
     // Set the text color for the fill pattern
     // Convert from BGI color to RGB color
@@ -555,9 +704,16 @@ __declspec(dllexport) void fillellipse( int x, int y, int xradius, int yradius )
 
 __declspec(dllexport) void fillpoly(int n_points, int* points)
 {
+    BGI__Recorder record( BGI__OP_FILLPOLY, n_points, 0, points, 2 * n_points * sizeof( int ) );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     int color;
+    RECT rect;
+
+    // Only the box around the points, grown by the pen, is updated.
+    if ( !BGI__PolyBounds( pWndData, n_points, points, &rect )
+         || !BGI__RectVisible( pWndData, rect.left, rect.top, rect.right, rect.bottom ) )
+        return;
 
     // Set the text color for the fill pattern
     // Convert from BGI color to RGB color
@@ -572,7 +728,7 @@ __declspec(dllexport) void fillpoly(int n_points, int* points)
     SetTextColor( hDC, color );
     BGI__ReleaseWinbgiDC( );
 
-    RefreshWindow( NULL );
+    RefreshWindow( &rect );
 }
 
 
@@ -583,10 +739,15 @@ __declspec(dllexport) void fillpoly(int n_points, int* points)
 //
 __declspec(dllexport) void floodfill( int x, int y, int border )
 {
+    BGI__Recorder record( BGI__OP_FLOODFILL, x, y, border );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     int color;
 
+    // A seed point that is clipped away fills nothing.
+    if ( !BGI__RectVisible( pWndData, x, y, x + 1, y + 1 ) )
+        return;
+
     // Set the text color for the fill pattern
     // Convert from BGI color to RGB color
     color = converttorgb( pWndData->fillInfo.color );
@@ -608,19 +769,28 @@ __declspec(dllexport) void floodfill( int x, int y, int border )
 //
 __declspec(dllexport) void line( int x1, int y1, int x2, int y2 )
 {
+    BGI__Recorder record( BGI__OP_LINE, x1, y1, x2, y2 );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
     // The current position
     POINT cp;
 
-    // Move to first point, save old point
+    if ( !BGI__LineVisible( pWndData, x1, y1, x2, y2 ) )
+        return;
+
+    // Horizontal and vertical lines and wide lines are drawn without GDI.
+    // Otherwise move to first point, save old point
     hDC = BGI__GetWinbgiDC( );
-    MoveToEx( hDC, x1, y1, &cp );
-    // Draw the line
-    LineTo( hDC, x2, y2 );
-    // Move the current point back to its original position
-    MoveToEx( hDC, cp.x, cp.y, NULL );
+    if ( !BGI__StraightLine( pWndData, x1, y1, x2, y2 )
+         && !BGI__StrokeLine( pWndData, x1, y1, x2, y2 ) )
+    {
+        MoveToEx( hDC, x1, y1, &cp );
+        // Draw the line
+        LineTo( hDC, x2, y2 );
+        // Move the current point back to its original position
+        MoveToEx( hDC, cp.x, cp.y, NULL );
+    }
     BGI__ReleaseWinbgiDC( );
 
     // The update rectangle does not contain the right or bottom edge.  Thus
@@ -636,6 +806,7 @@ __declspec(dllexport) void line( int x1, int y1, int x2, int y2 )
 //
 __declspec(dllexport) void linerel( int dx, int dy )
 {
+    BGI__Recorder record( BGI__OP_LINEREL, dx, dy );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
@@ -644,7 +815,11 @@ __declspec(dllexport) void linerel( int dx, int dy )
 
     hDC = BGI__GetWinbgiDC( );
     GetCurrentPositionEx( hDC, &cp );
-    LineTo( hDC, cp.x + dx, cp.y + dy );
+    if ( BGI__StraightLine( pWndData, cp.x, cp.y, cp.x + dx, cp.y + dy )
+         || BGI__StrokeLine( pWndData, cp.x, cp.y, cp.x + dx, cp.y + dy ) )
+        MoveToEx( hDC, cp.x + dx, cp.y + dy, NULL );
+    else
+        LineTo( hDC, cp.x + dx, cp.y + dy );
     BGI__ReleaseWinbgiDC( );
 
     // The update rectangle does not contain the right or bottom edge.  Thus
@@ -659,6 +834,7 @@ __declspec(dllexport) void linerel( int dx, int dy )
 //
 __declspec(dllexport) void lineto( int x, int y )
 {
+    BGI__Recorder record( BGI__OP_LINETO, x, y );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
@@ -667,7 +843,11 @@ __declspec(dllexport) void lineto( int x, int y )
 
     hDC = BGI__GetWinbgiDC( );
     GetCurrentPositionEx( hDC, &cp );
-    LineTo( hDC, x, y );
+    if ( BGI__StraightLine( pWndData, cp.x, cp.y, x, y )
+         || BGI__StrokeLine( pWndData, cp.x, cp.y, x, y ) )
+        MoveToEx( hDC, x, y, NULL );
+    else
+        LineTo( hDC, x, y );
     BGI__ReleaseWinbgiDC( );
 
     // The update rectangle does not contain the right or bottom edge.  Thus
@@ -686,6 +866,7 @@ __declspec(dllexport) void lineto( int x, int y )
 // 
 __declspec(dllexport) void pieslice( int x, int y, int stangle, int endangle, int radius )
 {
+    BGI__Recorder record( BGI__OP_PIESLICE, x, y, stangle, endangle, radius );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     // Convert coordinates to those expected by GDI Pie
@@ -699,6 +880,9 @@ __declspec(dllexport) void pieslice( int x, int y, int stangle, int endangle, in
     // Convert given arc specifications to pixel start and end points.
     ArcEndPoints( x, y, radius, radius, stangle, endangle, &xstart, &ystart, &xend, &yend );
 
+    if ( !BGI__ShapeVisible( pWndData, left, top, right, bottom ) )
+        return;
+
     // Set the text color for the fill pattern
     // Convert from BGI color to RGB color
     color = converttorgb( pWndData->fillInfo.color );
@@ -720,13 +904,15 @@ __declspec(dllexport) void pieslice( int x, int y, int stangle, int endangle, in
 //
 __declspec(dllexport) void putpixel( int x, int y, int color )
 {
-    HDC hDC;
+    BGI__Recorder record( BGI__OP_PUTPIXEL, x, y, color );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
-    color = converttorgb( color );
-    // The call to SetPixelV might fail, but I don't know what to do if it does.
-    hDC = BGI__GetWinbgiDC( );
-    SetPixelV( hDC, x, y, color );
+    if ( !BGI__RectVisible( pWndData, x, y, x + 1, y + 1 ) )
+        return;
+
+    // The pixel is stored in the page directly, as SetPixelV would.
+    BGI__GetWinbgiDC( );
+    BGI__PlotPixel( pWndData, x, y, color );
     BGI__ReleaseWinbgiDC( );
 
     // The update rectangle does not contain the right or bottom edge.  Thus
@@ -740,6 +926,7 @@ __declspec(dllexport) void putpixel( int x, int y, int color )
 //
 __declspec(dllexport) void rectangle( int left, int top, int right, int bottom )
 {
+    BGI__Recorder record( BGI__OP_RECTANGLE, left, top, right, bottom );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
@@ -754,9 +941,12 @@ __declspec(dllexport) void rectangle( int left, int top, int right, int bottom )
     endpoints[3].y = bottom;
     endpoints[4].x = left;      // Upper left to complete rectangle
     endpoints[4].y = top;
+    if ( !BGI__ShapeVisible( pWndData, left, top, right, bottom ) )
+        return;
 
     hDC = BGI__GetWinbgiDC( );
-    Polyline( hDC, endpoints, 5 );
+    if ( !BGI__StrokePolyline( pWndData, endpoints, 5 ) )
+        Polyline( hDC, endpoints, 5 );
     BGI__ReleaseWinbgiDC( );
 
     // The update rectangle does not contain the right or bottom edge.  Thus
@@ -775,6 +965,7 @@ __declspec(dllexport) void rectangle( int left, int top, int right, int bottom )
 // 
 __declspec(dllexport) void sector( int x, int y, int stangle, int endangle, int xradius, int yradius )
 {
+    BGI__Recorder record( BGI__OP_SECTOR, x, y, stangle, endangle, xradius, yradius );
     HDC hDC;
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     // Convert coordinates to those expected by GDI Pie
@@ -788,6 +979,9 @@ __declspec(dllexport) void sector( int x, int y, int stangle, int endangle, int
     // Convert given arc specifications to pixel start and end points.
     ArcEndPoints( x, y, xradius, yradius, stangle, endangle, &xstart, &ystart, &xend, &yend );
 
+    if ( !BGI__ShapeVisible( pWndData, left, top, right, bottom ) )
+        return;
+
     // Set the text color for the fill pattern
     // Convert from BGI color to RGB color
     color = converttorgb( pWndData->fillInfo.color );
@@ -805,6 +999,151 @@ __declspec(dllexport) void sector( int x, int y, int stangle, int endangle, int
     RefreshWindow( &rect );
 }
 
+// This function draws n bars.  rects holds the left, top, right and bottom
+// of each bar, as given to bar, and colors holds the fill color of each bar
+// (or is NULL to use the current fill color).  The DC mutex is taken once
+// and the area around all of the bars is refreshed once.  The bars are
+// drawn in order, so later bars cover earlier ones.  The fill settings are
+// left as they were.
+//
+__declspec(dllexport) void bars( int n, const int* rects, const int* colors )
+{
+    BGI__Counter counter( BGI__CALL_BARS );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    BGI__Pipeline* pipeline = &pWndData->pipeline;
+    int pattern = pWndData->fillInfo.pattern;
+    int fill_color = pWndData->fillInfo.color;
+    int color = fill_color;
+    DWORD fill = pipeline->fill;
+    RECT rect = { 0, 0, 0, 0 };
+
+    // An empty fill ignores the fill color.
+    if ( pattern == EMPTY_FILL )
+        colors = NULL;
+
+    // Hatch brushes hold their color, so they are made again (by
+    // setfillstyle) each time the color changes, and the bars go through bar.
+    if ( !pipeline->fills )
+    {
+        for ( int i = 0; i < n; i++ )
+        {
+            if ( colors != NULL && colors[i] != color )
+                setfillstyle( pattern, color = colors[i] );
+            bar( rects[4*i], rects[4*i+1], rects[4*i+2], rects[4*i+3] );
+        }
+        if ( color != fill_color )
+            setfillstyle( pattern, fill_color );
+        return;
+    }
+
+    BGI__GetWinbgiDC( );
+    for ( int i = 0; i < n; i++ )
+    {
+        const int* r = &rects[4*i];
+        if ( colors != NULL && colors[i] != color )
+        {
+            color = colors[i];
+            pipeline->fill = BGI__ColorToPixel( pWndData, color );
+            if ( pWndData->recording != NULL )
+                RecordFillColor( pWndData, color );
+        }
+        if ( pWndData->recording != NULL )
+        {
+            BGI__Recorder record( BGI__OP_BAR, r[0], r[1], r[2], r[3] );
+        }
+        if ( !BGI__RectVisible( pWndData, r[0], r[1], r[2], r[3] ) )
+            continue;
+        BGI__FillBar( pWndData, r[0], r[1], r[2], r[3] );
+        AddToRect( &rect, r[0], r[1], r[2] + 1, r[3] + 1 );
+    }
+    pipeline->fill = fill;
+    if ( color != fill_color && pWndData->recording != NULL )
+        RecordFillColor( pWndData, fill_color );
+    BGI__ReleaseWinbgiDC( );
+
+    if ( rect.left < rect.right )
+        RefreshWindow( &rect );
+}
+
+
+// This function draws n circles in the current drawing color, as circle
+// does.  centers holds the x and y of each center, and radii the radius of
+// each circle.  The DC mutex is taken once and the area around all of the
+// circles is refreshed once.
+//
+__declspec(dllexport) void circles( int n, const int* centers, const int* radii )
+{
+    BGI__Counter counter( BGI__CALL_CIRCLES );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    HDC hDC;
+    int x, y, radius;
+    RECT rect = { 0, 0, 0, 0 };
+
+    hDC = BGI__GetWinbgiDC( );
+    for ( int i = 0; i < n; i++ )
+    {
+        x = centers[2*i];
+        y = centers[2*i+1];
+        radius = radii[i];
+        if ( pWndData->recording != NULL )
+        {
+            BGI__Recorder record( BGI__OP_CIRCLE, x, y, radius );
+        }
+        if ( !BGI__ShapeVisible( pWndData, x - radius, y - radius, x + radius, y + radius ) )
+            continue;
+        // When the start and end points are the same, Arc draws a complete ellipse
+        Arc( hDC, x - radius, y - radius, x + radius, y + radius, x + radius, y, x + radius, y );
+        AddToRect( &rect, x - radius, y - radius, x + radius + 1, y + radius + 1 );
+    }
+    BGI__ReleaseWinbgiDC( );
+
+    if ( rect.left < rect.right )
+        RefreshWindow( &rect );
+}
+
+
+// This function draws n lines with the current line style, thickness and
+// color, as line does.  segs holds x1, y1, x2 and y2 for each line.  The DC
+// mutex is taken once and the area around all of the lines is refreshed
+// once.  The current point is not changed.
+//
+__declspec(dllexport) void lines( int n, const int* segs )
+{
+    BGI__Counter counter( BGI__CALL_LINES );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    int reach = pWndData->lineInfo.thickness / 2 + 1;
+    HDC hDC;
+    POINT cp;
+    RECT rect = { 0, 0, 0, 0 };
+
+    hDC = BGI__GetWinbgiDC( );
+    GetCurrentPositionEx( hDC, &cp );
+    for ( int i = 0; i < n; i++ )
+    {
+        const int* s = &segs[4*i];
+        if ( pWndData->recording != NULL )
+        {
+            BGI__Recorder record( BGI__OP_LINE, s[0], s[1], s[2], s[3] );
+        }
+        if ( !BGI__LineVisible( pWndData, s[0], s[1], s[2], s[3] ) )
+            continue;
+        if ( !BGI__StraightLine( pWndData, s[0], s[1], s[2], s[3] )
+             && !BGI__StrokeLine( pWndData, s[0], s[1], s[2], s[3] ) )
+        {
+            MoveToEx( hDC, s[0], s[1], NULL );
+            LineTo( hDC, s[2], s[3] );
+        }
+        AddToRect( &rect, min( s[0], s[2] ) - reach, min( s[1], s[3] ) - reach,
+                   max( s[0], s[2] ) + reach + 1, max( s[1], s[3] ) + reach + 1 );
+    }
+    MoveToEx( hDC, cp.x, cp.y, NULL );
+    BGI__ReleaseWinbgiDC( );
+
+    if ( rect.left < rect.right )
+        RefreshWindow( &rect );
+}
+
+
 // MGM modified imagesize so that it returns zero in the case of failure.
 __declspec(dllexport) unsigned int imagesize(int left, int top, int right, int bottom)
 {
@@ -849,6 +1188,7 @@ __declspec(dllexport) unsigned int imagesize(int left, int top, int right, int b
 
 __declspec(dllexport) void getimage(int left, int top, int right, int bottom, void *bitmap)
 {
+    BGI__Counter counter( BGI__CALL_GETIMAGE );
     long width, height;   // Width and height of the image in pixels
     WindowData* pWndData; // Our own window data struct for active window
     HDC hDC;              // Device context for the active window
@@ -889,6 +1229,8 @@ __declspec(dllexport) void getimage(int left, int top, int right, int bottom, vo
 
 __declspec(dllexport) void putimage( int left, int top, void *bitmap, int op )
 {
+    BGI__Recorder record( BGI__OP_PUTIMAGE, left, top, bitmap,
+                           sizeof( BITMAP ) + ((BITMAP*)bitmap)->bmHeight * ((BITMAP*)bitmap)->bmWidthBytes, op );
     long width, height;   // Width and height of the image in pixels
     WindowData* pWndData; // Our own window data struct for active window
     HDC hDC;              // Device context for the active window
@@ -902,17 +1244,40 @@ __declspec(dllexport) void putimage( int left, int top, void *bitmap, int op )
     width = pUser->bmWidth;
     height = pUser->bmHeight;
     pWndData = BGI__GetWindowDataPtr( );
+    if ( !BGI__RectVisible( pWndData, left, top, left + width, top + height ) )
+        return;
     hDC = BGI__GetWinbgiDC( );
     
     // Create the memory DC and select a new larger bitmap for it, saving the
     // original bitmap to restore later (before deleting).
     hMemoryDC = CreateCompatibleDC(hDC);
-    hBitmap = CreateCompatibleBitmap(hDC, pUser->bmWidth, pUser->bmHeight);
+    if (pUser->bmBitsPixel == 32)
+    {
+	// 32-bit images (from readimagesprite, or getimage on an XRGB8888
+	// page) go in a 32-bit DIB section, and BitBlt converts them to the
+	// format of the page, whatever it is.
+	BITMAPINFO bmi;
+	BYTE* pBits;
+	memset(&bmi, 0, sizeof(bmi));
+	bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	bmi.bmiHeader.biWidth = width;
+	bmi.bmiHeader.biHeight = -height;
+	bmi.bmiHeader.biPlanes = 1;
+	bmi.bmiHeader.biBitCount = 32;
+	bmi.bmiHeader.biCompression = BI_RGB;
+	hBitmap = CreateDIBSection(hMemoryDC, &bmi, DIB_RGB_COLORS, (void**)&pBits, NULL, 0);
+	GdiFlush();
+	for (long y = 0; y < height; y++)
+	    memcpy(pBits + y*4*width, (BYTE*) pUser->bmBits + y*pUser->bmWidthBytes, 4*width);
+    }
+    else
+    {
+	// Other images came from getimage on a page of the same format.
+	hBitmap = CreateCompatibleBitmap(hDC, pUser->bmWidth, pUser->bmHeight);
+	SetBitmapBits(hBitmap, pUser->bmHeight*pUser->bmWidthBytes, pUser->bmBits);
+    }
     hOldBitmap = (HBITMAP) SelectObject(hMemoryDC, hBitmap);
 
-    // Grab the bitmap data from the user's bitmap and put it in hMemoryDC
-    SetBitmapBits(hBitmap, pUser->bmHeight*pUser->bmWidthBytes, pUser->bmBits);
-
     // Copy the bitmap from hMemoryDC to the active hDC:
     switch (op)
     {
@@ -1041,6 +1406,7 @@ __declspec(dllexport) void readimagefile(
     int left, int top, int right, int bottom
     )
 {
+    BGI__Counter counter( BGI__CALL_READIMAGEFILE );
     WindowData* pWndData; // Our own window data struct for active window
     HDC hDC;              // Device context for the active window
     LPPICTURE pPicture = NULL;                     // Picture object for this image
@@ -1054,7 +1420,7 @@ __declspec(dllexport) void readimagefile(
 	ZeroMemory(&ofn, sizeof(OPENFILENAME));
 	ZeroMemory(&fn, MAX_PATH+1);
 	ofn.lStructSize = sizeof(OPENFILENAME);
-	ofn.lpstrFilter = _T("Image files (*.bmp, *.gif, *.jpg, *.ico, *.emf, *.wmf)\0*.BMP;*.GIF;*.JPG;*.ICO;*.EMF;*.WMF\0\0");
+	ofn.lpstrFilter = _T("Image files (*.bmp, *.png, *.tga, *.gif, *.jpg, *.ico, *.emf, *.wmf)\0*.BMP;*.PNG;*.TGA;*.GIF;*.JPG;*.ICO;*.EMF;*.WMF\0\0");
 	ofn.lpstrFile = fn;
 	ofn.nMaxFile = MAX_PATH+1;
 	ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST ;
@@ -1062,9 +1428,12 @@ __declspec(dllexport) void readimagefile(
     }
 
     if (filename == NULL)
-	pPicture = readipicture(fn);
-    else
-	pPicture = readipicture(filename);
+	filename = fn;
+
+    // BMP, PNG and TGA files are decoded by decode.cpp; OLE does the rest
+    if (BGI__ReadImageFile(filename, left, top, right, bottom))
+	return;
+    pPicture = readipicture(filename);
     if (pPicture)
     {
 	pWndData = BGI__GetWindowDataPtr( );
@@ -1080,19 +1449,51 @@ __declspec(dllexport) void readimagefile(
     }
 }    
 
+// This function fills a putimage bitmap from a BMP file, reading the pixels
+// straight from a mapping of the file.  It returns the number of bytes the
+// bitmap needs (0 if the file is not an 8, 24 or 32-bit BMP), and fills it
+// only if bitmap is not NULL.  The bitmap always has 32 bits per pixel, and
+// putimage converts it to the format of the page it is put on.
+__declspec(dllexport) unsigned int readimagesprite(const char* filename, void *bitmap)
+{
+    LPSTR lpFile;         // The mapped file
+    LPBITMAPINFOHEADER lpbi; // Its header
+    BITMAP* pUser;        // A pointer into the user's buffer, used as a BITMAP
+    long width, height;   // Width and height of the image in pixels
+    __int64 answer;       // Bytes needed to hold this image
+
+    if ((lpFile = MapDIB(filename)) == NULL) return 0;
+    lpbi = (LPBITMAPINFOHEADER)(lpFile + sizeof(BITMAPFILEHEADER));
+    width = lpbi->biWidth;
+    height = abs(lpbi->biHeight);
+    answer = sizeof(BITMAP) + (__int64)4*width*height;
+    if (answer > UINT_MAX) answer = 0;
+
+    // Same layout as getimage makes from a page: 32 bits per pixel, top-down
+    if (bitmap != NULL && answer != 0)
+    {
+	pUser = (BITMAP*) bitmap;
+	pUser->bmType = 0;
+	pUser->bmWidth = width;
+	pUser->bmHeight = height;
+	pUser->bmWidthBytes = 4*width;
+	pUser->bmPlanes = 1;
+	pUser->bmBitsPixel = 32;
+	pUser->bmBits = (BYTE*) bitmap + sizeof(BITMAP);
+	for (long y = 0; y < height; y++)
+	    BlitDIBRow(lpFile, y, 0, width, (DWORD*) pUser->bmBits + y*width);
+    }
+    UnmapDIB(lpFile);
+    return (unsigned int) answer;
+}
+
 __declspec(dllexport) void writeimagefile(
     const char* filename,
     int left, int top, int right, int bottom,
     bool active, HWND hwnd
     )
 {
-    long width, height;   // Width and height of the image in pixels
     WindowData* pWndData; // Our own window data struct for active window
-    HDC hDC;              // Device context for the active window
-    HDC hMemoryDC;        // Memory device context for a copy of the image
-    HBITMAP hOldBitmap;   // Handle to original bitmap of hMemDC
-    HBITMAP hBitmap;      // Handle to bitmap that will be selected into hMemDC
-    HDIB hDIB;            // Handle to equivalent device independent bitmap
     OPENFILENAME ofn;     // Struct for opening a file
     TCHAR fn[MAX_PATH+1]; // Space for storing the open file name
     // Get the filename, if needed
@@ -1101,7 +1502,7 @@ __declspec(dllexport) void writeimagefile(
 	ZeroMemory(&ofn, sizeof(OPENFILENAME));
 	ZeroMemory(&fn, MAX_PATH+1);
 	ofn.lStructSize = sizeof(OPENFILENAME);
-	ofn.lpstrFilter = _T("Bitmap files (*.bmp)\0*.BMP\0\0");
+	ofn.lpstrFilter = _T("Bitmap files (*.bmp)\0*.BMP\0PNG files (*.png)\0*.PNG\0\0");
 	ofn.lpstrFile = fn;
 	ofn.nMaxFile = MAX_PATH+1;
 	ofn.Flags = OFN_PATHMUSTEXIST | OFN_HIDEREADONLY | OFN_NOREADONLYRETURN | OFN_OVERWRITEPROMPT;
@@ -1110,48 +1511,11 @@ __declspec(dllexport) void writeimagefile(
 	    strcat(fn, ".BMP");
     }
 
-    // Preliminary computations
+    // The rows are streamed straight from the page into the file.
     pWndData = BGI__GetWindowDataPtr(hwnd);
-    WaitForSingleObject(pWndData->hDCMutex, 5000);
-    if (active)
-	hDC = pWndData->hDC[pWndData->ActivePage];
-    else
-	hDC = pWndData->hDC[pWndData->VisualPage];
-    if (left < 0) left = 0;
-    else if (left >= pWndData->width) left = pWndData->width - 1;
-    if (right < 0) right = 0;
-    else if (right >= pWndData->width) right = pWndData->width;
-    if (bottom < 0) bottom = 0;
-    else if (bottom >= pWndData->height) bottom = pWndData->height;
-    if (top < 0) top = 0;
-    else if (top >= pWndData->height) top = pWndData->height;
-    width = 1 + abs(right - left);
-    height = 1 + abs(bottom - top);
-
-    // Create the memory DC and select a new larger bitmap for it, saving the
-    // original bitmap to restore later (before deleting).
-    hMemoryDC = CreateCompatibleDC(hDC);
-    hBitmap = CreateCompatibleBitmap(hDC, width, height);
-
-    hOldBitmap = (HBITMAP) SelectObject(hMemoryDC, hBitmap);
-
-    // Grab the bitmap data from hDC and put it in hMemoryDC
-    SelectObject(hMemoryDC, hBitmap);
-    BitBlt(hMemoryDC, 0, 0, width, height, hDC, left, top, SRCCOPY);
-
-    // Get the equivalent DIB and write it to the file
-    hDIB = BitmapToDIB(hBitmap, NULL);
-    if (filename == NULL)
-	SaveDIB(hDIB, fn);
-    else
-	SaveDIB(hDIB, filename);
-    
-    // Delete resources
-    ReleaseMutex(pWndData->hDCMutex);
-    DestroyDIB(hDIB);
-    SelectObject(hMemoryDC, hOldBitmap); // Restore original bmp so it's deleted
-    DeleteObject(hBitmap);               // Delete the bitmap we used
-    DeleteDC(hMemoryDC);                 // Delete the memory dc and it's bmp
+    if (!BGI__WriteImageFile(pWndData, (filename == NULL) ? fn : filename, active,
+                             left, top, right, bottom))
+        pWndData->error_code = grError;
 }
 
 __declspec(dllexport) void printimage(
@@ -1196,6 +1560,7 @@ __declspec(dllexport) void printimage(
     // Get the window's hDC, width and height
     pWndData = BGI__GetWindowDataPtr(hwnd);
     WaitForSingleObject(pWndData->hDCMutex, 5000);
+    BGI__SyncViewport( pWndData, active ? pWndData->ActivePage : pWndData->VisualPage );
     if (active)
 	hDC = pWndData->hDC[pWndData->ActivePage];
     else
@@ -8,6 +8,9 @@
 //  SaveDIB()           - Saves the specified dib in a file
 //  LoadDIB()           - Loads a DIB from a file
 //  DestroyDIB()        - Deletes DIB when finished using it
+//  MapDIB()            - Maps a DIB file into memory without reading it
+//  UnmapDIB()          - Unmaps a DIB file mapped by MapDIB
+//  BlitDIBRow()        - Converts pixels of a mapped DIB to 32-bit pixels
 //
 // Written by Microsoft Product Support Services, Developer Support.
 // Copyright (C) 1991-1996 Microsoft Corporation. All rights reserved.
@@ -247,6 +250,186 @@ WORD DestroyDIB(HDIB hDib)
 }
 
 
+/*************************************************************************
+ *
+ * MapDIB()
+ *
+ * Maps the specified DIB file into memory.  Unlike LoadDIB, nothing is
+ * read or copied: the pages of the file are brought in by the system as
+ * BlitDIBRow touches them, and they can be dropped again at any time,
+ * since they are backed by the file itself.
+ *
+ * Parameters:
+ *
+ * const char* lpFileName - specifies the file to map
+ *
+ * Returns: A pointer to the BITMAPFILEHEADER at the start of the mapped
+ * file, or NULL if the file cannot be mapped or is not an uncompressed
+ * Windows DIB with 8, 24 or 32 bits per pixel (or a 32-bit DIB whose
+ * bit fields are the usual 8-8-8 masks).  No error box is shown, so that
+ * the caller can try another way of loading the file.
+ *
+ *************************************************************************/
+
+LPSTR MapDIB(const char* lpFileName)
+{
+    HANDLE              hFile;
+    HANDLE              hMapping;
+    LPSTR               lpFile = NULL;
+    LPBITMAPFILEHEADER  lpbmf;
+    LPBITMAPINFOHEADER  lpbi;
+    LPDWORD             lpMasks;
+    DWORD               dwSize;
+    ULONGLONG           qwBitsSize;
+    LONG                lHeight;
+
+    hFile = CreateFile(lpFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    dwSize = GetFileSize(hFile, NULL);
+    if (dwSize != INVALID_FILE_SIZE &&
+            dwSize >= sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER))
+    {
+        hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping)
+        {
+            lpFile = (LPSTR)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            // The view keeps the mapping (and the file) open on its own
+            CloseHandle(hMapping);
+        }
+    }
+    CloseHandle(hFile);
+    if (!lpFile)
+        return NULL;
+
+    // Check that the header describes something BlitDIBRow can convert,
+    // and that all of the bits are inside the file.
+
+    lpbmf = (LPBITMAPFILEHEADER)lpFile;
+    lpbi = (LPBITMAPINFOHEADER)(lpFile + sizeof(BITMAPFILEHEADER));
+    lHeight = (lpbi->biHeight < 0) ? -lpbi->biHeight : lpbi->biHeight;
+
+    if (lpbmf->bfType != DIB_HEADER_MARKER || lpbi->biSize < sizeof(BITMAPINFOHEADER) ||
+            lpbi->biWidth <= 0 || lHeight <= 0 || lpbi->biWidth > 32768 || lHeight > 32768)
+        goto ErrExit;
+
+    if (lpbi->biBitCount != 8 && lpbi->biBitCount != 24 && lpbi->biBitCount != 32)
+        goto ErrExit;
+
+    if (lpbi->biCompression == BI_BITFIELDS)
+    {
+        lpMasks = (LPDWORD)((LPSTR)lpbi + sizeof(BITMAPINFOHEADER));
+        if (lpbi->biBitCount != 32 ||
+                sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + 3 * sizeof(DWORD) > dwSize ||
+                lpMasks[0] != 0x00FF0000 || lpMasks[1] != 0x0000FF00 || lpMasks[2] != 0x000000FF)
+            goto ErrExit;
+    }
+    else if (lpbi->biCompression != BI_RGB)
+        goto ErrExit;
+
+    // Any byte of an 8-bit DIB is used as an index into the color table,
+    // so all 256 entries must be inside the file, even if fewer are used.
+
+    if (lpbi->biBitCount == 8 && (lpbi->biClrUsed > 256 ||
+            sizeof(BITMAPFILEHEADER) + lpbi->biSize + 256 * sizeof(RGBQUAD) > dwSize))
+        goto ErrExit;
+
+    // The size is worked out in 64 bits, since a 32768 x 32768 32-bit
+    // header needs 4 GB, which would wrap around to 0 in a DWORD.
+
+    qwBitsSize = WIDTHBYTES((ULONGLONG)lpbi->biWidth * lpbi->biBitCount) * (ULONGLONG)lHeight;
+    if (lpbmf->bfOffBits > dwSize || qwBitsSize > dwSize - lpbmf->bfOffBits)
+        goto ErrExit;
+
+    return lpFile;
+
+ErrExit:
+    UnmapViewOfFile(lpFile);
+    return NULL;
+}
+
+
+/*************************************************************************
+ *
+ * UnmapDIB()
+ *
+ * Purpose:  Unmaps a DIB file mapped by MapDIB
+ *
+ * Returns:  Nothing
+ *
+ *************************************************************************/
+
+void UnmapDIB(LPSTR lpFile)
+{
+    if (lpFile)
+        UnmapViewOfFile(lpFile);
+}
+
+
+/*************************************************************************
+ *
+ * BlitDIBRow()
+ *
+ * Converts pixels of one row of a DIB file mapped by MapDIB to 32-bit
+ * 0x00RRGGBB pixels, which is the layout of the winbgim pages and of the
+ * bitmaps made by getimage.  The pixels are read straight from the
+ * mapping and written straight to lpDest.
+ *
+ * Parameters:
+ *
+ * LPSTR lpFile   - the mapped file
+ * int nRow       - the row to convert, counting from the top of the
+ *                  picture whether the DIB is stored top-down or
+ *                  bottom-up
+ * int nFirst     - first column to convert
+ * int nCount     - number of columns to convert
+ * LPDWORD lpDest - where the converted pixels go
+ *
+ *************************************************************************/
+
+void BlitDIBRow(LPSTR lpFile, int nRow, int nFirst, int nCount, LPDWORD lpDest)
+{
+    LPBITMAPFILEHEADER  lpbmf = (LPBITMAPFILEHEADER)lpFile;
+    LPBITMAPINFOHEADER  lpbi = (LPBITMAPINFOHEADER)(lpFile + sizeof(BITMAPFILEHEADER));
+    RGBQUAD FAR *       lpColors;
+    LPBYTE              lpRow;
+    LPDWORD             lpSrc;
+    DWORD               dwStride;
+    int                 i;
+
+    dwStride = WIDTHBYTES(lpbi->biWidth * (DWORD)lpbi->biBitCount);
+    if (lpbi->biHeight > 0)
+        nRow = lpbi->biHeight - 1 - nRow;   // Bottom-up DIB
+    lpRow = (LPBYTE)lpFile + lpbmf->bfOffBits + nRow * dwStride;
+
+    switch (lpbi->biBitCount)
+    {
+    case 8:
+        lpColors = (RGBQUAD FAR *)((LPSTR)lpbi + lpbi->biSize);
+        for (i = 0, lpRow += nFirst; i < nCount; i++, lpRow++)
+        {
+            RGBQUAD q = lpColors[*lpRow];
+            lpDest[i] = ((DWORD)q.rgbRed << 16) | ((DWORD)q.rgbGreen << 8) | q.rgbBlue;
+        }
+        break;
+
+    case 24:
+        for (i = 0, lpRow += 3 * nFirst; i < nCount; i++, lpRow += 3)
+            lpDest[i] = ((DWORD)lpRow[2] << 16) | ((DWORD)lpRow[1] << 8) | lpRow[0];
+        break;
+
+    case 32:
+        // Already in the right layout, except for the unused top byte
+        lpSrc = (LPDWORD)lpRow + nFirst;
+        for (i = 0; i < nCount; i++)
+            lpDest[i] = lpSrc[i] & 0x00FFFFFF;
+        break;
+    }
+}
+
+
 //************************************************************************
 //
 // Auxiliary Functions which the above procedures use
@@ -0,0 +1,234 @@
+// File: frameserver.cxx
+//
+// This file contains what the frame streamer (stream.cpp) and the RFB server
+// (rfb.cpp) share: the listening socket, the server thread and the frames
+// that the window thread hands over to it (see frameserver.h).
+//
+// A viewer that stops reading must not be able to hold up the server thread,
+// since the window thread waits for that thread when the window is closed.
+// Each viewer therefore gets a send timeout, and BGI__CloseFrameServer shuts
+// down and closes the connection before it waits, which makes a send or
+// receive in progress fail at once.  The viewer socket is set and closed
+// only under hLock, so the server thread never closes it a second time, and
+// BGI__CloseFrameServer never reaches a socket that is being replaced.
+//
+
+#include <winsock2.h>       // Provides sockets (must come before windows.h)
+#include <windows.h>        // Provides the Win32 API
+#include <string.h>         // Provides memcmp and memcpy
+#include <vector>           // Provides STL vector class
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+#include "frameserver.h"    // The shared frame server
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function frees what BGI__OpenFrameServer made, once the server
+// thread has finished (or if it never started).
+//
+static void FreeFrameServer( BGI__FrameServer* fs )
+{
+    closesocket( fs->listener );
+    CloseHandle( fs->hLock );
+    CloseHandle( fs->hReady );
+    delete [] fs->latest;
+    delete [] fs->work;
+    delete [] fs->sent;
+    WSACleanup( );
+}
+
+
+/*****************************************************************************
+*
+*   The routines used by the streamer and the RFB server
+*
+*****************************************************************************/
+
+// This function starts listening for viewers on the given TCP port of the
+// loopback interface (127.0.0.1), makes the frames for a window of this
+// size, and starts the server thread.  It returns false if any of this
+// fails, and then there is nothing to free.
+// (used by startstream in stream.cpp and startrfbserver in rfb.cpp)
+//
+bool BGI__OpenFrameServer( BGI__FrameServer* fs, WindowData* pWndData, int port,
+                           LPTHREAD_START_ROUTINE thread, LPVOID data )
+{
+    WSADATA wsa;
+    sockaddr_in address;
+    int size;
+
+    if ( port <= 0 || port > 65535 || WSAStartup( MAKEWORD( 2, 2 ), &wsa ) != 0 )
+        return false;
+
+    fs->listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    ZeroMemory( &address, sizeof( address ) );
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    address.sin_port = htons( (u_short)port );
+    if ( fs->listener == INVALID_SOCKET
+         || bind( fs->listener, (sockaddr*)&address, sizeof( address ) ) == SOCKET_ERROR
+         || listen( fs->listener, 1 ) == SOCKET_ERROR )
+    {
+        if ( fs->listener != INVALID_SOCKET )
+            closesocket( fs->listener );
+        WSACleanup( );
+        return false;
+    }
+
+    fs->width = pWndData->width;
+    fs->height = pWndData->height;
+    fs->pitch = 4 * fs->width;
+    size = fs->height * fs->pitch;
+    fs->latest = new BYTE[size];
+    ZeroMemory( fs->latest, size );
+    fs->work = new BYTE[size];
+    ZeroMemory( fs->work, size );
+    fs->sent = new BYTE[size];
+    ZeroMemory( fs->sent, size );
+    fs->hLock = CreateMutex( NULL, FALSE, NULL );
+    fs->hReady = CreateEvent( NULL, FALSE, FALSE, NULL );
+    fs->stopping = false;
+    fs->viewer = INVALID_SOCKET;
+
+    fs->hThread = CreateThread( NULL, 0, thread, data, 0, NULL );
+    if ( fs->hThread == NULL )
+    {
+        FreeFrameServer( fs );
+        return false;
+    }
+    return true;
+}
+
+
+// This function stops the server thread, dropping the viewer (even one that
+// has stopped reading), and frees the rest of the server.
+// (used by BGI__StopStream in stream.cpp and BGI__StopRfbServer in rfb.cpp)
+//
+void BGI__CloseFrameServer( BGI__FrameServer* fs )
+{
+    WaitForSingleObject( fs->hLock, INFINITE );
+    fs->stopping = true;
+    if ( fs->viewer != INVALID_SOCKET )
+    {
+        shutdown( fs->viewer, SD_BOTH );
+        closesocket( fs->viewer );
+        fs->viewer = INVALID_SOCKET;
+    }
+    ReleaseMutex( fs->hLock );
+    SetEvent( fs->hReady );
+    WaitForSingleObject( fs->hThread, INFINITE );
+    CloseHandle( fs->hThread );
+    FreeFrameServer( fs );
+}
+
+
+// This function takes a viewer that is waiting to connect, if one does
+// within wait milliseconds.  It returns false if none did.  A viewer that
+// stops reading is dropped after BGI__FRAME_WAIT milliseconds.
+// (used by the server threads in stream.cpp and rfb.cpp)
+//
+bool BGI__AcceptViewer( BGI__FrameServer* fs, int wait )
+{
+    DWORD timeout = BGI__FRAME_WAIT;
+    timeval limit = { 0, wait * 1000 };
+    fd_set ready;
+    SOCKET viewer;
+
+    FD_ZERO( &ready );
+    FD_SET( fs->listener, &ready );
+    if ( select( 0, &ready, NULL, NULL, &limit ) <= 0 )
+        return false;
+    viewer = accept( fs->listener, NULL, NULL );
+    if ( viewer == INVALID_SOCKET )
+        return false;
+    setsockopt( viewer, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof( timeout ) );
+
+    WaitForSingleObject( fs->hLock, INFINITE );
+    if ( fs->stopping )
+        closesocket( viewer );
+    else
+        fs->viewer = viewer;
+    ReleaseMutex( fs->hLock );
+    return fs->viewer != INVALID_SOCKET;
+}
+
+
+// This function closes the connection to the viewer, unless
+// BGI__CloseFrameServer has closed it already.
+// (used by the server threads in stream.cpp and rfb.cpp)
+//
+void BGI__DropViewer( BGI__FrameServer* fs )
+{
+    WaitForSingleObject( fs->hLock, INFINITE );
+    if ( fs->viewer != INVALID_SOCKET )
+        closesocket( fs->viewer );
+    fs->viewer = INVALID_SOCKET;
+    ReleaseMutex( fs->hLock );
+}
+
+
+// This function copies the newest frame into work.
+// (used by the server threads in stream.cpp and rfb.cpp)
+//
+void BGI__TakeFrame( BGI__FrameServer* fs )
+{
+    WaitForSingleObject( fs->hLock, INFINITE );
+    memcpy( fs->work, fs->latest, fs->height * fs->pitch );
+    ReleaseMutex( fs->hLock );
+}
+
+
+// This function gives the visual page of a window to the server thread.  The
+// DC mutex must be held.
+// (used by BGI__StreamFrame in stream.cpp and BGI__RfbFrame in rfb.cpp)
+//
+void BGI__PutFrame( BGI__FrameServer* fs, WindowData* pWndData )
+{
+    GdiFlush( );
+    WaitForSingleObject( fs->hLock, INFINITE );
+    BGI__ReadPixels( pWndData, pWndData->VisualPage, NULL, fs->latest, fs->pitch );
+    ReleaseMutex( fs->hLock );
+    SetEvent( fs->hReady );
+}
+
+
+// This function returns true if a tile is the same in work and in sent.
+// (used by SendFrame in stream.cpp and SendUpdate in rfb.cpp)
+//
+bool BGI__SameTile( const BGI__FrameServer* fs, int left, int top, int right, int bottom )
+{
+    for ( int y = top; y < bottom; y++ )
+        if ( memcmp( fs->work + y * fs->pitch + 4 * left, fs->sent + y * fs->pitch + 4 * left,
+                     4 * ( right - left ) ) != 0 )
+            return false;
+    return true;
+}
+
+
+// This function sends all of a buffer.  It returns false if the viewer has
+// gone away, or has stopped reading.
+// (used by stream.cpp and rfb.cpp)
+//
+bool BGI__SendAll( SOCKET s, const std::vector<BYTE>& out )
+{
+    size_t done = 0;
+    int sent;
+
+    while ( done < out.size( ) )
+    {
+        sent = send( s, (const char*)&out[done], (int)min( out.size( ) - done, (size_t)0x100000 ), 0 );
+        if ( sent == SOCKET_ERROR )
+            return false;
+        done += sent;
+    }
+    return true;
+}
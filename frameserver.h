@@ -0,0 +1,61 @@
+// File: frameserver.h
+//
+// The parts that the frame streamer (stream.cpp) and the RFB server
+// (rfb.cpp) have in common: a socket on the loopback interface that takes
+// one viewer at a time, a thread that serves that viewer, and the copies of
+// the visual page that the window thread hands over to the thread.  This
+// header needs winsock2.h, which must be included before windows.h.
+//
+
+#ifndef FRAMESERVER_H
+#define FRAMESERVER_H
+
+#include <vector>               // Provides STL vector class
+#include "winbgitypes.h"        // Provides WindowData
+
+#define BGI__FRAME_WAIT     10000   // Milliseconds a viewer may take to read what is sent
+
+// A server of the frames of one window.  The window thread copies each
+// painted frame into latest; the server thread copies latest into work when
+// it is ready to send another frame, and sent holds what the viewer has.
+// The streamer and the RFB server add their own state to this.
+struct BGI__FrameServer
+{
+    int width, height, pitch;
+    BYTE* latest;               // Newest frame, guarded by hLock
+    BYTE* work;                 // Frame being sent
+    BYTE* sent;                 // Frame the viewer has
+    HANDLE hLock;               // Mutex for latest (and for changing viewer)
+    HANDLE hReady;              // Event set when latest has a new frame
+    volatile bool stopping;     // Set by BGI__CloseFrameServer
+    SOCKET listener;            // Socket that accepts viewers
+    SOCKET viewer;              // Connected viewer, or INVALID_SOCKET
+    HANDLE hThread;             // The server thread
+};
+
+// Starts listening on a port of the loopback interface, and starts the
+// server thread, which is given data.  It returns false (with nothing left
+// to free) if it cannot.
+bool BGI__OpenFrameServer( BGI__FrameServer* fs, WindowData* pWndData, int port,
+                           LPTHREAD_START_ROUTINE thread, LPVOID data );
+
+// Stops the server thread and frees what BGI__OpenFrameServer made
+void BGI__CloseFrameServer( BGI__FrameServer* fs );
+
+// Used by the server thread: takes a viewer that connects within wait
+// milliseconds, closes the connection to the viewer, and copies the newest
+// frame into work
+bool BGI__AcceptViewer( BGI__FrameServer* fs, int wait );
+void BGI__DropViewer( BGI__FrameServer* fs );
+void BGI__TakeFrame( BGI__FrameServer* fs );
+
+// Used by the window thread, with the DC mutex held: copies the visual page
+// into latest
+void BGI__PutFrame( BGI__FrameServer* fs, WindowData* pWndData );
+
+// Compares a tile of work with the same tile of sent, and sends a whole
+// buffer to a viewer
+bool BGI__SameTile( const BGI__FrameServer* fs, int left, int top, int right, int bottom );
+bool BGI__SendAll( SOCKET s, const std::vector<BYTE>& out );
+
+#endif
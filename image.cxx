@@ -0,0 +1,972 @@
+// File: image.cxx
+//
+// This file contains the image file writers.  The pixels are copied from the
+// memory of a page while it is locked, then encoded a row at a time into a
+// fixed-size buffer without the lock, so drawing only waits for the copy and
+// no window DC is needed.  Whenever the buffer fills, it is handed to the
+// file (or to a function supplied by the user).
+//
+// Images are written as BMP or PNG.  The PNG encoder is self-contained: rows
+// are filtered with the usual minimum-sum heuristic and compressed with a
+// fast deflate (one hash probe per position, fixed Huffman codes).  Strips of
+// rows are compressed on one thread per processor.  Each strip is an
+// independent run of deflate blocks ending in a sync flush, so the strips
+// can simply be written one after another.
+//
+// snapshotasync copies the pixels under the lock and leaves the encoding and
+// the file to a single writer thread, so drawing only waits for the copy.
+// At most SNAPSHOT_QUEUE copies wait for the writer; when that many do,
+// snapshotasync waits for the oldest to be written.  waitsnapshots (which
+// closegraph also calls) waits for all of them.  Nothing waits at exit,
+// since by then the writer thread may already have been ended, so a
+// program that does not call closegraph must call waitsnapshots itself.
+//
+
+#include <windows.h>        // Provides the Win32 API
+#include <stdlib.h>         // Provides abs
+#include <string.h>         // Provides memcpy
+#include <string>           // Provides STL string class
+#include <vector>           // Provides STL vector class
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Structures and constants
+*
+*****************************************************************************/
+#define IMAGE_BUFFER    65536   // Size of the output buffer
+#define PNG_STRIP       64      // Rows compressed together by one thread
+#define PNG_THREADS     64      // Most threads used (WaitForMultipleObjects limit)
+#define DEFLATE_WINDOW  32768   // Farthest back a match may start
+#define DEFLATE_HASH    15      // Bits in the match hash
+#define ADLER_BASE      65521
+#define SNAPSHOT_QUEUE  4       // Snapshots that may wait for the writer
+
+typedef bool (*ImageCallback)( const void*, int, void* );
+
+// Where encoded bytes go.  Exactly one of hFile and write is used.
+struct ImageOutput
+{
+    HANDLE hFile;               // The file being written, or INVALID_HANDLE_VALUE
+    ImageCallback write;        // The user's function, or NULL
+    void* data;                 // User data passed along to write
+    bool ok;                    // False once any write has failed
+    int used;                   // Number of bytes waiting in buffer
+    BYTE buffer[IMAGE_BUFFER];
+};
+
+
+// A copy of part of a page, made by snapshotasync for the writer thread.
+struct Snapshot
+{
+    std::string filename;
+    BYTE* pBits;                // The pixels, 4 * width bytes per row
+    int width, height;
+    void (*callback)( const char*, bool, void* );
+    void* data;                 // User data passed along to callback
+};
+
+// One strip of a PNG image.  The worker threads fill in adler and out.
+struct PngStrip
+{
+    int top, bottom;            // Device rows of the strip (bottom excluded)
+    bool last;                  // True for the last strip of the image
+    DWORD adler;                // Adler-32 of the filtered rows
+    DWORD size;                 // Number of bytes of filtered rows
+    std::vector<BYTE> out;      // The compressed rows
+};
+
+// The strips that are being compressed at the same time.
+struct PngJob
+{
+    const BYTE* pBits;          // Pixel memory of the page
+    int pitch;                  // Bytes per row of pBits
+    RECT rect;                  // The whole image in device coordinates
+    PngStrip* strips;
+    int count;                  // Number of strips in this batch
+    volatile LONG next;         // Next strip to hand out
+};
+
+// Deflate writes bits starting with the least significant bit of each byte.
+struct BitOutput
+{
+    std::vector<BYTE>* out;
+    DWORD bits;                 // Bits not yet written
+    int count;                  // Number of them
+};
+
+
+/*****************************************************************************
+*
+*   Global Variables
+*
+*****************************************************************************/
+static DWORD crc_table[256];            // CRC-32 of each byte value
+static WORD lit_code[288];              // Fixed Huffman codes, bit reversed
+static BYTE lit_bits[288];              // Length of each code
+static BYTE length_symbol[259];         // Length code (minus 257) of each length
+static BYTE distance_symbol[512];       // Distance code (see DistanceSymbol)
+static const WORD length_base[29] =
+    { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+      67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const BYTE length_extra[29] =
+    { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const WORD distance_base[30] =
+    { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+      1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const BYTE distance_extra[30] =
+    { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+      11, 11, 12, 12, 13, 13 };
+
+// The snapshots waiting for the writer thread.  snapshotasync fills
+// snapshots[tail % SNAPSHOT_QUEUE] (holding snapshot_lock) and the writer
+// empties snapshots[head % SNAPSHOT_QUEUE].  A slot of snapshot_free is
+// given back only after the file is written and the callback has returned.
+static Snapshot* snapshots[SNAPSHOT_QUEUE];
+static volatile LONG snapshot_head = 0, snapshot_tail = 0;
+static HANDLE snapshot_lock = NULL;         // Mutex for adding snapshots
+static HANDLE snapshot_free = NULL;         // Semaphore counting empty slots
+static HANDLE snapshot_queued = NULL;       // Semaphore counting waiting snapshots
+static HANDLE snapshot_writer = NULL;       // The writer thread
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function passes the buffered bytes on to the file or callback.
+//
+static void Flush( ImageOutput* out )
+{
+    DWORD written;
+
+    if ( out->used == 0 || !out->ok )
+    {
+        out->used = 0;
+        return;
+    }
+    if ( out->write != NULL )
+        out->ok = out->write( out->buffer, out->used, out->data );
+    else
+        out->ok = WriteFile( out->hFile, out->buffer, out->used, &written, NULL )
+               && written == (DWORD)out->used;
+    out->used = 0;
+}
+
+
+// This function adds size bytes to the output.
+//
+static void Put( ImageOutput* out, const void* p, int size )
+{
+    const BYTE* bytes = (const BYTE*)p;
+    int n;
+
+    while ( size > 0 )
+    {
+        if ( out->used == IMAGE_BUFFER )
+            Flush( out );
+        n = min( size, IMAGE_BUFFER - out->used );
+        memcpy( out->buffer + out->used, bytes, n );
+        out->used += n;
+        bytes += n;
+        size -= n;
+    }
+}
+
+
+// This function adds a little-endian number of the given number of bytes.
+//
+static void PutLE( ImageOutput* out, DWORD value, int bytes )
+{
+    BYTE b[4];
+
+    for ( int i = 0; i < bytes; i++ )
+        b[i] = (BYTE)( value >> ( 8 * i ) );
+    Put( out, b, bytes );
+}
+
+
+// This function writes the pixels of rect (in device coordinates, right and
+// bottom excluded) as a 24-bit BMP file.  BMP rows are stored bottom-up and
+// padded to a multiple of four bytes.  Only one row is converted at a time.
+//
+static void WriteBMP( ImageOutput* out, const BYTE* pBits, int pitch, const RECT* rect )
+{
+    int width = rect->right - rect->left;
+    int height = rect->bottom - rect->top;
+    int stride = ( 3 * width + 3 ) & ~3;
+    DWORD image_size = (DWORD)stride * height;
+    BYTE* row = new BYTE[stride];
+
+    // BITMAPFILEHEADER
+    Put( out, "BM", 2 );
+    PutLE( out, 14 + 40 + image_size, 4 );
+    PutLE( out, 0, 4 );
+    PutLE( out, 14 + 40, 4 );
+    // BITMAPINFOHEADER
+    PutLE( out, 40, 4 );
+    PutLE( out, width, 4 );
+    PutLE( out, height, 4 );        // Positive: bottom-up rows
+    PutLE( out, 1, 2 );             // Planes
+    PutLE( out, 24, 2 );            // Bits per pixel
+    PutLE( out, BI_RGB, 4 );
+    PutLE( out, image_size, 4 );
+    PutLE( out, 2835, 4 );          // 72 dots per inch
+    PutLE( out, 2835, 4 );
+    PutLE( out, 0, 4 );
+    PutLE( out, 0, 4 );
+
+    memset( row, 0, stride );
+    for ( int y = rect->bottom - 1; y >= rect->top && out->ok; y-- )
+    {
+        const DWORD* src = (const DWORD*)( pBits + y * pitch ) + rect->left;
+        BYTE* dst = row;
+        for ( int x = 0; x < width; x++ )
+        {
+            DWORD pixel = src[x];   // 0x00RRGGBB, stored as B, G, R
+            *dst++ = (BYTE)pixel;
+            *dst++ = (BYTE)( pixel >> 8 );
+            *dst++ = (BYTE)( pixel >> 16 );
+        }
+        Put( out, row, stride );
+    }
+    delete [] row;
+}
+
+
+// This function fills in the CRC and deflate tables.  It is called before
+// any worker threads are started.
+//
+static void InitTables( )
+{
+    static bool ready = false;
+    int i, j, code, bits;
+
+    if ( ready )
+        return;
+
+    for ( i = 0; i < 256; i++ )
+    {
+        DWORD c = i;
+        for ( j = 0; j < 8; j++ )
+            c = ( c & 1 ) ? 0xEDB88320 ^ ( c >> 1 ) : c >> 1;
+        crc_table[i] = c;
+    }
+
+    // The fixed Huffman codes of RFC 1951, section 3.2.6.  Huffman codes are
+    // sent starting with their most significant bit, so they are reversed.
+    for ( i = 0; i < 288; i++ )
+    {
+        if ( i < 144 )      { code = 0x30 + i;          bits = 8; }
+        else if ( i < 256 ) { code = 0x190 + i - 144;   bits = 9; }
+        else if ( i < 280 ) { code = i - 256;           bits = 7; }
+        else                { code = 0xC0 + i - 280;    bits = 8; }
+        lit_bits[i] = bits;
+        lit_code[i] = 0;
+        for ( j = 0; j < bits; j++ )
+            if ( code & ( 1 << j ) )
+                lit_code[i] |= 1 << ( bits - 1 - j );
+    }
+
+    for ( i = 0; i < 29; i++ )
+        for ( j = length_base[i]; j < length_base[i] + ( 1 << length_extra[i] ) && j <= 258; j++ )
+            length_symbol[j] = i;
+    length_symbol[258] = 28;
+    for ( i = 0; i < 30; i++ )
+    {
+        for ( j = distance_base[i]; j < distance_base[i] + ( 1 << distance_extra[i] ); j++ )
+        {
+            if ( j <= 256 )
+                distance_symbol[j - 1] = i;
+            else
+                distance_symbol[256 + ( ( j - 1 ) >> 7 )] = i;
+        }
+    }
+    ready = true;
+}
+
+
+// This function returns the deflate code of a match distance.
+//
+static int DistanceSymbol( int distance )
+{
+    return ( distance <= 256 ) ? distance_symbol[distance - 1]
+                               : distance_symbol[256 + ( ( distance - 1 ) >> 7 )];
+}
+
+
+// This function continues a CRC-32 over size more bytes.
+//
+static DWORD Crc( DWORD crc, const BYTE* p, int size )
+{
+    crc = ~crc;
+    while ( size-- > 0 )
+        crc = crc_table[( crc ^ *p++ ) & 0xFF] ^ ( crc >> 8 );
+    return ~crc;
+}
+
+
+// This function returns the Adler-32 checksum of size bytes.
+//
+static DWORD Adler( const BYTE* p, int size )
+{
+    DWORD a = 1, b = 0;
+    int n;
+
+    while ( size > 0 )
+    {
+        // 5552 bytes is the most that can be summed before b could overflow.
+        n = min( size, 5552 );
+        size -= n;
+        while ( n-- > 0 )
+        {
+            a += *p++;
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+    return ( b << 16 ) | a;
+}
+
+
+// This function returns the Adler-32 checksum of two blocks of data joined
+// together, given the checksum of each and the size of the second.
+//
+static DWORD AdlerCombine( DWORD adler1, DWORD adler2, DWORD size2 )
+{
+    DWORD rem = size2 % ADLER_BASE;
+    DWORD sum1 = adler1 & 0xFFFF;
+    DWORD sum2 = ( rem * sum1 ) % ADLER_BASE;
+
+    sum1 += ( adler2 & 0xFFFF ) + ADLER_BASE - 1;
+    sum2 += ( ( adler1 >> 16 ) & 0xFFFF ) + ( ( adler2 >> 16 ) & 0xFFFF ) + ADLER_BASE - rem;
+    if ( sum1 >= ADLER_BASE ) sum1 -= ADLER_BASE;
+    if ( sum1 >= ADLER_BASE ) sum1 -= ADLER_BASE;
+    if ( sum2 >= 2 * ADLER_BASE ) sum2 -= 2 * ADLER_BASE;
+    if ( sum2 >= ADLER_BASE ) sum2 -= ADLER_BASE;
+    return ( sum2 << 16 ) | sum1;
+}
+
+
+// These functions write bits for deflate.
+//
+static void PutBits( BitOutput* bits, DWORD value, int count )
+{
+    bits->bits |= value << bits->count;
+    bits->count += count;
+    while ( bits->count >= 8 )
+    {
+        bits->out->push_back( (BYTE)bits->bits );
+        bits->bits >>= 8;
+        bits->count -= 8;
+    }
+}
+
+static void AlignBits( BitOutput* bits )
+{
+    if ( bits->count > 0 )
+        bits->out->push_back( (BYTE)bits->bits );
+    bits->bits = 0;
+    bits->count = 0;
+}
+
+
+// This function compresses size bytes as one fixed Huffman deflate block.
+// Matches are found with a single probe of a hash of the next three bytes.
+// If the block is not the last one, it is followed by an empty stored block
+// (a sync flush) so that the next strip starts on a byte boundary.
+//
+static void Deflate( const BYTE* in, int size, bool last, std::vector<BYTE>& out )
+{
+    int* head = new int[1 << DEFLATE_HASH];
+    BitOutput bits = { &out, 0, 0 };
+    int i = 0, length, distance, candidate, sym, limit;
+    DWORD hash;
+
+    for ( i = 0; i < ( 1 << DEFLATE_HASH ); i++ )
+        head[i] = -DEFLATE_WINDOW - 1;
+
+    PutBits( &bits, last ? 1 : 0, 1 );      // BFINAL
+    PutBits( &bits, 1, 2 );                 // BTYPE: fixed Huffman codes
+    i = 0;
+    while ( i < size )
+    {
+        length = 0;
+        if ( i + 3 <= size )
+        {
+            hash = ( ( in[i] << 16 ) | ( in[i + 1] << 8 ) | in[i + 2] ) * 2654435761U >> ( 32 - DEFLATE_HASH );
+            candidate = head[hash];
+            head[hash] = i;
+            if ( i - candidate <= DEFLATE_WINDOW )
+            {
+                limit = min( 258, size - i );
+                while ( length < limit && in[candidate + length] == in[i + length] )
+                    length++;
+            }
+        }
+
+        if ( length < 3 )
+        {
+            PutBits( &bits, lit_code[in[i]], lit_bits[in[i]] );
+            i++;
+            continue;
+        }
+
+        distance = i - candidate;
+        sym = length_symbol[length];
+        PutBits( &bits, lit_code[257 + sym], lit_bits[257 + sym] );
+        PutBits( &bits, length - length_base[sym], length_extra[sym] );
+        sym = DistanceSymbol( distance );
+        // Fixed distance codes are 5 bits; reverse them.
+        PutBits( &bits, ( ( sym & 1 ) << 4 ) | ( ( sym & 2 ) << 2 ) | ( sym & 4 )
+                      | ( ( sym & 8 ) >> 2 ) | ( ( sym & 16 ) >> 4 ), 5 );
+        PutBits( &bits, distance - distance_base[sym], distance_extra[sym] );
+
+        // Remember the positions inside the match as well.
+        limit = min( i + length, size - 2 );
+        for ( int k = i + 1; k < limit; k++ )
+        {
+            hash = ( ( in[k] << 16 ) | ( in[k + 1] << 8 ) | in[k + 2] ) * 2654435761U >> ( 32 - DEFLATE_HASH );
+            head[hash] = k;
+        }
+        i += length;
+    }
+    PutBits( &bits, lit_code[256], lit_bits[256] );     // End of block
+
+    if ( !last )
+    {
+        PutBits( &bits, 0, 3 );             // Not final, stored
+        AlignBits( &bits );
+        out.push_back( 0x00 );
+        out.push_back( 0x00 );
+        out.push_back( 0xFF );
+        out.push_back( 0xFF );
+    }
+    AlignBits( &bits );
+    delete [] head;
+}
+
+
+// This function returns the Paeth predictor of PNG.
+//
+static int Paeth( int a, int b, int c )
+{
+    int p = a + b - c;
+    int pa = abs( p - a ), pb = abs( p - b ), pc = abs( p - c );
+
+    if ( pa <= pb && pa <= pc )
+        return a;
+    return ( pb <= pc ) ? b : c;
+}
+
+
+// This function filters and compresses one strip of a PNG image.  Each row
+// is tried with all five PNG filters, and the one whose output bytes (taken
+// as signed numbers) have the smallest sum of absolute values is used.
+//
+static void CompressStrip( PngJob* job, PngStrip* strip )
+{
+    int width = job->rect.right - job->rect.left;
+    int bytes = 3 * width;
+    int rows = strip->bottom - strip->top;
+    BYTE* raw = new BYTE[2 * bytes];        // This row and the previous one
+    BYTE* candidates = new BYTE[5 * bytes];
+    BYTE* filtered = new BYTE[rows * ( bytes + 1 )];
+    BYTE* cur = raw;
+    BYTE* prev = raw + bytes;
+    BYTE* dst = filtered;
+    int x, y, f, best, a, b, c;
+    unsigned sum, best_sum;
+
+    // The row above the strip is needed by the filters (zero for row 0).
+    memset( prev, 0, bytes );
+    if ( strip->top > job->rect.top )
+    {
+        const DWORD* src = (const DWORD*)( job->pBits + ( strip->top - 1 ) * job->pitch ) + job->rect.left;
+        for ( x = 0; x < width; x++ )
+        {
+            prev[3 * x] = (BYTE)( src[x] >> 16 );
+            prev[3 * x + 1] = (BYTE)( src[x] >> 8 );
+            prev[3 * x + 2] = (BYTE)src[x];
+        }
+    }
+
+    for ( y = strip->top; y < strip->bottom; y++ )
+    {
+        const DWORD* src = (const DWORD*)( job->pBits + y * job->pitch ) + job->rect.left;
+        for ( x = 0; x < width; x++ )
+        {
+            cur[3 * x] = (BYTE)( src[x] >> 16 );
+            cur[3 * x + 1] = (BYTE)( src[x] >> 8 );
+            cur[3 * x + 2] = (BYTE)src[x];
+        }
+
+        for ( x = 0; x < bytes; x++ )
+        {
+            a = ( x >= 3 ) ? cur[x - 3] : 0;
+            b = prev[x];
+            c = ( x >= 3 ) ? prev[x - 3] : 0;
+            candidates[x] = cur[x];
+            candidates[bytes + x] = cur[x] - a;
+            candidates[2 * bytes + x] = cur[x] - b;
+            candidates[3 * bytes + x] = cur[x] - ( ( a + b ) >> 1 );
+            candidates[4 * bytes + x] = cur[x] - Paeth( a, b, c );
+        }
+        best = 0;
+        best_sum = 0xFFFFFFFF;
+        for ( f = 0; f < 5; f++ )
+        {
+            const signed char* p = (const signed char*)candidates + f * bytes;
+            for ( sum = 0, x = 0; x < bytes && sum < best_sum; x++ )
+                sum += abs( p[x] );
+            if ( sum < best_sum )
+            {
+                best_sum = sum;
+                best = f;
+            }
+        }
+        *dst++ = best;
+        memcpy( dst, candidates + best * bytes, bytes );
+        dst += bytes;
+
+        BYTE* t = prev;
+        prev = cur;
+        cur = t;
+    }
+
+    strip->size = rows * ( bytes + 1 );
+    strip->adler = Adler( filtered, strip->size );
+    strip->out.clear( );
+    Deflate( filtered, strip->size, strip->last, strip->out );
+
+    delete [] filtered;
+    delete [] candidates;
+    delete [] raw;
+}
+
+
+// This is the entry point of each PNG worker thread.  It keeps taking the
+// next strip until all of the strips have been handed out.
+//
+static DWORD WINAPI PngThread( LPVOID pThreadData )
+{
+    PngJob* job = (PngJob*)pThreadData;
+    LONG strip;
+
+    while ( ( strip = InterlockedIncrement( &job->next ) - 1 ) < job->count )
+        CompressStrip( job, &job->strips[strip] );
+    return 0;
+}
+
+
+// This function writes one PNG chunk.  The chunk data may be given in up to
+// three pieces, any of which may be empty.
+//
+static void PutChunk( ImageOutput* out, const char* type,
+                      const BYTE* p1, int size1, const BYTE* p2, int size2,
+                      const BYTE* p3, int size3 )
+{
+    BYTE be[4];
+    DWORD size = size1 + size2 + size3;
+    DWORD crc;
+
+    be[0] = (BYTE)( size >> 24 ); be[1] = (BYTE)( size >> 16 );
+    be[2] = (BYTE)( size >> 8 );  be[3] = (BYTE)size;
+    Put( out, be, 4 );
+    Put( out, type, 4 );
+    crc = Crc( 0, (const BYTE*)type, 4 );
+    if ( size1 > 0 ) { Put( out, p1, size1 ); crc = Crc( crc, p1, size1 ); }
+    if ( size2 > 0 ) { Put( out, p2, size2 ); crc = Crc( crc, p2, size2 ); }
+    if ( size3 > 0 ) { Put( out, p3, size3 ); crc = Crc( crc, p3, size3 ); }
+    be[0] = (BYTE)( crc >> 24 ); be[1] = (BYTE)( crc >> 16 );
+    be[2] = (BYTE)( crc >> 8 );  be[3] = (BYTE)crc;
+    Put( out, be, 4 );
+}
+
+
+// This function writes the pixels of rect (in device coordinates, right and
+// bottom excluded) as a 24-bit PNG file.  The strips are compressed in
+// batches of one per thread, and each batch is written as soon as it is
+// done, one IDAT chunk per strip.
+//
+static void WritePNG( ImageOutput* out, const BYTE* pBits, int pitch, const RECT* rect )
+{
+    static const BYTE signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    static const BYTE zlib_header[2] = { 0x78, 0x01 };     // Deflate, fastest
+    int width = rect->right - rect->left;
+    int height = rect->bottom - rect->top;
+    int strips = ( height + PNG_STRIP - 1 ) / PNG_STRIP;
+    SYSTEM_INFO info;
+    HANDLE threads[PNG_THREADS];
+    PngJob job;
+    PngStrip* batch;
+    BYTE ihdr[13], trailer[4];
+    DWORD adler = 1;
+    int batch_size, first, i, count;
+
+    InitTables( );
+    GetSystemInfo( &info );
+    batch_size = max( 1, min( (int)info.dwNumberOfProcessors, PNG_THREADS + 1 ) );
+    batch = new PngStrip[batch_size];
+
+    Put( out, signature, 8 );
+    ihdr[0] = (BYTE)( width >> 24 );  ihdr[1] = (BYTE)( width >> 16 );
+    ihdr[2] = (BYTE)( width >> 8 );   ihdr[3] = (BYTE)width;
+    ihdr[4] = (BYTE)( height >> 24 ); ihdr[5] = (BYTE)( height >> 16 );
+    ihdr[6] = (BYTE)( height >> 8 );  ihdr[7] = (BYTE)height;
+    ihdr[8] = 8;                    // Bits per sample
+    ihdr[9] = 2;                    // Color type: RGB
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    PutChunk( out, "IHDR", ihdr, 13, NULL, 0, NULL, 0 );
+
+    job.pBits = pBits;
+    job.pitch = pitch;
+    job.rect = *rect;
+    job.strips = batch;
+    for ( first = 0; first < strips && out->ok; first += batch_size )
+    {
+        job.count = min( batch_size, strips - first );
+        job.next = 0;
+        for ( i = 0; i < job.count; i++ )
+        {
+            batch[i].top = rect->top + ( first + i ) * PNG_STRIP;
+            batch[i].bottom = min( batch[i].top + PNG_STRIP, (int)rect->bottom );
+            batch[i].last = ( first + i == strips - 1 );
+        }
+
+        for ( count = 0; count < job.count - 1; count++ )
+        {
+            threads[count] = CreateThread( NULL, 0, PngThread, (LPVOID)&job, 0, NULL );
+            if ( threads[count] == NULL )
+                break;              // Do the rest of the work with fewer threads
+        }
+        PngThread( (LPVOID)&job );
+        if ( count > 0 )
+            WaitForMultipleObjects( count, threads, TRUE, INFINITE );
+        for ( i = 0; i < count; i++ )
+            CloseHandle( threads[i] );
+
+        for ( i = 0; i < job.count; i++ )
+        {
+            adler = ( first + i == 0 ) ? batch[i].adler
+                                       : AdlerCombine( adler, batch[i].adler, batch[i].size );
+            trailer[0] = (BYTE)( adler >> 24 ); trailer[1] = (BYTE)( adler >> 16 );
+            trailer[2] = (BYTE)( adler >> 8 );  trailer[3] = (BYTE)adler;
+            PutChunk( out, "IDAT", zlib_header, ( first + i == 0 ) ? 2 : 0,
+                      &batch[i].out[0], (int)batch[i].out.size( ),
+                      trailer, batch[i].last ? 4 : 0 );
+        }
+    }
+    PutChunk( out, "IEND", NULL, 0, NULL, 0, NULL, 0 );
+    delete [] batch;
+}
+
+
+// This function works out the part of a window to encode.  The rectangle
+// is given with both corners included, in viewport coordinates (like the
+// drawing functions), and is clipped to the window.  It returns false if
+// nothing is left.
+//
+static bool ImageRect( WindowData* pWndData, int left, int top, int right, int bottom, RECT* rect )
+{
+    // The sums are made in 64 bits, since the defaults are INT_MAX.
+    LONGLONG x1 = (LONGLONG)min( left, right ) + pWndData->viewportInfo.left;
+    LONGLONG y1 = (LONGLONG)min( top, bottom ) + pWndData->viewportInfo.top;
+    LONGLONG x2 = (LONGLONG)max( left, right ) + pWndData->viewportInfo.left;
+    LONGLONG y2 = (LONGLONG)max( top, bottom ) + pWndData->viewportInfo.top;
+
+    rect->left = (int)max( x1, 0 );
+    rect->top = (int)max( y1, 0 );
+    rect->right = (int)min( x2, pWndData->width - 1 ) + 1;
+    rect->bottom = (int)min( y2, pWndData->height - 1 ) + 1;
+    return rect->left < rect->right && rect->top < rect->bottom;
+}
+
+
+// This function copies the pixels of rect (from ImageRect) on a page of a
+// window into pixels, as 32-bit pixels.  The hDC mutex is held only for the
+// copy, so the page does not change halfway through and drawing does not
+// wait for the encoding.  The rectangle of the copy is put in local.
+//
+static void CopyImage( WindowData* pWndData, bool active, const RECT* rect,
+                       std::vector<DWORD>& pixels, RECT* local )
+{
+    int page;
+
+    local->left = local->top = 0;
+    local->right = rect->right - rect->left;
+    local->bottom = rect->bottom - rect->top;
+    pixels.resize( local->right * local->bottom );
+
+    WaitForSingleObject(pWndData->hDCMutex, 5000);
+    page = active ? pWndData->ActivePage : pWndData->VisualPage;
+    // Any GDI drawing that is still queued must reach the page first.
+    GdiFlush( );
+    BGI__ReadPixels( pWndData, page, rect, (BYTE*)&pixels[0], 4 * local->right );
+    ReleaseMutex(pWndData->hDCMutex);
+}
+
+
+// This function encodes the pixels of rect (in device coordinates, right and
+// bottom excluded) in the given format.
+//
+static bool Encode( ImageOutput* out, int format, const BYTE* pBits, int pitch, const RECT* rect )
+{
+    out->ok = true;
+    out->used = 0;
+    if ( format == PNG_IMAGE )
+        WritePNG( out, pBits, pitch, rect );
+    else
+        WriteBMP( out, pBits, pitch, rect );
+    Flush( out );
+    return out->ok;
+}
+
+
+// This function encodes part of a page of a window (see ImageRect and
+// CopyImage).
+//
+static bool WriteImage( ImageOutput* out, WindowData* pWndData, bool active, int format,
+                        int left, int top, int right, int bottom )
+{
+    std::vector<DWORD> pixels;
+    RECT rect, local;
+
+    if ( !ImageRect( pWndData, left, top, right, bottom, &rect ) )
+        return false;
+    CopyImage( pWndData, active, &rect, pixels, &local );
+    return Encode( out, format, (const BYTE*)&pixels[0], 4 * local.right, &local );
+}
+
+
+// This function writes pixels to an image file.  The format is chosen by the
+// extension of the name: PNG for ".png", otherwise BMP.  It returns false if
+// the file cannot be written, in which case no file is left behind.
+//
+static bool EncodeFile( const char* filename, const BYTE* pBits, int pitch, const RECT* rect )
+{
+    ImageOutput* out = new ImageOutput;
+    size_t length = strlen( filename );
+    int format = BMP_IMAGE;
+    bool ok;
+
+    if ( length >= 4 && lstrcmpi( filename + length - 4, ".png" ) == 0 )
+        format = PNG_IMAGE;
+    out->write = NULL;
+    out->data = NULL;
+    out->hFile = CreateFile( filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if ( out->hFile == INVALID_HANDLE_VALUE )
+    {
+        delete out;
+        return false;
+    }
+    ok = Encode( out, format, pBits, pitch, rect );
+    CloseHandle( out->hFile );
+    if ( !ok )
+        DeleteFile( filename );
+    delete out;
+    return ok;
+}
+
+
+// This function writes part of a page to an image file (see ImageRect,
+// CopyImage and EncodeFile).  The file is written from the copy, without
+// holding the hDC mutex.  (used by writeimagefile in drawing.cpp)
+//
+bool BGI__WriteImageFile( WindowData* pWndData, const char* filename, bool active,
+                          int left, int top, int right, int bottom )
+{
+    std::vector<DWORD> pixels;
+    RECT rect, local;
+
+    if ( !ImageRect( pWndData, left, top, right, bottom, &rect ) )
+        return false;
+    CopyImage( pWndData, active, &rect, pixels, &local );
+    return EncodeFile( filename, (const BYTE*)&pixels[0], 4 * local.right, &local );
+}
+
+
+// This function writes a snapshot to its file, tells the user how it went
+// and frees the copy.
+//
+static void WriteSnapshot( Snapshot* shot )
+{
+    RECT rect = { 0, 0, shot->width, shot->height };
+    bool ok;
+
+    ok = EncodeFile( shot->filename.c_str( ), shot->pBits, 4 * shot->width, &rect );
+    if ( shot->callback != NULL )
+        shot->callback( shot->filename.c_str( ), ok, shot->data );
+    delete [] shot->pBits;
+    delete shot;
+}
+
+
+// This is the entry point of the snapshot writer thread.  It writes the
+// queued snapshots in order, for as long as the program runs.
+//
+static DWORD WINAPI SnapshotThread( LPVOID pThreadData )
+{
+    for ( ;; )
+    {
+        WaitForSingleObject( snapshot_queued, INFINITE );
+        WriteSnapshot( snapshots[snapshot_head % SNAPSHOT_QUEUE] );
+        InterlockedIncrement( &snapshot_head );
+        ReleaseSemaphore( snapshot_free, 1, NULL );
+    }
+    return 0;
+}
+
+
+// This function returns the mutex for adding snapshots, making it (and the
+// rest of the queue) the first time.  The writer thread is started later,
+// by snapshotasync.
+//
+static HANDLE SnapshotLock( )
+{
+    HANDLE hLock;
+
+    if ( snapshot_lock != NULL )
+        return snapshot_lock;
+    hLock = CreateMutex( NULL, FALSE, NULL );
+    if ( InterlockedCompareExchangePointer( (PVOID volatile*)&snapshot_lock, hLock, NULL ) != NULL )
+        CloseHandle( hLock );       // Another thread made it first
+    return snapshot_lock;
+}
+
+
+/*****************************************************************************
+*
+*   The actual API calls are implemented below
+*
+*****************************************************************************/
+
+// This function encodes part of a page (given as for writeimagefile) as a BMP
+// or PNG image (format is BMP_IMAGE or PNG_IMAGE).  Instead of writing a
+// file, it passes the encoded bytes to write( bytes, count, data ), one
+// buffer at a time.  If write returns false, encoding stops.  If the image
+// could not be fully delivered, the error code is set to grError.
+//
+__declspec(dllexport) void writeimagestream( bool write( const void* bytes, int count, void* data ),
+                                             void* data, int format, int left, int top, int right,
+                                             int bottom, bool active, HWND hwnd )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( hwnd );
+    ImageOutput* out;
+
+    if ( write == NULL )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    out = new ImageOutput;
+    out->hFile = INVALID_HANDLE_VALUE;
+    out->write = write;
+    out->data = data;
+    if ( !WriteImage( out, pWndData, active, format, left, top, right, bottom ) )
+        pWndData->error_code = grError;
+    delete out;
+}
+
+
+// This function writes part of a page (given as for writeimagefile) to an
+// image file without making the caller wait for the encoding or the disk.
+// The pixels are copied while the page is locked, and a writer thread
+// encodes the copy and writes the file.  The files are written one at a
+// time, in the order of the calls.  If SNAPSHOT_QUEUE copies are already
+// waiting, this waits for the oldest to be written first.  When a file is
+// done, the writer calls callback( filename, ok, data ), with ok false if
+// the file could not be written.  The callback must not call snapshotasync,
+// waitsnapshots or closegraph.
+//
+__declspec(dllexport) void snapshotasync( const char* filename, int left, int top, int right, int bottom,
+                                          void callback( const char* filename, bool ok, void* data ),
+                                          void* data, bool active, HWND hwnd )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( hwnd );
+    HANDLE hLock = SnapshotLock( );
+    Snapshot* shot;
+    RECT rect;
+
+    if ( filename == NULL || !ImageRect( pWndData, left, top, right, bottom, &rect ) )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+
+    shot = new Snapshot;
+    shot->filename = filename;
+    shot->width = rect.right - rect.left;
+    shot->height = rect.bottom - rect.top;
+    shot->callback = callback;
+    shot->data = data;
+
+    WaitForSingleObject( hLock, INFINITE );
+    if ( snapshot_writer == NULL )
+    {
+        snapshot_free = CreateSemaphore( NULL, SNAPSHOT_QUEUE, SNAPSHOT_QUEUE, NULL );
+        snapshot_queued = CreateSemaphore( NULL, 0, SNAPSHOT_QUEUE, NULL );
+        snapshot_writer = CreateThread( NULL, 0, SnapshotThread, NULL, 0, NULL );
+        if ( snapshot_writer == NULL )
+        {
+            CloseHandle( snapshot_free );
+            CloseHandle( snapshot_queued );
+        }
+    }
+
+    // The slot is taken before the copy is made, so no more than
+    // SNAPSHOT_QUEUE copies are ever held.
+    if ( snapshot_writer != NULL )
+        WaitForSingleObject( snapshot_free, INFINITE );
+    shot->pBits = new BYTE[4 * shot->width * shot->height];
+    WaitForSingleObject(pWndData->hDCMutex, 5000);
+    GdiFlush( );
+    BGI__ReadPixels( pWndData, active ? pWndData->ActivePage : pWndData->VisualPage,
+                     &rect, shot->pBits, 4 * shot->width );
+    ReleaseMutex(pWndData->hDCMutex);
+
+    if ( snapshot_writer == NULL )
+        WriteSnapshot( shot );      // Write it now instead
+    else
+    {
+        snapshots[snapshot_tail % SNAPSHOT_QUEUE] = shot;
+        InterlockedIncrement( &snapshot_tail );
+        ReleaseSemaphore( snapshot_queued, 1, NULL );
+    }
+    ReleaseMutex( hLock );
+}
+
+
+// This function waits until every file started by snapshotasync has been
+// written and its callback has returned.  It is called by closegraph, and
+// a program that ends without closegraph should call it first.
+//
+__declspec(dllexport) void waitsnapshots( )
+{
+    HANDLE hLock = SnapshotLock( );
+    int i;
+
+    // Holding the lock keeps new snapshots out, and holding every slot
+    // means that the writer has finished with all of them.
+    WaitForSingleObject( hLock, INFINITE );
+    if ( snapshot_writer != NULL )
+    {
+        for ( i = 0; i < SNAPSHOT_QUEUE; i++ )
+            WaitForSingleObject( snapshot_free, INFINITE );
+        ReleaseSemaphore( snapshot_free, SNAPSHOT_QUEUE, NULL );
+    }
+    ReleaseMutex( hLock );
+}
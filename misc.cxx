@@ -103,19 +103,47 @@ LinePattern CreateUserStyle( );
 *****************************************************************************/
 
 // This function converts a given color (specified by the user) into a format
-// native to windows.
+// native to windows.  BGI colors go through the palette of the window.  On
+// indexed pages, colors 0 to 255 are palette entries, which GDI stores as
+// they are when given as a DIBINDEX.
 //
 __declspec(dllexport) int converttorgb( int color )
 {
-    // Convert from BGI color to RGB color
-    if ( IS_BGI_COLOR( color ) )
-        color = BGI__Colors[color];
-    else
-        color &= 0x0FFFFFF;
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+
+    if ( pWndData->page_format == INDEXED8_PAGES && color >= 0 && color < 256 )
+        return DIBINDEX( color );
+    return BGI__ColorToRGB( pWndData, color );
+}
+
+// This function gives the DC of a page the current viewport, if it does not
+// have it yet: the clipping rectangle, the viewport origin, and a current
+// position at the new origin (as setviewport promises).  The DC mutex must
+// be held.
+// (used by BGI__GetWinbgiDC in drawing.cpp and MakeSnapshot in record.cpp)
+//
+void BGI__SyncViewport( WindowData* pWndData, int page )
+{
+    viewporttype* vp = &pWndData->viewportInfo;
+    HDC hDC = pWndData->hDC[page];
+
+    if ( pWndData->page_viewport[page] == pWndData->viewport_version )
+        return;
+    pWndData->page_viewport[page] = pWndData->viewport_version;
+
+    // Set the viewport origin to be the upper left corner, and clip to the
+    // viewport (given in logical coordinates, so after the origin) if
+    // requested.
+    SetViewportOrgEx( hDC, vp->left, vp->top, NULL );
+    SelectClipRgn( hDC, NULL );
+    if ( vp->clip != 0 )
+        IntersectClipRect( hDC, 0, 0, vp->right - vp->left, vp->bottom - vp->top );
 
-    return color;
+    // Move to the new origin
+    MoveToEx( hDC, 0, 0, NULL );
 }
 
+
 #include <iostream>
 // This function creates a new pen in the current drawing color and selects it
 // into all the memory DC's.
@@ -156,6 +184,15 @@ void CreateNewPen( )
         DeletePen( (HPEN)SelectObject( pWndData->hDC[i], hPen ) );
     }
     ReleaseMutex(pWndData->hDCMutex);
+
+    // Square ends cover the last point of a line, which the stock pen of
+    // graphdefaults leaves out.  Wide lines are drawn with the same dashes
+    // as the pen.
+    pWndData->pipeline.last_point = true;
+    pWndData->pipeline.dashes = style.width;
+    for ( int i = 0; i < style.width; i++ )
+        pWndData->pipeline.dash[i] = style.pattern[i];
+    BGI__UpdatePipeline( pWndData );
 }
 
 
@@ -385,11 +422,17 @@ __declspec(dllexport) int getwindowwidth( )
 // used with any bgi functions.  Numbers 0 to WHITE are the
 // original bgi colors. Other colors are 0x03rrggbb.
 // This used to be a macro.
+// The colors of the current window's palette are found with its perfect
+// hash; before there is a window, the default colors are searched.
 __declspec(dllexport) int COLOR(int r, int g, int b)
 {
     COLORREF color = RGB(r,g,b);
     int i;
 
+    if ( BGI__CurrentWindow >= 0 && BGI__CurrentWindow < BGI__WindowCount
+         && BGI__WindowTable[BGI__CurrentWindow] != NULL )
+        return BGI__RGBToColor( BGI__GetWindowDataPtr( ), color );
+
     for (i = 0; i <= WHITE; i++)
     {
 	if ( color == BGI__Colors[i] )
@@ -399,39 +442,47 @@ __declspec(dllexport) int COLOR(int r, int g, int b)
     return ( 0x03000000 | color );
 }
 
+// This function returns the color that getpixel would report after color
+// is drawn, without drawing it: the pixel it is stored as in the format of
+// the pages, read back as getpixel reads it.
 __declspec(dllexport) int getdisplaycolor( int color )
 {
-    int save = getpixel( 0, 0 );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
     int answer;
-    
-    putpixel( 0, 0, color );
-    answer = getpixel( 0, 0 );
-    putpixel( 0, 0, save );
+
+    WaitForSingleObject( pWndData->hDCMutex, INFINITE );
+    answer = BGI__PixelToColor( pWndData, BGI__ColorToPixel( pWndData, color ) );
+    ReleaseMutex( pWndData->hDCMutex );
     return answer;
 }
 
+// The pixel is read straight from the active page, and a color of the
+// palette is found with its perfect hash rather than by a search.
 __declspec(dllexport) int getpixel( int x, int y )
 {
-    HDC hDC = BGI__GetWinbgiDC( );
-    COLORREF color = GetPixel( hDC, x, y );
-    BGI__ReleaseWinbgiDC( );
-    int i;
-
-    if ( color == CLR_INVALID )
-        return CLR_INVALID;
-
-    // If the color is a BGI color, return the index rather than the RGB value.
-    for ( i = 0; i <= WHITE; i++ )
+    BGI__Counter counter( BGI__CALL_GETPIXEL );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    viewporttype* viewport = &pWndData->viewportInfo;
+    DWORD pixel;
+
+    BGI__GetWinbgiDC( );        // Holds the DC mutex
+    // Points outside the window, or outside a clipping viewport, have no
+    // color, as with GetPixel.  The right and bottom edges of the viewport
+    // are outside it, since drawing leaves them out too.
+    x += viewport->left;
+    y += viewport->top;
+    if ( x < 0 || y < 0 || x >= pWndData->width || y >= pWndData->height
+         || ( viewport->clip && ( x < viewport->left || y < viewport->top
+                                  || x >= viewport->right || y >= viewport->bottom ) ) )
     {
-        if ( color == BGI__Colors[i] )
-            return i;
+        BGI__ReleaseWinbgiDC( );
+        return CLR_INVALID;
     }
 
-    // If we got here, the color didn't match a BGI color.  Thus, convert to 
-    // our RGB format.
-    color |= 0x03000000;
-
-    return color;
+    GdiFlush( );
+    pixel = BGI__GetPagePixel( pWndData, pWndData->ActivePage, x, y );
+    BGI__ReleaseWinbgiDC( );
+    return BGI__PixelToColor( pWndData, pixel );
 }
 
 
@@ -473,6 +524,7 @@ __declspec(dllexport) int gety( )
 //
 __declspec(dllexport) void moverel( int dx, int dy )
 {
+    BGI__Recorder record( BGI__OP_MOVEREL, dx, dy );
     HDC hDC = BGI__GetWinbgiDC( );
     POINT cp;
 
@@ -488,6 +540,7 @@ __declspec(dllexport) void moverel( int dx, int dy )
 //
 __declspec(dllexport) void moveto( int x, int y )
 {
+    BGI__Recorder record( BGI__OP_MOVETO, x, y );
     HDC hDC = BGI__GetWinbgiDC( );
 
     MoveToEx( hDC, x, y, NULL );
@@ -497,6 +550,7 @@ __declspec(dllexport) void moveto( int x, int y )
 
 __declspec(dllexport) void setbkcolor( int color )
 {
+    BGI__Recorder record( BGI__OP_SETBKCOLOR, color );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
     pWndData->bgColor = color;
@@ -508,11 +562,13 @@ __declspec(dllexport) void setbkcolor( int color )
     for ( int i = 0; i < MAX_PAGES; i++ )
         SetBkColor( pWndData->hDC[i], color );
     ReleaseMutex(pWndData->hDCMutex);
+    BGI__UpdatePipeline( pWndData );
 }
 
 
 __declspec(dllexport) void setcolor( int color )
 {
+    BGI__Recorder record( BGI__OP_SETCOLOR, color );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
     // Update the color in our structure
@@ -534,6 +590,7 @@ __declspec(dllexport) void setcolor( int color )
 
 __declspec(dllexport) void setlinestyle( int linestyle, unsigned upattern, int thickness )
 {
+    BGI__Recorder record( BGI__OP_SETLINESTYLE, linestyle, upattern, thickness );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     pWndData->lineInfo.linestyle = linestyle;
     pWndData->lineInfo.upattern = upattern;
@@ -544,10 +601,26 @@ __declspec(dllexport) void setlinestyle( int linestyle, unsigned upattern, int t
 }
 
 
+// This function makes the 8x8 monochrome bitmap of a fill pattern.  Each
+// row of a bitmap takes a whole WORD, so the rows are moved into WORDs
+// first; given the DWORDs themselves, GDI would take every other row from
+// the padding.
+//
+static HBITMAP CreatePatternBitmap( const unsigned int* pattern )
+{
+    WORD rows[8];
+
+    for ( int i = 0; i < 8; i++ )
+        rows[i] = (WORD)pattern[i];
+    return CreateBitmap( 8, 8, 1, 1, rows );
+}
+
+
 // The user calls this function to create a brush with a pattern they create
 //
 __declspec(dllexport) void setfillpattern( char *upattern, int color )
 {
+    BGI__Recorder record( BGI__OP_SETFILLPATTERN, color, 0, upattern, 8 );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     HBITMAP hBitmap;
     HBRUSH hBrush;
@@ -566,7 +639,7 @@ __declspec(dllexport) void setfillpattern( char *upattern, int color )
     pWndData->fillInfo.color = color;
 
     // Create the bitmap
-    hBitmap = CreateBitmap( 8, 8, 1, 1, pattern );
+    hBitmap = CreatePatternBitmap( pattern );
     // Create a brush for each DC
     WaitForSingleObject(pWndData->hDCMutex, 5000);
     for ( int i = 0; i < MAX_PAGES; i++ )
@@ -580,18 +653,18 @@ __declspec(dllexport) void setfillpattern( char *upattern, int color )
     // hasn't caused any problems.  The material I've found just says the
     // bitmap must be deleted in addition to the brush when finished.
     DeleteBitmap( hBitmap );
+    BGI__UpdatePipeline( pWndData );
 
 }
 
 
-// If the USER_FILL pattern is passed, nothing is changed.
+// This function creates the brush for one of the predefined fill patterns.
+// It returns NULL if the pattern is not one of them.
 //
-__declspec(dllexport) void setfillstyle( int pattern, int color )
+static HBRUSH CreateFillBrush( int pattern, int color, int bkcolor )
 {
-    WindowData* pWndData = BGI__GetWindowDataPtr( );
-    HDC hDC = BGI__GetWinbgiDC( );
     HBRUSH hBrush;
-    // Unsigned char creates a truncation for some reason.
+    // CreatePatternBitmap lays these out in the WORD rows of a bitmap.
     unsigned int Slash[8]      = { ~0xE0U, ~0xC1U, ~0x83U, ~0x07U, ~0x0EU, ~0x1CU, ~0x38U, ~0x70U };
     unsigned int BkSlash[8]    = { ~0x07U, ~0x83U, ~0xC1U, ~0xE0U, ~0x70U, ~0x38U, ~0x1CU, ~0x0EU };
     unsigned int Interleave[8] = { ~0xCCU, ~0x33U, ~0xCCU, ~0x33U, ~0xCCU, ~0x33U, ~0xCCU, ~0x33U };
@@ -599,13 +672,10 @@ __declspec(dllexport) void setfillstyle( int pattern, int color )
     unsigned int CloseDot[8]   = { ~0x88U, ~0x00U, ~0x22U, ~0x00U, ~0x88U, ~0x00U, ~0x22U, ~0x00U };
     HBITMAP hBitmap;
 
-    // Convert from BGI color to RGB color
-    color = converttorgb( color );
-
     switch ( pattern )
     {
     case EMPTY_FILL:
-        hBrush = CreateSolidBrush( converttorgb( pWndData->bgColor ));
+        hBrush = CreateSolidBrush( bkcolor );
         break;
     case SOLID_FILL:
         hBrush = CreateSolidBrush( color );
@@ -622,12 +692,12 @@ __declspec(dllexport) void setfillstyle( int pattern, int color )
         // TODO: We may have to set the text color in every fill function
         // and then reset the text color to the user-specified text color
         // after the fill-draw routines are complete.
-        hBitmap = CreateBitmap( 8, 8, 1, 1, Slash );
+        hBitmap = CreatePatternBitmap( Slash );
         hBrush = CreatePatternBrush( hBitmap );
         DeleteBitmap( hBitmap );
         break;
     case BKSLASH_FILL:
-        hBitmap = CreateBitmap( 8, 8, 1, 1, BkSlash );
+        hBitmap = CreatePatternBitmap( BkSlash );
         hBrush = CreatePatternBrush( hBitmap );
         DeleteBitmap( hBitmap );
         break;
@@ -641,42 +711,72 @@ __declspec(dllexport) void setfillstyle( int pattern, int color )
         hBrush = CreateHatchBrush( HS_DIAGCROSS, color );
         break;
     case INTERLEAVE_FILL:
-        hBitmap = CreateBitmap( 8, 8, 1, 1, Interleave );
+        hBitmap = CreatePatternBitmap( Interleave );
         hBrush = CreatePatternBrush( hBitmap );
         DeleteBitmap( hBitmap );
         break;
     case WIDE_DOT_FILL:
-        hBitmap = CreateBitmap( 8, 8, 1, 1, WideDot );
+        hBitmap = CreatePatternBitmap( WideDot );
         hBrush = CreatePatternBrush( hBitmap );
         DeleteBitmap( hBitmap );
         break;
     case CLOSE_DOT_FILL:
-        hBitmap = CreateBitmap( 8, 8, 1, 1, CloseDot );
+        hBitmap = CreatePatternBitmap( CloseDot );
         hBrush = CreatePatternBrush( hBitmap );
         DeleteBitmap( hBitmap );
         break;
-    case USER_FILL:
-        return;
-        break;
     default:
+        hBrush = NULL;
+    }
+    return hBrush;
+}
+
+
+// If the USER_FILL pattern is passed, nothing is changed.  The brush is
+// created in every DC, so that every page fills with the same settings (and
+// a display list can tell whether a page already has them).
+//
+__declspec(dllexport) void setfillstyle( int pattern, int color )
+{
+    BGI__Recorder record( BGI__OP_SETFILLSTYLE, pattern, color );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    HBRUSH hBrush;
+
+    if ( pattern == USER_FILL )
+        return;
+    if ( pattern < EMPTY_FILL || pattern > CLOSE_DOT_FILL )
+    {
         pWndData->error_code = grError;
         return;
     }
 
-    // TODO: Modify this so the brush is created in every DC
+    // Keep the color the user gave, as with the drawing color.  It is
+    // converted when the brush is created.
     pWndData->fillInfo.pattern = pattern;
     pWndData->fillInfo.color = color;
 
-    // Select the new brush into the device context and delete the old one.
-    DeleteBrush( (HBRUSH)SelectBrush( hDC, hBrush ) );
-    BGI__ReleaseWinbgiDC( );
+    WaitForSingleObject(pWndData->hDCMutex, 5000);
+    for ( int i = 0; i < MAX_PAGES; i++ )
+    {
+        hBrush = CreateFillBrush( pattern, converttorgb( color ), converttorgb( pWndData->bgColor ) );
+        // Select the new brush into the device context and delete the old one.
+        DeleteBrush( (HBRUSH)SelectBrush( pWndData->hDC[i], hBrush ) );
+    }
+    ReleaseMutex(pWndData->hDCMutex);
+    pWndData->pipeline.empty_color = pWndData->bgColor;
+    BGI__UpdatePipeline( pWndData );
 }
 
 
+// The viewport is only stored here.  The software drawing paths translate
+// and clip in library code, and a page DC is given the viewport (and its
+// current position moved to the new origin) by BGI__SyncViewport the next
+// time it is used, so changing viewports many times between drawing calls
+// costs no GDI calls at all.
+//
 __declspec(dllexport) void setviewport( int left, int top, int right, int bottom, int clip )
 {
     WindowData* pWndData = BGI__GetWindowDataPtr( );
-    HRGN hRGN = NULL;
     
     // Store the viewport information in the structure
     pWndData->viewportInfo.left = left;
@@ -684,39 +784,28 @@ __declspec(dllexport) void setviewport( int left, int top, int right, int bottom
     pWndData->viewportInfo.right = right;
     pWndData->viewportInfo.bottom = bottom;
     pWndData->viewportInfo.clip = clip;
-    
-    // If the drwaing should be clipped at the viewport boundary, create a
-    // clipping region
-    if ( clip != 0 )
-        hRGN = CreateRectRgn( left, top, right, bottom );
-
-    WaitForSingleObject(pWndData->hDCMutex, 5000);
-    for ( int i = 0; i < MAX_PAGES; i++ )
-    {
-        SelectClipRgn( pWndData->hDC[i], hRGN );
-
-        // Set the viewport origin to be the upper left corner
-        SetViewportOrgEx( pWndData->hDC[i], left, top, NULL );
+    pWndData->viewport_version++;
 
-        // Move to the new origin
-        MoveToEx( pWndData->hDC[i], 0, 0, NULL );
-    }
-    ReleaseMutex(pWndData->hDCMutex);
-    // A copy of the region is used for the clipping region, so it is
-    // safe to delete the region  (p. 369 Win32 API book)
-    DeleteRgn( hRGN );
+    BGI__UpdatePipeline( pWndData );
 }
 
 
+// The write mode is set in every DC, like the pen that it applies to.
+//
 void setwritemode( int mode )
 {
-    HDC hDC = BGI__GetWinbgiDC( );
+    BGI__Recorder record( BGI__OP_SETWRITEMODE, mode );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
 
-    if ( mode == COPY_PUT )
-        SetROP2( hDC, R2_COPYPEN );
-    if ( mode == XOR_PUT )
-        SetROP2( hDC, R2_XORPEN );
-    BGI__ReleaseWinbgiDC( );
+    if ( mode != COPY_PUT && mode != XOR_PUT )
+        return;
+    pWndData->writemode = mode;
+
+    WaitForSingleObject(pWndData->hDCMutex, 5000);
+    for ( int i = 0; i < MAX_PAGES; i++ )
+        SetROP2( pWndData->hDC[i], ( mode == XOR_PUT ) ? R2_XORPEN : R2_COPYPEN );
+    ReleaseMutex(pWndData->hDCMutex);
+    BGI__UpdatePipeline( pWndData );
 }
 
 
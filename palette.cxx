@@ -12,6 +12,8 @@
 
 #include <windows.h>        // Provides Win32 API
 #include <windowsx.h>       // Provides GDI helper macros
+#include <limits.h>         // Provides INT_MAX
+#include <string.h>         // Provides memcpy and memset
 #include "winbgi.h"         // API routines
 #include "winbgitypes.h"    // Internal structure data
 
@@ -21,6 +23,423 @@
 *
 *****************************************************************************/
 
+// This function fills in the default palette: the 16 BGI colors, then a
+// 6x6x6 color cube and a ramp of 24 grays, so that an RGB color drawn on an
+// indexed page always has a close entry.
+//
+static void DefaultPalette( COLORREF* palette )
+{
+    int i;
+
+    for ( i = 0; i <= MAXCOLORS; i++ )
+        palette[i] = BGI__Colors[i];
+    for ( i = 0; i < 216; i++ )
+        palette[16 + i] = RGB( 51 * ( i / 36 ), 51 * ( i / 6 % 6 ), 51 * ( i % 6 ) );
+    for ( i = 0; i < 24; i++ )
+        palette[232 + i] = RGB( 8 + 10 * i, 8 + 10 * i, 8 + 10 * i );
+}
+
+
+// This function converts a palette to the color table of a DIB.
+//
+static void PaletteToQuads( const COLORREF* palette, RGBQUAD* quads )
+{
+    for ( int i = 0; i < 256; i++ )
+    {
+        quads[i].rgbRed = GetRValue( palette[i] );
+        quads[i].rgbGreen = GetGValue( palette[i] );
+        quads[i].rgbBlue = GetBValue( palette[i] );
+        quads[i].rgbReserved = 0;
+    }
+}
+
+
+// This function returns the table of the nearest palette entry for each
+// color with 5 bits of red, green and blue, which is made the first time it
+// is needed after the palette changes.  The DC mutex must be held.
+//
+static const BYTE* Nearest( WindowData* pWndData )
+{
+    int r, g, b, i, best, distance, d;
+
+    if ( pWndData->nearest != NULL )
+        return pWndData->nearest;
+
+    pWndData->nearest = new BYTE[32768];
+    for ( r = 0; r < 32; r++ )
+        for ( g = 0; g < 32; g++ )
+            for ( b = 0; b < 32; b++ )
+            {
+                best = 0;
+                distance = INT_MAX;
+                for ( i = 0; i < 256 && distance > 0; i++ )
+                {
+                    d = ( GetRValue( pWndData->palette[i] ) - ( r * 8 + 4 ) ) * ( GetRValue( pWndData->palette[i] ) - ( r * 8 + 4 ) )
+                      + ( GetGValue( pWndData->palette[i] ) - ( g * 8 + 4 ) ) * ( GetGValue( pWndData->palette[i] ) - ( g * 8 + 4 ) )
+                      + ( GetBValue( pWndData->palette[i] ) - ( b * 8 + 4 ) ) * ( GetBValue( pWndData->palette[i] ) - ( b * 8 + 4 ) );
+                    if ( d < distance )
+                    {
+                        distance = d;
+                        best = i;
+                    }
+                }
+                pWndData->nearest[( r << 10 ) | ( g << 5 ) | b] = (BYTE)best;
+            }
+    return pWndData->nearest;
+}
+
+
+// This function returns the palette entry nearest to a 0x00RRGGBB pixel.
+//
+static BYTE NearestEntry( const BYTE* nearest, DWORD pixel )
+{
+    return nearest[( ( pixel >> 9 ) & 0x7C00 ) | ( ( pixel >> 6 ) & 0x03E0 ) | ( ( pixel >> 3 ) & 0x001F )];
+}
+
+
+// This function makes a perfect hash of the 16 BGI colors of a palette, from
+// their RGB colors or their pixels.  Odd multipliers are tried until one
+// sends each key (after the first of any repeats) to a slot of its own,
+// which takes a few tries on average.
+//
+static void BuildLookup( BGI__ColorLookup* lookup, const DWORD* keys )
+{
+    DWORD multiplier = 0x9E3779B1;
+    int i, j, slot;
+
+    for ( ;; multiplier = multiplier * 0x2545F491 + 0x6C8E9CF6 | 1 )
+    {
+        memset( lookup->color, -1, sizeof( lookup->color ) );
+        for ( i = 0; i <= MAXCOLORS; i++ )
+        {
+            for ( j = 0; j < i && keys[j] != keys[i]; j++ )
+                ;
+            if ( j < i )
+                continue;       // A repeat finds the first color instead
+            slot = (int)( ( keys[i] * multiplier ) >> 26 );
+            if ( lookup->color[slot] >= 0 )
+                break;
+            lookup->key[slot] = keys[i];
+            lookup->color[slot] = (signed char)i;
+        }
+        if ( i > MAXCOLORS )
+            break;
+    }
+    lookup->multiplier = multiplier;
+}
+
+
+// This function returns the BGI color whose key is given, or -1 if none.
+//
+static inline int FindColor( const BGI__ColorLookup* lookup, DWORD key )
+{
+    int slot = (int)( ( key * lookup->multiplier ) >> 26 );
+
+    if ( lookup->color[slot] >= 0 && lookup->key[slot] == key )
+        return lookup->color[slot];
+    return -1;
+}
+
+
+// These functions copy rows between a page of one of the formats in
+// BGI__Format and a block of 0x00RRGGBB pixels.
+//
+template <int FORMAT>
+static void ReadRows( const WindowData* pWndData, int page, const RECT* rect, BYTE* out, int pitch )
+{
+    typedef typename BGI__Format<FORMAT>::Pixel Pixel;
+
+    for ( int y = rect->top; y < rect->bottom; y++ )
+    {
+        const Pixel* src = (const Pixel*)( pWndData->pBits[page] + y * pWndData->pitch ) + rect->left;
+        DWORD* dst = (DWORD*)( out + ( y - rect->top ) * pitch );
+        for ( int x = rect->left; x < rect->right; x++ )
+            *dst++ = BGI__Format<FORMAT>::ToRGB( *src++ );
+    }
+}
+
+template <int FORMAT>
+static void WriteRows( WindowData* pWndData, int page, const RECT* rect, const BYTE* in, int pitch )
+{
+    typedef typename BGI__Format<FORMAT>::Pixel Pixel;
+
+    for ( int y = rect->top; y < rect->bottom; y++ )
+    {
+        const DWORD* src = (const DWORD*)( in + ( y - rect->top ) * pitch );
+        Pixel* dst = (Pixel*)( pWndData->pBits[page] + y * pWndData->pitch ) + rect->left;
+        for ( int x = rect->left; x < rect->right; x++ )
+            *dst++ = BGI__Format<FORMAT>::FromRGB( *src++ );
+    }
+}
+
+
+// This function makes a change to the palette of a window take effect.
+// Indexed pages get the new color table, which changes the color of
+// everything already drawn with those entries, and the window is repainted.
+// On other pages only what is drawn from now on changes, so the pen, brush
+// and text colors are made again (without recording them in a display
+// list).  When the palette is reset by graphdefaults, the drawing state is
+// about to be reset anyway, so tools is false.
+//
+static void ApplyPalette( WindowData* pWndData, bool tools )
+{
+    RGBQUAD quads[256];
+    DWORD pixels[MAXCOLORS + 1];
+    int i;
+
+    WaitForSingleObject( pWndData->hDCMutex, INFINITE );
+    pWndData->palette_version++;
+    delete [] pWndData->nearest;
+    pWndData->nearest = NULL;
+    for ( i = 0; i <= MAXCOLORS; i++ )
+        pixels[i] = BGI__ColorToPixel( pWndData, i );
+    BuildLookup( &pWndData->lookup, (const DWORD*)pWndData->palette );
+    BuildLookup( &pWndData->pixel_lookup, pixels );
+    if ( pWndData->page_format == INDEXED8_PAGES )
+    {
+        PaletteToQuads( pWndData->palette, quads );
+        for ( i = 0; i < MAX_PAGES; i++ )
+            SetDIBColorTable( pWndData->hDC[i], 0, 256, quads );
+    }
+    ReleaseMutex( pWndData->hDCMutex );
+
+    if ( pWndData->page_format == INDEXED8_PAGES )
+        InvalidateRect( pWndData->hWnd, NULL, FALSE );
+    else if ( tools )
+    {
+        pWndData->record_mute++;
+        setcolor( pWndData->drawColor );
+        setbkcolor( pWndData->bgColor );
+        if ( pWndData->fillInfo.pattern == USER_FILL )
+            setfillpattern( pWndData->uPattern, pWndData->fillInfo.color );
+        else
+            setfillstyle( pWndData->fillInfo.pattern, pWndData->fillInfo.color );
+        pWndData->record_mute--;
+    }
+    BGI__UpdatePipeline( pWndData );
+}
+
+
+// This function fills in the format of the pages of a window, with the
+// default palette as the color table of indexed pages, a ramp of grays for
+// gray pages and the masks of the parts of 16-bit pixels, and sets the
+// pitch of the pages to match.
+// (used by BGI__ThreadInitWindow in winthread.cpp)
+//
+void BGI__PageBitmapInfo( WindowData* pWndData, BGI__PageInfo* info )
+{
+    ZeroMemory( info, sizeof( BGI__PageInfo ) );
+    info->bmiHeader.biSize = sizeof( BITMAPINFOHEADER );
+    info->bmiHeader.biWidth = pWndData->width;
+    info->bmiHeader.biHeight = -pWndData->height;   // Negative for top-down rows
+    info->bmiHeader.biPlanes = 1;
+    info->bmiHeader.biCompression = BI_RGB;
+    if ( pWndData->page_format == INDEXED8_PAGES )
+    {
+        info->bmiHeader.biBitCount = 8;
+        info->bmiHeader.biClrUsed = 256;
+        DefaultPalette( pWndData->palette );
+        PaletteToQuads( pWndData->palette, info->bmiColors );
+    }
+    else if ( pWndData->page_format == GRAY8_PAGES )
+    {
+        info->bmiHeader.biBitCount = 8;
+        info->bmiHeader.biClrUsed = 256;
+        for ( int i = 0; i < 256; i++ )
+            info->bmiColors[i].rgbRed = info->bmiColors[i].rgbGreen = info->bmiColors[i].rgbBlue = (BYTE)i;
+    }
+    else if ( pWndData->page_format == RGB565_PAGES )
+    {
+        info->bmiHeader.biBitCount = 16;
+        info->bmiHeader.biCompression = BI_BITFIELDS;
+        ( (DWORD*)info->bmiColors )[0] = 0xF800;
+        ( (DWORD*)info->bmiColors )[1] = 0x07E0;
+        ( (DWORD*)info->bmiColors )[2] = 0x001F;
+    }
+    else
+        info->bmiHeader.biBitCount = 32;
+
+    // Each row of a DIB takes a whole number of DWORDs.
+    pWndData->pitch = ( pWndData->width * info->bmiHeader.biBitCount + 31 ) / 32 * 4;
+}
+
+
+// This function restores the default palette of a window.
+// (used by graphdefaults in winbgi.cpp)
+//
+void BGI__ResetPalette( WindowData* pWndData )
+{
+    pWndData->bgi_palette = *getdefaultpalette( );
+    DefaultPalette( pWndData->palette );
+    ApplyPalette( pWndData, false );
+}
+
+
+// This function converts a BGI color, a palette entry of an indexed page,
+// or an RGB color from COLOR to the COLORREF that the window shows for it.
+//
+COLORREF BGI__ColorToRGB( WindowData* pWndData, int color )
+{
+    if ( IS_BGI_COLOR( color )
+         || ( pWndData->page_format == INDEXED8_PAGES && color >= 0 && color < 256 ) )
+        return pWndData->palette[color];
+    return color & 0x0FFFFFF;
+}
+
+
+// This function converts an RGB color that was read from a window back to
+// the color that getpixel reports: the number of the BGI color that shows
+// as it, if there is one, or else the RGB color in the form COLOR returns.
+//
+int BGI__RGBToColor( WindowData* pWndData, COLORREF rgb )
+{
+    int color = FindColor( &pWndData->lookup, rgb );
+
+    if ( color >= 0 )
+        return color;
+    return 0x03000000 | rgb;
+}
+
+
+// This function converts a color to the value of a pixel in page memory:
+// 0x00RRGGBB on 32-bit pages (a COLORREF is 0x00BBGGRR), the palette entry
+// on indexed pages, or the pixel of BGI__Format for the other formats.  The
+// DC mutex must be held.
+//
+DWORD BGI__ColorToPixel( WindowData* pWndData, int color )
+{
+    COLORREF rgb;
+
+    if ( pWndData->page_format == INDEXED8_PAGES && color >= 0 && color < 256 )
+        return color;
+    rgb = BGI__ColorToRGB( pWndData, color );
+    rgb = ( GetRValue( rgb ) << 16 ) | ( GetGValue( rgb ) << 8 ) | GetBValue( rgb );
+    switch ( pWndData->page_format )
+    {
+    case INDEXED8_PAGES: return NearestEntry( Nearest( pWndData ), rgb );
+    case RGB565_PAGES:   return BGI__Format<RGB565_PAGES>::FromRGB( rgb );
+    case GRAY8_PAGES:    return BGI__Format<GRAY8_PAGES>::FromRGB( rgb );
+    }
+    return rgb;
+}
+
+
+// This function returns the value of one pixel of a page, which must be
+// inside the window.  The DC mutex must be held, after a GdiFlush.
+//
+DWORD BGI__GetPagePixel( WindowData* pWndData, int page, int x, int y )
+{
+    const BYTE* row = pWndData->pBits[page] + y * pWndData->pitch;
+
+    switch ( pWndData->page_format )
+    {
+    case INDEXED8_PAGES:
+    case GRAY8_PAGES:    return row[x];
+    case RGB565_PAGES:   return ( (const WORD*)row )[x];
+    }
+    return ( (const DWORD*)row )[x];
+}
+
+
+// This function converts the value of a pixel in page memory to the color
+// that getpixel reports: the palette entry itself on indexed pages, or else
+// the number of the BGI color that is stored as that pixel, if there is
+// one, or the RGB color it shows as in the form COLOR returns.
+//
+int BGI__PixelToColor( WindowData* pWndData, DWORD pixel )
+{
+    int color;
+
+    if ( pWndData->page_format == INDEXED8_PAGES )
+        return pixel;
+    color = FindColor( &pWndData->pixel_lookup, pixel );
+    if ( color >= 0 )
+        return color;
+    switch ( pWndData->page_format )
+    {
+    case RGB565_PAGES: pixel = BGI__Format<RGB565_PAGES>::ToRGB( (WORD)pixel ); break;
+    case GRAY8_PAGES:  pixel = BGI__Format<GRAY8_PAGES>::ToRGB( (BYTE)pixel ); break;
+    }
+    return 0x03000000 | RGB( pixel >> 16, pixel >> 8, pixel );
+}
+
+
+// This function copies a rectangle of a page (the whole page if rect is
+// NULL) into a block of 32-bit 0x00RRGGBB pixels with pitch bytes per row,
+// whatever the format of the page.  The DC mutex must be held, after a
+// GdiFlush.
+//
+void BGI__ReadPixels( WindowData* pWndData, int page, const RECT* rect, BYTE* out, int pitch )
+{
+    RECT all = { 0, 0, pWndData->width, pWndData->height };
+    DWORD colors[256];
+    int x, y;
+
+    if ( rect == NULL )
+        rect = &all;
+    switch ( pWndData->page_format )
+    {
+    case XRGB8888_PAGES:
+        for ( y = rect->top; y < rect->bottom; y++ )
+            memcpy( out + ( y - rect->top ) * pitch,
+                    pWndData->pBits[page] + y * pWndData->pitch + 4 * rect->left,
+                    4 * ( rect->right - rect->left ) );
+        return;
+    case RGB565_PAGES:
+        ReadRows<RGB565_PAGES>( pWndData, page, rect, out, pitch );
+        return;
+    case GRAY8_PAGES:
+        ReadRows<GRAY8_PAGES>( pWndData, page, rect, out, pitch );
+        return;
+    }
+
+    for ( x = 0; x < 256; x++ )
+        colors[x] = ( GetRValue( pWndData->palette[x] ) << 16 )
+                  | ( GetGValue( pWndData->palette[x] ) << 8 ) | GetBValue( pWndData->palette[x] );
+    for ( y = rect->top; y < rect->bottom; y++ )
+    {
+        const BYTE* src = pWndData->pBits[page] + y * pWndData->pitch;
+        DWORD* dst = (DWORD*)( out + ( y - rect->top ) * pitch );
+        for ( x = rect->left; x < rect->right; x++ )
+            *dst++ = colors[src[x]];
+    }
+}
+
+
+// This function stores a block of 32-bit 0x00RRGGBB pixels with pitch bytes
+// per row into a rectangle of a page, converting them to the format of the
+// page.  The DC mutex must be held, after a GdiFlush.
+//
+void BGI__WritePixels( WindowData* pWndData, int page, const RECT* rect, const BYTE* in, int pitch )
+{
+    const BYTE* nearest;
+    int x, y;
+
+    switch ( pWndData->page_format )
+    {
+    case XRGB8888_PAGES:
+        for ( y = rect->top; y < rect->bottom; y++ )
+            memcpy( pWndData->pBits[page] + y * pWndData->pitch + 4 * rect->left,
+                    in + ( y - rect->top ) * pitch, 4 * ( rect->right - rect->left ) );
+        return;
+    case RGB565_PAGES:
+        WriteRows<RGB565_PAGES>( pWndData, page, rect, in, pitch );
+        return;
+    case GRAY8_PAGES:
+        WriteRows<GRAY8_PAGES>( pWndData, page, rect, in, pitch );
+        return;
+    }
+
+    nearest = Nearest( pWndData );
+    for ( y = rect->top; y < rect->bottom; y++ )
+    {
+        const DWORD* src = (const DWORD*)( in + ( y - rect->top ) * pitch );
+        BYTE* dst = pWndData->pBits[page] + y * pWndData->pitch;
+        for ( x = rect->left; x < rect->right; x++ )
+            dst[x] = NearestEntry( nearest, *src++ );
+    }
+}
+
 
 /*****************************************************************************
 *
@@ -38,31 +457,106 @@ __declspec(dllexport) palettetype *getdefaultpalette( )
 }
 
 
+// This function returns the colors last given to setpalette (or
+// setallpalette) for the 16 BGI colors.
+//
 __declspec(dllexport) void getpalette( palettetype *palette )
 {
-
+    *palette = BGI__GetWindowDataPtr( )->bgi_palette;
 }
 
 
+// This function returns the number of palette entries: 16 (the BGI colors),
+// or 256 for a window with indexed pages.
+//
 __declspec(dllexport) int getpalettesize( )
 {
+    if ( BGI__GetWindowDataPtr( )->page_format == INDEXED8_PAGES )
+        return 256;
     return MAXCOLORS + 1;
 }
 
 
+// This function sets each of the 16 BGI colors whose entry in the palette
+// is a BGI color (rather than -1), as setpalette does, and applies them all
+// at once.
+//
 __declspec(dllexport) void setallpalette( palettetype *palette )
 {
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
 
+    for ( int i = 0; i < palette->size && i <= MAXCOLORS; i++ )
+    {
+        if ( !IS_BGI_COLOR( palette->colors[i] ) )
+            continue;
+        pWndData->bgi_palette.colors[i] = palette->colors[i];
+        pWndData->palette[i] = BGI__Colors[palette->colors[i]];
+    }
+    ApplyPalette( pWndData, true );
 }
 
 
+// This function makes BGI color colornum show as color, which is one of the
+// default BGI colors or an RGB color from COLOR.  On indexed pages, what is
+// already drawn in that color changes at once; on 32-bit pages, only what
+// is drawn from now on does.
+//
 __declspec(dllexport) void setpalette( int colornum, int color )
 {
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
 
+    if ( !IS_BGI_COLOR( colornum ) )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    if ( IS_BGI_COLOR( color ) )
+    {
+        pWndData->bgi_palette.colors[colornum] = color;
+        pWndData->palette[colornum] = BGI__Colors[color];
+    }
+    else
+        pWndData->palette[colornum] = color & 0x0FFFFFF;
+    ApplyPalette( pWndData, true );
 }
 
 
+// This function sets palette entry colornum to an RGB color (each part is
+// 0 to 255).  Windows with indexed pages have 256 entries, so this is also
+// how their colors 16 to 255 are set, for example to cycle colors without
+// drawing anything again (setrgbpalettes sets many entries at once).
+//
 __declspec(dllexport) void setrgbpalette( int colornum, int red, int green, int blue )
 {
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+
+    if ( colornum < 0 || colornum >= getpalettesize( ) )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    pWndData->palette[colornum] = RGB( red & 0xFF, green & 0xFF, blue & 0xFF );
+    ApplyPalette( pWndData, true );
+}
+
+
+// This function sets count palette entries, from entry first on, to RGB
+// colors given as red, green and blue bytes (three per entry) in rgb, and
+// applies them all at once.  Setting the entries one at a time with
+// setrgbpalette would apply the whole palette (and on indexed pages repaint
+// the window) once per entry, so this is the way to cycle or fade many
+// colors in each frame.
+//
+__declspec(dllexport) void setrgbpalettes( int first, int count, const unsigned char* rgb )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
 
+    if ( rgb == NULL || first < 0 || count < 0 || count > getpalettesize( ) - first )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    for ( int i = 0; i < count; i++ )
+        pWndData->palette[first + i] = RGB( rgb[3*i], rgb[3*i + 1], rgb[3*i + 2] );
+    ApplyPalette( pWndData, true );
 }
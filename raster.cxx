@@ -0,0 +1,548 @@
+// File: raster.cxx
+//
+// This file contains the software drawing paths.  Pixels, bars and
+// horizontal and vertical lines are so common that a trip through GDI for
+// each of them costs more than the drawing itself, so they are written
+// straight into the pixel memory of the active page instead.  Each path is
+// a template that is instantiated for every pixel size, write mode and kind
+// of fill, and for clipped and unclipped drawing, so that its inner loop
+// tests nothing that stays the same for the whole call.
+// BGI__UpdatePipeline picks the instantiations for the current state
+// whenever the state changes, and the drawing calls use the ones it picked.
+//
+// Anything that GDI would not draw the same way (hatch brushes, thin styled
+// or slanted lines) is still drawn by GDI.  Wide lines are drawn by
+// stroke.cpp.
+//
+
+#include <windows.h>        // Provides the Win32 API
+#include <windowsx.h>       // Provides GDI helper macros
+#include <math.h>           // Provides ceil
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function returns the rows of the fill pattern when it is one that
+// setfillstyle makes from a bitmap (or the user's pattern), or NULL for a
+// solid fill or a hatch brush.  A set bit is drawn in the fill color and a
+// clear bit in the background color, with the leftmost pixel in the high
+// bit, as in the brushes of setfillstyle.
+//
+static const BYTE* PatternRows( WindowData* pWndData )
+{
+    static const BYTE Slash[8]      = { 0xE0, 0xC1, 0x83, 0x07, 0x0E, 0x1C, 0x38, 0x70 };
+    static const BYTE BkSlash[8]    = { 0x07, 0x83, 0xC1, 0xE0, 0x70, 0x38, 0x1C, 0x0E };
+    static const BYTE Interleave[8] = { 0xCC, 0x33, 0xCC, 0x33, 0xCC, 0x33, 0xCC, 0x33 };
+    static const BYTE WideDot[8]    = { 0x80, 0x00, 0x08, 0x00, 0x80, 0x00, 0x08, 0x00 };
+    static const BYTE CloseDot[8]   = { 0x88, 0x00, 0x22, 0x00, 0x88, 0x00, 0x22, 0x00 };
+
+    switch ( pWndData->fillInfo.pattern )
+    {
+    case SLASH_FILL:      return Slash;
+    case BKSLASH_FILL:    return BkSlash;
+    case INTERLEAVE_FILL: return Interleave;
+    case WIDE_DOT_FILL:   return WideDot;
+    case CLOSE_DOT_FILL:  return CloseDot;
+    case USER_FILL:       return (const BYTE*)pWndData->uPattern;
+    }
+    return NULL;
+}
+
+
+// This function clips a rectangle (right and bottom edges excluded) to
+// another, and returns false if nothing is left.
+//
+static inline bool ClipRect( RECT* rect, const RECT* clip )
+{
+    rect->left = max( rect->left, clip->left );
+    rect->top = max( rect->top, clip->top );
+    rect->right = min( rect->right, clip->right );
+    rect->bottom = min( rect->bottom, clip->bottom );
+    return rect->left < rect->right && rect->top < rect->bottom;
+}
+
+
+// This function returns true if a rectangle is entirely inside another.
+//
+static inline bool InsideRect( const RECT* rect, const RECT* clip )
+{
+    return rect->left >= clip->left && rect->top >= clip->top
+        && rect->right <= clip->right && rect->bottom <= clip->bottom;
+}
+
+
+// This function returns the number of pixels of a rectangle that are inside
+// another (for BGI__COUNT_PIXELS).
+//
+static inline double ClippedArea( const RECT* rect, const RECT* clip )
+{
+    LONG width = min( rect->right, clip->right ) - max( rect->left, clip->left );
+    LONG height = min( rect->bottom, clip->bottom ) - max( rect->top, clip->top );
+
+    return ( width > 0 && height > 0 ) ? (double)width * height : 0;
+}
+
+
+// This function counts a shape that was given up on because it cannot be
+// seen, and returns false so the visibility tests can return it.
+//
+static inline bool Culled( WindowData* pWndData )
+{
+    pWndData->culled++;
+    return false;
+}
+
+
+/*****************************************************************************
+*
+*   The drawing paths
+*
+*****************************************************************************/
+// Pixel is BYTE, WORD or DWORD for the size of the pixels of the page.  All
+// coordinates are device coordinates, and the DC mutex must be held, after
+// a GdiFlush.  The clipped paths draw only inside pipeline.clip; the others
+// must only be given what is already inside it.
+
+// This function sets one pixel, as SetPixelV does (whatever the write mode).
+//
+template <class Pixel>
+static void Plot( WindowData* pWndData, int x, int y, DWORD pixel )
+{
+    const RECT* clip = &pWndData->pipeline.clip;
+
+    if ( x < clip->left || y < clip->top || x >= clip->right || y >= clip->bottom )
+        return;
+    ( (Pixel*)( pWndData->pBits[pWndData->ActivePage] + y * pWndData->pitch ) )[x] = (Pixel)pixel;
+}
+
+
+// This function fills a rectangle (right and bottom edges excluded) with the
+// fill color, or with the fill pattern, as FillRect does with the brush.  A
+// pattern is lined up with the page, as a brush is.
+//
+template <class Pixel, bool PATTERN, bool CLIP>
+static void Fill( WindowData* pWndData, RECT rect )
+{
+    const BGI__Pipeline* pipeline = &pWndData->pipeline;
+    Pixel colors[8];            // One row of the pattern, starting at x = 0
+    int x, y;
+
+    if ( CLIP && !ClipRect( &rect, &pipeline->clip ) )
+        return;
+    for ( y = rect.top; y < rect.bottom; y++ )
+    {
+        Pixel* row = (Pixel*)( pWndData->pBits[pWndData->ActivePage] + y * pWndData->pitch );
+        if ( PATTERN )
+        {
+            for ( x = 0; x < 8; x++ )
+                colors[x] = (Pixel)( ( pipeline->pattern[y & 7] & ( 0x80 >> x ) ) ? pipeline->fill : pipeline->back );
+            for ( x = rect.left; x < rect.right; x++ )
+                row[x] = colors[x & 7];
+        }
+        else
+        {
+            for ( x = rect.left; x < rect.right; x++ )
+                row[x] = (Pixel)pipeline->fill;
+        }
+    }
+}
+
+
+// These functions draw a horizontal line from (x1,y) to (x2,y), or a
+// vertical one from (x,y1) to (x,y2), in the pen color and the write mode.
+// Both ends are drawn, and x1 <= x2 (or y1 <= y2).
+//
+template <class Pixel, bool XOR, bool CLIP>
+static void HLine( WindowData* pWndData, int x1, int x2, int y )
+{
+    const BGI__Pipeline* pipeline = &pWndData->pipeline;
+    Pixel pen = (Pixel)pipeline->pen;
+
+    if ( CLIP )
+    {
+        if ( y < pipeline->clip.top || y >= pipeline->clip.bottom )
+            return;
+        x1 = max( x1, (int)pipeline->clip.left );
+        x2 = min( x2, (int)pipeline->clip.right - 1 );
+    }
+    Pixel* p = (Pixel*)( pWndData->pBits[pWndData->ActivePage] + y * pWndData->pitch ) + x1;
+    for ( int x = x1; x <= x2; x++, p++ )
+    {
+        if ( XOR )
+            *p ^= pen;
+        else
+            *p = pen;
+    }
+}
+
+template <class Pixel, bool XOR, bool CLIP>
+static void VLine( WindowData* pWndData, int x, int y1, int y2 )
+{
+    const BGI__Pipeline* pipeline = &pWndData->pipeline;
+    Pixel pen = (Pixel)pipeline->pen;
+
+    if ( CLIP )
+    {
+        if ( x < pipeline->clip.left || x >= pipeline->clip.right )
+            return;
+        y1 = max( y1, (int)pipeline->clip.top );
+        y2 = min( y2, (int)pipeline->clip.bottom - 1 );
+    }
+    BYTE* p = pWndData->pBits[pWndData->ActivePage] + y1 * pWndData->pitch + x * sizeof( Pixel );
+    for ( int y = y1; y <= y2; y++, p += pWndData->pitch )
+    {
+        if ( XOR )
+            *(Pixel*)p ^= pen;
+        else
+            *(Pixel*)p = pen;
+    }
+}
+
+
+// This function fills a rectangle with one pixel, whatever the fill style.
+// The rectangle must be inside the window.
+//
+template <class Pixel>
+static void Clear( WindowData* pWndData, RECT rect, DWORD pixel )
+{
+    for ( int y = rect.top; y < rect.bottom; y++ )
+    {
+        Pixel* row = (Pixel*)( pWndData->pBits[pWndData->ActivePage] + y * pWndData->pitch );
+        for ( int x = rect.left; x < rect.right; x++ )
+            row[x] = (Pixel)pixel;
+    }
+}
+
+
+// This function points the pipeline at the instantiations of each path for
+// one pixel size.
+//
+template <class Pixel>
+static void Choose( BGI__Pipeline* pipeline, bool pattern, bool xor_put )
+{
+    pipeline->plot = Plot<Pixel>;
+    pipeline->clear = Clear<Pixel>;
+    if ( pattern )
+    {
+        pipeline->fill_rect[0] = Fill<Pixel, true, false>;
+        pipeline->fill_rect[1] = Fill<Pixel, true, true>;
+    }
+    else
+    {
+        pipeline->fill_rect[0] = Fill<Pixel, false, false>;
+        pipeline->fill_rect[1] = Fill<Pixel, false, true>;
+    }
+    if ( xor_put )
+    {
+        pipeline->hline[0] = HLine<Pixel, true, false>;
+        pipeline->hline[1] = HLine<Pixel, true, true>;
+        pipeline->vline[0] = VLine<Pixel, true, false>;
+        pipeline->vline[1] = VLine<Pixel, true, true>;
+    }
+    else
+    {
+        pipeline->hline[0] = HLine<Pixel, false, false>;
+        pipeline->hline[1] = HLine<Pixel, false, true>;
+        pipeline->vline[0] = VLine<Pixel, false, false>;
+        pipeline->vline[1] = VLine<Pixel, false, true>;
+    }
+}
+
+
+// This function makes the drawing paths of a window match its state: the
+// clip rectangle, the pixels of the colors, which kinds of bars and lines
+// can be drawn here, and the instantiation of each path.  It is called
+// whenever the viewport, the colors, the write mode, the line style or the
+// fill style change.
+//
+void BGI__UpdatePipeline( WindowData* pWndData )
+{
+    BGI__Pipeline* pipeline = &pWndData->pipeline;
+    viewporttype* vp = &pWndData->viewportInfo;
+    const BYTE* rows = PatternRows( pWndData );
+    int fill_color;
+
+    // Drawing may go anywhere in the window, or only inside a clipping
+    // viewport (which does not include its right and bottom edges).
+    SetRect( &pipeline->clip, 0, 0, pWndData->width, pWndData->height );
+    if ( vp->clip != 0 )
+    {
+        RECT viewport = { vp->left, vp->top, vp->right, vp->bottom };
+        if ( !ClipRect( &pipeline->clip, &viewport ) )
+            SetRectEmpty( &pipeline->clip );
+    }
+
+    // An empty fill uses the background color from when it was chosen, as
+    // its brush does.
+    switch ( pWndData->fillInfo.pattern )
+    {
+    case EMPTY_FILL:
+        pipeline->fills = true;
+        fill_color = pipeline->empty_color;
+        break;
+    case SOLID_FILL:
+        pipeline->fills = true;
+        fill_color = pWndData->fillInfo.color;
+        break;
+    default:
+        pipeline->fills = ( rows != NULL );
+        fill_color = pWndData->fillInfo.color;
+        break;
+    }
+    if ( rows != NULL )
+    {
+        for ( int i = 0; i < 8; i++ )
+            pipeline->pattern[i] = rows[i];
+    }
+    pipeline->lines = pWndData->lineInfo.linestyle == SOLID_LINE
+                   && pWndData->lineInfo.thickness == NORM_WIDTH;
+    pipeline->strokes = pipeline->last_point
+                     && pWndData->lineInfo.thickness > NORM_WIDTH;
+
+    WaitForSingleObject( pWndData->hDCMutex, INFINITE );
+    pipeline->pen = BGI__ColorToPixel( pWndData, pWndData->drawColor );
+    pipeline->fill = BGI__ColorToPixel( pWndData, fill_color );
+    pipeline->back = BGI__ColorToPixel( pWndData, pWndData->bgColor );
+    ReleaseMutex( pWndData->hDCMutex );
+
+    switch ( pWndData->page_format )
+    {
+    case INDEXED8_PAGES:
+    case GRAY8_PAGES:
+        Choose<BYTE>( pipeline, rows != NULL, pWndData->writemode == XOR_PUT );
+        break;
+    case RGB565_PAGES:
+        Choose<WORD>( pipeline, rows != NULL, pWndData->writemode == XOR_PUT );
+        break;
+    default:
+        Choose<DWORD>( pipeline, rows != NULL, pWndData->writemode == XOR_PUT );
+        break;
+    }
+}
+
+
+// This function returns true if any of the rectangle from (left,top) to
+// (right,bottom) in viewport coordinates, without its right and bottom
+// edges, can be drawn.  It needs no lock, so drawing calls can give up on
+// shapes that cannot be seen before they take the DC mutex.  Each shape
+// given up on is counted in culled.
+//
+bool BGI__RectVisible( WindowData* pWndData, int left, int top, int right, int bottom )
+{
+    RECT rect = { left + pWndData->viewportInfo.left, top + pWndData->viewportInfo.top,
+                  right + pWndData->viewportInfo.left, bottom + pWndData->viewportInfo.top };
+
+    return ClipRect( &rect, &pWndData->pipeline.clip ) || Culled( pWndData );
+}
+
+
+// This function returns how far past the points of a line the current pen
+// can draw.  The corners of the square caps of a wide line are up to
+// sqrt(2) * thickness/2 away from its end points (for a diagonal line).
+//
+static int PenReach( WindowData* pWndData )
+{
+    return (int)ceil( max( pWndData->lineInfo.thickness, 0 ) * 0.7072 ) + 1;
+}
+
+
+// This function returns true if any of a shape that is drawn with the
+// current pen can be seen, given the box from (left,top) to (right,bottom)
+// in viewport coordinates (both edges included, in either order) that
+// holds all of its points.  The box is grown by the reach of the pen.
+//
+bool BGI__ShapeVisible( WindowData* pWndData, int left, int top, int right, int bottom )
+{
+    int reach = PenReach( pWndData );
+
+    return BGI__RectVisible( pWndData, min( left, right ) - reach, min( top, bottom ) - reach,
+                             max( left, right ) + reach, max( top, bottom ) + reach );
+}
+
+
+// This function finds the box that holds the n points (x,y pairs) of a
+// polygon or polyline, grown by the reach of the pen, with its right and
+// bottom edges excluded, as RefreshWindow wants it.  It returns false if
+// there are no points.
+// (used by drawpoly and fillpoly in drawing.cpp)
+//
+bool BGI__PolyBounds( WindowData* pWndData, int n, const int* points, RECT* bounds )
+{
+    int reach = PenReach( pWndData );
+
+    if ( n < 1 )
+        return false;
+    bounds->left = bounds->right = points[0];
+    bounds->top = bounds->bottom = points[1];
+    for ( int i = 1; i < n; i++ )
+    {
+        bounds->left = min( bounds->left, points[2*i] );
+        bounds->right = max( bounds->right, points[2*i] );
+        bounds->top = min( bounds->top, points[2*i+1] );
+        bounds->bottom = max( bounds->bottom, points[2*i+1] );
+    }
+    bounds->left -= reach;
+    bounds->top -= reach;
+    bounds->right += reach;
+    bounds->bottom += reach;
+    return true;
+}
+
+
+// This function returns true if any of the line from (x1,y1) to (x2,y2) in
+// viewport coordinates can be drawn with the current pen.  The line is
+// clipped (Liang-Barsky) to the clip rectangle, grown by the reach of the
+// pen past the line, and only a line with nothing left is given up on.
+// Like BGI__RectVisible, it needs no lock and counts the lines given up on.
+//
+bool BGI__LineVisible( WindowData* pWndData, int x1, int y1, int x2, int y2 )
+{
+    const RECT* clip = &pWndData->pipeline.clip;
+    int reach = PenReach( pWndData );
+    double p[4], q[4];
+    double t0 = 0, t1 = 1, t;
+
+    p[0] = -( x2 - x1 );
+    p[1] = x2 - x1;
+    p[2] = -( y2 - y1 );
+    p[3] = y2 - y1;
+    x1 += pWndData->viewportInfo.left;
+    y1 += pWndData->viewportInfo.top;
+    q[0] = x1 - ( clip->left - reach );
+    q[1] = ( clip->right - 1 + reach ) - x1;
+    q[2] = y1 - ( clip->top - reach );
+    q[3] = ( clip->bottom - 1 + reach ) - y1;
+
+    for ( int i = 0; i < 4; i++ )
+    {
+        if ( p[i] == 0 )
+        {
+            // Parallel to this edge, so wholly inside or outside of it
+            if ( q[i] < 0 )
+                return Culled( pWndData );
+            continue;
+        }
+        t = q[i] / p[i];
+        if ( p[i] < 0 )
+        {
+            if ( t > t1 )
+                return Culled( pWndData );
+            t0 = max( t0, t );
+        }
+        else
+        {
+            if ( t < t0 )
+                return Culled( pWndData );
+            t1 = min( t1, t );
+        }
+    }
+    return true;
+}
+
+
+// This function fills a rectangle, given in device coordinates with its
+// right and bottom edges excluded, with a color, ignoring the viewport.
+// The DC mutex must be held.
+// (used by cleardevice and clearviewport in drawing.cpp)
+//
+void BGI__ClearRect( WindowData* pWndData, RECT rect, int color )
+{
+    RECT window = { 0, 0, pWndData->width, pWndData->height };
+    DWORD pixel = BGI__ColorToPixel( pWndData, color );
+
+    if ( !ClipRect( &rect, &window ) )
+        return;
+    GdiFlush( );
+    pWndData->pipeline.clear( pWndData, rect, pixel );
+    BGI__COUNT_PIXELS( pWndData, ClippedArea( &rect, &window ) );
+}
+
+
+// This function sets the pixel at (x,y) in viewport coordinates to a color.
+// The DC mutex must be held.
+// (used by putpixel in drawing.cpp)
+//
+void BGI__PlotPixel( WindowData* pWndData, int x, int y, int color )
+{
+    DWORD pixel = BGI__ColorToPixel( pWndData, color );
+
+    GdiFlush( );
+    pWndData->pipeline.plot( pWndData, x + pWndData->viewportInfo.left,
+                             y + pWndData->viewportInfo.top, pixel );
+    BGI__COUNT_PIXELS( pWndData, 1 );
+}
+
+
+// This function fills the rectangle from (left,top) to (right,bottom) in
+// viewport coordinates, without its right and bottom edges (as FillRect
+// does), if the fill style can be drawn here.  It returns false, and draws
+// nothing, if it cannot.  The DC mutex must be held.
+// (used by bar in drawing.cpp)
+//
+bool BGI__FillBar( WindowData* pWndData, int left, int top, int right, int bottom )
+{
+    BGI__Pipeline* pipeline = &pWndData->pipeline;
+    RECT rect = { left + pWndData->viewportInfo.left, top + pWndData->viewportInfo.top,
+                  right + pWndData->viewportInfo.left, bottom + pWndData->viewportInfo.top };
+
+    if ( !pipeline->fills )
+        return false;
+    GdiFlush( );
+    pipeline->fill_rect[!InsideRect( &rect, &pipeline->clip )]( pWndData, rect );
+    BGI__COUNT_PIXELS( pWndData, ClippedArea( &rect, &pipeline->clip ) );
+    return true;
+}
+
+
+// This function draws the line from (x1,y1) to (x2,y2) in viewport
+// coordinates if it is horizontal or vertical and the pen is a thin solid
+// one.  The pen of graphdefaults (a stock pen) leaves out the last point,
+// as LineTo does; the pens of setcolor and setlinestyle have square ends,
+// which cover it.  It returns false, and draws nothing, if GDI must draw the
+// line.  The DC mutex must be held.
+// (used by line, linerel and lineto in drawing.cpp)
+//
+bool BGI__StraightLine( WindowData* pWndData, int x1, int y1, int x2, int y2 )
+{
+    BGI__Pipeline* pipeline = &pWndData->pipeline;
+    RECT rect;
+
+    if ( !pipeline->lines || ( x1 != x2 && y1 != y2 ) )
+        return false;
+    if ( !pipeline->last_point )
+    {
+        if ( x1 == x2 && y1 == y2 )
+            return true;        // LineTo draws nothing
+        if ( x2 > x1 ) x2--;
+        else if ( x2 < x1 ) x2++;
+        else if ( y2 > y1 ) y2--;
+        else y2++;
+    }
+
+    x1 += pWndData->viewportInfo.left;
+    x2 += pWndData->viewportInfo.left;
+    y1 += pWndData->viewportInfo.top;
+    y2 += pWndData->viewportInfo.top;
+    SetRect( &rect, min( x1, x2 ), min( y1, y2 ), max( x1, x2 ) + 1, max( y1, y2 ) + 1 );
+
+    GdiFlush( );
+    if ( y1 == y2 )
+        pipeline->hline[!InsideRect( &rect, &pipeline->clip )]( pWndData, rect.left, rect.right - 1, y1 );
+    else
+        pipeline->vline[!InsideRect( &rect, &pipeline->clip )]( pWndData, x1, rect.top, rect.bottom - 1 );
+    BGI__COUNT_PIXELS( pWndData, ClippedArea( &rect, &pipeline->clip ) );
+    return true;
+}
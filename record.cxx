@@ -0,0 +1,1139 @@
+// File: record.cxx
+//
+// This file contains the display list routines.  Between beginrecord and
+// endrecord, each drawing call and state change made in the current window
+// is drawn as usual and is also appended to a list of fixed-size commands.
+// replay draws the list again, at an offset if desired.  When the list is
+// finished, state changes that are overwritten before anything uses them
+// are removed.  When it is replayed, state changes that would not change
+// anything are skipped.
+//
+// A list that does not depend on the pixels it draws over can also be kept
+// as a snapshot of the pixels it covers.  The second time in a row that such
+// a list is replayed the same way (same window, offset, viewport and the
+// parts of the drawing state that the list does not set itself), the
+// snapshot is made.  From then on, replaying the list only copies those
+// pixels to the active page.
+//
+
+#include <windows.h>        // Provides the Win32 API
+#include <windowsx.h>       // Provides GDI helper macros
+#include <string.h>         // Provides memcpy, memcmp and memset
+#include <vector>           // Provides STL vector class
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Structures and constants
+*
+*****************************************************************************/
+// The parts of the drawing state that commands can read or change.
+#define STATE_COLOR         0x001   // setcolor
+#define STATE_BKCOLOR       0x002   // setbkcolor
+#define STATE_FILL          0x004   // setfillstyle and setfillpattern
+#define STATE_LINE          0x008   // setlinestyle
+#define STATE_WRITEMODE     0x010   // setwritemode
+#define STATE_TEXTSTYLE     0x020   // settextstyle
+#define STATE_JUSTIFY       0x040   // settextjustify
+#define STATE_CHARSIZE      0x080   // setusercharsize
+#define STATE_CP            0x100   // The current position
+#define STATE_PIXELS        0x200   // The pixels that are already on the page
+#define STATE_CLASSES       8       // Number of classes that have a set function
+
+#define USES_LINE   ( STATE_COLOR | STATE_LINE | STATE_WRITEMODE )
+#define USES_FILL   ( STATE_FILL | STATE_BKCOLOR )
+#define USES_SHAPE  ( USES_LINE | USES_FILL )
+#define USES_TEXT   ( STATE_COLOR | STATE_BKCOLOR | STATE_TEXTSTYLE | STATE_JUSTIFY | STATE_CHARSIZE )
+
+// What each command does with the drawing state.
+struct OpInfo
+{
+    int op;
+    int reads;                  // State used by the command
+    int sets;                   // State changed by the command
+};
+
+static const OpInfo op_table[] =
+{
+    { BGI__OP_ARC,              USES_LINE,              0 },
+    { BGI__OP_BAR,              USES_FILL,              0 },
+    { BGI__OP_BAR3D,            USES_SHAPE,             0 },
+    { BGI__OP_CIRCLE,           USES_LINE,              0 },
+    { BGI__OP_CLEARDEVICE,      STATE_BKCOLOR,          STATE_CP },
+    { BGI__OP_CLEARVIEWPORT,    STATE_BKCOLOR,          STATE_CP },
+    { BGI__OP_DRAWPOLY,         USES_LINE,              0 },
+    { BGI__OP_ELLIPSE,          USES_LINE,              0 },
+    { BGI__OP_FILLELLIPSE,      USES_SHAPE,             0 },
+    { BGI__OP_FILLPOLY,         USES_SHAPE,             0 },
+    { BGI__OP_FLOODFILL,        USES_FILL | STATE_PIXELS, 0 },
+    { BGI__OP_LINE,             USES_LINE,              0 },
+    { BGI__OP_LINEREL,          USES_LINE | STATE_CP,   STATE_CP },
+    { BGI__OP_LINETO,           USES_LINE | STATE_CP,   STATE_CP },
+    { BGI__OP_MOVEREL,          STATE_CP,               STATE_CP },
+    { BGI__OP_MOVETO,           0,                      STATE_CP },
+    { BGI__OP_PIESLICE,         USES_SHAPE,             0 },
+    { BGI__OP_PUTPIXEL,         0,                      0 },
+    { BGI__OP_RECTANGLE,        USES_LINE,              0 },
+    { BGI__OP_SECTOR,           USES_SHAPE,             0 },
+    { BGI__OP_OUTTEXT,          USES_TEXT | STATE_CP,   STATE_CP },
+    { BGI__OP_OUTTEXTXY,        USES_TEXT,              0 },
+    { BGI__OP_PUTIMAGE,         0,                      0 },
+    { BGI__OP_SETCOLOR,         0,                      STATE_COLOR },
+    { BGI__OP_SETBKCOLOR,       0,                      STATE_BKCOLOR },
+    { BGI__OP_SETFILLSTYLE,     0,                      STATE_FILL },
+    { BGI__OP_SETFILLPATTERN,   0,                      STATE_FILL },
+    { BGI__OP_SETLINESTYLE,     0,                      STATE_LINE },
+    { BGI__OP_SETWRITEMODE,     0,                      STATE_WRITEMODE },
+    { BGI__OP_SETTEXTSTYLE,     0,                      STATE_TEXTSTYLE },
+    { BGI__OP_SETTEXTJUSTIFY,   0,                      STATE_JUSTIFY },
+    { BGI__OP_SETUSERCHARSIZE,  0,                      STATE_CHARSIZE },
+};
+
+// The drawing state of a window that display lists care about.
+struct ListState
+{
+    int color;
+    int bkcolor;
+    fillsettingstype fill;
+    char upattern[8];
+    linesettingstype line;
+    int writemode;
+    textsettingstype text;
+    int t_scale[4];
+};
+
+// Everything that decides what a replay draws.  Two replays with equal keys
+// draw the same pixels.  Parts of the state that the list sets itself before
+// using them are left zero.
+struct ListKey
+{
+    HWND hWnd;
+    int width, height;
+    int palette_version;
+    int dx, dy;
+    viewporttype viewport;
+    ListState state;
+    POINT cp;
+};
+
+// One run of pixels in a snapshot, in device coordinates.
+struct ListSpan
+{
+    int x, y;
+    int count;
+};
+
+struct DisplayList
+{
+    std::vector<BGI__Command> commands;
+    std::vector<char> data;     // Points, strings, patterns and images
+    int uses;                   // State the list reads before it sets it
+    int sets;                   // State the list changes
+    bool arcs;                  // True if the list calls arc (and sets arcInfo)
+    std::vector<int> finals;    // The last state change of each class
+
+    // The snapshot cache
+    bool seen;                  // True if key describes the last replay
+    bool cached;                // True if spans and pixels are valid for key
+    ListKey key;
+    std::vector<ListSpan> spans;
+    std::vector<DWORD> pixels;
+    RECT bounds;                // Device rectangle around all of the spans
+    POINT cp;                   // Current position after the list
+    arccoordstype arcInfo;      // Result of the last arc in the list
+};
+
+
+/*****************************************************************************
+*
+*   Global Variables
+*
+*****************************************************************************/
+// All of the display lists.  The handle of a list is its index.
+static std::vector<DisplayList*> BGI__Lists;
+static OpInfo op_info[BGI__OP_COUNT];       // op_table indexed by op
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function returns the description of an op, building the lookup table
+// the first time it is needed.
+//
+static const OpInfo& Info( int op )
+{
+    static bool ready = false;
+
+    if ( !ready )
+    {
+        memset( op_info, 0, sizeof( op_info ) );
+        for ( unsigned i = 0; i < sizeof( op_table ) / sizeof( op_table[0] ); i++ )
+            op_info[op_table[i].op] = op_table[i];
+        ready = true;
+    }
+    if ( op <= BGI__OP_NOP || op >= BGI__OP_COUNT )
+        return op_info[BGI__OP_NOP];
+    return op_info[op];
+}
+
+
+// This function returns the state read by one command.  A few commands
+// depend on their arguments.
+//
+static int Reads( const BGI__Command& c )
+{
+    int reads = Info( c.op ).reads;
+
+    if ( c.op == BGI__OP_PUTIMAGE && c.arg[2] != COPY_PUT )
+        reads |= STATE_PIXELS;
+    if ( c.op == BGI__OP_SETFILLSTYLE && c.arg[0] == EMPTY_FILL )
+        reads |= STATE_BKCOLOR;     // The brush is made in the background color
+    return reads;
+}
+
+
+// This function returns the class of state that a command sets, or 0 if
+// it is not a state change.  The current position does not count.
+//
+static int SetterClass( int op )
+{
+    return Info( op ).sets & ~STATE_CP;
+}
+
+
+// This function returns the number (0 to STATE_CLASSES-1) of a class.
+//
+static int ClassIndex( int state )
+{
+    int i;
+
+    for ( i = 0; ( state & 1 ) == 0; i++ )
+        state >>= 1;
+    return i;
+}
+
+
+// This function returns true if two state changes of the same class always
+// result in the same state.
+//
+static bool SameSetting( const DisplayList* list, const BGI__Command& a, const BGI__Command& b )
+{
+    if ( a.op != b.op || memcmp( a.arg, b.arg, 4 * sizeof( int ) ) != 0 )
+        return false;
+    if ( a.op == BGI__OP_SETFILLSTYLE && a.arg[0] == EMPTY_FILL )
+        return false;               // Depends on the background color
+    if ( a.op == BGI__OP_SETFILLPATTERN )
+        return memcmp( &list->data[a.arg[5]], &list->data[b.arg[5]], 8 ) == 0;
+    return true;
+}
+
+
+// This function returns true if a state change would leave the window's
+// state as it already is, so that it does not need to be executed.  This
+// relies on every page having the same settings, which the set functions
+// make sure of.
+//
+static bool StateMatches( WindowData* pWndData, const BGI__Command* c, const char* data )
+{
+    const int* a = c->arg;
+
+    switch ( c->op )
+    {
+    case BGI__OP_SETCOLOR:
+        return pWndData->drawColor == a[0];
+    case BGI__OP_SETBKCOLOR:
+        return pWndData->bgColor == a[0];
+    case BGI__OP_SETFILLSTYLE:
+        if ( a[0] == USER_FILL )
+            return true;            // setfillstyle ignores USER_FILL
+        return a[0] != EMPTY_FILL && pWndData->fillInfo.pattern == a[0]
+                                  && pWndData->fillInfo.color == a[1];
+    case BGI__OP_SETFILLPATTERN:
+        return pWndData->fillInfo.pattern == USER_FILL && pWndData->fillInfo.color == a[0]
+            && memcmp( pWndData->uPattern, data + a[5], 8 ) == 0;
+    case BGI__OP_SETLINESTYLE:
+        return pWndData->lineInfo.linestyle == a[0]
+            && pWndData->lineInfo.upattern == (unsigned)a[1]
+            && pWndData->lineInfo.thickness == a[2];
+    case BGI__OP_SETWRITEMODE:
+        return pWndData->writemode == a[0];
+    case BGI__OP_SETTEXTSTYLE:
+        return pWndData->textInfo.font == a[0] && pWndData->textInfo.direction == a[1]
+            && pWndData->textInfo.charsize == a[2];
+    case BGI__OP_SETTEXTJUSTIFY:
+        return pWndData->textInfo.horiz == a[0] && pWndData->textInfo.vert == a[1];
+    case BGI__OP_SETUSERCHARSIZE:
+        return memcmp( pWndData->t_scale, a, 4 * sizeof( int ) ) == 0;
+    }
+    return false;
+}
+
+
+// This function appends one command to a list.  Extra data is stored at the
+// next multiple of 8 bytes, so that images can be used in place.
+//
+static void Append( DisplayList* list, int op, const int args[6], const void* data, int size )
+{
+    BGI__Command c;
+
+    c.op = op;
+    memcpy( c.arg, args, sizeof( c.arg ) );
+    if ( data != NULL )
+    {
+        list->data.resize( ( list->data.size( ) + 7 ) & ~7 );
+        c.arg[4] = size;
+        c.arg[5] = (int)list->data.size( );
+        list->data.insert( list->data.end( ), (const char*)data, (const char*)data + size );
+    }
+    list->commands.push_back( c );
+}
+
+
+// This function removes the state changes that cannot make a difference.
+// First, a change is dropped if another change of the same class follows
+// before any command uses that state.  Then, a change is dropped if it
+// sets the same value as the previous change of its class.
+//
+static void FoldStateChanges( DisplayList* list )
+{
+    std::vector<BGI__Command>& cmds = list->commands;
+    int pending[STATE_CLASSES];     // Unused change of each class, or -1
+    int last[STATE_CLASSES];        // Last change of each class, or -1
+    unsigned i, n;
+    int k, reads, cls;
+
+    for ( k = 0; k < STATE_CLASSES; k++ )
+        pending[k] = last[k] = -1;
+
+    for ( i = 0; i < cmds.size( ); i++ )
+    {
+        reads = Reads( cmds[i] );
+        for ( k = 0; k < STATE_CLASSES; k++ )
+            if ( reads & ( 1 << k ) )
+                pending[k] = -1;
+        if ( ( cls = SetterClass( cmds[i].op ) ) != 0 )
+        {
+            k = ClassIndex( cls );
+            if ( pending[k] >= 0 )
+                cmds[pending[k]].op = BGI__OP_NOP;
+            pending[k] = i;
+        }
+    }
+
+    for ( i = 0; i < cmds.size( ); i++ )
+    {
+        if ( ( cls = SetterClass( cmds[i].op ) ) == 0 )
+            continue;
+        k = ClassIndex( cls );
+        if ( last[k] >= 0 && SameSetting( list, cmds[last[k]], cmds[i] ) )
+            cmds[i].op = BGI__OP_NOP;
+        else
+            last[k] = i;
+    }
+
+    for ( i = n = 0; i < cmds.size( ); i++ )
+        if ( cmds[i].op != BGI__OP_NOP )
+            cmds[n++] = cmds[i];
+    cmds.resize( n );
+}
+
+
+// This function works out what a finished list depends on.  A list that
+// reads the pixels under it (floodfill, XOR drawing, putimage other than
+// COPY_PUT) can never be kept as a snapshot; this is marked by STATE_PIXELS
+// in uses.
+//
+static void Analyze( DisplayList* list )
+{
+    int set = 0;                // State set so far
+    int mode = -1;              // Write mode set by the list, or -1
+    int last[STATE_CLASSES];
+    int reads, k;
+
+    list->uses = 0;
+    list->arcs = false;
+    for ( k = 0; k < STATE_CLASSES; k++ )
+        last[k] = -1;
+
+    for ( unsigned i = 0; i < list->commands.size( ); i++ )
+    {
+        const BGI__Command& c = list->commands[i];
+
+        reads = Reads( c );
+        if ( ( reads & STATE_WRITEMODE ) && mode == XOR_PUT )
+            reads |= STATE_PIXELS;
+        list->uses |= reads & ~set;
+        set |= Info( c.op ).sets;
+        if ( SetterClass( c.op ) != 0 )
+            last[ClassIndex( SetterClass( c.op ) )] = i;
+        if ( c.op == BGI__OP_SETWRITEMODE )
+            mode = c.arg[0];
+        if ( c.op == BGI__OP_ARC )
+            list->arcs = true;
+    }
+    list->sets = set;
+
+    list->finals.clear( );
+    for ( k = 0; k < STATE_CLASSES; k++ )
+        if ( last[k] >= 0 )
+            list->finals.push_back( last[k] );
+}
+
+
+// This function copies the drawing state of a window.
+//
+static void SaveState( WindowData* pWndData, ListState* state )
+{
+    memset( state, 0, sizeof( ListState ) );
+    state->color = pWndData->drawColor;
+    state->bkcolor = pWndData->bgColor;
+    state->fill = pWndData->fillInfo;
+    memcpy( state->upattern, pWndData->uPattern, sizeof( state->upattern ) );
+    state->line = pWndData->lineInfo;
+    state->writemode = pWndData->writemode;
+    state->text = pWndData->textInfo;
+    memcpy( state->t_scale, pWndData->t_scale, sizeof( state->t_scale ) );
+}
+
+
+// This function gives every page of the window the drawing state in state,
+// whether or not the window already thinks it has it.
+//
+static void ApplyState( const ListState* state )
+{
+    setbkcolor( state->bkcolor );
+    setcolor( state->color );
+    setlinestyle( state->line.linestyle, state->line.upattern, state->line.thickness );
+    if ( state->fill.pattern == USER_FILL )
+        setfillpattern( (char*)state->upattern, state->fill.color );
+    else
+        setfillstyle( state->fill.pattern, state->fill.color );
+    setwritemode( state->writemode );
+    setusercharsize( state->t_scale[0], state->t_scale[1], state->t_scale[2], state->t_scale[3] );
+    settextstyle( state->text.font, state->text.direction, state->text.charsize );
+    settextjustify( state->text.horiz, state->text.vert );
+}
+
+
+// This function executes one command, moved by (dx,dy).  data is the data
+// area of the list, and points is a buffer that can be used to move a
+// polygon.
+//
+static void ExecCommand( const BGI__Command* c, const char* data, int dx, int dy,
+                         std::vector<int>& points )
+{
+    const int* a = c->arg;
+    int* p;
+
+    switch ( c->op )
+    {
+    case BGI__OP_ARC:           arc( a[0] + dx, a[1] + dy, a[2], a[3], a[4] ); break;
+    case BGI__OP_BAR:           bar( a[0] + dx, a[1] + dy, a[2] + dx, a[3] + dy ); break;
+    case BGI__OP_BAR3D:         bar3d( a[0] + dx, a[1] + dy, a[2] + dx, a[3] + dy, a[4], a[5] ); break;
+    case BGI__OP_CIRCLE:        circle( a[0] + dx, a[1] + dy, a[2] ); break;
+    case BGI__OP_CLEARDEVICE:   cleardevice( ); break;
+    case BGI__OP_CLEARVIEWPORT: clearviewport( ); break;
+    case BGI__OP_ELLIPSE:       ellipse( a[0] + dx, a[1] + dy, a[2], a[3], a[4], a[5] ); break;
+    case BGI__OP_FILLELLIPSE:   fillellipse( a[0] + dx, a[1] + dy, a[2], a[3] ); break;
+    case BGI__OP_FLOODFILL:     floodfill( a[0] + dx, a[1] + dy, a[2] ); break;
+    case BGI__OP_LINE:          line( a[0] + dx, a[1] + dy, a[2] + dx, a[3] + dy ); break;
+    case BGI__OP_LINEREL:       linerel( a[0], a[1] ); break;
+    case BGI__OP_LINETO:        lineto( a[0] + dx, a[1] + dy ); break;
+    case BGI__OP_MOVEREL:       moverel( a[0], a[1] ); break;
+    case BGI__OP_MOVETO:        moveto( a[0] + dx, a[1] + dy ); break;
+    case BGI__OP_PIESLICE:      pieslice( a[0] + dx, a[1] + dy, a[2], a[3], a[4] ); break;
+    case BGI__OP_PUTPIXEL:      putpixel( a[0] + dx, a[1] + dy, a[2] ); break;
+    case BGI__OP_RECTANGLE:     rectangle( a[0] + dx, a[1] + dy, a[2] + dx, a[3] + dy ); break;
+    case BGI__OP_SECTOR:        sector( a[0] + dx, a[1] + dy, a[2], a[3], a[4], a[5] ); break;
+    case BGI__OP_OUTTEXT:       outtext( (char*)( data + a[5] ) ); break;
+    case BGI__OP_OUTTEXTXY:     outtextxy( a[0] + dx, a[1] + dy, (char*)( data + a[5] ) ); break;
+    case BGI__OP_SETCOLOR:      setcolor( a[0] ); break;
+    case BGI__OP_SETBKCOLOR:    setbkcolor( a[0] ); break;
+    case BGI__OP_SETFILLSTYLE:  setfillstyle( a[0], a[1] ); break;
+    case BGI__OP_SETFILLPATTERN: setfillpattern( (char*)( data + a[5] ), a[0] ); break;
+    case BGI__OP_SETLINESTYLE:  setlinestyle( a[0], a[1], a[2] ); break;
+    case BGI__OP_SETWRITEMODE:  setwritemode( a[0] ); break;
+    case BGI__OP_SETTEXTSTYLE:  settextstyle( a[0], a[1], a[2] ); break;
+    case BGI__OP_SETTEXTJUSTIFY: settextjustify( a[0], a[1] ); break;
+    case BGI__OP_SETUSERCHARSIZE: setusercharsize( a[0], a[1], a[2], a[3] ); break;
+
+    case BGI__OP_DRAWPOLY:
+    case BGI__OP_FILLPOLY:
+        p = (int*)( data + a[5] );
+        if ( dx != 0 || dy != 0 )
+        {
+            points.assign( p, p + 2 * a[0] );
+            for ( int i = 0; i < 2 * a[0]; i += 2 )
+            {
+                points[i] += dx;
+                points[i + 1] += dy;
+            }
+            p = points.data( );
+        }
+        if ( c->op == BGI__OP_DRAWPOLY )
+            drawpoly( a[0], p );
+        else
+            fillpoly( a[0], p );
+        break;
+
+    case BGI__OP_PUTIMAGE:
+        {
+            // putimage uses bmBits, which must point at the bits in the list.
+            BITMAP header;
+            memcpy( &header, data + a[5], sizeof( BITMAP ) );
+            header.bmBits = (void*)( data + a[5] + sizeof( BITMAP ) );
+            putimage( a[0] + dx, a[1] + dy, &header, a[2] );
+        }
+        break;
+    }
+}
+
+
+// This function executes count commands.  State changes that would not
+// change anything are skipped.  The commands may come straight from a
+// mapped file, so nothing here allocates except the buffer for moving
+// polygons, which is reused.
+//
+static void ExecCommands( WindowData* pWndData, const BGI__Command* cmds, int count,
+                          const char* data, int dx, int dy )
+{
+    std::vector<int> points;
+
+    for ( int i = 0; i < count; i++ )
+    {
+        const BGI__Command* c = &cmds[i];
+        if ( SetterClass( c->op ) != 0 && StateMatches( pWndData, c, data ) )
+            continue;
+        ExecCommand( c, data, dx, dy, points );
+    }
+}
+
+
+// This function executes every command of a list.
+//
+static void ExecList( WindowData* pWndData, DisplayList* list, int dx, int dy )
+{
+    if ( list->commands.empty( ) )
+        return;
+    ExecCommands( pWndData, &list->commands[0], (int)list->commands.size( ),
+                  list->data.empty( ) ? NULL : &list->data[0], dx, dy );
+}
+
+
+// This function fills in the key of a replay.  It returns false if the
+// replay cannot use a snapshot at all.
+//
+static bool MakeKey( WindowData* pWndData, DisplayList* list, int dx, int dy, ListKey* key )
+{
+    ListState state;
+
+    if ( list->uses & STATE_PIXELS )
+        return false;
+    if ( ( list->uses & STATE_WRITEMODE ) && pWndData->writemode == XOR_PUT )
+        return false;
+
+    memset( key, 0, sizeof( ListKey ) );
+    key->hWnd = pWndData->hWnd;
+    key->width = pWndData->width;
+    key->height = pWndData->height;
+    key->palette_version = pWndData->palette_version;
+    key->dx = dx;
+    key->dy = dy;
+    key->viewport = pWndData->viewportInfo;
+
+    SaveState( pWndData, &state );
+    if ( list->uses & STATE_COLOR )     key->state.color = state.color;
+    if ( list->uses & STATE_BKCOLOR )   key->state.bkcolor = state.bkcolor;
+    if ( list->uses & STATE_FILL )
+    {
+        key->state.fill = state.fill;
+        memcpy( key->state.upattern, state.upattern, sizeof( state.upattern ) );
+    }
+    if ( list->uses & STATE_LINE )      key->state.line = state.line;
+    if ( list->uses & STATE_WRITEMODE ) key->state.writemode = state.writemode;
+    if ( list->uses & ( STATE_TEXTSTYLE | STATE_JUSTIFY | STATE_CHARSIZE ) )
+    {
+        key->state.text = state.text;
+        memcpy( key->state.t_scale, state.t_scale, sizeof( state.t_scale ) );
+    }
+    if ( list->uses & STATE_CP )
+    {
+        HDC hDC = BGI__GetWinbgiDC( );
+        GetCurrentPositionEx( hDC, &key->cp );
+        BGI__ReleaseWinbgiDC( );
+    }
+    return true;
+}
+
+
+// This function makes the snapshot of a list.  The list is drawn twice on
+// a scratch page that stands in for the active page: once over black and
+// once over white.  The pixels that come out the same both times are the
+// ones the list covers.  The hDC mutex is held throughout, so the paint
+// thread never sees the scratch page.
+//
+static void MakeSnapshot( WindowData* pWndData, DisplayList* list, int dx, int dy )
+{
+    int page = pWndData->ActivePage;
+    int width = pWndData->width, height = pWndData->height;
+    viewporttype* vp = &pWndData->viewportInfo;
+    HDC hPageDC = pWndData->hDC[page];
+    BYTE* pPageBits = pWndData->pBits[page];
+    bool refreshing = pWndData->refreshing;
+    ListState before, after;
+    BITMAPINFO bmi;
+    HDC hScratch;
+    HBITMAP hBitmap, hOldBitmap;
+    BYTE* pBits;
+    HRGN hRGN = NULL;
+    POINT cp;
+    DWORD* black;
+    DWORD* white;
+    int x, y, start;
+
+    memset( &bmi, 0, sizeof( bmi ) );
+    bmi.bmiHeader.biSize = sizeof( BITMAPINFOHEADER );
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = -height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    WaitForSingleObject(pWndData->hDCMutex, 5000);
+    BGI__SyncViewport( pWndData, page );
+    hScratch = CreateCompatibleDC( hPageDC );
+    hBitmap = CreateDIBSection( hScratch, &bmi, DIB_RGB_COLORS, (void**)&pBits, NULL, 0 );
+    if ( hScratch == NULL || hBitmap == NULL )
+    {
+        if ( hBitmap != NULL ) DeleteBitmap( hBitmap );
+        if ( hScratch != NULL ) DeleteDC( hScratch );
+        ReleaseMutex(pWndData->hDCMutex);
+        return;
+    }
+    hOldBitmap = (HBITMAP)SelectObject( hScratch, hBitmap );
+    if ( vp->clip != 0 )
+        hRGN = CreateRectRgn( vp->left, vp->top, vp->right, vp->bottom );
+    SelectClipRgn( hScratch, hRGN );
+    DeleteRgn( hRGN );
+    SetViewportOrgEx( hScratch, vp->left, vp->top, NULL );
+    GetCurrentPositionEx( hPageDC, &cp );
+
+    SaveState( pWndData, &before );
+    pWndData->hDC[page] = hScratch;
+    pWndData->pBits[page] = pBits;
+    pWndData->refreshing = false;
+
+    black = new DWORD[width * height];
+    white = (DWORD*)pBits;
+    for ( int pass = 0; pass < 2; pass++ )
+    {
+        ApplyState( &before );
+        MoveToEx( hScratch, cp.x, cp.y, NULL );
+        GdiFlush( );
+        memset( pBits, ( pass == 0 ) ? 0x00 : 0xFF, width * height * sizeof( DWORD ) );
+        ExecList( pWndData, list, dx, dy );
+        GdiFlush( );
+        if ( pass == 0 )
+            memcpy( black, pBits, width * height * sizeof( DWORD ) );
+    }
+    GetCurrentPositionEx( hScratch, &list->cp );
+    list->arcInfo = pWndData->arcInfo;
+
+    // Keep each run of pixels that did not depend on the background.
+    list->spans.clear( );
+    list->pixels.clear( );
+    SetRect( &list->bounds, width, height, 0, 0 );
+    for ( y = 0; y < height; y++ )
+    {
+        DWORD* b = black + y * width;
+        DWORD* w = white + y * width;
+        for ( x = 0; x < width; )
+        {
+            if ( ( ( b[x] ^ w[x] ) & 0x00FFFFFF ) != 0 )
+            {
+                x++;
+                continue;
+            }
+            for ( start = x; x < width && ( ( b[x] ^ w[x] ) & 0x00FFFFFF ) == 0; x++ )
+                ;
+            ListSpan span = { start, y, x - start };
+            list->spans.push_back( span );
+            list->pixels.insert( list->pixels.end( ), w + start, w + x );
+            list->bounds.left = min( list->bounds.left, start );
+            list->bounds.right = max( list->bounds.right, x );
+            list->bounds.top = min( list->bounds.top, y );
+            list->bounds.bottom = y + 1;
+        }
+    }
+    delete [] black;
+
+    // Put the real page back and give every page the state that the list
+    // leaves behind, since the real active page missed the changes.
+    SaveState( pWndData, &after );
+    pWndData->hDC[page] = hPageDC;
+    pWndData->pBits[page] = pPageBits;
+    pWndData->refreshing = refreshing;
+    ApplyState( &after );
+    if ( list->sets & STATE_CP )
+        MoveToEx( hPageDC, list->cp.x, list->cp.y, NULL );
+
+    DeletePen( SelectPen( hScratch, GetStockPen( WHITE_PEN ) ) );
+    DeleteBrush( SelectBrush( hScratch, GetStockBrush( WHITE_BRUSH ) ) );
+    SelectObject( hScratch, GetStockObject( SYSTEM_FONT ) );
+    SelectObject( hScratch, hOldBitmap );
+    DeleteBitmap( hBitmap );
+    DeleteDC( hScratch );
+    ReleaseMutex(pWndData->hDCMutex);
+
+    list->cached = true;
+}
+
+
+// This function draws a list by copying its snapshot to the active page, and
+// then leaves the state (and current position) as executing the list would.
+//
+static void DrawSnapshot( WindowData* pWndData, DisplayList* list )
+{
+    const DWORD* src = list->pixels.empty( ) ? NULL : &list->pixels[0];
+    const char* data = list->data.empty( ) ? NULL : &list->data[0];
+    std::vector<int> points;
+    HDC hDC;
+    BYTE* pBits;
+
+    hDC = BGI__GetWinbgiDC( );
+    GdiFlush( );
+    pBits = pWndData->pBits[pWndData->ActivePage];
+    for ( unsigned i = 0; i < list->spans.size( ); i++ )
+    {
+        const ListSpan& span = list->spans[i];
+        memcpy( pBits + span.y * pWndData->pitch + span.x * sizeof( DWORD ), src,
+                span.count * sizeof( DWORD ) );
+        src += span.count;
+    }
+    if ( list->sets & STATE_CP )
+        MoveToEx( hDC, list->cp.x, list->cp.y, NULL );
+    BGI__ReleaseWinbgiDC( );
+
+    for ( unsigned i = 0; i < list->finals.size( ); i++ )
+    {
+        const BGI__Command* c = &list->commands[list->finals[i]];
+        if ( !StateMatches( pWndData, c, data ) )
+            ExecCommand( c, data, 0, 0, points );
+    }
+    if ( list->arcs )
+        pWndData->arcInfo = list->arcInfo;
+
+    if ( !list->spans.empty( ) )
+    {
+        // The update rectangle is in logical coordinates.
+        RECT rect = list->bounds;
+        OffsetRect( &rect, -pWndData->viewportInfo.left, -pWndData->viewportInfo.top );
+        RefreshWindow( &rect );
+    }
+}
+
+
+/*****************************************************************************
+*
+*   Display list files
+*
+*****************************************************************************/
+// A display list file holds, in order:
+//   - a ListFileHeader
+//   - the commands, each one a BGI__Command (28 bytes)
+//   - zero bytes up to the next multiple of 8
+//   - the data table: the strings, points, fill patterns and images used by
+//     the commands, which refer to it by offset (arg[5]) and size (arg[4])
+// All numbers are little-endian, as they are in memory.  The images written
+// by putimage contain a BITMAP header, whose size depends on the size of a
+// pointer, so files with images can only be played by a build with the same
+// BITMAP size.
+#define LIST_FILE_MAGIC     0x4C444742      // "BGDL"
+#define LIST_FILE_VERSION   1
+
+struct ListFileHeader
+{
+    DWORD magic;                // LIST_FILE_MAGIC
+    DWORD version;              // LIST_FILE_VERSION
+    DWORD command_size;         // sizeof( BGI__Command )
+    DWORD bitmap_size;          // sizeof( BITMAP )
+    DWORD commands;             // Number of commands
+    DWORD data_offset;          // Byte offset of the data table in the file
+    DWORD data_size;            // Bytes in the data table
+    DWORD reserved;             // Zero
+};
+
+
+// This function checks that a command read from a file is safe to execute:
+// the op is known, the arguments that select a font, a style, a mode or a
+// justification are in range (some of them index tables), and its data
+// lies inside the data table and is the right shape.
+//
+static bool ValidCommand( const BGI__Command* c, const char* data, DWORD data_size, DWORD bitmap_size )
+{
+    const int* a = c->arg;
+
+    if ( c->op <= BGI__OP_NOP || c->op >= BGI__OP_COUNT || Info( c->op ).op != c->op )
+        return false;
+
+    switch ( c->op )
+    {
+    case BGI__OP_SETTEXTSTYLE:
+        // The font and the size index the table of font sizes in text.cpp.
+        return a[0] >= DEFAULT_FONT && a[0] <= BOLD_FONT && ( a[1] == HORIZ_DIR || a[1] == VERT_DIR )
+            && a[2] >= 0 && a[2] <= 10;
+    case BGI__OP_SETTEXTJUSTIFY:
+        return a[0] >= LEFT_TEXT && a[0] <= RIGHT_TEXT && a[1] >= BOTTOM_TEXT && a[1] <= TOP_TEXT;
+    case BGI__OP_SETUSERCHARSIZE:
+        return a[1] != 0 && a[3] != 0;
+    case BGI__OP_SETLINESTYLE:
+        return a[0] >= SOLID_LINE && a[0] <= USERBIT_LINE;
+    case BGI__OP_SETFILLSTYLE:
+        return a[0] >= EMPTY_FILL && a[0] <= USER_FILL;
+    case BGI__OP_SETWRITEMODE:
+        return a[0] == COPY_PUT || a[0] == XOR_PUT;
+    case BGI__OP_PUTIMAGE:
+        if ( a[2] < COPY_PUT || a[2] > NOT_PUT )
+            return false;
+        break;
+    case BGI__OP_DRAWPOLY:
+    case BGI__OP_FILLPOLY:
+    case BGI__OP_OUTTEXT:
+    case BGI__OP_OUTTEXTXY:
+    case BGI__OP_SETFILLPATTERN:
+        break;
+    default:
+        return true;            // No data
+    }
+
+    // drawpoly and fillpoly of no points record no data.
+    if ( a[4] == 0 && a[0] == 0 && ( c->op == BGI__OP_DRAWPOLY || c->op == BGI__OP_FILLPOLY ) )
+        return a[5] >= 0 && (DWORD)a[5] <= data_size;
+    if ( a[4] <= 0 || a[5] < 0 || (DWORD)a[5] > data_size || (DWORD)a[4] > data_size - a[5] )
+        return false;
+    switch ( c->op )
+    {
+    case BGI__OP_DRAWPOLY:
+    case BGI__OP_FILLPOLY:
+        return a[0] >= 0 && a[0] <= a[4] / (int)( 2 * sizeof( int ) ) && a[5] % sizeof( int ) == 0;
+    case BGI__OP_OUTTEXT:
+    case BGI__OP_OUTTEXTXY:
+        return data[a[5] + a[4] - 1] == '\0';
+    case BGI__OP_SETFILLPATTERN:
+        return a[4] >= 8;
+    case BGI__OP_PUTIMAGE:
+        {
+            BITMAP header;
+            if ( (DWORD)a[4] < bitmap_size )
+                return false;
+            memcpy( &header, data + a[5], sizeof( BITMAP ) );
+            int bits = header.bmBitsPixel;
+            if ( bits != 1 && bits != 4 && bits != 8 && bits != 16 && bits != 24 && bits != 32 )
+                return false;
+            return header.bmHeight >= 0 && header.bmWidthBytes >= 0 && header.bmWidth >= 0
+                && header.bmWidthBytes >= ( (__int64)header.bmWidth * bits + 7 ) / 8
+                && (__int64)header.bmHeight * header.bmWidthBytes <= a[4] - (__int64)sizeof( BITMAP );
+        }
+    }
+    return true;
+}
+
+
+// This function writes size bytes to a file, returning false on failure.
+//
+static bool WriteAll( HANDLE hFile, const void* p, DWORD size )
+{
+    DWORD written;
+
+    return size == 0 || ( WriteFile( hFile, p, size, &written, NULL ) && written == size );
+}
+
+
+/*****************************************************************************
+*
+*   BGI__Recorder
+*
+*****************************************************************************/
+
+BGI__Recorder::BGI__Recorder( int op, int a0, int a1, int a2, int a3, int a4, int a5 )
+    : counter( op )
+{
+    pWndData = BGI__GetWindowDataPtr( );
+    if ( pWndData->recording == NULL )
+    {
+        pWndData = NULL;
+        return;
+    }
+    if ( pWndData->record_mute++ == 0 )
+    {
+        int args[6] = { a0, a1, a2, a3, a4, a5 };
+        Append( pWndData->recording, op, args, NULL, 0 );
+    }
+}
+
+
+BGI__Recorder::BGI__Recorder( int op, int a0, int a1, const void* data, int size, int a2 )
+    : counter( op )
+{
+    pWndData = BGI__GetWindowDataPtr( );
+    if ( pWndData->recording == NULL )
+    {
+        pWndData = NULL;
+        return;
+    }
+    if ( pWndData->record_mute++ == 0 )
+    {
+        int args[6] = { a0, a1, a2, 0, 0, 0 };
+        Append( pWndData->recording, op, args, data, size );
+    }
+}
+
+
+BGI__Recorder::~BGI__Recorder( )
+{
+    if ( pWndData != NULL )
+        pWndData->record_mute--;
+}
+
+
+/*****************************************************************************
+*
+*   The actual API calls are implemented below
+*
+*****************************************************************************/
+
+// This function starts recording a display list for the current window.
+// Until endrecord is called, drawing calls and state changes are still drawn
+// as usual, but they are also added to the list.
+//
+__declspec(dllexport) void beginrecord( )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+
+    if ( pWndData->recording != NULL )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    pWndData->recording = new DisplayList;
+    pWndData->record_mute = 0;
+}
+
+
+// This function finishes the display list of the current window and returns
+// its handle, or -1 if no list was being recorded.
+//
+__declspec(dllexport) int endrecord( )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    DisplayList* list = pWndData->recording;
+
+    if ( list == NULL )
+    {
+        pWndData->error_code = grError;
+        return -1;
+    }
+    pWndData->recording = NULL;
+
+    FoldStateChanges( list );
+    Analyze( list );
+    list->seen = false;
+    list->cached = false;
+
+    for ( unsigned i = 0; i < BGI__Lists.size( ); i++ )
+    {
+        if ( BGI__Lists[i] == NULL )
+        {
+            BGI__Lists[i] = list;
+            return i;
+        }
+    }
+    BGI__Lists.push_back( list );
+    return (int)BGI__Lists.size( ) - 1;
+}
+
+
+// This function draws a display list in the current window, with every
+// coordinate moved by (dx,dy).  Like calling the recorded functions again,
+// the list leaves the drawing state and current position as it set them.
+//
+__declspec(dllexport) void replay( int list, int dx, int dy )
+{
+    BGI__Counter counter( BGI__CALL_REPLAY );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    DisplayList* pList;
+    ListKey key;
+
+    if ( list < 0 || list >= (int)BGI__Lists.size( ) || BGI__Lists[list] == NULL )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    pList = BGI__Lists[list];
+
+    // While another list is being recorded, the commands must go through
+    // the normal calls so that they are recorded too.  Snapshots are only
+    // kept for 32-bit pages.
+    if ( pWndData->recording != NULL || pWndData->page_format != XRGB8888_PAGES
+         || !MakeKey( pWndData, pList, dx, dy, &key ) )
+    {
+        ExecList( pWndData, pList, dx, dy );
+        return;
+    }
+
+    if ( pList->seen && memcmp( &key, &pList->key, sizeof( ListKey ) ) == 0 )
+    {
+        if ( !pList->cached )
+            MakeSnapshot( pWndData, pList, dx, dy );
+        if ( pList->cached )
+        {
+            DrawSnapshot( pWndData, pList );
+            return;
+        }
+    }
+    else
+    {
+        pList->key = key;
+        pList->seen = true;
+        pList->cached = false;
+        pList->spans.clear( );
+        pList->pixels.clear( );
+    }
+    ExecList( pWndData, pList, dx, dy );
+}
+
+
+// This function frees a display list.  Its handle may be reused.
+//
+__declspec(dllexport) void deletelist( int list )
+{
+    if ( list < 0 || list >= (int)BGI__Lists.size( ) )
+        return;
+    delete BGI__Lists[list];
+    BGI__Lists[list] = NULL;
+}
+
+
+// This function saves a display list to a file that replayfile can play.
+// If the file cannot be written, the error code is set to grError.
+//
+__declspec(dllexport) void savelist( int list, const char* filename )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    DisplayList* pList;
+    ListFileHeader header;
+    HANDLE hFile;
+    DWORD pad;
+    bool ok;
+    char zeros[8] = { 0 };
+
+    if ( list < 0 || list >= (int)BGI__Lists.size( ) || BGI__Lists[list] == NULL || filename == NULL )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    pList = BGI__Lists[list];
+
+    memset( &header, 0, sizeof( header ) );
+    header.magic = LIST_FILE_MAGIC;
+    header.version = LIST_FILE_VERSION;
+    header.command_size = sizeof( BGI__Command );
+    header.bitmap_size = sizeof( BITMAP );
+    header.commands = (DWORD)pList->commands.size( );
+    header.data_offset = sizeof( header ) + header.commands * sizeof( BGI__Command );
+    pad = ( 8 - header.data_offset % 8 ) % 8;
+    header.data_offset += pad;
+    header.data_size = (DWORD)pList->data.size( );
+
+    hFile = CreateFile( filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if ( hFile == INVALID_HANDLE_VALUE )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    ok = WriteAll( hFile, &header, sizeof( header ) )
+      && ( header.commands == 0
+           || WriteAll( hFile, &pList->commands[0], header.commands * sizeof( BGI__Command ) ) )
+      && WriteAll( hFile, zeros, pad )
+      && ( header.data_size == 0 || WriteAll( hFile, &pList->data[0], header.data_size ) );
+    CloseHandle( hFile );
+    if ( !ok )
+    {
+        DeleteFile( filename );
+        pWndData->error_code = grError;
+    }
+}
+
+
+// This function plays a display list file saved by savelist, with every
+// coordinate moved by (dx,dy).  The file is mapped into memory and the
+// commands are executed where they lie; nothing is copied or parsed into
+// other structures.  If the file is missing, damaged or was written by an
+// incompatible build, nothing is drawn and the error code is set to grError.
+//
+__declspec(dllexport) void replayfile( const char* filename, int dx, int dy )
+{
+    BGI__Counter counter( BGI__CALL_REPLAYFILE );
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    HANDLE hFile, hMapping;
+    const char* base;
+    const ListFileHeader* header;
+    const BGI__Command* cmds;
+    const char* data;
+    DWORD size, i;
+    bool ok;
+
+    hFile = CreateFile( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if ( hFile == INVALID_HANDLE_VALUE )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    size = GetFileSize( hFile, NULL );
+    hMapping = ( size >= sizeof( ListFileHeader ) )
+             ? CreateFileMapping( hFile, NULL, PAGE_READONLY, 0, 0, NULL ) : NULL;
+    base = ( hMapping != NULL ) ? (const char*)MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+
+    ok = ( base != NULL );
+    if ( ok )
+    {
+        header = (const ListFileHeader*)base;
+        ok = header->magic == LIST_FILE_MAGIC && header->version == LIST_FILE_VERSION
+          && header->command_size == sizeof( BGI__Command ) && header->bitmap_size == sizeof( BITMAP )
+          && header->data_offset % 8 == 0 && header->data_offset >= sizeof( ListFileHeader )
+          && header->data_offset <= size
+          && header->data_size <= size - header->data_offset
+          && header->commands <= ( header->data_offset - sizeof( ListFileHeader ) ) / sizeof( BGI__Command );
+    }
+    if ( ok )
+    {
+        cmds = (const BGI__Command*)( base + sizeof( ListFileHeader ) );
+        data = base + header->data_offset;
+        for ( i = 0; ok && i < header->commands; i++ )
+            ok = ValidCommand( &cmds[i], data, header->data_size, header->bitmap_size );
+        if ( ok )
+            ExecCommands( pWndData, cmds, header->commands, data, dx, dy );
+    }
+    if ( !ok )
+        pWndData->error_code = grError;
+
+    if ( base != NULL )
+        UnmapViewOfFile( base );
+    if ( hMapping != NULL )
+        CloseHandle( hMapping );
+    CloseHandle( hFile );
+}
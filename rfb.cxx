@@ -0,0 +1,793 @@
+// File: rfb.cxx
+//
+// This file contains a small RFB (VNC) server, so that a window can be seen
+// and used from any VNC viewer, for example on a machine without a desktop
+// session.  It speaks version 3.8 of the protocol (and the older 3.7 and 3.3
+// handshakes) with no password, and it listens on the loopback interface
+// only (use an SSH tunnel or similar to reach it from another machine).
+//
+// Each time the window is painted, the visual page is copied for the server
+// thread, which keeps only the newest frame.  When the viewer asks for an
+// update, the page is compared, 16 by 16 pixel tile by tile, with what the
+// viewer already has, and only the changed tiles are sent, in the raw, RRE or
+// hextile encoding (whichever the viewer lists first), and in the pixel
+// format that the viewer asks for.  Pointer and key events from the viewer
+// are posted to the window as mouse and keyboard messages, so that they reach
+// the clicks queues, the mouse handlers and the keyboard queue just as local
+// input does.
+//
+// One viewer is served at a time; when it disconnects, the next one can
+// connect.  Viewers that need a color map (rather than true color) are not
+// supported.  The listening socket, the handing over of frames and the
+// sending are shared with the frame streamer (frameserver.cpp).
+//
+// There is no authentication: any local program that connects can send input
+// to the window.  initwindow starts a server by itself when BGI_RFB_PORT is
+// set (see winbgi.h).
+//
+
+#include <winsock2.h>       // Provides sockets (must come before windows.h)
+#include <windows.h>        // Provides the Win32 API
+#include <windowsx.h>       // Provides message cracker macros
+#include <stdlib.h>         // Provides atoi
+#include <string.h>         // Provides memcmp and memcpy
+#include <algorithm>        // Provides sort
+#include <vector>           // Provides STL vector class
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+#include "frameserver.h"    // The shared frame server
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Structures and constants
+*
+*****************************************************************************/
+#define RFB_TILE        16      // Width and height of a tile (as in hextile)
+#define RFB_WAIT        20      // Milliseconds between checks for messages
+#define RFB_TIMEOUT     5000    // Milliseconds a viewer may take to finish a message
+
+// Encodings that the server can send
+#define RFB_RAW         0
+#define RFB_RRE         2
+#define RFB_HEXTILE     5
+
+// Bits of the subencoding of a hextile tile
+#define HEXTILE_RAW             1
+#define HEXTILE_BACKGROUND      2
+#define HEXTILE_FOREGROUND      4
+#define HEXTILE_ANY_SUBRECTS    8
+#define HEXTILE_COLORED         16
+
+// The pixel format that the viewer wants.  Only true color is supported.
+struct RfbFormat
+{
+    int bytes;                  // Bytes per pixel: 1, 2 or 4
+    bool big_endian;
+    int red_max, green_max, blue_max;
+    int red_shift, green_shift, blue_shift;
+};
+
+// One rectangle of a single color, within a rectangle being encoded
+struct RfbSubrect
+{
+    DWORD pixel;
+    int x, y, width, height;
+};
+
+// The state of a server: the frames and the viewer (see frameserver.h), the
+// window, and what the viewer has asked for.
+struct RfbServer : BGI__FrameServer
+{
+    HWND hWnd;                  // The window, which gets the input events
+    std::string name;           // Desktop name shown by the viewer
+
+    // State of the connected viewer
+    RfbFormat format;           // Pixel format it wants
+    int encoding;               // Encoding it prefers
+    bool fresh;                 // latest has a frame that work does not
+    bool pending;               // It asked for an update that is not sent yet
+    bool incremental;           // Only the changes are needed for that update
+    RECT wanted;                // Part of the frame that it asked for
+    int buttons;                // Mouse buttons that are down
+    POINTS pointer;             // Last pointer position
+    bool control;               // A control key is down
+};
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function adds a big-endian number of the given number of bytes.
+//
+static void PutBE( std::vector<BYTE>& out, DWORD value, int bytes )
+{
+    for ( int i = bytes - 1; i >= 0; i-- )
+        out.push_back( (BYTE)( value >> ( 8 * i ) ) );
+}
+
+
+// This function reads a big-endian number of the given number of bytes.
+//
+static DWORD GetBE( const BYTE* in, int bytes )
+{
+    DWORD value = 0;
+
+    for ( int i = 0; i < bytes; i++ )
+        value = ( value << 8 ) | in[i];
+    return value;
+}
+
+
+// This function converts a pixel of a page (0x00RRGGBB) to the pixel format
+// of the viewer.
+//
+static DWORD ConvertPixel( const RfbFormat& f, DWORD pixel )
+{
+    DWORD r = ( pixel >> 16 ) & 0xFF, g = ( pixel >> 8 ) & 0xFF, b = pixel & 0xFF;
+
+    return ( ( r * f.red_max + 127 ) / 255 ) << f.red_shift
+         | ( ( g * f.green_max + 127 ) / 255 ) << f.green_shift
+         | ( ( b * f.blue_max + 127 ) / 255 ) << f.blue_shift;
+}
+
+
+// This function returns true if a channel of a pixel format from the viewer
+// (its maximum and shift) fits in a pixel of the given number of bits, so
+// that ConvertPixel never shifts a value by 32 or more.
+//
+static bool ChannelFits( int max, int shift, int bits )
+{
+    int width = 0;
+
+    while ( ( max >> width ) != 0 )
+        width++;
+    return shift + width <= bits;
+}
+
+
+// This function adds one converted pixel, in the byte order of the viewer.
+//
+static void PutPixel( std::vector<BYTE>& out, const RfbFormat& f, DWORD value )
+{
+    for ( int i = 0; i < f.bytes; i++ )
+        out.push_back( (BYTE)( value >> ( 8 * ( f.big_endian ? f.bytes - 1 - i : i ) ) ) );
+}
+
+
+// This function returns the pixel that occurs most often in a list.
+//
+static DWORD Background( std::vector<DWORD> pixels )
+{
+    DWORD best = pixels[0];
+    size_t i, j, most = 0;
+
+    std::sort( pixels.begin( ), pixels.end( ) );
+    for ( i = 0; i < pixels.size( ); i = j )
+    {
+        for ( j = i + 1; j < pixels.size( ) && pixels[j] == pixels[i]; j++ )
+            ;
+        if ( j - i > most )
+        {
+            most = j - i;
+            best = pixels[i];
+        }
+    }
+    return best;
+}
+
+
+// This function covers the pixels of a rectangle that are not the background
+// with rectangles of one color each.  Each one is as wide as possible and
+// then as tall as possible.  It gives up and returns false when more than
+// limit rectangles would be needed.
+//
+static bool FindSubrects( const std::vector<DWORD>& pixels, int width, int height,
+                          DWORD background, size_t limit, std::vector<RfbSubrect>& out )
+{
+    std::vector<bool> done( pixels.size( ), false );
+    RfbSubrect s;
+    int x, y, i;
+
+    out.clear( );
+    for ( y = 0; y < height; y++ )
+        for ( x = 0; x < width; x++ )
+        {
+            if ( done[y * width + x] || pixels[y * width + x] == background )
+                continue;
+            if ( out.size( ) == limit )
+                return false;
+            s.pixel = pixels[y * width + x];
+            s.x = x;
+            s.y = y;
+            for ( s.width = 1; x + s.width < width; s.width++ )
+                if ( done[y * width + x + s.width] || pixels[y * width + x + s.width] != s.pixel )
+                    break;
+            for ( s.height = 1; y + s.height < height; s.height++ )
+            {
+                for ( i = 0; i < s.width; i++ )
+                    if ( done[( y + s.height ) * width + x + i] || pixels[( y + s.height ) * width + x + i] != s.pixel )
+                        break;
+                if ( i < s.width )
+                    break;
+            }
+            for ( int row = y; row < y + s.height; row++ )
+                for ( i = 0; i < s.width; i++ )
+                    done[row * width + x + i] = true;
+            out.push_back( s );
+        }
+    return true;
+}
+
+
+// This function takes the pixels of part of the work frame, converted to the
+// pixel format of the viewer.
+//
+static void GetPixels( RfbServer* sv, int left, int top, int right, int bottom, std::vector<DWORD>& pixels )
+{
+    pixels.clear( );
+    for ( int y = top; y < bottom; y++ )
+    {
+        const DWORD* row = (const DWORD*)( sv->work + y * sv->pitch );
+        for ( int x = left; x < right; x++ )
+            pixels.push_back( ConvertPixel( sv->format, row[x] & 0x00FFFFFF ) );
+    }
+}
+
+
+// This function adds a rectangle in the raw encoding.
+//
+static void EncodeRaw( std::vector<BYTE>& out, const RfbFormat& f, const std::vector<DWORD>& pixels )
+{
+    for ( size_t i = 0; i < pixels.size( ); i++ )
+        PutPixel( out, f, pixels[i] );
+}
+
+
+// This function adds a rectangle in the RRE encoding: a background color and
+// the rectangles that are drawn over it.
+//
+static void EncodeRRE( std::vector<BYTE>& out, const RfbFormat& f,
+                       const std::vector<DWORD>& pixels, int width, int height )
+{
+    std::vector<RfbSubrect> subrects;
+    DWORD background = Background( pixels );
+
+    FindSubrects( pixels, width, height, background, pixels.size( ), subrects );
+    PutBE( out, (DWORD)subrects.size( ), 4 );
+    PutPixel( out, f, background );
+    for ( size_t i = 0; i < subrects.size( ); i++ )
+    {
+        PutPixel( out, f, subrects[i].pixel );
+        PutBE( out, subrects[i].x, 2 );
+        PutBE( out, subrects[i].y, 2 );
+        PutBE( out, subrects[i].width, 2 );
+        PutBE( out, subrects[i].height, 2 );
+    }
+}
+
+
+// This function adds a rectangle in the hextile encoding.  Each tile states
+// its own background, so no tile depends on the one before it, and a tile
+// whose rectangles would take more room than its pixels is sent raw.
+//
+static void EncodeHextile( std::vector<BYTE>& out, RfbServer* sv, int left, int top, int right, int bottom )
+{
+    const RfbFormat& f = sv->format;
+    std::vector<DWORD> pixels;
+    std::vector<RfbSubrect> subrects;
+    DWORD background;
+    size_t i, raw_size, limit;
+    bool one_color;
+    int x, y, width, height;
+
+    for ( y = top; y < bottom; y += RFB_TILE )
+        for ( x = left; x < right; x += RFB_TILE )
+        {
+            width = min( RFB_TILE, right - x );
+            height = min( RFB_TILE, bottom - y );
+            GetPixels( sv, x, y, x + width, y + height, pixels );
+            background = Background( pixels );
+
+            // Each colored rectangle takes a pixel and 2 bytes, so a tile
+            // that needs more than this many is smaller raw.
+            raw_size = pixels.size( ) * f.bytes;
+            limit = ( raw_size - f.bytes ) / ( f.bytes + 2 );
+            if ( !FindSubrects( pixels, width, height, background, min( limit, (size_t)255 ), subrects ) )
+            {
+                out.push_back( HEXTILE_RAW );
+                EncodeRaw( out, f, pixels );
+                continue;
+            }
+            if ( subrects.size( ) == 0 )
+            {
+                out.push_back( HEXTILE_BACKGROUND );
+                PutPixel( out, f, background );
+                continue;
+            }
+
+            one_color = true;
+            for ( i = 1; i < subrects.size( ); i++ )
+                if ( subrects[i].pixel != subrects[0].pixel )
+                    one_color = false;
+            out.push_back( HEXTILE_BACKGROUND | HEXTILE_ANY_SUBRECTS
+                           | ( one_color ? HEXTILE_FOREGROUND : HEXTILE_COLORED ) );
+            PutPixel( out, f, background );
+            if ( one_color )
+                PutPixel( out, f, subrects[0].pixel );
+            out.push_back( (BYTE)subrects.size( ) );
+            for ( i = 0; i < subrects.size( ); i++ )
+            {
+                if ( !one_color )
+                    PutPixel( out, f, subrects[i].pixel );
+                out.push_back( (BYTE)( ( subrects[i].x << 4 ) | subrects[i].y ) );
+                out.push_back( (BYTE)( ( ( subrects[i].width - 1 ) << 4 ) | ( subrects[i].height - 1 ) ) );
+            }
+        }
+}
+
+
+// This function receives exactly size bytes.  It returns false if the viewer
+// has gone away or took too long.
+//
+static bool RecvAll( SOCKET s, BYTE* in, int size )
+{
+    int got;
+
+    while ( size > 0 )
+    {
+        got = recv( s, (char*)in, size, 0 );
+        if ( got <= 0 )
+            return false;
+        in += got;
+        size -= got;
+    }
+    return true;
+}
+
+
+// This function answers the update that the viewer asked for, if there is
+// something to send.  The changed tiles of each row of tiles are joined into
+// one rectangle.  It returns false if the viewer has gone away.
+//
+static bool SendUpdate( RfbServer* sv )
+{
+    std::vector<BYTE> out;
+    std::vector<DWORD> pixels;
+    std::vector<RECT> rects;
+    RECT r;
+    int left, top, right, bottom, first, last;
+    size_t i;
+
+    // The tiles that the wanted area touches
+    first = sv->wanted.left / RFB_TILE * RFB_TILE;
+    last = min( ( sv->wanted.right + RFB_TILE - 1 ) / RFB_TILE * RFB_TILE, sv->width );
+    for ( top = sv->wanted.top / RFB_TILE * RFB_TILE; top < sv->wanted.bottom; top += RFB_TILE )
+    {
+        bottom = min( top + RFB_TILE, sv->height );
+        for ( left = first; left < last; left = right )
+        {
+            right = min( left + RFB_TILE, sv->width );
+            if ( sv->incremental && BGI__SameTile( sv, left, top, right, bottom ) )
+                continue;
+            if ( rects.size( ) && rects.back( ).top == top && rects.back( ).right == left )
+                rects.back( ).right = right;
+            else
+            {
+                r.left = left; r.top = top; r.right = right; r.bottom = bottom;
+                rects.push_back( r );
+            }
+        }
+    }
+    if ( rects.size( ) == 0 && sv->incremental )
+        return true;            // Nothing changed, so wait for another frame
+    if ( rects.size( ) > 0xFFFF )
+    {   // Too many for one update, so send all of the tiles instead
+        rects.clear( );
+        r.left = first;
+        r.top = sv->wanted.top / RFB_TILE * RFB_TILE;
+        r.right = last;
+        r.bottom = min( ( sv->wanted.bottom + RFB_TILE - 1 ) / RFB_TILE * RFB_TILE, sv->height );
+        rects.push_back( r );
+    }
+
+    out.push_back( 0 );         // FramebufferUpdate
+    out.push_back( 0 );
+    PutBE( out, (DWORD)rects.size( ), 2 );
+    for ( i = 0; i < rects.size( ); i++ )
+    {
+        r = rects[i];
+        PutBE( out, r.left, 2 );
+        PutBE( out, r.top, 2 );
+        PutBE( out, r.right - r.left, 2 );
+        PutBE( out, r.bottom - r.top, 2 );
+        PutBE( out, sv->encoding, 4 );
+        if ( sv->encoding == RFB_HEXTILE )
+            EncodeHextile( out, sv, r.left, r.top, r.right, r.bottom );
+        else
+        {
+            GetPixels( sv, r.left, r.top, r.right, r.bottom, pixels );
+            if ( sv->encoding == RFB_RRE )
+                EncodeRRE( out, sv->format, pixels, r.right - r.left, r.bottom - r.top );
+            else
+                EncodeRaw( out, sv->format, pixels );
+        }
+
+        // The viewer will have these tiles now
+        for ( int y = r.top; y < r.bottom; y++ )
+            memcpy( sv->sent + y * sv->pitch + 4 * r.left, sv->work + y * sv->pitch + 4 * r.left, 4 * ( r.right - r.left ) );
+    }
+    sv->pending = false;
+    return BGI__SendAll( sv->viewer, out );
+}
+
+
+// This function posts the mouse messages for a pointer event to the window.
+//
+static void InjectPointer( RfbServer* sv, int buttons, int x, int y )
+{
+    static const UINT down[3] = { WM_LBUTTONDOWN, WM_MBUTTONDOWN, WM_RBUTTONDOWN };
+    static const UINT up[3] = { WM_LBUTTONUP, WM_MBUTTONUP, WM_RBUTTONUP };
+    static const WPARAM keys[3] = { MK_LBUTTON, MK_MBUTTON, MK_RBUTTON };
+    WPARAM held = 0;
+    LPARAM where;
+    int i;
+
+    x = min( x, sv->width - 1 );
+    y = min( y, sv->height - 1 );
+    where = MAKELPARAM( x, y );
+    for ( i = 0; i < 3; i++ )
+        if ( buttons & ( 1 << i ) )
+            held |= keys[i];
+
+    if ( x != sv->pointer.x || y != sv->pointer.y )
+        PostMessage( sv->hWnd, WM_MOUSEMOVE, held, where );
+    for ( i = 0; i < 3; i++ )
+        if ( ( buttons ^ sv->buttons ) & ( 1 << i ) )
+            PostMessage( sv->hWnd, ( buttons & ( 1 << i ) ) ? down[i] : up[i], held, where );
+    sv->buttons = buttons;
+    sv->pointer.x = (SHORT)x;
+    sv->pointer.y = (SHORT)y;
+}
+
+
+// This function posts the keyboard message for a key event to the window.
+// Characters become WM_CHAR messages (control letters become control
+// characters), and the keys that getch reports with a 0 first become the
+// WM_KEYDOWN messages that cls_OnKey in winthread.cpp understands.
+//
+static void InjectKey( RfbServer* sv, bool down, DWORD key )
+{
+    static const struct { DWORD key; UINT vk; } keys[] =
+    {
+        { 0xFF50, VK_HOME }, { 0xFF51, VK_LEFT }, { 0xFF52, VK_UP }, { 0xFF53, VK_RIGHT },
+        { 0xFF54, VK_DOWN }, { 0xFF55, VK_PRIOR }, { 0xFF56, VK_NEXT }, { 0xFF57, VK_END },
+        { 0xFF63, VK_INSERT }, { 0xFFFF, VK_DELETE }, { 0xFF9D, VK_CLEAR },
+        { 0xFFBE, VK_F1 }, { 0xFFBF, VK_F2 }, { 0xFFC0, VK_F3 }, { 0xFFC1, VK_F4 },
+        { 0xFFC2, VK_F5 }, { 0xFFC3, VK_F6 }, { 0xFFC4, VK_F7 }, { 0xFFC5, VK_F8 },
+        { 0xFFC6, VK_F9 }
+    };
+    int ch = -1;
+
+    if ( key == 0xFFE3 || key == 0xFFE4 )
+        sv->control = down;     // Control_L or Control_R
+    if ( !down )
+        return;
+
+    if ( ( key >= 0x20 && key <= 0x7E ) || ( key >= 0xA0 && key <= 0xFF ) )
+        ch = ( sv->control && ( key >= '@' && key <= 0x7E ) ) ? ( key & 0x1F ) : key;
+    else if ( key == 0xFF08 )
+        ch = '\b';              // BackSpace
+    else if ( key == 0xFF09 )
+        ch = '\t';              // Tab
+    else if ( key == 0xFF0D || key == 0xFF8D )
+        ch = '\r';              // Return and KP_Enter
+    else if ( key == 0xFF1B )
+        ch = 27;                // Escape
+    if ( ch >= 0 )
+    {
+        PostMessage( sv->hWnd, WM_CHAR, (WPARAM)ch, 1 );
+        return;
+    }
+
+    for ( size_t i = 0; i < sizeof( keys ) / sizeof( keys[0] ); i++ )
+        if ( keys[i].key == key )
+            PostMessage( sv->hWnd, WM_KEYDOWN, keys[i].vk, 1 );
+}
+
+
+// This function reads and handles one message from the viewer.  It returns
+// false if the viewer has gone away or sent something that is not supported.
+//
+static bool HandleMessage( RfbServer* sv )
+{
+    BYTE in[20];
+    RECT r;
+    DWORD count, i;
+
+    if ( !RecvAll( sv->viewer, in, 1 ) )
+        return false;
+    switch ( in[0] )
+    {
+    case 0:                     // SetPixelFormat
+        if ( !RecvAll( sv->viewer, in, 19 ) )
+            return false;
+        if ( !in[6] || ( in[3] != 8 && in[3] != 16 && in[3] != 32 ) )
+            return false;       // Color maps are not supported
+        sv->format.bytes = in[3] / 8;
+        sv->format.big_endian = in[5] != 0;
+        sv->format.red_max = GetBE( in + 7, 2 );
+        sv->format.green_max = GetBE( in + 9, 2 );
+        sv->format.blue_max = GetBE( in + 11, 2 );
+        sv->format.red_shift = in[13];
+        sv->format.green_shift = in[14];
+        sv->format.blue_shift = in[15];
+        if ( !ChannelFits( sv->format.red_max, sv->format.red_shift, in[3] )
+             || !ChannelFits( sv->format.green_max, sv->format.green_shift, in[3] )
+             || !ChannelFits( sv->format.blue_max, sv->format.blue_shift, in[3] ) )
+            return false;       // A channel does not fit in the pixel
+        return true;
+
+    case 2:                     // SetEncodings
+        if ( !RecvAll( sv->viewer, in, 3 ) )
+            return false;
+        sv->encoding = RFB_RAW;
+        for ( i = 0, count = GetBE( in + 1, 2 ); i < count; i++ )
+        {
+            if ( !RecvAll( sv->viewer, in + 4, 4 ) )
+                return false;
+            if ( sv->encoding == RFB_RAW && ( GetBE( in + 4, 4 ) == RFB_RRE || GetBE( in + 4, 4 ) == RFB_HEXTILE ) )
+                sv->encoding = GetBE( in + 4, 4 );
+        }
+        return true;
+
+    case 3:                     // FramebufferUpdateRequest
+        if ( !RecvAll( sv->viewer, in, 9 ) )
+            return false;
+        r.left = min( (int)GetBE( in + 1, 2 ), sv->width );
+        r.top = min( (int)GetBE( in + 3, 2 ), sv->height );
+        r.right = min( r.left + (int)GetBE( in + 5, 2 ), sv->width );
+        r.bottom = min( r.top + (int)GetBE( in + 7, 2 ), sv->height );
+        if ( sv->pending )
+        {   // Join it to the request that is still waiting
+            r.left = min( r.left, sv->wanted.left );
+            r.top = min( r.top, sv->wanted.top );
+            r.right = max( r.right, sv->wanted.right );
+            r.bottom = max( r.bottom, sv->wanted.bottom );
+            sv->incremental = sv->incremental && in[0];
+        }
+        else
+            sv->incremental = in[0] != 0;
+        sv->wanted = r;
+        sv->pending = true;
+        return true;
+
+    case 4:                     // KeyEvent
+        if ( !RecvAll( sv->viewer, in, 7 ) )
+            return false;
+        InjectKey( sv, in[0] != 0, GetBE( in + 3, 4 ) );
+        return true;
+
+    case 5:                     // PointerEvent
+        if ( !RecvAll( sv->viewer, in, 5 ) )
+            return false;
+        InjectPointer( sv, in[0], GetBE( in + 1, 2 ), GetBE( in + 3, 2 ) );
+        return true;
+
+    case 6:                     // ClientCutText, which is ignored
+        if ( !RecvAll( sv->viewer, in, 7 ) )
+            return false;
+        for ( count = GetBE( in + 3, 4 ); count > 0; count -= i )
+        {
+            i = min( count, (DWORD)sizeof( in ) );
+            if ( !RecvAll( sv->viewer, in, i ) )
+                return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+
+// This function greets a new viewer: it agrees on the protocol version, on
+// no security, and tells the viewer the size, pixel format and name of the
+// desktop.  It returns false if the viewer does not go along.
+//
+static bool Handshake( RfbServer* sv )
+{
+    std::vector<BYTE> out;
+    BYTE in[12];
+    int minor;
+
+    out.insert( out.end( ), (const BYTE*)"RFB 003.008\n", (const BYTE*)"RFB 003.008\n" + 12 );
+    if ( !BGI__SendAll( sv->viewer, out ) || !RecvAll( sv->viewer, in, 12 ) || memcmp( in, "RFB 003.", 8 ) != 0 )
+        return false;
+    in[11] = 0;
+    minor = atoi( (const char*)in + 8 );
+
+    out.clear( );
+    if ( minor < 7 )
+        PutBE( out, 1, 4 );     // 3.3: the server picks security type None
+    else
+    {
+        out.push_back( 1 );     // One security type, None
+        out.push_back( 1 );
+        if ( !BGI__SendAll( sv->viewer, out ) || !RecvAll( sv->viewer, in, 1 ) || in[0] != 1 )
+            return false;
+        out.clear( );
+        if ( minor >= 8 )
+            PutBE( out, 0, 4 ); // SecurityResult OK
+    }
+    if ( ( out.size( ) && !BGI__SendAll( sv->viewer, out ) ) || !RecvAll( sv->viewer, in, 1 ) )
+        return false;           // The ClientInit message is ignored
+
+    // ServerInit, with the pixel format of the pages
+    sv->format.bytes = 4;
+    sv->format.big_endian = false;
+    sv->format.red_max = sv->format.green_max = sv->format.blue_max = 255;
+    sv->format.red_shift = 16;
+    sv->format.green_shift = 8;
+    sv->format.blue_shift = 0;
+    out.clear( );
+    PutBE( out, sv->width, 2 );
+    PutBE( out, sv->height, 2 );
+    out.push_back( 32 );        // Bits per pixel
+    out.push_back( 24 );        // Depth
+    out.push_back( 0 );         // Little-endian
+    out.push_back( 1 );         // True color
+    PutBE( out, 255, 2 );
+    PutBE( out, 255, 2 );
+    PutBE( out, 255, 2 );
+    out.push_back( 16 );
+    out.push_back( 8 );
+    out.push_back( 0 );
+    out.insert( out.end( ), 3, 0 );
+    PutBE( out, (DWORD)sv->name.size( ), 4 );
+    out.insert( out.end( ), sv->name.begin( ), sv->name.end( ) );
+    return BGI__SendAll( sv->viewer, out );
+}
+
+
+// This is the entry point of the server thread.  It waits for a viewer, and
+// while one is connected, handles its messages and answers its update
+// requests whenever there is a new frame.
+//
+static DWORD WINAPI RfbThread( LPVOID pThreadData )
+{
+    RfbServer* sv = (RfbServer*)pThreadData;
+    DWORD timeout = RFB_TIMEOUT;
+    fd_set ready;
+    timeval wait;
+    bool ok;
+
+    while ( !sv->stopping )
+    {
+        wait.tv_sec = 0;
+        wait.tv_usec = RFB_WAIT * 1000;
+        if ( sv->viewer == INVALID_SOCKET )
+        {
+            if ( !BGI__AcceptViewer( sv, RFB_WAIT ) )
+                continue;
+
+            // A viewer that stops in the middle of a message is dropped.
+            setsockopt( sv->viewer, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof( timeout ) );
+            sv->encoding = RFB_RAW;
+            sv->fresh = true;
+            sv->pending = false;
+            sv->buttons = 0;
+            sv->pointer.x = sv->pointer.y = -1;
+            sv->control = false;
+            if ( !Handshake( sv ) )
+                BGI__DropViewer( sv );
+            continue;
+        }
+
+        FD_ZERO( &ready );
+        FD_SET( sv->viewer, &ready );
+        ok = true;
+        if ( select( 0, &ready, NULL, NULL, &wait ) > 0 )
+            ok = HandleMessage( sv );
+        if ( WaitForSingleObject( sv->hReady, 0 ) == WAIT_OBJECT_0 )
+            sv->fresh = true;
+
+        // An incremental update waits for a frame with changes in it.
+        if ( ok && sv->pending && ( sv->fresh || !sv->incremental ) )
+        {
+            if ( sv->fresh )
+            {
+                BGI__TakeFrame( sv );
+                sv->fresh = false;
+            }
+            ok = SendUpdate( sv );
+        }
+        if ( !ok )
+            BGI__DropViewer( sv );
+    }
+
+    if ( sv->viewer != INVALID_SOCKET )
+        BGI__DropViewer( sv );
+    return 0;
+}
+
+
+// This function gives the visual page of a window to the server thread.  It
+// is called by cls_OnPaint (and by startrfbserver, for the first frame),
+// with the DC mutex held.
+// (used by cls_OnPaint in winthread.cpp)
+//
+void BGI__RfbFrame( WindowData* pWndData )
+{
+    BGI__PutFrame( pWndData->rfb, pWndData );
+}
+
+
+// This function stops the RFB server of a window, if there is one.
+// (used by cls_OnDestroy in winthread.cpp)
+//
+void BGI__StopRfbServer( WindowData* pWndData )
+{
+    RfbServer* sv;
+
+    WaitForSingleObject( pWndData->hDCMutex, INFINITE );
+    sv = pWndData->rfb;
+    pWndData->rfb = NULL;
+    ReleaseMutex( pWndData->hDCMutex );
+    if ( sv == NULL )
+        return;
+
+    BGI__CloseFrameServer( sv );
+    delete sv;
+}
+
+
+/*****************************************************************************
+*
+*   The actual API calls are implemented below
+*
+*****************************************************************************/
+
+// This function starts an RFB (VNC) server for the current window on the
+// given TCP port of the loopback interface (127.0.0.1).  A server that is
+// already running for the window is stopped first.  Frames are handed to
+// the server only when the window paints, so while the window is minimized
+// the viewers keep the last frame.
+//
+__declspec(dllexport) void startrfbserver( int port )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    RfbServer* sv;
+
+    BGI__StopRfbServer( pWndData );
+    sv = new RfbServer;
+    sv->hWnd = pWndData->hWnd;
+    sv->name = pWndData->title.size( ) ? pWndData->title : "winbgim";
+    if ( !BGI__OpenFrameServer( sv, pWndData, port, RfbThread, (LPVOID)sv ) )
+    {
+        delete sv;
+        pWndData->error_code = grError;
+        return;
+    }
+
+    WaitForSingleObject( pWndData->hDCMutex, INFINITE );
+    pWndData->rfb = sv;
+    BGI__RfbFrame( pWndData );
+    ReleaseMutex( pWndData->hDCMutex );
+}
+
+
+// This function stops the RFB server of the current window.
+//
+__declspec(dllexport) void stoprfbserver( )
+{
+    BGI__StopRfbServer( BGI__GetWindowDataPtr( ) );
+}
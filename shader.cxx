@@ -0,0 +1,375 @@
+// File: shader.cxx
+//
+// This file contains the parallel pixel shading routines.  Instead of one
+// putpixel call (and one trip through the DC mutex) for every pixel, the
+// user supplies a function that computes the color of each pixel (or of each
+// row) in a region.  The region is split into tiles that are handed out to
+// one worker thread per processor.  The colors are written into a private
+// copy of the region, in the pixel format of the page, without any lock, so
+// a slow shader never holds up painting.  Each finished tile is then copied
+// into the pixel memory of the active page with the DC mutex held, and is
+// refreshed at once, so each pass shows up as it is shaded.
+//
+
+#include <windows.h>        // Provides the Win32 API
+#include <windowsx.h>       // Provides GDI helper macros
+#include <string.h>         // Provides memcpy and memset
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Structures and constants
+*
+*****************************************************************************/
+#define SHADE_TILE      64      // Width and height of a pixel shader tile
+#define SHADE_BAND      8       // Number of rows in a row shader tile
+#define SHADE_THREADS   64      // Most threads used (WaitForMultipleObjects limit)
+
+typedef int (*PixelShader)( int, int, void* );
+typedef void (*RowShader)( int, int, int, int*, void* );
+
+// This structure describes one pass of shading work.  It is shared by all of
+// the worker threads, which take tiles from it until none are left.
+struct ShadeJob
+{
+    WindowData* pWndData;       // The window, for converting colors
+    BYTE* pBits;                // Private copy of the region, where tiles are shaded
+    int pitch;                  // Bytes per row of pBits
+    BYTE* pPage;                // Pixel memory of the active page
+    int page_pitch;             // Bytes per row of pPage
+    bool refresh;               // Whether finished tiles are repainted
+    void (*shade)( ShadeJob*, int, int* );  // ShadeTile for the pixel size of the page
+    int left, top;              // Region to shade in device coordinates
+    int right, bottom;          // (the right and bottom edges are included)
+    int xorigin, yorigin;       // Viewport origin, subtracted for the user
+    PixelShader pixel;          // Per-pixel shader (NULL for a row shader)
+    RowShader row;              // Per-row shader (NULL for a pixel shader)
+    void* data;                 // User data passed along to the shader
+    int block;                  // Block size of this pass
+    int skip;                   // Block size of the previous pass (0 if none)
+    int tiles_across;           // Number of tiles in each row of tiles
+    int tiles;                  // Total number of tiles
+    volatile LONG next;         // Next tile to hand out
+};
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function stores one pixel (from BGI__ColorToPixel) in the private
+// copy of the region.  Pixel is BYTE, WORD or DWORD, for the size of the
+// pixels of the page.  x and y are device coordinates.
+//
+template <class Pixel>
+static inline void StorePixel( ShadeJob* job, int x, int y, DWORD pixel )
+{
+    ( (Pixel*)( job->pBits + ( y - job->top ) * job->pitch ) )[x - job->left] = (Pixel)pixel;
+}
+
+
+// This function fills a block of the private copy with one color.  The
+// block is given in device coordinates with both edges included.
+//
+template <class Pixel>
+static void FillBlock( ShadeJob* job, int left, int top, int right, int bottom, DWORD pixel )
+{
+    for ( int y = top; y <= bottom; y++ )
+    {
+        Pixel* p = (Pixel*)( job->pBits + ( y - job->top ) * job->pitch ) + ( left - job->left );
+        if ( sizeof( Pixel ) == 1 )
+        {
+            memset( p, (BYTE)pixel, right - left + 1 );
+            continue;
+        }
+        for ( int x = left; x <= right; x++ )
+            *p++ = (Pixel)pixel;
+    }
+}
+
+
+// This function copies a finished tile from the private copy to the page,
+// holding the DC mutex only for the copy, and marks it for repainting.  The
+// tile is given in device coordinates with both edges included.
+//
+template <class Pixel>
+static void CopyTile( ShadeJob* job, int left, int top, int right, int bottom )
+{
+    WindowData* pWndData = job->pWndData;
+    RECT rect = { left, top, right + 1, bottom + 1 };
+
+    WaitForSingleObject( pWndData->hDCMutex, 5000 );
+    for ( int y = top; y <= bottom; y++ )
+        memcpy( job->pPage + y * job->page_pitch + left * sizeof( Pixel ),
+                job->pBits + ( y - job->top ) * job->pitch + ( left - job->left ) * sizeof( Pixel ),
+                ( right - left + 1 ) * sizeof( Pixel ) );
+    ReleaseMutex( pWndData->hDCMutex );
+    if ( job->refresh )
+        InvalidateRect( pWndData->hWnd, &rect, FALSE );
+}
+
+
+// This function shades one tile of a job.  For a row shader the tiles are
+// bands of SHADE_BAND full rows, and colors is a buffer with room for one
+// row.  For a pixel shader the tiles are SHADE_TILE pixels square, and each
+// block of the current pass is filled with the color of its upper left
+// pixel.  Blocks whose upper left pixel was already shaded by the previous
+// (coarser) pass already have the right color and are skipped.  The tile is
+// copied to the page when it is done.
+//
+template <class Pixel>
+static void ShadeTile( ShadeJob* job, int tile, int* colors )
+{
+    int left, top, right, bottom;
+    int x, y, i;
+
+    if ( job->row != NULL )
+    {
+        top = job->top + tile * SHADE_BAND;
+        bottom = min( top + SHADE_BAND - 1, job->bottom );
+        for ( y = top; y <= bottom; y++ )
+        {
+            job->row( y - job->yorigin, job->left - job->xorigin,
+                      job->right - job->xorigin, colors, job->data );
+            for ( i = 0; i <= job->right - job->left; i++ )
+                StorePixel<Pixel>( job, job->left + i, y, BGI__ColorToPixel( job->pWndData, colors[i] ) );
+        }
+        CopyTile<Pixel>( job, job->left, top, job->right, bottom );
+        return;
+    }
+
+    left = job->left + ( tile % job->tiles_across ) * SHADE_TILE;
+    top = job->top + ( tile / job->tiles_across ) * SHADE_TILE;
+    right = min( left + SHADE_TILE - 1, job->right );
+    bottom = min( top + SHADE_TILE - 1, job->bottom );
+
+    for ( y = top; y <= bottom; y += job->block )
+    {
+        for ( x = left; x <= right; x += job->block )
+        {
+            if ( job->skip != 0 && ( x - job->left ) % job->skip == 0
+                                && ( y - job->top ) % job->skip == 0 )
+                continue;
+            DWORD pixel = BGI__ColorToPixel( job->pWndData, job->pixel( x - job->xorigin, y - job->yorigin, job->data ) );
+            if ( job->block == 1 )
+                StorePixel<Pixel>( job, x, y, pixel );
+            else
+                FillBlock<Pixel>( job, x, y, min( x + job->block - 1, right ),
+                           min( y + job->block - 1, bottom ), pixel );
+        }
+    }
+    CopyTile<Pixel>( job, left, top, right, bottom );
+}
+
+
+// This is the entry point of each worker thread.  It keeps taking the next
+// tile of the job until all of the tiles have been handed out.
+//
+static DWORD WINAPI ShadeThread( LPVOID pThreadData )
+{
+    ShadeJob* job = (ShadeJob*)pThreadData;
+    int* colors = NULL;         // Row buffer for a row shader
+    LONG tile;
+
+    if ( job->row != NULL )
+        colors = new int[job->right - job->left + 1];
+    while ( ( tile = InterlockedIncrement( &job->next ) - 1 ) < job->tiles )
+        job->shade( job, tile, colors );
+    delete [] colors;
+    return 0;
+}
+
+
+// This function runs one pass of a job on one thread per processor.  The
+// calling thread does its share of the tiles too.
+//
+static void RunShadeJob( ShadeJob* job )
+{
+    SYSTEM_INFO info;
+    HANDLE threads[SHADE_THREADS];
+    int count = 0;              // Number of extra threads started
+    int wanted;
+
+    GetSystemInfo( &info );
+    wanted = min( (int)info.dwNumberOfProcessors, min( job->tiles, SHADE_THREADS + 1 ) );
+    job->next = 0;
+
+    while ( count < wanted - 1 )
+    {
+        threads[count] = CreateThread( NULL, 0, ShadeThread, (LPVOID)job, 0, NULL );
+        if ( threads[count] == NULL )
+            break;              // Do the rest of the work with fewer threads
+        count++;
+    }
+    ShadeThread( (LPVOID)job );
+    if ( count > 0 )
+        WaitForMultipleObjects( count, threads, TRUE, INFINITE );
+    for ( int i = 0; i < count; i++ )
+        CloseHandle( threads[i] );
+}
+
+
+// This function does the work of both API calls.  The region is given in
+// viewport coordinates, like all other drawing operations.  It is clipped to
+// the window (and to the viewport when clipping is on) and then shaded in
+// passes with block sizes coarse, coarse/2, ..., 1.  The DC mutex is held
+// only to get ready and to copy each finished tile, never while the shader
+// runs.
+//
+static void Shade( int left, int top, int right, int bottom,
+                   PixelShader pixel, RowShader row, void* data, int coarse )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    viewporttype* vp = &pWndData->viewportInfo;
+    ShadeJob job;
+    int block, size;            // Block size of the pass, and bytes per pixel
+
+    job.xorigin = vp->left;
+    job.yorigin = vp->top;
+    job.left = min( left, right ) + vp->left;
+    job.top = min( top, bottom ) + vp->top;
+    job.right = max( left, right ) + vp->left;
+    job.bottom = max( top, bottom ) + vp->top;
+
+    // Clip to the window, and to the viewport (which does not include its
+    // right and bottom edges) if requested.
+    job.left = max( job.left, 0 );
+    job.top = max( job.top, 0 );
+    job.right = min( job.right, pWndData->width - 1 );
+    job.bottom = min( job.bottom, pWndData->height - 1 );
+    if ( vp->clip != 0 )
+    {
+        job.left = max( job.left, vp->left );
+        job.top = max( job.top, vp->top );
+        job.right = min( job.right, vp->right - 1 );
+        job.bottom = min( job.bottom, vp->bottom - 1 );
+    }
+    if ( job.left > job.right || job.top > job.bottom )
+        return;
+
+    job.pWndData = pWndData;
+    switch ( pWndData->page_format )
+    {
+    case INDEXED8_PAGES:
+    case GRAY8_PAGES:
+        job.shade = ShadeTile<BYTE>;
+        size = 1;
+        break;
+    case RGB565_PAGES:
+        job.shade = ShadeTile<WORD>;
+        size = 2;
+        break;
+    default:
+        job.shade = ShadeTile<DWORD>;
+        size = 4;
+        break;
+    }
+    job.pixel = pixel;
+    job.row = row;
+    job.data = data;
+    if ( row != NULL )
+    {
+        job.tiles_across = 1;
+        job.tiles = ( job.bottom - job.top + SHADE_BAND ) / SHADE_BAND;
+        coarse = 1;
+    }
+    else
+    {
+        job.tiles_across = ( job.right - job.left + SHADE_TILE ) / SHADE_TILE;
+        job.tiles = job.tiles_across * ( ( job.bottom - job.top + SHADE_TILE ) / SHADE_TILE );
+    }
+
+    // The block size must be a power of two that divides the tile size.
+    for ( block = 1; block * 2 <= coarse && block < SHADE_TILE; block *= 2 )
+        ;
+    coarse = block;
+
+    // The private copy keeps the colors of each pass, which the refining
+    // passes rely on for the blocks that they skip.
+    job.pitch = size * ( job.right - job.left + 1 );
+    job.pBits = new BYTE[job.pitch * ( job.bottom - job.top + 1 )];
+
+    BGI__GetWinbgiDC( );
+    // Any GDI drawing that is still queued must reach the page first.
+    GdiFlush( );
+    job.pPage = pWndData->pBits[pWndData->ActivePage];
+    job.page_pitch = pWndData->pitch;
+    // Only repaint if we are viewing what we are drawing (as RefreshWindow).
+    job.refresh = pWndData->refreshing && pWndData->VisualPage == pWndData->ActivePage;
+    // The first RGB color converted for an indexed page makes the table
+    // of nearest entries, which must not happen in the worker threads
+    // (any RGB color will do).
+    if ( pWndData->page_format == INDEXED8_PAGES )
+        BGI__ColorToPixel( pWndData, COLOR( 0, 0, 1 ) );
+    BGI__ReleaseWinbgiDC( );
+
+    for ( block = coarse; block >= 1; block /= 2 )
+    {
+        job.block = block;
+        job.skip = ( block == coarse ) ? 0 : 2 * block;
+        RunShadeJob( &job );
+
+        // A refining pass skips about a quarter of the blocks.
+        BGI__COUNT_PIXELS( pWndData, ( job.skip != 0 ? 0.75 : 1.0 )
+                                     * ( job.right - job.left + 1 ) * ( job.bottom - job.top + 1 ) );
+#ifdef BGI_STATS
+        if ( job.refresh )
+        {
+            RECT rect = { job.left, job.top, job.right + 1, job.bottom + 1 };
+            BGI__COUNT_REFRESH( pWndData, &rect );
+        }
+#endif
+        if ( job.refresh )
+            BGI__TRACE_INSTANT( "refresh", ( job.right - job.left + 1 ) * ( job.bottom - job.top + 1 ) );
+    }
+    delete [] job.pBits;
+}
+
+
+/*****************************************************************************
+*
+*   The actual API calls are implemented below
+*
+*****************************************************************************/
+
+// This function colors every pixel of the rectangle from (left,top) to
+// (right,bottom) with the color returned by shader(x, y, data).  The shader
+// is called from several threads at once, so it must be safe to do so, and
+// it must not call other BGI functions.  If coarse is larger than one, the
+// region is first drawn in coarse blocks and then refined until each pixel
+// has been shaded (each pixel is still shaded only once).
+//
+__declspec(dllexport) void shadepixels( int left, int top, int right, int bottom,
+                                        int shader( int, int, void* ), void* data, int coarse )
+{
+    BGI__Counter counter( BGI__CALL_SHADEPIXELS );
+
+    if ( shader != NULL )
+        Shade( left, top, right, bottom, shader, NULL, data, coarse );
+}
+
+
+// This function colors the rectangle from (left,top) to (right,bottom) one
+// row at a time.  For each row y, shader(y, x1, x2, colors, data) must put
+// the colors of pixels x1 through x2 into colors[0] through colors[x2-x1].
+// As with shadepixels, the rows are shaded on several threads at once.
+//
+__declspec(dllexport) void shaderows( int left, int top, int right, int bottom,
+                                      void shader( int, int, int, int*, void* ), void* data )
+{
+    BGI__Counter counter( BGI__CALL_SHADEROWS );
+
+    if ( shader != NULL )
+        Shade( left, top, right, bottom, NULL, shader, data, 1 );
+}
@@ -0,0 +1,398 @@
+// File: stats.cxx
+//
+// This file contains the call counters.  When the library is built with
+// BGI_STATS defined, each counted call (the drawing calls, the state changes
+// and a few others) adds its time to the counters of its window, along with
+// the time it spent waiting for the DC mutex, the pixels that the library
+// wrote itself and the area of the window that it marked for repainting.
+// getbgistats reports the counters, and setbgistatsdump has them written to
+// a file every so often.  Other builds keep no counters, so they pay nothing
+// for them; getbgistats reports that there are none.  A BGI_TRACE build
+// uses the same hooks to add each call to the trace (trace.cpp).
+//
+
+#include <windows.h>        // Provides the Win32 API
+#include <stdio.h>          // Provides fopen and fprintf
+#include <string.h>         // Provides memset
+#include <string>           // Provides STL string class
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+#ifdef BGI__COUNTING
+/*****************************************************************************
+*
+*   Structures and constants
+*
+*****************************************************************************/
+#ifdef BGI_STATS
+// The counters of one call.  Times are in ticks of the performance counter.
+struct CallCount
+{
+    unsigned long calls;
+    LONGLONG total, longest, wait;
+    double pixels, refreshed;
+};
+
+// The counters of a window
+struct CallCounters
+{
+    CallCount count[BGI__CALL_COUNT];
+    int current;                // The call that is running, or BGI__CALL_OTHER
+    int depth;                  // Number of counted calls that are running
+    LONGLONG frequency;         // Ticks of the performance counter per second
+    LONGLONG started;           // When the counting started
+    std::string dump_file;      // Where the counters are dumped, or empty
+    DWORD dump_interval;        // Milliseconds between dumps, or 0 for only at the end
+    DWORD last_dump;            // GetTickCount of the last dump
+};
+#endif
+
+// The name of each counted call, in the order they are reported
+static const struct
+{
+    int call;
+    const char* name;
+} call_table[] =
+{
+    { BGI__OP_ARC, "arc" },                 { BGI__OP_BAR, "bar" },
+    { BGI__CALL_BARS, "bars" },             { BGI__OP_BAR3D, "bar3d" },
+    { BGI__OP_CIRCLE, "circle" },           { BGI__CALL_CIRCLES, "circles" },
+    { BGI__OP_CLEARDEVICE, "cleardevice" }, { BGI__OP_CLEARVIEWPORT, "clearviewport" },
+    { BGI__OP_DRAWPOLY, "drawpoly" },       { BGI__CALL_DRAWPOLYFAST, "drawpolyfast" },
+    { BGI__OP_ELLIPSE, "ellipse" },         { BGI__OP_FILLELLIPSE, "fillellipse" },
+    { BGI__OP_FILLPOLY, "fillpoly" },       { BGI__OP_FLOODFILL, "floodfill" },
+    { BGI__CALL_GETIMAGE, "getimage" },     { BGI__CALL_GETPIXEL, "getpixel" },
+    { BGI__OP_LINE, "line" },               { BGI__CALL_LINES, "lines" },
+    { BGI__OP_LINEREL, "linerel" },         { BGI__OP_LINETO, "lineto" },
+    { BGI__OP_MOVEREL, "moverel" },         { BGI__OP_MOVETO, "moveto" },
+    { BGI__OP_OUTTEXT, "outtext" },         { BGI__OP_OUTTEXTXY, "outtextxy" },
+    { BGI__OP_PIESLICE, "pieslice" },       { BGI__OP_PUTIMAGE, "putimage" },
+    { BGI__OP_PUTPIXEL, "putpixel" },       { BGI__CALL_READIMAGEFILE, "readimagefile" },
+    { BGI__OP_RECTANGLE, "rectangle" },     { BGI__CALL_REFRESHBGI, "refreshbgi" },
+    { BGI__CALL_REPLAY, "replay" },         { BGI__CALL_REPLAYFILE, "replayfile" },
+    { BGI__OP_SECTOR, "sector" },           { BGI__CALL_SHADEPIXELS, "shadepixels" },
+    { BGI__CALL_SHADEROWS, "shaderows" },   { BGI__OP_SETBKCOLOR, "setbkcolor" },
+    { BGI__OP_SETCOLOR, "setcolor" },       { BGI__OP_SETFILLPATTERN, "setfillpattern" },
+    { BGI__OP_SETFILLSTYLE, "setfillstyle" }, { BGI__OP_SETLINESTYLE, "setlinestyle" },
+    { BGI__OP_SETTEXTJUSTIFY, "settextjustify" }, { BGI__OP_SETTEXTSTYLE, "settextstyle" },
+    { BGI__OP_SETUSERCHARSIZE, "setusercharsize" }, { BGI__OP_SETWRITEMODE, "setwritemode" },
+    { BGI__CALL_OTHER, "other" }
+};
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function returns the time in ticks of the performance counter.
+//
+static inline LONGLONG Clock( )
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter( &now );
+    return now.QuadPart;
+}
+
+
+#ifdef BGI_STATS
+// This function empties the counters.
+//
+static void ResetCounters( CallCounters* c )
+{
+    memset( c->count, 0, sizeof( c->count ) );
+    c->started = Clock( );
+}
+
+
+// This function returns the counters of a window, which are made the first
+// time they are needed.
+//
+static CallCounters* GetCounters( WindowData* pWndData )
+{
+    CallCounters* c = pWndData->counters;
+    LARGE_INTEGER frequency;
+
+    if ( c != NULL )
+        return c;
+    c = new CallCounters;
+    QueryPerformanceFrequency( &frequency );
+    c->frequency = frequency.QuadPart;
+    c->current = BGI__CALL_OTHER;
+    c->depth = 0;
+    c->dump_interval = 0;
+    c->last_dump = GetTickCount( );
+    ResetCounters( c );
+    pWndData->counters = c;
+    return c;
+}
+
+
+// This function converts ticks of the performance counter to milliseconds.
+//
+static double Milliseconds( const CallCounters* c, LONGLONG ticks )
+{
+    return 1000.0 * ticks / c->frequency;
+}
+
+
+// This function copies the counters of the calls that were used into
+// stats, in the order of call_table.
+//
+static void Report( const CallCounters* c, bgistatstype* stats )
+{
+    stats->enabled = 1;
+    stats->count = 0;
+    for ( unsigned i = 0; i < sizeof( call_table ) / sizeof( call_table[0] ); i++ )
+    {
+        const CallCount* count = &c->count[call_table[i].call];
+        callstatstype* out = &stats->call[stats->count];
+
+        if ( count->calls == 0 && count->wait == 0 && count->pixels == 0 && count->refreshed == 0 )
+            continue;
+        if ( stats->count == BGI_STATS_CALLS )
+            break;
+        out->name = call_table[i].name;
+        out->calls = count->calls;
+        out->total_ms = Milliseconds( c, count->total );
+        out->max_ms = Milliseconds( c, count->longest );
+        out->wait_ms = Milliseconds( c, count->wait );
+        out->pixels = count->pixels;
+        out->refreshed = count->refreshed;
+        stats->count++;
+    }
+}
+
+
+// This function appends the counters to the dump file, as a table.
+//
+static void Dump( CallCounters* c )
+{
+    bgistatstype stats;
+    FILE* f;
+
+    c->last_dump = GetTickCount( );
+    if ( c->dump_file.empty( ) || ( f = fopen( c->dump_file.c_str( ), "a" ) ) == NULL )
+        return;
+    Report( c, &stats );
+    fprintf( f, "winbgim call counters after %.3f s\n", Milliseconds( c, Clock( ) - c->started ) / 1000 );
+    fprintf( f, "%-16s %10s %12s %10s %10s %14s %14s\n",
+             "call", "calls", "total ms", "max ms", "wait ms", "pixels", "refreshed" );
+    for ( int i = 0; i < stats.count; i++ )
+    {
+        const callstatstype* s = &stats.call[i];
+        fprintf( f, "%-16s %10lu %12.3f %10.3f %10.3f %14.0f %14.0f\n",
+                 s->name, s->calls, s->total_ms, s->max_ms, s->wait_ms, s->pixels, s->refreshed );
+    }
+    fprintf( f, "\n" );
+    fclose( f );
+}
+#endif
+
+
+/*****************************************************************************
+*
+*   BGI__Counter
+*
+*****************************************************************************/
+
+BGI__Counter::BGI__Counter( int call )
+{
+    pWndData = BGI__GetWindowDataPtr( );
+    this->call = call;
+    outer = true;
+#ifdef BGI_STATS
+    CallCounters* c = GetCounters( pWndData );
+    outer = ( c->depth++ == 0 );
+    if ( outer )
+        c->current = call;
+#endif
+    start = Clock( );
+}
+
+
+BGI__Counter::~BGI__Counter( )
+{
+    LONGLONG end = Clock( );
+
+#ifdef BGI_TRACE
+    BGI__TraceEvent( BGI__CallName( call ), start, end, 0 );
+#endif
+#ifdef BGI_STATS
+    CallCounters* c = pWndData->counters;
+    CallCount* count = &c->count[call];
+
+    c->depth--;
+    if ( !outer )
+        return;
+    count->calls++;
+    count->total += end - start;
+    count->longest = max( count->longest, end - start );
+    c->current = BGI__CALL_OTHER;
+    if ( c->dump_interval > 0 && GetTickCount( ) - c->last_dump >= c->dump_interval )
+        Dump( c );
+#endif
+}
+
+
+/*****************************************************************************
+*
+*   The routines used by the rest of the library
+*
+*****************************************************************************/
+
+// This function returns the name of a counted call.
+// (used by BGI__Counter and trace.cpp)
+//
+const char* BGI__CallName( int call )
+{
+    for ( unsigned i = 0; i < sizeof( call_table ) / sizeof( call_table[0] ); i++ )
+    {
+        if ( call_table[i].call == call )
+            return call_table[i].name;
+    }
+    return "other";
+}
+
+
+// This function takes the DC mutex of a window, and adds the time it waited
+// for it to the call that is running (and to the trace).
+// (used by BGI__GetWinbgiDC in drawing.cpp)
+//
+void BGI__WaitForDC( WindowData* pWndData )
+{
+    LONGLONG start = Clock( ), end;
+
+    WaitForSingleObject( pWndData->hDCMutex, 5000 );
+    end = Clock( );
+#ifdef BGI_TRACE
+    BGI__TraceWait( start, end );
+#endif
+#ifdef BGI_STATS
+    CallCounters* c = GetCounters( pWndData );
+    c->count[c->current].wait += end - start;
+#endif
+}
+
+
+#ifdef BGI_STATS
+
+
+// This function adds pixels written by the library to the call that is
+// running.
+// (used by raster.cpp, stroke.cpp, shader.cpp and decode.cpp)
+//
+void BGI__CountPixels( WindowData* pWndData, double pixels )
+{
+    CallCounters* c = GetCounters( pWndData );
+
+    c->count[c->current].pixels += pixels;
+}
+
+
+// This function adds the part of a rectangle, in device coordinates, that is
+// inside the window to the pixels that the running call marked for
+// repainting.  NULL is the whole window.
+// (used by RefreshWindow in drawing.cpp)
+//
+void BGI__CountRefresh( WindowData* pWndData, const RECT* rect )
+{
+    CallCounters* c = GetCounters( pWndData );
+    RECT window = { 0, 0, pWndData->width, pWndData->height };
+    RECT area = window;
+
+    if ( rect != NULL && !IntersectRect( &area, rect, &window ) )
+        return;
+    c->count[c->current].refreshed += (double)( area.right - area.left ) * ( area.bottom - area.top );
+}
+#endif
+#endif
+
+
+// This function frees the counters of a window, after a last dump.
+// (used by BGI__ThreadInitWindow in winthread.cpp)
+//
+void BGI__FreeCounters( WindowData* pWndData )
+{
+#ifdef BGI_STATS
+    if ( pWndData->counters == NULL )
+        return;
+    Dump( pWndData->counters );
+    delete pWndData->counters;
+    pWndData->counters = NULL;
+#endif
+}
+
+
+/*****************************************************************************
+*
+*   The actual API calls are implemented below
+*
+*****************************************************************************/
+
+// This function reports the counters of the current window: one entry for
+// each call that has been counted since the window was made (or since
+// resetbgistats).  If the library was built without BGI_STATS, enabled and
+// count are zero.
+//
+__declspec(dllexport) void getbgistats( bgistatstype *stats )
+{
+#ifdef BGI_STATS
+    Report( GetCounters( BGI__GetWindowDataPtr( ) ), stats );
+#else
+    stats->enabled = 0;
+    stats->count = 0;
+#endif
+}
+
+
+// This function sets the counters of the current window back to zero.
+//
+__declspec(dllexport) void resetbgistats( )
+{
+#ifdef BGI_STATS
+    ResetCounters( GetCounters( BGI__GetWindowDataPtr( ) ) );
+#endif
+}
+
+
+// This function has the counters of the current window written to a text
+// file every msec milliseconds (checked when a counted call returns), and
+// when the window is closed.  If msec is 0, they are only written at the
+// end.  The file is emptied first.  A NULL filename stops the dumps.  If
+// the library was built without BGI_STATS, the error code is set to grError.
+//
+__declspec(dllexport) void setbgistatsdump( const char* filename, int msec )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+#ifdef BGI_STATS
+    CallCounters* c = GetCounters( pWndData );
+    FILE* f;
+
+    c->dump_file = ( filename != NULL ) ? filename : "";
+    c->dump_interval = max( msec, 0 );
+    c->last_dump = GetTickCount( );
+    if ( filename != NULL )
+    {
+        if ( ( f = fopen( filename, "w" ) ) == NULL )
+        {
+            c->dump_file = "";
+            pWndData->error_code = grError;
+            return;
+        }
+        fclose( f );
+    }
+#else
+    pWndData->error_code = grError;
+#endif
+}
@@ -0,0 +1,283 @@
+// File: stream.cxx
+//
+// This file contains the frame streamer, which lets another program watch a
+// window over a TCP connection on the loopback interface (use an SSH tunnel
+// or similar to watch from another machine).  Each time the window is
+// painted, the visual page is copied for the sender thread, which keeps
+// only the newest frame.  The sender compares it, tile by tile, with the
+// last frame the viewer got and sends only the tiles that changed,
+// run-length encoded.  A slow connection therefore skips frames instead of
+// falling behind.
+//
+// The stream is a header followed by frames.  All numbers are little-endian.
+//
+//     header:  "BGIS", version (4 bytes, 1), width (4), height (4),
+//              tile size (4)
+//     frame:   "FRAM", frame number (4), number of tiles (4), then for each
+//              tile: column (2), row (2), size of its data (4), data
+//
+// A tile covers tile size by tile size pixels (less at the right and bottom
+// edges), and its data is a list of runs of pixels, row by row.  Each run
+// starts with 2 bytes n.  If the top bit of n is set, the next 3 bytes (blue,
+// green, red) are one pixel repeated (n & 0x7FFF) + 1 times; otherwise n + 1
+// pixels of 3 bytes each follow.  A viewer that connects gets every tile of
+// the current picture in its first frame.
+//
+
+#include <winsock2.h>       // Provides sockets (must come before windows.h)
+#include <windows.h>        // Provides the Win32 API
+#include <string.h>         // Provides memcmp and memcpy
+#include <vector>           // Provides STL vector class
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+#include "frameserver.h"    // The shared frame server
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Structures and constants
+*
+*****************************************************************************/
+#define STREAM_TILE     32      // Width and height of a tile
+#define STREAM_WAIT     100     // Milliseconds between checks for a viewer
+#define STREAM_RUN      0x8000  // Marks a run of one repeated pixel
+#define STREAM_MAX_RUN  0x8000  // Longest run of either kind
+
+// The state of a stream: the frames and the viewer (see frameserver.h), and
+// the number of the next frame.
+struct FrameStreamer : BGI__FrameServer
+{
+    DWORD frame;                // Number of frames sent to this viewer
+};
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function adds a little-endian number of the given number of bytes.
+//
+static void PutLE( std::vector<BYTE>& out, DWORD value, int bytes )
+{
+    for ( int i = 0; i < bytes; i++ )
+        out.push_back( (BYTE)( value >> ( 8 * i ) ) );
+}
+
+
+// This function adds one pixel as 3 bytes (blue, green, red).
+//
+static void PutPixel( std::vector<BYTE>& out, DWORD pixel )
+{
+    out.push_back( (BYTE)pixel );
+    out.push_back( (BYTE)( pixel >> 8 ) );
+    out.push_back( (BYTE)( pixel >> 16 ) );
+}
+
+
+// This function run-length encodes one tile of a frame (see the top of this
+// file).
+//
+static void EncodeTile( std::vector<BYTE>& out, const BYTE* pBits, int pitch,
+                        int left, int top, int right, int bottom )
+{
+    std::vector<DWORD> pixels;
+    size_t i, j, n;
+
+    for ( int y = top; y < bottom; y++ )
+    {
+        const DWORD* row = (const DWORD*)( pBits + y * pitch );
+        for ( int x = left; x < right; x++ )
+            pixels.push_back( row[x] & 0x00FFFFFF );
+    }
+
+    for ( i = 0; i < pixels.size( ); i = j )
+    {
+        // A run of three or more equal pixels is worth a run of its own.
+        for ( j = i + 1; j < pixels.size( ) && pixels[j] == pixels[i] && j - i < STREAM_MAX_RUN; j++ )
+            ;
+        if ( j - i >= 3 )
+        {
+            PutLE( out, STREAM_RUN | (DWORD)( j - i - 1 ), 2 );
+            PutPixel( out, pixels[i] );
+            continue;
+        }
+
+        // Otherwise take pixels literally until the next such run starts.
+        for ( j = i + 1; j < pixels.size( ) && j - i < STREAM_MAX_RUN; j++ )
+            if ( j + 2 < pixels.size( ) && pixels[j] == pixels[j + 1] && pixels[j] == pixels[j + 2] )
+                break;
+        PutLE( out, (DWORD)( j - i - 1 ), 2 );
+        for ( n = i; n < j; n++ )
+            PutPixel( out, pixels[n] );
+    }
+}
+
+
+// This function sends the tiles of the work frame that differ from the sent
+// frame (all of them if all is true) as one frame of the stream.
+//
+static bool SendFrame( FrameStreamer* st, bool all )
+{
+    std::vector<BYTE> out;
+    size_t count_at, size_at;
+    DWORD tiles = 0;
+    int left, top, right, bottom;
+
+    out.insert( out.end( ), (const BYTE*)"FRAM", (const BYTE*)"FRAM" + 4 );
+    PutLE( out, st->frame, 4 );
+    count_at = out.size( );
+    PutLE( out, 0, 4 );
+    for ( top = 0; top < st->height; top += STREAM_TILE )
+    {
+        bottom = min( top + STREAM_TILE, st->height );
+        for ( left = 0; left < st->width; left += STREAM_TILE )
+        {
+            right = min( left + STREAM_TILE, st->width );
+            if ( !all && BGI__SameTile( st, left, top, right, bottom ) )
+                continue;
+            PutLE( out, left / STREAM_TILE, 2 );
+            PutLE( out, top / STREAM_TILE, 2 );
+            size_at = out.size( );
+            PutLE( out, 0, 4 );
+            EncodeTile( out, st->work, st->pitch, left, top, right, bottom );
+            for ( int i = 0; i < 4; i++ )
+                out[size_at + i] = (BYTE)( ( out.size( ) - size_at - 4 ) >> ( 8 * i ) );
+            tiles++;
+        }
+    }
+    if ( tiles == 0 )
+        return true;            // Nothing changed, so send nothing
+    for ( int i = 0; i < 4; i++ )
+        out[count_at + i] = (BYTE)( tiles >> ( 8 * i ) );
+    st->frame++;
+    return BGI__SendAll( st->viewer, out );
+}
+
+
+// This is the entry point of the sender thread.  It waits for a viewer, and
+// while one is connected, sends it each new frame.
+//
+static DWORD WINAPI StreamThread( LPVOID pThreadData )
+{
+    FrameStreamer* st = (FrameStreamer*)pThreadData;
+    std::vector<BYTE> header;
+    bool all = false;
+    BYTE* swap;
+
+    while ( !st->stopping )
+    {
+        if ( st->viewer == INVALID_SOCKET )
+        {
+            if ( !BGI__AcceptViewer( st, STREAM_WAIT ) )
+                continue;
+
+            header.clear( );
+            header.insert( header.end( ), (const BYTE*)"BGIS", (const BYTE*)"BGIS" + 4 );
+            PutLE( header, 1, 4 );
+            PutLE( header, st->width, 4 );
+            PutLE( header, st->height, 4 );
+            PutLE( header, STREAM_TILE, 4 );
+            st->frame = 0;
+            all = true;         // The viewer has nothing yet
+            if ( !BGI__SendAll( st->viewer, header ) )
+            {
+                BGI__DropViewer( st );
+                continue;
+            }
+        }
+        else if ( WaitForSingleObject( st->hReady, STREAM_WAIT ) != WAIT_OBJECT_0 )
+            continue;
+
+        BGI__TakeFrame( st );
+        if ( !SendFrame( st, all ) )
+        {
+            BGI__DropViewer( st );
+            continue;
+        }
+        all = false;
+        swap = st->sent;
+        st->sent = st->work;
+        st->work = swap;
+    }
+
+    if ( st->viewer != INVALID_SOCKET )
+        BGI__DropViewer( st );
+    return 0;
+}
+
+
+// This function gives the visual page of a window to the sender thread.  It
+// is called by cls_OnPaint (and by startstream, for the first frame), with
+// the DC mutex held.
+// (used by cls_OnPaint in winthread.cpp)
+//
+void BGI__StreamFrame( WindowData* pWndData )
+{
+    BGI__PutFrame( pWndData->streamer, pWndData );
+}
+
+
+// This function ends the stream of a window, if there is one.
+// (used by cls_OnDestroy in winthread.cpp)
+//
+void BGI__StopStream( WindowData* pWndData )
+{
+    FrameStreamer* st;
+
+    WaitForSingleObject( pWndData->hDCMutex, INFINITE );
+    st = pWndData->streamer;
+    pWndData->streamer = NULL;
+    ReleaseMutex( pWndData->hDCMutex );
+    if ( st == NULL )
+        return;
+
+    BGI__CloseFrameServer( st );
+    delete st;
+}
+
+
+/*****************************************************************************
+*
+*   The actual API calls are implemented below
+*
+*****************************************************************************/
+
+// This function starts streaming the current window to a viewer that connects
+// to the given TCP port on the loopback interface (127.0.0.1).  One viewer is
+// served at a time; when it disconnects, the next one can connect.  A stream
+// that is already running is stopped first.
+//
+__declspec(dllexport) void startstream( int port )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    FrameStreamer* st;
+
+    BGI__StopStream( pWndData );
+    st = new FrameStreamer;
+    st->frame = 0;
+    if ( !BGI__OpenFrameServer( st, pWndData, port, StreamThread, (LPVOID)st ) )
+    {
+        delete st;
+        pWndData->error_code = grError;
+        return;
+    }
+
+    WaitForSingleObject( pWndData->hDCMutex, INFINITE );
+    pWndData->streamer = st;
+    BGI__StreamFrame( pWndData );
+    ReleaseMutex( pWndData->hDCMutex );
+}
+
+
+// This function stops streaming the current window.
+//
+__declspec(dllexport) void stopstream( )
+{
+    BGI__StopStream( BGI__GetWindowDataPtr( ) );
+}
@@ -0,0 +1,365 @@
+// File: stroke.cxx
+//
+// This file contains the software drawing path for wide lines.  GDI strokes
+// the pens of setlinestyle (ExtCreatePen with PS_GEOMETRIC) slowly, and each
+// segment of a polyline on its own.  Here a whole polyline is turned into
+// convex pieces instead: a rectangle for each part of a segment that is
+// inside a dash, with square ends where a dash starts or stops, and a bevel
+// triangle at each corner that a dash goes around.  The pieces are scanned
+// together, one row at a time, and the union of their spans in each row is
+// drawn once, so no pixel is drawn twice (which matters in XOR_PUT mode),
+// not even where the pieces overlap at the corners.
+//
+// The points of a line are the centers of pixels, and a pixel is drawn if
+// its center is inside the outline (with its right and bottom edges left
+// out).  The dashes are the LinePattern of the pen, measured along the line
+// as GDI measures them, and continue around corners.
+//
+
+#include <windows.h>        // Provides the Win32 API
+#include <math.h>           // Provides ceil and sqrt
+#include <algorithm>        // Provides sort
+#include <vector>           // Provides STL vector class
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Structures
+*
+*****************************************************************************/
+// A point of the line, in device coordinates
+struct StrokePoint
+{
+    double x, y;
+};
+
+// A convex piece of the outline, with 3 or 4 corners in order, and the
+// rows it covers (top included, bottom excluded)
+struct StrokePiece
+{
+    int count;
+    double x[4], y[4];
+    double top, bottom;
+};
+
+// Part of a row that is inside a piece
+struct StrokeSpan
+{
+    double left, right;
+};
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function adds a piece with count corners to the outline.
+//
+static void AddPiece( std::vector<StrokePiece>& pieces, int count, const StrokePoint* corners )
+{
+    StrokePiece piece;
+
+    piece.count = count;
+    piece.top = piece.bottom = corners[0].y;
+    for ( int i = 0; i < count; i++ )
+    {
+        piece.x[i] = corners[i].x;
+        piece.y[i] = corners[i].y;
+        piece.top = min( piece.top, corners[i].y );
+        piece.bottom = max( piece.bottom, corners[i].y );
+    }
+    pieces.push_back( piece );
+}
+
+
+// This function adds the outline of one dash, which runs through the given
+// points, to the pieces.  Each end gets a square cap that reaches half past
+// it, and each corner gets a bevel.  A dash of no length is a square, turned
+// to the direction (ux,uy) of the line it is on.
+//
+static void AddDash( std::vector<StrokePiece>& pieces, const std::vector<StrokePoint>& dash,
+                     double ux, double uy, double half )
+{
+    std::vector<StrokePoint> points;
+    StrokePoint corners[4];
+    double px = 0, py = 0;      // Direction of the previous segment
+
+    // Repeated points would give segments without a direction.
+    for ( size_t i = 0; i < dash.size( ); i++ )
+    {
+        if ( points.empty( ) || dash[i].x != points.back( ).x || dash[i].y != points.back( ).y )
+            points.push_back( dash[i] );
+    }
+    if ( points.empty( ) )
+        return;
+    if ( points.size( ) == 1 )
+        points.push_back( points[0] );
+
+    for ( size_t i = 0; i + 1 < points.size( ); i++ )
+    {
+        StrokePoint a = points[i], b = points[i+1];
+        double length = sqrt( ( b.x - a.x ) * ( b.x - a.x ) + ( b.y - a.y ) * ( b.y - a.y ) );
+        if ( length > 0 )
+        {
+            ux = ( b.x - a.x ) / length;
+            uy = ( b.y - a.y ) / length;
+        }
+        double nx = -uy * half, ny = ux * half;
+
+        // The bevel fills the outside of the corner at a, between the ends
+        // of this segment and the last one.
+        double turn = px * uy - py * ux;
+        if ( i > 0 && turn != 0 )
+        {
+            double side = ( turn > 0 ) ? -half : half;
+            corners[0] = a;
+            corners[1].x = a.x - py * side;
+            corners[1].y = a.y + px * side;
+            corners[2].x = a.x - uy * side;
+            corners[2].y = a.y + ux * side;
+            AddPiece( pieces, 3, corners );
+        }
+
+        // Square caps at the two ends of the dash
+        if ( i == 0 )
+        {
+            a.x -= ux * half;
+            a.y -= uy * half;
+        }
+        if ( i + 2 == points.size( ) )
+        {
+            b.x += ux * half;
+            b.y += uy * half;
+        }
+        corners[0].x = a.x + nx;
+        corners[0].y = a.y + ny;
+        corners[1].x = b.x + nx;
+        corners[1].y = b.y + ny;
+        corners[2].x = b.x - nx;
+        corners[2].y = b.y - ny;
+        corners[3].x = a.x - nx;
+        corners[3].y = a.y - ny;
+        AddPiece( pieces, 4, corners );
+        px = ux;
+        py = uy;
+    }
+}
+
+
+// This function finds where row y crosses a piece.  It returns false if the
+// row misses the piece.
+//
+static bool PieceSpan( const StrokePiece& piece, double y, StrokeSpan* span )
+{
+    int found = 0;
+
+    for ( int i = 0; i < piece.count; i++ )
+    {
+        int j = ( i + 1 ) % piece.count;
+        double y0 = piece.y[i], y1 = piece.y[j];
+        if ( ( y0 <= y && y < y1 ) || ( y1 <= y && y < y0 ) )
+        {
+            double x = piece.x[i] + ( y - y0 ) * ( piece.x[j] - piece.x[i] ) / ( y1 - y0 );
+            if ( found++ == 0 )
+                span->left = span->right = x;
+            else
+            {
+                span->left = min( span->left, x );
+                span->right = max( span->right, x );
+            }
+        }
+    }
+    return found >= 2;
+}
+
+
+static bool ByTop( const StrokePiece& a, const StrokePiece& b )
+{
+    return a.top < b.top;
+}
+
+
+static bool ByLeft( const StrokeSpan& a, const StrokeSpan& b )
+{
+    return a.left < b.left;
+}
+
+
+// This function draws the union of the pieces, inside the clip rectangle,
+// in the pen color and write mode.
+//
+static void FillPieces( WindowData* pWndData, std::vector<StrokePiece>& pieces )
+{
+    const BGI__Pipeline* pipeline = &pWndData->pipeline;
+    std::vector<size_t> active;
+    std::vector<StrokeSpan> spans;
+    size_t next = 0;
+    int y;
+
+    if ( pieces.empty( ) )
+        return;
+    std::sort( pieces.begin( ), pieces.end( ), ByTop );
+    y = max( (int)ceil( pieces[0].top ), (int)pipeline->clip.top );
+    while ( y < pipeline->clip.bottom && ( next < pieces.size( ) || !active.empty( ) ) )
+    {
+        // Skip rows that no piece covers.
+        if ( active.empty( ) && pieces[next].top > y )
+            y = (int)ceil( pieces[next].top );
+        while ( next < pieces.size( ) && pieces[next].top <= y )
+            active.push_back( next++ );
+
+        spans.clear( );
+        for ( size_t i = 0; i < active.size( ); )
+        {
+            StrokeSpan span;
+            if ( pieces[active[i]].bottom <= y )
+            {
+                active[i] = active.back( );
+                active.pop_back( );
+                continue;
+            }
+            if ( PieceSpan( pieces[active[i]], y, &span ) )
+                spans.push_back( span );
+            i++;
+        }
+
+        // Spans that overlap or touch are joined, so each pixel is drawn
+        // once.
+        if ( !spans.empty( ) )
+        {
+            std::sort( spans.begin( ), spans.end( ), ByLeft );
+            StrokeSpan run = spans[0];
+            for ( size_t i = 1; i <= spans.size( ); i++ )
+            {
+                if ( i < spans.size( ) && spans[i].left <= run.right )
+                {
+                    run.right = max( run.right, spans[i].right );
+                    continue;
+                }
+                int x1 = (int)ceil( run.left ), x2 = (int)ceil( run.right ) - 1;
+                if ( x1 <= x2 )
+                {
+                    pipeline->hline[1]( pWndData, x1, x2, y );
+                    BGI__COUNT_PIXELS( pWndData, max( 0, min( x2 + 1, (int)pipeline->clip.right )
+                                                         - max( x1, (int)pipeline->clip.left ) ) );
+                }
+                if ( i < spans.size( ) )
+                    run = spans[i];
+            }
+        }
+        y++;
+    }
+}
+
+
+/*****************************************************************************
+*
+*   The routines used by the drawing calls
+*
+*****************************************************************************/
+
+// This function draws the polyline through the n points in viewport
+// coordinates with the current wide pen, its dashes and the write mode.
+// It returns false, and draws nothing, if GDI must draw the line.  The DC
+// mutex must be held.
+// (used by drawpoly and rectangle in drawing.cpp)
+//
+bool BGI__StrokePolyline( WindowData* pWndData, const POINT* points, int n )
+{
+    const BGI__Pipeline* pipeline = &pWndData->pipeline;
+    std::vector<StrokePiece> pieces;
+    std::vector<StrokePoint> dash;
+    double half = pWndData->lineInfo.thickness / 2.0;
+    double ux = 1, uy = 0;      // Direction of the current segment
+    double remain;              // Length left in the current dash or space
+    double total = 0;           // Length of the whole pattern
+    bool solid = true;          // True if the pattern has no spaces
+    bool on = true;             // True inside a dash
+    int k = 0;                  // The current entry of the pattern
+
+    if ( !pipeline->strokes )
+        return false;
+    if ( n < 1 )
+        return true;
+    for ( int i = 0; i < pipeline->dashes; i++ )
+    {
+        total += pipeline->dash[i];
+        if ( i % 2 == 1 && pipeline->dash[i] != 0 )
+            solid = false;
+    }
+    if ( total == 0 )
+        solid = true;
+
+    remain = solid ? 0 : pipeline->dash[0];
+    for ( int i = 0; i < n; i++ )
+    {
+        StrokePoint b = { (double)points[i].x + pWndData->viewportInfo.left,
+                          (double)points[i].y + pWndData->viewportInfo.top };
+        StrokePoint a = { b.x, b.y };
+        if ( i > 0 )
+        {
+            a.x = (double)points[i-1].x + pWndData->viewportInfo.left;
+            a.y = (double)points[i-1].y + pWndData->viewportInfo.top;
+        }
+        double length = sqrt( ( b.x - a.x ) * ( b.x - a.x ) + ( b.y - a.y ) * ( b.y - a.y ) );
+        double t = 0;
+        if ( i == 0 || solid )
+        {
+            dash.push_back( b );
+            continue;
+        }
+        if ( length == 0 )
+            continue;
+
+        // Walk along the segment from a to b.  Each time a dash or space
+        // runs out, a dash ends (and is added) or a new one starts.
+        ux = ( b.x - a.x ) / length;
+        uy = ( b.y - a.y ) / length;
+        while ( length - t > remain )
+        {
+            t += remain;
+            StrokePoint q = { a.x + ux * t, a.y + uy * t };
+            dash.push_back( q );
+            if ( on )
+            {
+                AddDash( pieces, dash, ux, uy, half );
+                dash.clear( );
+            }
+            on = !on;
+            k = ( k + 1 ) % pipeline->dashes;
+            remain = pipeline->dash[k];
+        }
+        remain -= length - t;
+        if ( on )
+            dash.push_back( b );
+    }
+    if ( on )
+        AddDash( pieces, dash, ux, uy, half );
+
+    GdiFlush( );
+    FillPieces( pWndData, pieces );
+    return true;
+}
+
+
+// This function draws the line from (x1,y1) to (x2,y2) in viewport
+// coordinates with the current wide pen, as BGI__StrokePolyline does.
+// (used by line, linerel and lineto in drawing.cpp)
+//
+bool BGI__StrokeLine( WindowData* pWndData, int x1, int y1, int x2, int y2 )
+{
+    POINT ends[2] = { { x1, y1 }, { x2, y2 } };
+
+    return BGI__StrokePolyline( pWndData, ends, 2 );
+}
@@ -16,9 +16,15 @@
 #include <iostream>
 #include <sstream>          // Provides ostringstream
 #include <string>           // Provides string
+#include <stdlib.h>         // Provides abs
+#include <string.h>         // Provides strlen
 #include "winbgi.h"         // API routines
 #include "winbgitypes.h"    // Internal structure data
 
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
 
 /*****************************************************************************
 *
@@ -125,14 +131,14 @@ static void set_align(WindowData* pWndData)
 	SetTextAlign(pWndData->hDC[i], alignment);
 }
 
-// This function updates the current hdc with the user defined font
-// POSTCONDITION: text written to the current hdc will be in the new font
+// This function finds the character width and height that the user defined
+// font is made with.
+// POSTCONDITION: width and height have been set.
 //
-static void set_font(WindowData* pWndData)
+static void font_size(WindowData* pWndData, int* width, int* height)
 {
     int mindex;
     double xscale, yscale;
-    HFONT hFont;
     
     // get the scaling factors based on charsize
     if(pWndData->textInfo.charsize == 0)
@@ -153,10 +159,23 @@ static void set_font(WindowData* pWndData)
 	mindex = pWndData->textInfo.charsize;
     }
 
+    *height = int(font_metrics[pWndData->textInfo.font][mindex].height * yscale);
+    *width = int(font_metrics[pWndData->textInfo.font][mindex].width  * xscale);
+}
+
+// This function updates the current hdc with the user defined font
+// POSTCONDITION: text written to the current hdc will be in the new font
+//
+static void set_font(WindowData* pWndData)
+{
+    int width, height;
+    HFONT hFont;
+
     // with the scaling decided, make a font.
+    font_size(pWndData, &width, &height);
     hFont = CreateFont(
-	int(font_metrics[pWndData->textInfo.font][mindex].height * yscale), 
-	int(font_metrics[pWndData->textInfo.font][mindex].width  * xscale),
+	height, 
+	width,
 	pWndData->textInfo.direction * 900,
 	(pWndData->textInfo.direction & 1) * 900,
 	font_weight[pWndData->textInfo.font],
@@ -176,6 +195,26 @@ static void set_font(WindowData* pWndData)
 	DeleteObject( SelectObject( pWndData->hDC[i], hFont ) );
 }
 
+// This function finds a box that surely holds textstring written at (x,y),
+// whatever the justification and direction, without asking GDI (so without
+// taking the DC mutex).  No character is taken to be more than twice as
+// wide or tall as the font was asked to be, and a font asked to be of size
+// zero (which GDI replaces by its default size) is taken to be 32 pixels.
+// POSTCONDITION: the box (right and bottom edges excluded) has been returned.
+//
+static RECT text_bounds(WindowData* pWndData, int x, int y, const char* textstring)
+{
+    int width, height, size, reach;
+
+    font_size(pWndData, &width, &height);
+    size = max(abs(width), abs(height));
+    if (size == 0)
+	size = 32;
+    reach = 2 * (int(strlen(textstring)) + 1) * size;
+    RECT rect = { x - reach, y - reach, x + reach + 1, y + reach + 1 };
+    return rect;
+}
+
 
 /*****************************************************************************
 *
@@ -205,6 +244,7 @@ __declspec(dllexport) void gettextsettings(struct textsettingstype *texttypeinfo
 //
 __declspec(dllexport) void outtext(char *textstring)
 {
+    BGI__Recorder record( BGI__OP_OUTTEXT, 0, 0, textstring, strlen( textstring ) + 1 );
     HDC hDC = BGI__GetWinbgiDC( );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
@@ -233,10 +273,17 @@ __declspec(dllexport) void outtext(char *textstring)
 //
 __declspec(dllexport) void outtextxy(int x, int y, char *textstring)
 {
-    HDC hDC = BGI__GetWinbgiDC( );
+    BGI__Recorder record( BGI__OP_OUTTEXTXY, x, y, textstring, strlen( textstring ) + 1 );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
+    RECT rect = text_bounds(pWndData, x, y, textstring);
+    HDC hDC;
+
+    // text that cannot reach the viewport is not drawn at all.
+    if (!BGI__RectVisible(pWndData, rect.left, rect.top, rect.right, rect.bottom))
+	return;
 
     // check alignment
+    hDC = BGI__GetWinbgiDC( );
     if (pWndData->alignment != TA_NOUPDATECP)
     {
 	pWndData->alignment = TA_NOUPDATECP;
@@ -246,8 +293,7 @@ __declspec(dllexport) void outtextxy(int x, int y, char *textstring)
     TextOut(hDC, x, y, (LPCTSTR)textstring, strlen(textstring));
     BGI__ReleaseWinbgiDC( );
 
-    RefreshWindow( NULL );
-    // Todo: Change to refresh only the needed part.
+    RefreshWindow( &rect );
 }
 
 
@@ -258,6 +304,7 @@ __declspec(dllexport) void outtextxy(int x, int y, char *textstring)
 //
 __declspec(dllexport) void settextjustify(int horiz, int vert)
 {
+    BGI__Recorder record( BGI__OP_SETTEXTJUSTIFY, horiz, vert );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
     pWndData->textInfo.horiz = horiz;
@@ -276,6 +323,7 @@ __declspec(dllexport) void settextjustify(int horiz, int vert)
 //
 __declspec(dllexport) void settextstyle(int font, int direction, int charsize)
 {
+    BGI__Recorder record( BGI__OP_SETTEXTSTYLE, font, direction, charsize );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
 
     pWndData->textInfo.font = font;
@@ -294,6 +342,7 @@ __declspec(dllexport) void settextstyle(int font, int direction, int charsize)
 //
 __declspec(dllexport) void setusercharsize(int multx, int divx, int multy, int divy)
 {
+    BGI__Recorder record( BGI__OP_SETUSERCHARSIZE, multx, divx, multy, divy );
     WindowData* pWndData = BGI__GetWindowDataPtr( );
     pWndData->t_scale[0] = multx;
     pWndData->t_scale[1] = divx;
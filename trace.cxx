@@ -0,0 +1,366 @@
+// File: trace.cxx
+//
+// This file contains the event tracer of a library built with BGI_TRACE
+// defined.  Between starttrace and stoptrace, the counted calls of the
+// drawing threads, their waits for the DC mutex and their refreshes, and the
+// painting and the mouse and keyboard messages of the window threads, are
+// written to a file of Chrome trace events, which chrome://tracing and
+// Perfetto (ui.perfetto.dev) show as a timeline with one row per thread.
+//
+// Each thread adds its events to a ring of its own, without any lock: only
+// the thread moves the head of its ring and only the writer thread moves the
+// tail.  Every so often the writer thread empties all of the rings into the
+// file.  If a ring fills up before that, its newest events are dropped and
+// counted.  Other builds have no tracer, and starttrace sets the error code.
+//
+
+#include <windows.h>        // Provides the Win32 API
+#include <stdio.h>          // Provides fopen and fprintf
+#include <stdlib.h>         // Provides atexit
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+
+
+#ifdef BGI_TRACE
+/*****************************************************************************
+*
+*   Structures and constants
+*
+*****************************************************************************/
+#define TRACE_EVENTS        65536   // Events in the ring of each thread (a power of two)
+#define TRACE_FLUSH_MS      50      // How often the writer thread empties the rings
+#define TRACE_MIN_WAIT_US   10      // Shorter waits for the DC mutex are left out
+
+// One event.  phase is 'X' for an event that ran from start to end, and 'i'
+// for an instant.
+struct TraceEvent
+{
+    const char* name;
+    char phase;
+    int arg;
+    LONGLONG start, end;
+};
+
+// The events of one thread, which are events[tail % TRACE_EVENTS] up to
+// events[head % TRACE_EVENTS].  Rings are never freed, since their threads
+// may still hold them.
+struct TraceRing
+{
+    TraceEvent events[TRACE_EVENTS];
+    volatile LONG head;         // Events added (changed only by the thread)
+    volatile LONG tail;         // Events written (changed only by the writer)
+    volatile LONG dropped;      // Events lost because the ring was full
+    DWORD thread;               // Id of the thread
+    const char* name;           // Name of the thread
+    bool named;                 // Whether the name is in the file yet
+    TraceRing* next;            // The next ring in the list of all rings
+};
+
+
+/*****************************************************************************
+*
+*   Global Variables
+*
+*****************************************************************************/
+static TraceRing* volatile rings = NULL;        // All of the rings, newest first
+static thread_local TraceRing* ring = NULL;     // The ring of this thread
+static thread_local const char* thread_name = "user thread";
+static volatile LONG tracing = 0;               // Whether events are kept
+static LONGLONG origin;                         // Time 0 of the trace
+static LONGLONG frequency;                      // Ticks per second
+static FILE* trace_file = NULL;                 // The file being written
+static bool first_event;                        // No event is in the file yet
+static HANDLE writer = NULL;                    // The writer thread
+static HANDLE stop_writer = NULL;               // Event that stops the writer
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function returns the time in ticks of the performance counter.
+//
+static inline LONGLONG Clock( )
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter( &now );
+    return now.QuadPart;
+}
+
+
+// This function returns the ring of the calling thread, making it (and
+// adding it to the list of rings) the first time.
+//
+static TraceRing* GetRing( )
+{
+    TraceRing* r = ring;
+
+    if ( r != NULL )
+        return r;
+    r = new TraceRing;
+    r->head = r->tail = r->dropped = 0;
+    r->thread = GetCurrentThreadId( );
+    r->name = thread_name;
+    r->named = false;
+    do
+    {
+        r->next = rings;
+    } while ( InterlockedCompareExchangePointer( (PVOID volatile*)&rings, r, r->next ) != r->next );
+    ring = r;
+    return r;
+}
+
+
+// This function adds an event to the ring of the calling thread, if a trace
+// is running.
+//
+static void AddEvent( const char* name, char phase, LONGLONG start, LONGLONG end, int arg )
+{
+    TraceRing* r;
+    TraceEvent* e;
+    LONG head;
+
+    if ( !tracing )
+        return;
+    r = GetRing( );
+    head = r->head;
+    if ( (ULONG)head - (ULONG)r->tail >= TRACE_EVENTS )
+    {
+        InterlockedIncrement( &r->dropped );
+        return;
+    }
+    e = &r->events[head & ( TRACE_EVENTS - 1 )];
+    e->name = name;
+    e->phase = phase;
+    e->arg = arg;
+    e->start = start;
+    e->end = end;
+    // The event must be complete before the writer can see the new head.
+    InterlockedExchange( &r->head, (LONG)( (ULONG)head + 1 ) );
+}
+
+
+// This function converts a time to microseconds since the trace started.
+//
+static double Microseconds( LONGLONG ticks )
+{
+    return 1e6 * ( ticks - origin ) / frequency;
+}
+
+
+// This function starts the next event in the file.
+//
+static void NextEvent( )
+{
+    fprintf( trace_file, first_event ? "\n" : ",\n" );
+    first_event = false;
+}
+
+
+// This function writes the events in all of the rings to the file, and
+// empties the rings.  Only the writer thread (or starttrace and stoptrace,
+// when there is none) may call it.
+//
+static void WriteRings( )
+{
+    DWORD pid = GetCurrentProcessId( );
+
+    for ( TraceRing* r = rings; r != NULL; r = r->next )
+    {
+        LONG head = InterlockedCompareExchange( &r->head, 0, 0 );
+        LONG tail = r->tail;
+
+        if ( head != tail && !r->named )
+        {
+            NextEvent( );
+            fprintf( trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,"
+                     "\"args\":{\"name\":\"%s\"}}", (unsigned long)pid, (unsigned long)r->thread, r->name );
+            r->named = true;
+        }
+        for ( ; tail != head; tail = (LONG)( (ULONG)tail + 1 ) )
+        {
+            const TraceEvent* e = &r->events[tail & ( TRACE_EVENTS - 1 )];
+            NextEvent( );
+            if ( e->phase == 'X' )
+                fprintf( trace_file, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                         "\"pid\":%lu,\"tid\":%lu,\"args\":{\"n\":%d}}",
+                         e->name, Microseconds( e->start ), Microseconds( e->end ) - Microseconds( e->start ),
+                         (unsigned long)pid, (unsigned long)r->thread, e->arg );
+            else
+                fprintf( trace_file, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                         "\"pid\":%lu,\"tid\":%lu,\"args\":{\"n\":%d}}",
+                         e->name, Microseconds( e->start ), (unsigned long)pid, (unsigned long)r->thread, e->arg );
+        }
+        InterlockedExchange( &r->tail, head );
+    }
+}
+
+
+// This is the entry point of the writer thread.  It empties the rings every
+// TRACE_FLUSH_MS milliseconds until stoptrace signals stop_writer.
+//
+static DWORD WINAPI WriterThread( LPVOID )
+{
+    while ( WaitForSingleObject( stop_writer, TRACE_FLUSH_MS ) == WAIT_TIMEOUT )
+    {
+        WriteRings( );
+        fflush( trace_file );
+    }
+    return 0;
+}
+
+
+/*****************************************************************************
+*
+*   The routines used by the rest of the library
+*
+*****************************************************************************/
+
+BGI__TraceSpan::BGI__TraceSpan( const char* name, int arg )
+{
+    this->name = name;
+    this->arg = arg;
+    start = Clock( );
+}
+
+
+BGI__TraceSpan::~BGI__TraceSpan( )
+{
+    AddEvent( name, 'X', start, Clock( ), arg );
+}
+
+
+// This function adds an event that ran from start to end on the calling
+// thread.
+// (used by BGI__Counter in stats.cpp)
+//
+void BGI__TraceEvent( const char* name, LONGLONG start, LONGLONG end, int arg )
+{
+    AddEvent( name, 'X', start, end, arg );
+}
+
+
+// This function adds a wait for the DC mutex, unless it was too short to
+// be anything but the lock being taken without a wait.
+// (used by BGI__WaitForDC in stats.cpp)
+//
+void BGI__TraceWait( LONGLONG start, LONGLONG end )
+{
+    if ( tracing && ( end - start ) * 1000000 >= TRACE_MIN_WAIT_US * frequency )
+        AddEvent( "wait for DC", 'X', start, end, 0 );
+}
+
+
+// This function adds an event with no length.
+// (used by RefreshWindow in drawing.cpp and swapbuffers in winbgi.cpp)
+//
+void BGI__TraceInstant( const char* name, int arg )
+{
+    LONGLONG now = Clock( );
+
+    AddEvent( name, 'i', now, now, arg );
+}
+
+
+// This function names the calling thread in the trace.  Threads that are
+// not named are shown as "user thread".
+// (used by BGI__ThreadInitWindow in winthread.cpp)
+//
+void BGI__TraceThread( const char* name )
+{
+    thread_name = name;
+    if ( ring != NULL )
+        ring->name = name;
+}
+#endif
+
+
+/*****************************************************************************
+*
+*   The actual API calls are implemented below
+*
+*****************************************************************************/
+
+// This function ends the trace, if there is one, and finishes its file.
+//
+__declspec(dllexport) void stoptrace( )
+{
+#ifdef BGI_TRACE
+    LONG dropped = 0;
+
+    if ( writer == NULL )
+        return;
+    InterlockedExchange( &tracing, 0 );
+    SetEvent( stop_writer );
+    WaitForSingleObject( writer, INFINITE );
+    CloseHandle( writer );
+    CloseHandle( stop_writer );
+    writer = stop_writer = NULL;
+
+    WriteRings( );
+    for ( TraceRing* r = rings; r != NULL; r = r->next )
+        dropped += InterlockedExchange( &r->dropped, 0 );
+    fprintf( trace_file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%ld}}\n", dropped );
+    fclose( trace_file );
+    trace_file = NULL;
+#endif
+}
+
+
+// This function starts writing a trace of the library to a Chrome trace
+// event (JSON) file, ending any trace that is already running.  The trace
+// is written while it runs and finished by stoptrace (or at exit).  If the
+// file cannot be made, or the library was built without BGI_TRACE, the
+// error code is set to grError.
+//
+__declspec(dllexport) void starttrace( const char* filename )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+#ifdef BGI_TRACE
+    LARGE_INTEGER ticks;
+    static bool registered = false;
+
+    stoptrace( );
+    if ( ( trace_file = fopen( filename, "w" ) ) == NULL )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+    fprintf( trace_file, "{\"traceEvents\":[" );
+    first_event = true;
+
+    // Events left from an earlier trace are thrown away.
+    for ( TraceRing* r = rings; r != NULL; r = r->next )
+    {
+        InterlockedExchange( &r->tail, r->head );
+        r->dropped = 0;
+        r->named = false;
+    }
+    QueryPerformanceFrequency( &ticks );
+    frequency = ticks.QuadPart;
+    origin = Clock( );
+
+    stop_writer = CreateEvent( NULL, TRUE, FALSE, NULL );
+    writer = CreateThread( NULL, 0, WriterThread, NULL, 0, NULL );
+    if ( writer == NULL )
+    {
+        CloseHandle( stop_writer );
+        stop_writer = NULL;
+        fclose( trace_file );
+        trace_file = NULL;
+        pWndData->error_code = grError;
+        return;
+    }
+    if ( !registered )
+    {
+        atexit( stoptrace );
+        registered = true;
+    }
+    InterlockedExchange( &tracing, 1 );
+#else
+    pWndData->error_code = grError;
+#endif
+}
@@ -0,0 +1,297 @@
+// File: video.cxx
+//
+// This file contains the frame recorder.  While a window is being recorded,
+// the recorder keeps its own copy of the visual page.  Each time the window
+// is painted, the painted rectangle (and only that) is copied into it with
+// the DC mutex held.  After the mutex is released, the rectangle is compared
+// with the last frame that was kept, and if anything changed, the copy goes
+// into a small queue of frames.  A background thread takes the frames from
+// the queue, converts them to YCbCr and appends them to a YUV4MPEG2 (.y4m)
+// file, which most video tools can read or convert.  If the queue is full,
+// painting waits for the encoder, so no frame is ever lost, but the drawing
+// thread is never held up because the DC mutex is not held while waiting.
+//
+
+#include <windows.h>        // Provides the Win32 API
+#include <stdio.h>          // Provides sprintf
+#include <string.h>         // Provides memcmp and memcpy
+#include "winbgi.h"         // API routines
+#include "winbgitypes.h"    // Internal structure data
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+
+/*****************************************************************************
+*
+*   Structures and constants
+*
+*****************************************************************************/
+#define FRAME_QUEUE     8       // Number of frames waiting to be encoded
+
+// The state of one recording.  The window thread fills the frames at
+// frames[tail % FRAME_QUEUE], and the encoder thread empties them from
+// frames[head % FRAME_QUEUE].  next and last differ only inside rect, since
+// every paint either queues next or finds it the same as last.
+struct FrameRecorder
+{
+    HANDLE hFile;               // The .y4m file
+    int width, height;          // Size of each frame
+    BYTE* last;                 // Copy of the last frame that was queued
+    BYTE* next;                 // The visual page, as 32-bit pixels
+    RECT rect;                  // The part of next that was just painted
+    HANDLE hBusy;               // Mutex held from copying into next to queuing it
+    BYTE* frames[FRAME_QUEUE];  // Frames in the layout of the pages
+    volatile LONG head, tail;   // Frames taken and frames queued so far
+    HANDLE free_slots;          // Semaphore counting empty frames
+    HANDLE queued;              // Semaphore counting queued frames (and the stop)
+    bool failed;                // A write failed, so the rest are dropped
+    HANDLE hThread;             // The encoder thread
+};
+
+
+/*****************************************************************************
+*
+*   Helper functions
+*
+*****************************************************************************/
+
+// This function converts one frame to the Y, Cb and Cr planes of a 4:4:4
+// YUV4MPEG2 frame (JPEG coefficients, full range), after the FRAME header.
+//
+static void ConvertFrame( const BYTE* pBits, int width, int height, BYTE* out )
+{
+    int size = width * height;
+    BYTE* y = out;
+    BYTE* cb = out + size;
+    BYTE* cr = out + 2 * size;
+
+    for ( int i = 0; i < size; i++ )
+    {
+        DWORD pixel = ( (const DWORD*)pBits )[i];
+        int r = ( pixel >> 16 ) & 0xFF, g = ( pixel >> 8 ) & 0xFF, b = pixel & 0xFF;
+        y[i] = ( 77 * r + 150 * g + 29 * b ) >> 8;
+        cb[i] = ( ( -43 * r - 84 * g + 127 * b ) >> 8 ) + 128;
+        cr[i] = ( ( 127 * r - 106 * g - 21 * b ) >> 8 ) + 128;
+    }
+}
+
+
+// This is the entry point of the encoder thread.  It encodes and writes the
+// queued frames in order.  It stops when it is woken with no frame queued,
+// which stoprecording does after the last frame.
+//
+static DWORD WINAPI EncodeThread( LPVOID pThreadData )
+{
+    FrameRecorder* r = (FrameRecorder*)pThreadData;
+    DWORD size = 6 + 3 * r->width * r->height;
+    BYTE* out = new BYTE[size];
+    DWORD written;
+
+    memcpy( out, "FRAME\n", 6 );
+    for ( ;; )
+    {
+        WaitForSingleObject( r->queued, INFINITE );
+        if ( r->head == r->tail )
+            break;
+        if ( !r->failed )
+        {
+            ConvertFrame( r->frames[r->head % FRAME_QUEUE], r->width, r->height, out + 6 );
+            if ( !WriteFile( r->hFile, out, size, &written, NULL ) || written != size )
+                r->failed = true;
+        }
+        InterlockedIncrement( &r->head );
+        ReleaseSemaphore( r->free_slots, 1, NULL );
+    }
+    delete [] out;
+    return 0;
+}
+
+
+// This function copies the rectangle of the visual page that is being
+// painted into the recorder's copy of the page, if the window is being
+// recorded.  It is called by cls_OnPaint with the DC mutex held, and it
+// returns the recorder (or NULL), which must then be given to
+// BGI__QueueFrame after the mutex is released.
+// (used by cls_OnPaint in winthread.cpp)
+//
+FrameRecorder* BGI__RecordFrame( WindowData* pWndData, const RECT* rect )
+{
+    FrameRecorder* r = pWndData->recorder;
+
+    if ( r == NULL )
+        return NULL;
+    WaitForSingleObject( r->hBusy, INFINITE );
+    r->rect.left = max( rect->left, 0 );
+    r->rect.top = max( rect->top, 0 );
+    r->rect.right = min( rect->right, r->width );
+    r->rect.bottom = min( rect->bottom, r->height );
+    if ( r->rect.left >= r->rect.right || r->rect.top >= r->rect.bottom )
+        r->rect.bottom = r->rect.top;   // Nothing to copy or compare
+    else if ( !r->failed )
+    {
+        GdiFlush( );
+        BGI__ReadPixels( pWndData, pWndData->VisualPage, &r->rect,
+                         r->next + r->rect.top * 4 * r->width + 4 * r->rect.left, 4 * r->width );
+    }
+    return r;
+}
+
+
+// This function queues the recorder's copy of the visual page as the next
+// frame, unless the rectangle that was just painted is the same as in the
+// last frame.  It is called without the DC mutex, so if it has to wait for
+// the encoder, only the window thread waits.
+// (used by cls_OnPaint in winthread.cpp)
+//
+void BGI__QueueFrame( FrameRecorder* r )
+{
+    int pitch = 4 * r->width;
+    int offset = r->rect.top * pitch + 4 * r->rect.left;
+    int bytes = 4 * ( r->rect.right - r->rect.left );
+    int y;
+
+    for ( y = r->rect.top; y < r->rect.bottom; y++, offset += pitch )
+        if ( memcmp( r->last + offset, r->next + offset, bytes ) != 0 )
+            break;
+    if ( !r->failed && y < r->rect.bottom )
+    {
+        for ( ; y < r->rect.bottom; y++, offset += pitch )
+            memcpy( r->last + offset, r->next + offset, bytes );
+        WaitForSingleObject( r->free_slots, INFINITE );
+        memcpy( r->frames[r->tail % FRAME_QUEUE], r->next, r->height * pitch );
+        InterlockedIncrement( &r->tail );
+        ReleaseSemaphore( r->queued, 1, NULL );
+    }
+    ReleaseMutex( r->hBusy );
+}
+
+
+// This function ends the recording of a window, if there is one.  The frames
+// that are still queued are written before the file is closed.
+// (used by cls_OnDestroy in winthread.cpp)
+//
+void BGI__StopRecording( WindowData* pWndData )
+{
+    FrameRecorder* r;
+
+    WaitForSingleObject( pWndData->hDCMutex, INFINITE );
+    r = pWndData->recorder;
+    pWndData->recorder = NULL;
+    ReleaseMutex( pWndData->hDCMutex );
+    if ( r == NULL )
+        return;
+
+    // Wait for a frame that the window thread is queuing.
+    WaitForSingleObject( r->hBusy, INFINITE );
+    ReleaseMutex( r->hBusy );
+
+    // Nothing can be queued any more, so a wake-up with an empty queue tells
+    // the encoder to finish.
+    ReleaseSemaphore( r->queued, 1, NULL );
+    WaitForSingleObject( r->hThread, INFINITE );
+    CloseHandle( r->hThread );
+    CloseHandle( r->hFile );
+    CloseHandle( r->free_slots );
+    CloseHandle( r->queued );
+    CloseHandle( r->hBusy );
+    for ( int i = 0; i < FRAME_QUEUE; i++ )
+        delete [] r->frames[i];
+    delete [] r->last;
+    delete [] r->next;
+    delete r;
+}
+
+
+/*****************************************************************************
+*
+*   The actual API calls are implemented below
+*
+*****************************************************************************/
+
+// This function starts recording the current window to a YUV4MPEG2 video
+// file that plays at fps frames per second.  The current picture is the
+// first frame, and after that a frame is added whenever the window shows
+// something new.  A recording that is already running is stopped first.
+//
+__declspec(dllexport) void startrecording( const char* filename, int fps )
+{
+    WindowData* pWndData = BGI__GetWindowDataPtr( );
+    FrameRecorder* r;
+    char header[80];
+    DWORD written;
+    int i;
+
+    BGI__StopRecording( pWndData );
+    if ( fps <= 0 )
+    {
+        pWndData->error_code = grError;
+        return;
+    }
+
+    r = new FrameRecorder;
+    r->width = pWndData->width;
+    r->height = pWndData->height;
+    r->hFile = CreateFile( filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    sprintf( header, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", r->width, r->height, fps );
+    if ( r->hFile == INVALID_HANDLE_VALUE
+         || !WriteFile( r->hFile, header, (DWORD)strlen( header ), &written, NULL ) )
+    {
+        if ( r->hFile != INVALID_HANDLE_VALUE )
+            CloseHandle( r->hFile );
+        delete r;
+        pWndData->error_code = grError;
+        return;
+    }
+
+    r->last = new BYTE[4 * r->width * r->height];
+    r->next = new BYTE[4 * r->width * r->height];
+    for ( i = 0; i < FRAME_QUEUE; i++ )
+        r->frames[i] = new BYTE[4 * r->width * r->height];
+    r->head = r->tail = 0;
+    r->free_slots = CreateSemaphore( NULL, FRAME_QUEUE, FRAME_QUEUE, NULL );
+    r->queued = CreateSemaphore( NULL, 0, FRAME_QUEUE + 1, NULL );
+    r->hBusy = CreateMutex( NULL, FALSE, NULL );
+    r->failed = false;
+    r->hThread = CreateThread( NULL, 0, EncodeThread, (LPVOID)r, 0, NULL );
+    if ( r->hThread == NULL )
+    {
+        CloseHandle( r->hFile );
+        CloseHandle( r->free_slots );
+        CloseHandle( r->queued );
+        CloseHandle( r->hBusy );
+        for ( i = 0; i < FRAME_QUEUE; i++ )
+            delete [] r->frames[i];
+        delete [] r->last;
+        delete [] r->next;
+        delete r;
+        pWndData->error_code = grError;
+        return;
+    }
+
+    // The first frame is the whole visual page.  It is read in the same hold
+    // of the DC mutex that starts the recording, so no paint is missed.
+    WaitForSingleObject( pWndData->hDCMutex, INFINITE );
+    GdiFlush( );
+    BGI__ReadPixels( pWndData, pWndData->VisualPage, NULL, r->next, 4 * r->width );
+    memcpy( r->last, r->next, 4 * r->width * r->height );
+    memcpy( r->frames[0], r->next, 4 * r->width * r->height );
+    WaitForSingleObject( r->free_slots, 0 );
+    r->tail = 1;
+    ReleaseSemaphore( r->queued, 1, NULL );
+    pWndData->recorder = r;
+    ReleaseMutex( pWndData->hDCMutex );
+}
+
+
+// This function stops recording the current window and closes the file.
+//
+__declspec(dllexport) void stoprecording( )
+{
+    BGI__StopRecording( BGI__GetWindowDataPtr( ) );
+}
@@ -12,6 +12,7 @@
 #include <windows.h>            // Provides the Win32 API
 #include <windowsx.h>           // Provides message cracker macros (p. 96)
 #include <stdio.h>              // Provides sprintf
+#include <stdlib.h>             // Provides atoi
 #include <iostream>             // This is for debug only
 #include <vector>               // MGM: Added for BGI__WindowTable
 #include "winbgi.h"             // External API routines
@@ -189,6 +190,9 @@ __declspec(dllexport) void graphdefaults( )
     BGI__Colors[14] = RGB( 255, 255, 0 );  // Yellow
     BGI__Colors[15] = RGB( 255, 255, 255 );  // White
 
+    // Restore the palette of the window to these colors
+    BGI__ResetPalette( pWndData );
+
     // Set background color to default (black)
     setbkcolor( BLACK );
 
@@ -197,6 +201,8 @@ __declspec(dllexport) void graphdefaults( )
     // Set fill style and pattern to default (white solid)
     pWndData->fillInfo.pattern = SOLID_FILL;
     pWndData->fillInfo.color = WHITE;
+    // Set the write mode to default (copy)
+    pWndData->writemode = COPY_PUT;
 
     hDC = BGI__GetWinbgiDC( );
     // Reset the pen and brushes for each DC
@@ -215,6 +221,9 @@ __declspec(dllexport) void graphdefaults( )
 
 	// Set the default text color for each page
 	SetTextColor(pWndData->hDC[i], converttorgb(WHITE));
+
+        // Set the default write mode
+        SetROP2( pWndData->hDC[i], R2_COPYPEN );
     }
     ReleaseMutex(pWndData->hDCMutex);
 
@@ -240,6 +249,12 @@ __declspec(dllexport) void graphdefaults( )
     pWndData->lineInfo.linestyle = SOLID_LINE;
     pWndData->lineInfo.thickness = NORM_WIDTH;
 
+    // The software drawing paths follow the new state.  The stock pen
+    // leaves out the last point of a line, and has no dashes.
+    pWndData->pipeline.last_point = false;
+    pWndData->pipeline.dashes = 0;
+    BGI__UpdatePipeline( pWndData );
+
     // Set the default active and visual page
     if ( pWndData->DoubleBuffer )
     {
@@ -265,17 +280,23 @@ using namespace std;
 // This thread is responsible for creating the window and processing all the
 // messages.  It returns a positive integer value which the user can then
 // use whenever he needs to reference the window.
+// The pages of the window hold 32-bit pixels (XRGB8888_PAGES), palette
+// entries (INDEXED8_PAGES), whose colors can be changed with setrgbpalette,
+// 16-bit pixels (RGB565_PAGES) or 8-bit grays (GRAY8_PAGES).  The smaller
+// formats take a half or a quarter of the memory, and are converted to the
+// screen's format only when the window is painted.
 // RETURN VALUE: If the window is successfully created, a nonnegative integer
 //                  uniquely identifing the window.
 //               On failure, -1.
 //
 __declspec(dllexport) int initwindow
-( int width, int height, const char* title, int left, int top, bool dbflag , bool closeflag)
+( int width, int height, const char* title, int left, int top, bool dbflag , bool closeflag, int pageformat)
 {
     HANDLE hThread;                     // Handle to the message pump thread
     int index;                          // Index of current window in the table
     HANDLE objects[2];                  // Handle to objects (thread and event) to ensure proper creation
     int code;                           // Return code of thread wait function
+    char rfb_port[16];                  // Value of BGI_RFB_PORT, if it is set
 
     // MGM: Call the DllMain, which used to be the DLL entry point.
     if (!DllMain_MGM(
@@ -283,6 +304,8 @@ __declspec(dllexport) int initwindow
         DLL_PROCESS_ATTACH,
         NULL))
         return -1;
+    if ( pageformat < XRGB8888_PAGES || pageformat > GRAY8_PAGES )
+        return -1;
 
     WindowData* pWndData = new WindowData;
     // Check if new failed
@@ -297,6 +320,19 @@ __declspec(dllexport) int initwindow
     pWndData->initleft = left;
     pWndData->inittop = top;
     pWndData->title = title; // Converts to a string object
+    pWndData->recording = NULL;
+    pWndData->record_mute = 0;
+    pWndData->recorder = NULL;
+    pWndData->streamer = NULL;
+    pWndData->rfb = NULL;
+    pWndData->page_format = pageformat;
+    pWndData->palette_version = 0;
+    pWndData->nearest = NULL;
+    pWndData->viewport_version = 0;
+    pWndData->culled = 0;
+    pWndData->counters = NULL;
+    for ( int i = 0; i < MAX_PAGES; i++ )
+        pWndData->page_viewport[i] = 0;
 
     hThread = CreateThread( NULL,                   // Security Attributes (use default)
                             0,                      // Stack size (use default)
@@ -365,6 +401,11 @@ __declspec(dllexport) int initwindow
     setcolor(WHITE);
     setfillstyle(SOLID_FILL, WHITE);
 
+    // If BGI_RFB_PORT is set, serve the window to VNC viewers, so that it can
+    // be used without a desktop session.  Later windows use the next ports.
+    if ( GetEnvironmentVariable( "BGI_RFB_PORT", rfb_port, sizeof( rfb_port ) ) > 0 )
+        startrfbserver( atoi( rfb_port ) + index );
+
     // Everything went well!  Return the window index to the user.
     return index;
 }
@@ -372,6 +413,9 @@ __declspec(dllexport) int initwindow
 
 __declspec(dllexport) void closegraph(int wid)
 {
+    // Finish the files that snapshotasync has started before windows go.
+    waitsnapshots( );
+
     if (wid == CURRENT_WINDOW)
 	closegraph(BGI__CurrentWindow);
     else if (wid == ALL_WINDOWS)
@@ -896,5 +940,6 @@ __declspec(dllexport) void swapbuffers( )
     // Redraw the entire current window.  No need to erase the background as
     // the new image is simply copied over the old one.
     InvalidateRect( pWndData->hWnd, NULL, FALSE );
+    BGI__TRACE_INSTANT( "swapbuffers", 0 );
 }
 
@@ -115,6 +115,15 @@ enum graph_errors { grInvalidVersion = -18, grInvalidDeviceNum = -15, grInvalidF
 // Write modes
 enum putimage_ops{ COPY_PUT, XOR_PUT, OR_PUT, AND_PUT, NOT_PUT };
 
+// Image file formats (writeimagestream)
+enum image_formats { BMP_IMAGE, PNG_IMAGE };
+
+// Image scaling (setimagescaling)
+enum image_scaling { NEAREST_SCALING, BILINEAR_SCALING };
+
+// Formats of the pages of a window (initwindow)
+enum page_formats { XRGB8888_PAGES, INDEXED8_PAGES, RGB565_PAGES, GRAY8_PAGES };
+
 // Text Modes
 enum horiz { LEFT_TEXT, CENTER_TEXT, RIGHT_TEXT };
 enum vertical { BOTTOM_TEXT, VCENTER_TEXT, TOP_TEXT }; // middle not needed other than as seperator
@@ -180,6 +189,45 @@ struct viewporttype
 };
 
 
+// This structure records how well the image cache of readimagefile is doing.
+// hits and misses count the calls that did and did not find their image in
+// the cache; entries and bytes describe what is held now, out of budget.
+struct imagecachetype
+{
+    unsigned int hits;          // Calls that found their image
+    unsigned int misses;        // Calls that had to read the file
+    unsigned int entries;       // Images in the cache
+    unsigned int bytes;         // Memory used by those images
+    unsigned int budget;        // Most memory the cache may use
+};
+
+
+// These structures hold the counters of a library built with BGI_STATS
+// defined (getbgistats).  Each entry covers one call, and "other" covers
+// the work done outside the counted calls.  Times are in milliseconds.
+// pixels counts the pixels that the library wrote itself (shapes that GDI
+// draws are not counted), and refreshed the pixels of the window that were
+// marked for repainting.
+#define BGI_STATS_CALLS 64
+struct callstatstype
+{
+    const char* name;           // Name of the call, such as "putpixel"
+    unsigned long calls;        // Number of calls
+    double total_ms;            // Time spent in the calls
+    double max_ms;              // Time spent in the longest call
+    double wait_ms;             // Time spent waiting for the window's lock
+    double pixels;              // Pixels written
+    double refreshed;           // Pixels marked for repainting
+};
+
+struct bgistatstype
+{
+    int enabled;                // Zero if the library does not keep counters
+    int count;                  // Entries of call in use
+    callstatstype call[BGI_STATS_CALLS];
+};
+
+
 // This structure records information about the palette.
 struct palettetype
 {
@@ -201,16 +249,20 @@ extern "C" {
 __declspec(dllexport) void arc( int x, int y, int stangle, int endangle, int radius );
 __declspec(dllexport) void bar( int left, int top, int right, int bottom );
 __declspec(dllexport) void bar3d( int left, int top, int right, int bottom, int depth, int topflag );
+__declspec(dllexport) void bars( int n, const int* rects, const int* colors );
 __declspec(dllexport) void circle( int x, int y, int radius );
+__declspec(dllexport) void circles( int n, const int* centers, const int* radii );
 __declspec(dllexport) void cleardevice( );
 __declspec(dllexport) void clearviewport( );
 __declspec(dllexport) void drawpoly(int n_points, int* points);
+__declspec(dllexport) void drawpolyfast(int n_points, int* points);
 __declspec(dllexport) void ellipse( int x, int y, int stangle, int endangle, int xradius, int yradius );
 __declspec(dllexport) void fillellipse( int x, int y, int xradius, int yradius );
 __declspec(dllexport) void fillpoly(int n_points, int* points);
 __declspec(dllexport) void floodfill( int x, int y, int border );
 __declspec(dllexport) void line( int x1, int y1, int x2, int y2 );
 __declspec(dllexport) void linerel( int dx, int dy );
+__declspec(dllexport) void lines( int n, const int* segs );
 __declspec(dllexport) void lineto( int x, int y );
 __declspec(dllexport) void pieslice( int x, int y, int stangle, int endangle, int radius );
 __declspec(dllexport) void putpixel( int x, int y, int color );
@@ -224,6 +276,7 @@ __declspec(dllexport) void delay( int msec );
 __declspec(dllexport) void getarccoords( arccoordstype *arccoords );
 __declspec(dllexport) int getbkcolor( );
 __declspec(dllexport) int getcolor( );
+__declspec(dllexport) unsigned long getculledcount( );
 __declspec(dllexport) void getfillpattern( char *pattern );
 __declspec(dllexport) void getfillsettings( fillsettingstype *fillinfo );
 __declspec(dllexport) void getlinesettings( linesettingstype *lineinfo );
@@ -266,7 +319,8 @@ __declspec(dllexport) char *grapherrormsg( int errorcode );
 __declspec(dllexport) int graphresult( );
 __declspec(dllexport) void initgraph( int *graphdriver, int *graphmode, char *pathtodriver );
 __declspec(dllexport) int initwindow
-    ( int width, int height, const char* title="Windows BGI", int left=0, int top=0, bool dbflag=false, bool closeflag=true );
+    ( int width, int height, const char* title="Windows BGI", int left=0, int top=0, bool dbflag=false, bool closeflag=true,
+      int pageformat=XRGB8888_PAGES );
 __declspec(dllexport) int installuserdriver( char *name, int *fp );    // Not available in WinBGI
 __declspec(dllexport) int installuserfont( char *name );               // Not available in WinBGI
 __declspec(dllexport) int registerbgidriver( void *driver );           // Not available in WinBGI
@@ -292,6 +346,38 @@ __declspec(dllexport) void setactivepage( int page );
 __declspec(dllexport) void setvisualpage( int page );
 __declspec(dllexport) void swapbuffers( );
 
+// Parallel pixel shading (shader.cpp)
+__declspec(dllexport) void shadepixels( int left, int top, int right, int bottom,
+    int shader( int x, int y, void* data ), void* data=NULL, int coarse=1 );
+__declspec(dllexport) void shaderows( int left, int top, int right, int bottom,
+    void shader( int y, int left, int right, int* colors, void* data ), void* data=NULL );
+
+// Display lists (record.cpp)
+__declspec(dllexport) void beginrecord( );
+__declspec(dllexport) int endrecord( );
+__declspec(dllexport) void replay( int list, int dx=0, int dy=0 );
+__declspec(dllexport) void deletelist( int list );
+__declspec(dllexport) void savelist( int list, const char* filename );
+__declspec(dllexport) void replayfile( const char* filename, int dx=0, int dy=0 );
+
+// Video recording (video.cpp)
+__declspec(dllexport) void startrecording( const char* filename, int fps=30 );
+__declspec(dllexport) void stoprecording( );
+
+// Frame streaming (stream.cpp)
+__declspec(dllexport) void startstream( int port );
+__declspec(dllexport) void stopstream( );
+
+// RFB (VNC) server (rfb.cpp).  The server asks for no password, and a viewer
+// can move the mouse and type into the window, so any program or user on the
+// machine can control it.  It listens on 127.0.0.1 only.  Setting the
+// environment variable BGI_RFB_PORT makes initwindow start a server for each
+// new window (on that port, and the next ones for later windows).  The
+// viewers only get new frames when the window paints, so they do not see
+// drawing done while the window is minimized.
+__declspec(dllexport) void startrfbserver( int port=5900 );
+__declspec(dllexport) void stoprfbserver( );
+
 // Image Functions (drawing.cpp)
 __declspec(dllexport) unsigned imagesize( int left, int top, int right, int bottom );
 __declspec(dllexport) void getimage( int left, int top, int right, int bottom, void *bitmap );
@@ -306,11 +392,36 @@ __declspec(dllexport) void readimagefile(
     const char* filename=NULL,
     int left=0, int top=0, int right=INT_MAX, int bottom=INT_MAX
     );
+__declspec(dllexport) unsigned int readimagesprite( const char* filename, void *bitmap=NULL );
 __declspec(dllexport) void writeimagefile(
     const char* filename=NULL,
     int left=0, int top=0, int right=INT_MAX, int bottom=INT_MAX,
     bool active=true, HWND hwnd=NULL
     );
+__declspec(dllexport) void writeimagestream(
+    bool write( const void* bytes, int count, void* data ), void* data=NULL, int format=BMP_IMAGE,
+    int left=0, int top=0, int right=INT_MAX, int bottom=INT_MAX,
+    bool active=true, HWND hwnd=NULL
+    );
+__declspec(dllexport) void snapshotasync(
+    const char* filename,
+    int left=0, int top=0, int right=INT_MAX, int bottom=INT_MAX,
+    void callback( const char* filename, bool ok, void* data )=NULL, void* data=NULL,
+    bool active=true, HWND hwnd=NULL
+    );
+__declspec(dllexport) void waitsnapshots( );
+__declspec(dllexport) void setimagescaling( int mode );
+__declspec(dllexport) void setimagecache( unsigned int budget );
+__declspec(dllexport) void getimagecache( imagecachetype *cacheinfo );
+
+// Call Counters (stats.cpp)
+__declspec(dllexport) void getbgistats( bgistatstype *stats );
+__declspec(dllexport) void resetbgistats( );
+__declspec(dllexport) void setbgistatsdump( const char* filename, int msec );
+
+// Tracing (trace.cpp)
+__declspec(dllexport) void starttrace( const char* filename );
+__declspec(dllexport) void stoptrace( );
 
 // Text Functions (text.cpp)
 __declspec(dllexport) void gettextsettings(struct textsettingstype *texttypeinfo);
@@ -343,6 +454,7 @@ __declspec(dllexport) int getpalettesize( );
 __declspec(dllexport) void setallpalette( palettetype *palette );
 __declspec(dllexport) void setpalette( int colornum, int color );
 __declspec(dllexport) void setrgbpalette( int colornum, int red, int green, int blue );
+__declspec(dllexport) void setrgbpalettes( int first, int count, const unsigned char* rgb );
 
 // Color Macros
 #define IS_BGI_COLOR(v)     ( ((v) >= 0) && ((v) < 16) )
@@ -115,6 +115,15 @@ enum graph_errors { grInvalidVersion = -18, grInvalidDeviceNum = -15, grInvalidF
 // Write modes
 enum putimage_ops{ COPY_PUT, XOR_PUT, OR_PUT, AND_PUT, NOT_PUT };
 
+// Image file formats (writeimagestream)
+enum image_formats { BMP_IMAGE, PNG_IMAGE };
+
+// Image scaling (setimagescaling)
+enum image_scaling { NEAREST_SCALING, BILINEAR_SCALING };
+
+// Formats of the pages of a window (initwindow)
+enum page_formats { XRGB8888_PAGES, INDEXED8_PAGES, RGB565_PAGES, GRAY8_PAGES };
+
 // Text Modes
 enum horiz { LEFT_TEXT, CENTER_TEXT, RIGHT_TEXT };
 enum vertical { BOTTOM_TEXT, VCENTER_TEXT, TOP_TEXT }; // middle not needed other than as seperator
@@ -180,6 +189,45 @@ struct viewporttype
 };
 
 
+// This structure records how well the image cache of readimagefile is doing.
+// hits and misses count the calls that did and did not find their image in
+// the cache; entries and bytes describe what is held now, out of budget.
+struct imagecachetype
+{
+    unsigned int hits;          // Calls that found their image
+    unsigned int misses;        // Calls that had to read the file
+    unsigned int entries;       // Images in the cache
+    unsigned int bytes;         // Memory used by those images
+    unsigned int budget;        // Most memory the cache may use
+};
+
+
+// These structures hold the counters of a library built with BGI_STATS
+// defined (getbgistats).  Each entry covers one call, and "other" covers
+// the work done outside the counted calls.  Times are in milliseconds.
+// pixels counts the pixels that the library wrote itself (shapes that GDI
+// draws are not counted), and refreshed the pixels of the window that were
+// marked for repainting.
+#define BGI_STATS_CALLS 64
+struct callstatstype
+{
+    const char* name;           // Name of the call, such as "putpixel"
+    unsigned long calls;        // Number of calls
+    double total_ms;            // Time spent in the calls
+    double max_ms;              // Time spent in the longest call
+    double wait_ms;             // Time spent waiting for the window's lock
+    double pixels;              // Pixels written
+    double refreshed;           // Pixels marked for repainting
+};
+
+struct bgistatstype
+{
+    int enabled;                // Zero if the library does not keep counters
+    int count;                  // Entries of call in use
+    callstatstype call[BGI_STATS_CALLS];
+};
+
+
 // This structure records information about the palette.
 struct palettetype
 {
@@ -201,16 +249,20 @@ extern "C" {
 __declspec(dllimport) void arc( int x, int y, int stangle, int endangle, int radius );
 __declspec(dllimport) void bar( int left, int top, int right, int bottom );
 __declspec(dllimport) void bar3d( int left, int top, int right, int bottom, int depth, int topflag );
+__declspec(dllimport) void bars( int n, const int* rects, const int* colors );
 __declspec(dllimport) void circle( int x, int y, int radius );
+__declspec(dllimport) void circles( int n, const int* centers, const int* radii );
 __declspec(dllimport) void cleardevice( );
 __declspec(dllimport) void clearviewport( );
 __declspec(dllimport) void drawpoly(int n_points, int* points);
+__declspec(dllimport) void drawpolyfast(int n_points, int* points);
 __declspec(dllimport) void ellipse( int x, int y, int stangle, int endangle, int xradius, int yradius );
 __declspec(dllimport) void fillellipse( int x, int y, int xradius, int yradius );
 __declspec(dllimport) void fillpoly(int n_points, int* points);
 __declspec(dllimport) void floodfill( int x, int y, int border );
 __declspec(dllimport) void line( int x1, int y1, int x2, int y2 );
 __declspec(dllimport) void linerel( int dx, int dy );
+__declspec(dllimport) void lines( int n, const int* segs );
 __declspec(dllimport) void lineto( int x, int y );
 __declspec(dllimport) void pieslice( int x, int y, int stangle, int endangle, int radius );
 __declspec(dllimport) void putpixel( int x, int y, int color );
@@ -224,6 +276,7 @@ __declspec(dllimport) void delay( int msec );
 __declspec(dllimport) void getarccoords( arccoordstype *arccoords );
 __declspec(dllimport) int getbkcolor( );
 __declspec(dllimport) int getcolor( );
+__declspec(dllimport) unsigned long getculledcount( );
 __declspec(dllimport) void getfillpattern( char *pattern );
 __declspec(dllimport) void getfillsettings( fillsettingstype *fillinfo );
 __declspec(dllimport) void getlinesettings( linesettingstype *lineinfo );
@@ -266,7 +319,8 @@ __declspec(dllimport) char *grapherrormsg( int errorcode );
 __declspec(dllimport) int graphresult( );
 __declspec(dllimport) void initgraph( int *graphdriver, int *graphmode, char *pathtodriver );
 __declspec(dllimport) int initwindow
-    ( int width, int height, const char* title="Windows BGI", int left=0, int top=0, bool dbflag=false, bool closeflag=true );
+    ( int width, int height, const char* title="Windows BGI", int left=0, int top=0, bool dbflag=false, bool closeflag=true,
+      int pageformat=XRGB8888_PAGES );
 __declspec(dllimport) int installuserdriver( char *name, int *fp );    // Not available in WinBGI
 __declspec(dllimport) int installuserfont( char *name );               // Not available in WinBGI
 __declspec(dllimport) int registerbgidriver( void *driver );           // Not available in WinBGI
@@ -292,6 +346,38 @@ __declspec(dllimport) void setactivepage( int page );
 __declspec(dllimport) void setvisualpage( int page );
 __declspec(dllimport) void swapbuffers( );
 
+// Parallel pixel shading (shader.cpp)
+__declspec(dllimport) void shadepixels( int left, int top, int right, int bottom,
+    int shader( int x, int y, void* data ), void* data=NULL, int coarse=1 );
+__declspec(dllimport) void shaderows( int left, int top, int right, int bottom,
+    void shader( int y, int left, int right, int* colors, void* data ), void* data=NULL );
+
+// Display lists (record.cpp)
+__declspec(dllimport) void beginrecord( );
+__declspec(dllimport) int endrecord( );
+__declspec(dllimport) void replay( int list, int dx=0, int dy=0 );
+__declspec(dllimport) void deletelist( int list );
+__declspec(dllimport) void savelist( int list, const char* filename );
+__declspec(dllimport) void replayfile( const char* filename, int dx=0, int dy=0 );
+
+// Video recording (video.cpp)
+__declspec(dllimport) void startrecording( const char* filename, int fps=30 );
+__declspec(dllimport) void stoprecording( );
+
+// Frame streaming (stream.cpp)
+__declspec(dllimport) void startstream( int port );
+__declspec(dllimport) void stopstream( );
+
+// RFB (VNC) server (rfb.cpp).  The server asks for no password, and a viewer
+// can move the mouse and type into the window, so any program or user on the
+// machine can control it.  It listens on 127.0.0.1 only.  Setting the
+// environment variable BGI_RFB_PORT makes initwindow start a server for each
+// new window (on that port, and the next ones for later windows).  The
+// viewers only get new frames when the window paints, so they do not see
+// drawing done while the window is minimized.
+__declspec(dllimport) void startrfbserver( int port=5900 );
+__declspec(dllimport) void stoprfbserver( );
+
 // Image Functions (drawing.cpp)
 __declspec(dllimport) unsigned imagesize( int left, int top, int right, int bottom );
 __declspec(dllimport) void getimage( int left, int top, int right, int bottom, void *bitmap );
@@ -306,11 +392,36 @@ __declspec(dllimport) void readimagefile(
     const char* filename=NULL,
     int left=0, int top=0, int right=INT_MAX, int bottom=INT_MAX
     );
+__declspec(dllimport) unsigned int readimagesprite( const char* filename, void *bitmap=NULL );
 __declspec(dllimport) void writeimagefile(
     const char* filename=NULL,
     int left=0, int top=0, int right=INT_MAX, int bottom=INT_MAX,
     bool active=true, HWND hwnd=NULL
     );
+__declspec(dllimport) void writeimagestream(
+    bool write( const void* bytes, int count, void* data ), void* data=NULL, int format=BMP_IMAGE,
+    int left=0, int top=0, int right=INT_MAX, int bottom=INT_MAX,
+    bool active=true, HWND hwnd=NULL
+    );
+__declspec(dllimport) void snapshotasync(
+    const char* filename,
+    int left=0, int top=0, int right=INT_MAX, int bottom=INT_MAX,
+    void callback( const char* filename, bool ok, void* data )=NULL, void* data=NULL,
+    bool active=true, HWND hwnd=NULL
+    );
+__declspec(dllimport) void waitsnapshots( );
+__declspec(dllimport) void setimagescaling( int mode );
+__declspec(dllimport) void setimagecache( unsigned int budget );
+__declspec(dllimport) void getimagecache( imagecachetype *cacheinfo );
+
+// Call Counters (stats.cpp)
+__declspec(dllimport) void getbgistats( bgistatstype *stats );
+__declspec(dllimport) void resetbgistats( );
+__declspec(dllimport) void setbgistatsdump( const char* filename, int msec );
+
+// Tracing (trace.cpp)
+__declspec(dllimport) void starttrace( const char* filename );
+__declspec(dllimport) void stoptrace( );
 
 // Text Functions (text.cpp)
 __declspec(dllimport) void gettextsettings(struct textsettingstype *texttypeinfo);
@@ -343,6 +454,7 @@ __declspec(dllimport) int getpalettesize( );
 __declspec(dllimport) void setallpalette( palettetype *palette );
 __declspec(dllimport) void setpalette( int colornum, int color );
 __declspec(dllimport) void setrgbpalette( int colornum, int red, int green, int blue );
+__declspec(dllimport) void setrgbpalettes( int first, int count, const unsigned char* rgb );
 
 // Color Macros
 #define IS_BGI_COLOR(v)     ( ((v) >= 0) && ((v) < 16) )
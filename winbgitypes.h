@@ -20,10 +20,49 @@
 // Define maximum pages used for drawing.
 #define MAX_PAGES 4
 typedef void (*Handler)(int, int);
+struct WindowData;              // The state of one window (below)
+struct DisplayList;             // A recorded list of drawing calls (record.cpp)
+struct FrameRecorder;           // A video recording of a window (video.cpp)
+struct FrameStreamer;           // A stream of a window to a viewer (stream.cpp)
+struct RfbServer;               // An RFB (VNC) server for a window (rfb.cpp)
+struct CallCounters;            // The counters of the calls to a window (stats.cpp)
 
 // ---------------------------------------------------------------------------
 //                              Structures
 // ---------------------------------------------------------------------------
+// A perfect hash from the RGB colors (or the pixels) of the 16 BGI colors in
+// the palette back to their numbers: (key * multiplier) >> 26 is the slot of
+// each one (palette.cpp)
+#define BGI__LOOKUP_SLOTS 64
+struct BGI__ColorLookup
+{
+    DWORD multiplier;
+    DWORD key[BGI__LOOKUP_SLOTS];
+    signed char color[BGI__LOOKUP_SLOTS];   // -1 for an empty slot
+};
+
+// The software drawing paths of a window, as picked for its current state
+// (raster.cpp).  Index 0 of each pair is the unclipped path and index 1 the
+// clipped one.  Pixels are in the format of the pages.
+struct BGI__Pipeline
+{
+    void (*plot)( WindowData* pWndData, int x, int y, DWORD pixel );
+    void (*fill_rect[2])( WindowData* pWndData, RECT rect );
+    void (*hline[2])( WindowData* pWndData, int x1, int x2, int y );
+    void (*vline[2])( WindowData* pWndData, int x, int y1, int y2 );
+    void (*clear)( WindowData* pWndData, RECT rect, DWORD pixel );
+    RECT clip;                  // Where drawing may go (right and bottom excluded)
+    DWORD pen, fill, back;      // Pixels of the drawing, fill and background colors
+    BYTE pattern[8];            // Rows of the fill pattern
+    int empty_color;            // Background color when EMPTY_FILL was chosen
+    bool fills;                 // Whether the fill style can be drawn here
+    bool lines;                 // Whether the line style can be drawn here
+    bool last_point;            // Whether the pen draws the last point of a line
+    bool strokes;               // Whether the wide pen can be drawn here (stroke.cpp)
+    int dashes;                 // Entries in dash
+    DWORD dash[16];             // Lengths of the dashes and spaces of the pen
+};
+
 // This structure gives all necessary information to the ThreadInitWindow
 // function which creates a new window and processes its messages
 struct WindowData
@@ -42,6 +81,9 @@ struct WindowData
     HWND hWnd;                  // Handle to the window created
     HDC hDC[MAX_PAGES];         // Device contexts used for double buffering
     HBITMAP hOldBitmap[MAX_PAGES]; // The bitmaps generated with CreateCompatibleBitmap
+    BYTE* pBits[MAX_PAGES];     // Pixel memory of each page (DIB section in page_format, top-down rows)
+    int page_format;            // Format of the pages (one of the page_formats)
+    int pitch;                  // Bytes from one row of pBits to the next
     int VisualPage;             // The current device context used for painting the window
     int ActivePage;             // The current device context used for drawing
     bool DoubleBuffer;          // Whether the user wants a double buffered window (DOUBLE_BUFFER in initwindow)
@@ -66,6 +108,23 @@ struct WindowData
     Handler mouse_handlers[WM_MOUSELAST - WM_MOUSEFIRST + 1];   // Array of mouse event handlers
     bool refreshing;            // True if autorefershing should be done after each drawing event
     HANDLE hDCMutex;            // A mutex so that only one thread at a time can access the hDC array.
+    int writemode;              // The current write mode (COPY_PUT or XOR_PUT)
+    DisplayList* recording;     // The display list being recorded, or NULL
+    int record_mute;            // How many recorded calls are running right now
+    FrameRecorder* recorder;    // The video recording of this window, or NULL
+    FrameStreamer* streamer;    // The stream of this window, or NULL
+    RfbServer* rfb;             // The RFB server of this window, or NULL
+    COLORREF palette[256];      // Color of each palette entry (16 for 32-bit pages)
+    palettetype bgi_palette;    // Colors given to setpalette, for getpalette
+    int palette_version;        // Counts changes to the palette
+    BYTE* nearest;              // Nearest palette entry of each 15-bit color, or NULL
+    BGI__ColorLookup lookup;    // Finds the BGI color of an RGB color
+    BGI__ColorLookup pixel_lookup;  // Finds the BGI color of a pixel of a page
+    BGI__Pipeline pipeline;     // The software drawing paths for the current state
+    int viewport_version;       // Counts calls to setviewport
+    int page_viewport[MAX_PAGES];   // viewport_version that each page DC was given
+    unsigned long culled;       // Drawing calls given up on because nothing could be seen
+    CallCounters* counters;     // The counters of a BGI_STATS build, or NULL
 };
 // maybe need current position for lines, text, etc.
 // palette settings
@@ -77,6 +136,145 @@ struct WindowData
 
 
 
+// The pixels of the pages that hold colors rather than palette entries, and
+// how they are made from 0x00RRGGBB and turned back into it.  The software
+// drawing paths are instantiated once for each of these formats, so the
+// format is decided once per call rather than once per pixel.  A gray is
+// the average of the red, green and blue, which is the entry of a gray
+// color table that GDI picks for a color.
+template <int FORMAT> struct BGI__Format;
+
+template <> struct BGI__Format<XRGB8888_PAGES>
+{
+    typedef DWORD Pixel;
+    static inline Pixel FromRGB( DWORD rgb ) { return rgb; }
+    static inline DWORD ToRGB( Pixel pixel ) { return pixel; }
+};
+
+template <> struct BGI__Format<RGB565_PAGES>
+{
+    typedef WORD Pixel;
+    static inline Pixel FromRGB( DWORD rgb )
+    {
+        return (Pixel)( ( ( rgb >> 8 ) & 0xF800 ) | ( ( rgb >> 5 ) & 0x07E0 ) | ( ( rgb >> 3 ) & 0x001F ) );
+    }
+    static inline DWORD ToRGB( Pixel pixel )
+    {
+        // The top bits of each part are repeated in the bottom bits, so that
+        // full brightness stays 255.
+        DWORD r = pixel >> 11, g = ( pixel >> 5 ) & 0x3F, b = pixel & 0x1F;
+        return ( ( ( r << 3 ) | ( r >> 2 ) ) << 16 ) | ( ( ( g << 2 ) | ( g >> 4 ) ) << 8 )
+               | ( b << 3 ) | ( b >> 2 );
+    }
+};
+
+template <> struct BGI__Format<GRAY8_PAGES>
+{
+    typedef BYTE Pixel;
+    static inline Pixel FromRGB( DWORD rgb )
+    {
+        return (Pixel)( ( ( rgb >> 16 ) + ( ( rgb >> 8 ) & 0xFF ) + ( rgb & 0xFF ) + 1 ) / 3 );
+    }
+    static inline DWORD ToRGB( Pixel pixel ) { return pixel * 0x010101; }
+};
+
+// The format of the pages of a window: a BITMAPINFO with room for a full
+// color table, or for the masks of 16-bit pixels (palette.cpp)
+struct BGI__PageInfo
+{
+    BITMAPINFOHEADER bmiHeader;
+    RGBQUAD bmiColors[256];
+};
+
+
+
+// ---------------------------------------------------------------------------
+//                              Display lists
+// ---------------------------------------------------------------------------
+// Each recorded call is stored as one fixed-size command.  Points, strings,
+// fill patterns and images are kept in the data area of the list, and the
+// command holds their size (arg[4]) and offset (arg[5]).  These numbers must
+// not change, since display lists can be saved in files.
+enum BGI__Opcodes
+{
+    BGI__OP_NOP = 0,
+    // Drawing calls
+    BGI__OP_ARC = 1, BGI__OP_BAR, BGI__OP_BAR3D, BGI__OP_CIRCLE, BGI__OP_CLEARDEVICE,
+    BGI__OP_CLEARVIEWPORT, BGI__OP_DRAWPOLY, BGI__OP_ELLIPSE, BGI__OP_FILLELLIPSE,
+    BGI__OP_FILLPOLY, BGI__OP_FLOODFILL, BGI__OP_LINE, BGI__OP_LINEREL, BGI__OP_LINETO,
+    BGI__OP_MOVEREL, BGI__OP_MOVETO, BGI__OP_PIESLICE, BGI__OP_PUTPIXEL, BGI__OP_RECTANGLE,
+    BGI__OP_SECTOR, BGI__OP_OUTTEXT, BGI__OP_OUTTEXTXY, BGI__OP_PUTIMAGE,
+    // State changes
+    BGI__OP_SETCOLOR = 64, BGI__OP_SETBKCOLOR, BGI__OP_SETFILLSTYLE, BGI__OP_SETFILLPATTERN,
+    BGI__OP_SETLINESTYLE, BGI__OP_SETWRITEMODE, BGI__OP_SETTEXTSTYLE, BGI__OP_SETTEXTJUSTIFY,
+    BGI__OP_SETUSERCHARSIZE,
+    BGI__OP_COUNT
+};
+
+// The calls that are counted when the library is built with BGI_STATS, or
+// traced with BGI_TRACE (stats.cpp).  Those that can be recorded use their
+// BGI__OP numbers.
+enum BGI__Calls
+{
+    BGI__CALL_OTHER = BGI__OP_NOP,      // Work done outside the counted calls
+    BGI__CALL_BARS = BGI__OP_COUNT, BGI__CALL_CIRCLES, BGI__CALL_LINES, BGI__CALL_DRAWPOLYFAST,
+    BGI__CALL_GETPIXEL, BGI__CALL_GETIMAGE, BGI__CALL_READIMAGEFILE, BGI__CALL_SHADEPIXELS,
+    BGI__CALL_SHADEROWS, BGI__CALL_REPLAY, BGI__CALL_REPLAYFILE, BGI__CALL_REFRESHBGI,
+    BGI__CALL_COUNT
+};
+
+struct BGI__Command
+{
+    int op;                     // One of the BGI__OP values
+    int arg[6];                 // Arguments of the call
+};
+
+// Every counted call creates one of these on entry.  In a BGI_STATS build,
+// the time until the call returns, with the lock waits, pixels and
+// refreshes in between, is added to the counters of the call.  Calls made
+// while a counted call is running are counted as part of it.  In a
+// BGI_TRACE build, each call (nested ones too) is also a trace event.
+// Other builds do nothing here.
+#if defined( BGI_STATS ) || defined( BGI_TRACE )
+#define BGI__COUNTING
+#endif
+#ifdef BGI__COUNTING
+class BGI__Counter
+{
+public:
+    BGI__Counter( int call );
+    ~BGI__Counter( );
+private:
+    WindowData* pWndData;       // The window the call draws on
+    int call;                   // The call
+    bool outer;                 // False inside another counted call
+    LONGLONG start;             // When the call started
+};
+#else
+class BGI__Counter
+{
+public:
+    BGI__Counter( int ) { }
+};
+#endif
+
+// Every drawing function that can be recorded creates one of these on entry.
+// If a display list is being recorded for the current window, the call is
+// appended to it.  Calls made while a recorded call is running (such as the
+// moveto inside cleardevice) are not recorded a second time.  The call is
+// counted too.
+class BGI__Recorder
+{
+public:
+    BGI__Recorder( int op, int a0 = 0, int a1 = 0, int a2 = 0, int a3 = 0, int a4 = 0, int a5 = 0 );
+    BGI__Recorder( int op, int a0, int a1, const void* data, int size, int a2 = 0 );
+    ~BGI__Recorder( );
+private:
+    BGI__Counter counter;       // Counts the call
+    WindowData* pWndData;       // The window being recorded, or NULL
+};
+
+
 // ---------------------------------------------------------------------------
 //                              Prototypes
 // ---------------------------------------------------------------------------
@@ -95,6 +293,121 @@ WindowData* BGI__GetWindowDataPtr( HWND hWnd = NULL );
 // Refreshes an area of the window:
 void RefreshWindow( RECT* rect );
 
+// Page formats and palettes (palette.cpp).  The pixel functions need the DC
+// mutex, after a GdiFlush.  BGI__ColorToRGB gives the COLORREF a color shows
+// as, and BGI__RGBToColor goes back (as COLOR reports colors).
+// BGI__ColorToPixel gives the value of a color in page memory, and
+// BGI__GetPagePixel and BGI__PixelToColor read one back (as getpixel reports
+// colors).  BGI__ReadPixels and BGI__WritePixels convert between a page and
+// 32-bit 0x00RRGGBB pixels.
+void BGI__PageBitmapInfo( WindowData* pWndData, BGI__PageInfo* info );
+void BGI__ResetPalette( WindowData* pWndData );
+COLORREF BGI__ColorToRGB( WindowData* pWndData, int color );
+int BGI__RGBToColor( WindowData* pWndData, COLORREF rgb );
+DWORD BGI__ColorToPixel( WindowData* pWndData, int color );
+DWORD BGI__GetPagePixel( WindowData* pWndData, int page, int x, int y );
+int BGI__PixelToColor( WindowData* pWndData, DWORD pixel );
+void BGI__ReadPixels( WindowData* pWndData, int page, const RECT* rect, BYTE* out, int pitch );
+void BGI__WritePixels( WindowData* pWndData, int page, const RECT* rect, const BYTE* in, int pitch );
+
+// The software drawing paths (raster.cpp).  BGI__UpdatePipeline is called
+// whenever the drawing state changes, and the visibility tests and
+// BGI__PolyBounds need no lock; the others need the DC mutex, and the last
+// two return false if GDI must do the drawing instead.
+void BGI__UpdatePipeline( WindowData* pWndData );
+bool BGI__RectVisible( WindowData* pWndData, int left, int top, int right, int bottom );
+bool BGI__ShapeVisible( WindowData* pWndData, int left, int top, int right, int bottom );
+bool BGI__LineVisible( WindowData* pWndData, int x1, int y1, int x2, int y2 );
+bool BGI__PolyBounds( WindowData* pWndData, int n, const int* points, RECT* bounds );
+void BGI__ClearRect( WindowData* pWndData, RECT rect, int color );
+void BGI__PlotPixel( WindowData* pWndData, int x, int y, int color );
+bool BGI__FillBar( WindowData* pWndData, int left, int top, int right, int bottom );
+bool BGI__StraightLine( WindowData* pWndData, int x1, int y1, int x2, int y2 );
+
+// The software drawing path for wide lines (stroke.cpp).  Both need the DC
+// mutex, and return false if GDI must draw the line instead.
+bool BGI__StrokePolyline( WindowData* pWndData, const POINT* points, int n );
+bool BGI__StrokeLine( WindowData* pWndData, int x1, int y1, int x2, int y2 );
+
+// Gives the DC of a page the current viewport if it does not have it yet,
+// with the DC mutex held (misc.cpp)
+void BGI__SyncViewport( WindowData* pWndData, int page );
+
+// Writes part of a page to an image file (image.cpp)
+bool BGI__WriteImageFile( WindowData* pWndData, const char* filename, bool active,
+                          int left, int top, int right, int bottom );
+
+// Copies the painted part of the visual page for the video recording (with
+// the DC mutex held), queues it as a frame (without the mutex), and ends the
+// recording (video.cpp)
+FrameRecorder* BGI__RecordFrame( WindowData* pWndData, const RECT* rect );
+void BGI__QueueFrame( FrameRecorder* r );
+void BGI__StopRecording( WindowData* pWndData );
+
+// Gives the visual page to the stream (with the DC mutex held), and ends the
+// stream (stream.cpp)
+void BGI__StreamFrame( WindowData* pWndData );
+void BGI__StopStream( WindowData* pWndData );
+
+// Gives the visual page to the RFB server (with the DC mutex held), and stops
+// the server (rfb.cpp)
+void BGI__RfbFrame( WindowData* pWndData );
+void BGI__StopRfbServer( WindowData* pWndData );
+
+// The counters of a BGI_STATS build (stats.cpp).  BGI__WaitForDC takes the
+// DC mutex and counts (or traces) the wait.  BGI__COUNT_PIXELS counts pixels that the
+// library wrote and BGI__COUNT_REFRESH a rectangle (in device coordinates,
+// or NULL for the window) that was marked for repainting; both vanish from
+// other builds.  BGI__FreeCounters writes the last dump.
+#ifdef BGI__COUNTING
+void BGI__WaitForDC( WindowData* pWndData );
+const char* BGI__CallName( int call );
+#endif
+#ifdef BGI_STATS
+void BGI__CountPixels( WindowData* pWndData, double pixels );
+void BGI__CountRefresh( WindowData* pWndData, const RECT* rect );
+#define BGI__COUNT_PIXELS( pWndData, n )        BGI__CountPixels( pWndData, n )
+#define BGI__COUNT_REFRESH( pWndData, rect )    BGI__CountRefresh( pWndData, rect )
+#else
+#define BGI__COUNT_PIXELS( pWndData, n )        ( (void)0 )
+#define BGI__COUNT_REFRESH( pWndData, rect )    ( (void)0 )
+#endif
+void BGI__FreeCounters( WindowData* pWndData );
+
+// The trace events of a BGI_TRACE build (trace.cpp).  Times are ticks of
+// QueryPerformanceCounter.  BGI__TraceEvent adds an event that ran from
+// start to end on the calling thread, BGI__TraceWait adds a wait for the DC
+// mutex if it was long enough to matter, and BGI__TraceInstant adds an
+// event with no length.  BGI__TRACE_SPAN declares a variable that traces
+// the rest of its block, and BGI__TRACE_THREAD names the calling thread.
+// The macros vanish from other builds.
+#ifdef BGI_TRACE
+class BGI__TraceSpan
+{
+public:
+    BGI__TraceSpan( const char* name, int arg = 0 );
+    ~BGI__TraceSpan( );
+private:
+    const char* name;           // Name of the event (a constant string)
+    int arg;                    // Number shown with the event
+    LONGLONG start;             // When the span started
+};
+void BGI__TraceEvent( const char* name, LONGLONG start, LONGLONG end, int arg );
+void BGI__TraceWait( LONGLONG start, LONGLONG end );
+void BGI__TraceInstant( const char* name, int arg );
+void BGI__TraceThread( const char* name );
+#define BGI__TRACE_SPAN( var, name, arg )   BGI__TraceSpan var( name, arg )
+#define BGI__TRACE_INSTANT( name, arg )     BGI__TraceInstant( name, arg )
+#define BGI__TRACE_THREAD( name )           BGI__TraceThread( name )
+#else
+#define BGI__TRACE_SPAN( var, name, arg )
+#define BGI__TRACE_INSTANT( name, arg )     ( (void)0 )
+#define BGI__TRACE_THREAD( name )           ( (void)0 )
+#endif
+
+// Decodes a BMP, PNG or TGA file and draws it on the active page (decode.cpp)
+bool BGI__ReadImageFile( const char* filename, int left, int top, int right, int bottom );
+
 // ---------------------------------------------------------------------------
 //                            Global Variables
 // ---------------------------------------------------------------------------
@@ -45,6 +45,7 @@ DWORD WINAPI BGI__ThreadInitWindow( LPVOID pThreadData )
     MSG Message;                        // A windows event message
     HDC hDC;                            // The device context of the window
     HBITMAP hBitmap;                    // A compatible bitmap of the DC for the Memory DC
+    BGI__PageInfo bmi;                  // Format of the page bitmaps
     HMENU hMenu;                        // Handle to the system menu
     int CaptionHeight, xBorder, yBorder;
     
@@ -115,6 +116,12 @@ DWORD WINAPI BGI__ThreadInitWindow( LPVOID pThreadData )
     // Create a memory Device Context used for drawing.  The image is copied from here
     // to the screen in the paint method.  The DC and bitmaps are deleted
     // in cls_OnDestroy()
+    // The bitmaps are top-down DIB sections (32-bit, or 8-bit with a color
+    // table for indexed pages) rather than compatible bitmaps so that the
+    // library can also reach the pixels directly through pWndData->pBits
+    // (after a GdiFlush) without a GetDIBits round trip.
+    BGI__PageBitmapInfo( pWndData, &bmi );
+
     hDC = GetDC( hWindow );
     pWndData->hDCMutex = CreateMutex(NULL, FALSE,	NULL);
     WaitForSingleObject(pWndData->hDCMutex, 5000);
@@ -122,7 +129,7 @@ DWORD WINAPI BGI__ThreadInitWindow( LPVOID pThreadData )
     {
         pWndData->hDC[i] = CreateCompatibleDC( hDC );
         // Create a bitmap for the memory DC.  This is where the drawn image is stored.
-        hBitmap = CreateCompatibleBitmap( hDC, pWndData->width, pWndData->height );
+        hBitmap = CreateDIBSection( hDC, (BITMAPINFO*)&bmi, DIB_RGB_COLORS, (void**)&pWndData->pBits[i], NULL, 0 );
         pWndData->hOldBitmap[i] = (HBITMAP)SelectObject( pWndData->hDC[i], hBitmap );
     }
     ReleaseMutex(pWndData->hDCMutex);    
@@ -135,6 +142,7 @@ DWORD WINAPI BGI__ThreadInitWindow( LPVOID pThreadData )
     
     // Tell the user thread that the window was created successfully
     SetEvent( pWndData->WindowCreated );
+    BGI__TRACE_THREAD( "window thread" );
 
     // The message loop, which stops when a WM_QUIT message arrives
     while( GetMessage( &Message, NULL, 0, 0 ) )
@@ -144,6 +152,7 @@ DWORD WINAPI BGI__ThreadInitWindow( LPVOID pThreadData )
     }
 
     // Free memory used by thread structure
+    BGI__FreeCounters( pWndData );
     delete pWndData;
     return (DWORD)Message.wParam;
 }
@@ -158,6 +167,7 @@ void cls_OnChar( HWND hWnd, TCHAR ch, int repeat )
 {
     // This gets the address of the WindowData structure associated with the window
     WindowData *pWndData = BGI__GetWindowDataPtr( hWnd );
+    BGI__TRACE_SPAN( key, "WM_CHAR", ch );
 
     pWndData->kbd_queue.push( (TCHAR)ch );// Add the key to the queue
     SetEvent( pWndData->key_waiting );    // Notify the waiting thread, if any
@@ -180,6 +190,11 @@ static void cls_OnDestroy( HWND hWnd )
     // This gets the address of the WindowData structure associated with the window
     WindowData *pWndData = BGI__GetWindowDataPtr( hWnd );
 
+    // Finish any video recording, stream or RFB server while the pages still exist
+    BGI__StopRecording( pWndData );
+    BGI__StopStream( pWndData );
+    BGI__StopRfbServer( pWndData );
+
     WaitForSingleObject(pWndData->hDCMutex, 5000);
     for ( int i = 0; i < MAX_PAGES; i++ )
     {
@@ -196,6 +211,9 @@ static void cls_OnDestroy( HWND hWnd )
         // Finally, we delete the MemoryDC
         DeleteObject( pWndData->hDC[i] );
     }
+    // The table of nearest palette entries goes with the pages
+    delete [] pWndData->nearest;
+    pWndData->nearest = NULL;
     ReleaseMutex(pWndData->hDCMutex);
     // Clean up the bitmap memory
     DeleteBitmap( pWndData->hbitmap );
@@ -216,6 +234,7 @@ static void cls_OnKey( HWND hWnd, UINT vk, BOOL down, int repeat, UINT flags )
     // This gets the address of the WindowData structure associated with the window
     // TODO: Set event for each key
     WindowData *pWndData = BGI__GetWindowDataPtr( hWnd );
+    BGI__TRACE_SPAN( key, "WM_KEYDOWN", vk );
 
     switch ( vk )
     {
@@ -318,8 +337,13 @@ static void cls_OnPaint( HWND hWnd )
     POINT srcCorner;            // Logical coordinates of the source image upper left point
     BOOL success;               // Is the BitBlt successful?
     int i;                      // Count for how many bitblts have been tried.
+    FrameRecorder* recorder;    // The video recording, if there is one
+    BGI__TRACE_SPAN( paint, "paint", 0 );
 
-    WaitForSingleObject(pWndData->hDCMutex, INFINITE);
+    {
+        BGI__TRACE_SPAN( wait, "wait for DC", 0 );
+        WaitForSingleObject(pWndData->hDCMutex, INFINITE);
+    }
     BeginPaint( hWnd, &ps );
     hSrcDC = pWndData->hDC[pWndData->VisualPage];   // The source (memory) DC
 
@@ -337,10 +361,20 @@ static void cls_OnPaint( HWND hWnd )
     DPtoLP( hSrcDC, &srcCorner, 1 );
 
     // MGM: Screen BitBlts are not always successful, although I don't know why.
-    success = BitBlt( ps.hdc, ps.rcPaint.left, ps.rcPaint.top, width, height,
-			 hSrcDC, srcCorner.x, srcCorner.y, SRCCOPY );
+    {
+        BGI__TRACE_SPAN( blit, "BitBlt", width * height );
+        success = BitBlt( ps.hdc, ps.rcPaint.left, ps.rcPaint.top, width, height,
+                          hSrcDC, srcCorner.x, srcCorner.y, SRCCOPY );
+    }
     EndPaint( hWnd, &ps );  // Validates the rectangle
+    recorder = BGI__RecordFrame( pWndData, &ps.rcPaint );
+    if ( pWndData->streamer != NULL )
+        BGI__StreamFrame( pWndData );
+    if ( pWndData->rfb != NULL )
+        BGI__RfbFrame( pWndData );
     ReleaseMutex(pWndData->hDCMutex);
+    if ( recorder != NULL )
+        BGI__QueueFrame( recorder );    // May wait for the encoder
     
     if ( !success )
     {   // I would like to invalidate the rectangle again
@@ -368,6 +402,7 @@ LRESULT CALLBACK WndProc
     // If this is a mouse message, set our internal state
     if ( pWndData && ( uiMessage >= WM_MOUSEFIRST ) && ( uiMessage <= WM_MOUSELAST ) )
     {
+        BGI__TRACE_SPAN( mouse, "mouse message", uiMessage );
 	type = uiMessage - WM_MOUSEFIRST;
 	if (!(pWndData->mouse_queuing[type]) && pWndData->clicks[type].size( ) )
 	{